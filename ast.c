@@ -28,6 +28,8 @@ AST *ast_new(ASTType type, Token *token) {
 
     if (ast_is_block(new_ast)) {
         new_ast->block_max_stack_depth = -1;
+    } else if (ast_is_binary_expression(new_ast)) {
+        new_ast->evaluates_second_first = false;
     }
 
     return new_ast;
@@ -43,14 +45,59 @@ bool ast_is_block(AST *ast) {
     return ast->type == AST_BLOCK_STATEMENT;
 }
 
-void ast_free(AST *ast) {
+bool ast_is_binary_expression(AST *ast) {
+    // The expressions whose operands can be evaluated in either order
+    ASTType t = ast->type;
+    return t == AST_ADD || t == AST_SUBTRACT || t == AST_MULTIPLY || t == AST_DIVIDE
+        || t == AST_REMAINDER || t == AST_CMP_LT || t == AST_CMP_GT || t == AST_CMP_LT_EQ
+        || t == AST_CMP_GT_EQ;
+}
+
+AST *ast_nth_evaluated(AST *ast, int n) {
+    // The child evaluated nth, which for binary expressions depends on the
+    // order chosen when allocating
+    xcc_assert(n >= 0 && n < ast->num_nodes);
+
+    if (ast_is_binary_expression(ast) && ast->evaluates_second_first) {
+        xcc_assert(ast->num_nodes == 2);
+        return ast->nodes[1 - n];
+    }
+    return ast->nodes[n];
+}
+
+void ast_free_children(AST *ast) {
     xcc_assert(ast);
     for(int i = 0; i < ast->num_nodes; ++i) {
         ast_free(ast->nodes[i]);
     }
 
-    if(ast->pos) xcc_free(ast->pos);
     xcc_free(ast->nodes);
+    ast->nodes = NULL;
+    ast->num_nodes = 0;
+    ast->num_nodes_allocated = 0;
+}
+
+void ast_replace_with_child(AST *ast, int index) {
+    // ast becomes its child at index, and everything else under it is freed.
+    // Nothing else should point at the child node itself.
+    xcc_assert(index >= 0 && index < ast->num_nodes);
+    AST *child = ast->nodes[index];
+
+    for(int i = 0; i < ast->num_nodes; ++i) {
+        if(i != index) ast_free(ast->nodes[i]);
+    }
+    xcc_free(ast->nodes);
+    if(ast->pos) xcc_free(ast->pos);
+
+    *ast = *child;
+    xcc_free(child);
+}
+
+void ast_free(AST *ast) {
+    xcc_assert(ast);
+    ast_free_children(ast);
+
+    if(ast->pos) xcc_free(ast->pos);
     xcc_free(ast);
 }
 
@@ -145,6 +192,8 @@ static void ast_debug_internal(bool just_lines, AST *ast, int depth,
         fprintf(stderr, " [%s]", ast->identifier_string);
     } else if (ast->type == AST_BLOCK_STATEMENT) {
         fprintf(stderr, " [max depth %d]", ast->block_max_stack_depth);
+    } else if (ast_is_binary_expression(ast) && ast->evaluates_second_first) {
+        fprintf(stderr, " [second first]");
     }
 
     if(ast->value_type) {
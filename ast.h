@@ -49,6 +49,7 @@ typedef struct AST {
         long long integer_literal_val;
         const char *identifier_string;
         int block_max_stack_depth;
+        bool evaluates_second_first; // for binary expressions
     };
 
     struct Declaration *declaration;
@@ -59,6 +60,10 @@ void ast_append(AST *parent, AST *child);
 AST *ast_new(ASTType type, Token *token);
 AST *ast_append_new(AST *parent, ASTType type, Token *token);
 bool ast_is_block(AST *ast);
+bool ast_is_binary_expression(AST *ast);
+AST *ast_nth_evaluated(AST *ast, int n);
+void ast_free_children(AST *ast);
+void ast_replace_with_child(AST *ast, int index);
 void ast_free(AST *ast);
 void ast_dump(AST *ast, const char *header_name);
 void prog_error_ast(const char *msg, AST *ast);
@@ -0,0 +1,255 @@
+// Constant folding and propagation
+//
+// Runs on each top level declaration once it's been checked. Arithmetic and
+// comparisons on literals are worked out in the width and signedness of
+// their type, locals which are only ever set by a constant initialiser are
+// replaced by that constant, and ifs and whiles with constant conditions
+// lose whatever can't run.
+#include "xcc.h"
+
+typedef struct {
+    Declaration *declaration;
+    long long value;
+} ConstantLocal;
+
+typedef struct {
+    // locals assigned to anywhere in the function, which can't be replaced
+    Declaration **assigned;
+    int num_assigned;
+    int num_assigned_allocated;
+
+    ConstantLocal *constants;
+    int num_constants;
+    int num_constants_allocated;
+} FoldContext;
+
+static long long wrap_to_type(unsigned long long value, Type *type) {
+    // The value as it would be stored in the type, which is what the
+    // generated code would have worked out
+    xcc_assert(type->type_type == TYPE_INTEGER);
+
+    if (type->integer_type == TYPE_BOOL) return value != 0;
+
+    int bits = 8 * type_get_size(type);
+    if (bits == 64) return (long long) value;
+
+    unsigned long long mask = (1ULL << bits) - 1;
+    value &= mask;
+    if (integer_type_is_signed(type) && (value >> (bits - 1))) {
+        value |= ~mask;
+    }
+    return (long long) value;
+}
+
+static bool is_integer_expression(AST *ast) {
+    return ast->value_type && ast->value_type->type_type == TYPE_INTEGER;
+}
+
+static bool is_literal(AST *ast) {
+    return ast->type == AST_INTEGER_LITERAL;
+}
+
+static long long literal_value(AST *ast) {
+    xcc_assert(is_literal(ast));
+    return wrap_to_type(ast->integer_literal_val, ast->value_type);
+}
+
+static void make_literal(AST *ast, unsigned long long value) {
+    // Turns the expression into a literal of its own type
+    xcc_assert(is_integer_expression(ast));
+
+    ast_free_children(ast);
+    ast->type = AST_INTEGER_LITERAL;
+    ast->declaration = NULL;
+    ast->integer_literal_val = wrap_to_type(value, ast->value_type);
+}
+
+static bool is_assigned(FoldContext *ctx, Declaration *declaration) {
+    for (int i = 0; i < ctx->num_assigned; ++i) {
+        if (ctx->assigned[i] == declaration) return true;
+    }
+    return false;
+}
+
+static void find_assigned(FoldContext *ctx, AST *ast) {
+    for (int i = 0; i < ast->num_nodes; ++i) {
+        find_assigned(ctx, ast->nodes[i]);
+    }
+
+    if (ast->type == AST_ASSIGN && ast->nodes[0]->type == AST_IDENT_USE) {
+        Declaration *declaration = ast->nodes[0]->declaration;
+        if (is_assigned(ctx, declaration)) return;
+
+        Declaration **new_assigned;
+        LIST_STRUCT_APPEND_FUNC(
+            Declaration *, ctx, num_assigned, num_assigned_allocated, assigned, new_assigned
+        );
+        *new_assigned = declaration;
+    }
+}
+
+static ConstantLocal *find_constant(FoldContext *ctx, Declaration *declaration) {
+    for (int i = 0; i < ctx->num_constants; ++i) {
+        if (ctx->constants[i].declaration == declaration) return &ctx->constants[i];
+    }
+    return NULL;
+}
+
+static bool fold_binary(AST *ast) {
+    // Returns false if either operand isn't a literal
+    AST *left = ast->nodes[0];
+    AST *right = ast->nodes[1];
+    if (!is_literal(left) || !is_literal(right)) return false;
+
+    // the operands have already been converted to the same type
+    bool is_signed = integer_type_is_signed(left->value_type);
+    unsigned long long a = literal_value(left);
+    unsigned long long b = literal_value(right);
+
+    unsigned long long result;
+    switch (ast->type) {
+        case AST_ADD: result = a + b; break;
+        case AST_SUBTRACT: result = a - b; break;
+        case AST_MULTIPLY: result = a * b; break;
+        case AST_CMP_LT: result = is_signed ? (long long) a < (long long) b : a < b; break;
+        case AST_CMP_GT: result = is_signed ? (long long) a > (long long) b : a > b; break;
+        case AST_CMP_LT_EQ: result = is_signed ? (long long) a <= (long long) b : a <= b; break;
+        case AST_CMP_GT_EQ: result = is_signed ? (long long) a >= (long long) b : a >= b; break;
+        default: return false;
+    }
+
+    make_literal(ast, result);
+    return true;
+}
+
+static bool is_add_or_subtract(AST *ast) {
+    return ast->type == AST_ADD || ast->type == AST_SUBTRACT;
+}
+
+static void reassociate_constant(AST *ast) {
+    // (x + c1) - c2 and the like become x + (c1 - c2), so that the two
+    // constants are added together here rather than at run time
+    AST *inner = ast->nodes[0];
+    AST *outer_constant = ast->nodes[1];
+
+    if (!is_add_or_subtract(ast) || !is_add_or_subtract(inner)) return;
+    if (!is_literal(outer_constant) || !is_literal(inner->nodes[1])) return;
+
+    Type *type = ast->value_type;
+    if (inner->value_type->integer_type != type->integer_type) return;
+
+    unsigned long long inner_value = literal_value(inner->nodes[1]);
+    unsigned long long outer_value = literal_value(outer_constant);
+
+    unsigned long long combined = inner->type == AST_ADD ? inner_value : -inner_value;
+    combined = ast->type == AST_ADD ? combined + outer_value : combined - outer_value;
+
+    // x - 2 reads better than x + -2, and is the same instruction
+    long long signed_combined = wrap_to_type(combined, type);
+    if (integer_type_is_signed(type) && signed_combined < 0) {
+        ast->type = AST_SUBTRACT;
+        combined = -(unsigned long long) signed_combined;
+    } else {
+        ast->type = AST_ADD;
+    }
+
+    outer_constant->integer_literal_val = wrap_to_type(combined, type);
+    ast_replace_with_child(inner, 0);
+}
+
+static void fold_expression(FoldContext *ctx, AST *ast) {
+    // An assignment's target is left alone, and so is a call's function
+    int first_folded = ast->type == AST_ASSIGN || ast->type == AST_CALL ? 1 : 0;
+    for (int i = first_folded; i < ast->num_nodes; ++i) {
+        fold_expression(ctx, ast->nodes[i]);
+    }
+
+    if (!is_integer_expression(ast)) return;
+
+    if (ast->type == AST_IDENT_USE) {
+        ConstantLocal *constant = find_constant(ctx, ast->declaration);
+        if (constant) make_literal(ast, constant->value);
+    } else if (ast->type == AST_CONVERT_TO_INT || ast->type == AST_CONVERT_TO_BOOL) {
+        if (is_literal(ast->nodes[0])) make_literal(ast, literal_value(ast->nodes[0]));
+    } else if (ast_is_binary_expression(ast)) {
+        if (!fold_binary(ast)) reassociate_constant(ast);
+    }
+}
+
+static void make_empty_block(AST *ast) {
+    ast_free_children(ast);
+    ast->type = AST_BLOCK_STATEMENT;
+    ast->block_max_stack_depth = -1;
+}
+
+static void fold_statement(FoldContext *ctx, AST *ast) {
+    if (ast->type == AST_RETURN_STMT || ast->type == AST_STATEMENT_EXPRESSION) {
+        if (ast->num_nodes == 1) fold_expression(ctx, ast->nodes[0]);
+    } else if (ast->type == AST_IF) {
+        fold_expression(ctx, ast->nodes[0]);
+        for (int i = 1; i < ast->num_nodes; ++i) {
+            fold_statement(ctx, ast->nodes[i]);
+        }
+
+        if (!is_literal(ast->nodes[0])) return;
+
+        // the if is replaced by whichever branch is taken
+        if (literal_value(ast->nodes[0])) {
+            ast_replace_with_child(ast, 1);
+        } else if (ast->num_nodes == 3) {
+            ast_replace_with_child(ast, 2);
+        } else {
+            make_empty_block(ast);
+        }
+    } else if (ast->type == AST_WHILE) {
+        fold_expression(ctx, ast->nodes[0]);
+        fold_statement(ctx, ast->nodes[1]);
+
+        // a loop which never runs can go, and one which always does is left
+        // for the code generator to skip the test
+        if (is_literal(ast->nodes[0]) && !literal_value(ast->nodes[0])) {
+            make_empty_block(ast);
+        }
+    } else if (ast->type == AST_DECLARATOR_GROUP) {
+        if (ast->num_nodes != 2) return;
+        fold_expression(ctx, ast->nodes[1]);
+
+        AST *declarator = ast->nodes[0];
+        if (declarator->type != AST_DECLARATOR_IDENT || !is_literal(ast->nodes[1])) return;
+
+        Declaration *declaration = declarator->declaration;
+        if (declaration->decl_type != DECL_LOCAL_VAR || is_assigned(ctx, declaration)) return;
+        if (declaration->type->type_type != TYPE_INTEGER) return;
+
+        ConstantLocal *constant;
+        LIST_STRUCT_APPEND_FUNC(
+            ConstantLocal, ctx, num_constants, num_constants_allocated, constants, constant
+        );
+        constant->declaration = declaration;
+        constant->value = literal_value(ast->nodes[1]);
+    } else if (ast->type == AST_BLOCK_STATEMENT) {
+        for (int i = 0; i < ast->num_nodes; ++i) {
+            fold_statement(ctx, ast->nodes[i]);
+        }
+    } else if (ast->type == AST_DECLARATION) {
+        for (int i = 1; i < ast->num_nodes; ++i) {
+            fold_statement(ctx, ast->nodes[i]);
+        }
+    } else {
+        xcc_assert_not_reached_msg("unknown statement");
+    }
+}
+
+void constant_fold(AST *ast) {
+    if (ast->type != AST_FUNCTION_DEFINITION) return;
+    xcc_assert(ast->num_nodes == 3);
+
+    FoldContext ctx;
+    memset(&ctx, 0, sizeof(FoldContext));
+
+    find_assigned(&ctx, ast->nodes[2]);
+    fold_statement(&ctx, ast->nodes[2]);
+
+    xcc_free(ctx.assigned);
+    xcc_free(ctx.constants);
+}
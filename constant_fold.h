@@ -0,0 +1,5 @@
+#pragma once
+
+#include "xcc.h"
+
+void constant_fold(AST *ast);
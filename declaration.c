@@ -97,19 +97,47 @@ static void handle_ident_declaration(ResolutionList *res_list, AST *ast, AST *pa
     }
 }
 
+Declaration *resolve_find_declaration(ResolutionList *res_list, const char *name) {
+    // The declaration that name refers to at this point, or NULL
+    for (int i = res_list->num_local_declarations - 1; i >= 0; i--) {
+        Declaration *d = res_list->local_declarations[i];
+        if (d->name && !strcmp(d->name, name)) return d;
+    }
+    return NULL;
+}
+
 static void handle_ident_usage(ResolutionList *res_list, AST *ast) {
     const char *ident_name = ast->identifier_string;
     xcc_assert(ident_name);
 
-    for (int i = res_list->num_local_declarations - 1; i >= 0; i--) {
-        Declaration *d = res_list->local_declarations[i];
-        if (d->name && !strcmp(d->name, ident_name)) {
-            ast->declaration = d;
-            return;
-        }
+    ast->declaration = resolve_find_declaration(res_list, ident_name);
+    if (!ast->declaration) {
+        prog_error_ast("unknown identifier", ast);
+    }
+}
+
+static void pop_local_declarations_above(ResolutionList *res_list, int scope_level) {
+    // After an error, the scopes it was inside weren't closed
+    while (res_list->num_local_declarations > 0 &&
+           res_list->local_declarations[res_list->num_local_declarations - 1]->scope_level > scope_level) {
+        res_list->num_local_declarations--;
     }
+}
+
+static void resolve_recursive(ResolutionList *res_list, AST *ast, AST *parent, AST *declaration_root, AST *declarator_group, int scope_level);
 
-    prog_error_ast("unknown identifier", ast);
+static void resolve_statement_or_recover(ResolutionList *res_list, AST *statement, AST *block, AST *declaration_root, AST *declarator_group, int scope_level) {
+    // An error only abandons the rest of this statement, so that the others
+    // in the block are still checked
+    ProgErrorRecovery recovery;
+
+    prog_error_push_recovery(&recovery);
+    if (!setjmp(recovery.jump_buffer)) {
+        resolve_recursive(res_list, statement, block, declaration_root, declarator_group, scope_level);
+    } else {
+        pop_local_declarations_above(res_list, scope_level);
+    }
+    prog_error_pop_recovery(&recovery);
 }
 
 static void resolve_recursive(ResolutionList *res_list, AST *ast, AST *parent, AST *declaration_root, AST *declarator_group, int scope_level) {
@@ -175,6 +203,14 @@ static void resolve_recursive(ResolutionList *res_list, AST *ast, AST *parent, A
     }
 
     for (int i = node_offset_index; i < ast->num_nodes; ++i) {
+        if (ast->type == AST_BLOCK_STATEMENT) {
+            resolve_statement_or_recover(
+                res_list, ast->nodes[i], ast, declaration_root,
+                declarator_group, scope_level + 1
+            );
+            continue;
+        }
+
         resolve_recursive(
             res_list, ast->nodes[i], ast, declaration_root,
             declarator_group, scope_level + is_scope_introduction
@@ -197,7 +233,17 @@ static void resolve_recursive(ResolutionList *res_list, AST *ast, AST *parent, A
     }
 }
 
-ResolutionList *resolve_declarations(AST *program) {
+void resolve_add_precompiled_declaration(ResolutionList *res_list, const char *name, struct Type *type, DeclarationType decl_type) {
+    // These are at the top level as if they were declared before the program
+    Declaration *declaration = append_empty_declaration(res_list);
+    declaration->name = name;
+    declaration->type = type;
+    declaration->decl_type = decl_type;
+    declaration->pos = NULL;
+    declaration->scope_level = 0;
+}
+
+ResolutionList *resolve_begin(struct PrecompiledHeader *pch) {
     ResolutionList *res_list = xcc_malloc(sizeof(ResolutionList));
 
     res_list->all_declarations_head = NULL;
@@ -206,11 +252,59 @@ ResolutionList *resolve_declarations(AST *program) {
     res_list->num_local_declarations = 0;
     res_list->num_local_declarations_allocated = 0;
 
-    resolve_recursive(res_list, program, NULL, NULL, NULL, 0);
+    if (pch) {
+        pch_add_declarations(pch, res_list);
+    }
 
     return res_list;
 }
 
+void resolve_top_level(ResolutionList *res_list, AST *program, AST *declaration) {
+    // Resolves one top level declaration (which is a child of program) using
+    // everything resolved before it
+    xcc_assert(program->type == AST_PROGRAM);
+
+    ProgErrorRecovery recovery;
+
+    prog_error_push_recovery(&recovery);
+    if (!setjmp(recovery.jump_buffer)) {
+        resolve_recursive(res_list, declaration, program, NULL, NULL, 0);
+    } else {
+        pop_local_declarations_above(res_list, 0);
+        res_list->current_func = NULL;
+
+        // so that calls to a function with an error don't give more errors
+        if (declaration->type == AST_FUNCTION_DEFINITION && declaration->declaration) {
+            append_local_declaration_pointer(res_list, declaration->declaration);
+        }
+    }
+    prog_error_pop_recovery(&recovery);
+}
+
+// Top level declarations are at scope level 0, a function definition's
+// name and parameters are at level 1, and its body starts at level 2
+#define FUNCTION_BODY_SCOPE_LEVEL 2
+
+void resolve_free_function_body_declarations(ResolutionList *res_list, Declaration *old_head) {
+    // Frees the declarations from inside function bodies that were added
+    // since old_head. Nothing may refer to them afterwards.
+    xcc_assert(!res_list->current_func);
+
+    Declaration **link = &res_list->all_declarations_head;
+
+    while (*link != old_head) {
+        Declaration *declaration = *link;
+        xcc_assert(declaration);
+
+        if (declaration->scope_level < FUNCTION_BODY_SCOPE_LEVEL) {
+            link = &declaration->next_in_list;
+        } else {
+            *link = declaration->next_in_list;
+            xcc_free(declaration);
+        }
+    }
+}
+
 void resolve_free(ResolutionList *res) {
     Declaration *current = res->all_declarations_head;
 
@@ -31,6 +31,11 @@ typedef struct {
     Declaration *current_func_declaration;
 } ResolutionList;
 
-ResolutionList *resolve_declarations(AST *program);
+struct PrecompiledHeader;
+ResolutionList *resolve_begin(struct PrecompiledHeader *pch);
+void resolve_add_precompiled_declaration(ResolutionList *res_list, const char *name, struct Type *type, DeclarationType decl_type);
+void resolve_top_level(ResolutionList *res_list, AST *program, AST *declaration);
+Declaration *resolve_find_declaration(ResolutionList *res_list, const char *name);
+void resolve_free_function_body_declarations(ResolutionList *res_list, Declaration *old_head);
 void resolve_free(ResolutionList *res);
 void dump_declaration_list(ResolutionList *res_list);
\ No newline at end of file
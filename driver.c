@@ -0,0 +1,137 @@
+// Assembles and links the generated assembly into an executable
+//
+// The system compiler driver is started with its stdin as a pipe, and the
+// assembly is written straight into the pipe as it's generated. The
+// assembler runs alongside code generation, and there's no temporary
+// assembly file.
+#include <signal.h>
+#include <spawn.h>
+#include <stdio_ext.h>
+#include <sys/wait.h>
+#include "xcc.h"
+
+extern char **environ;
+
+#define LINKER_DRIVER "gcc"
+
+static pid_t link_pid = 0;
+static const char *link_filename_out = NULL;
+static FILE *link_stream = NULL;
+
+FILE *driver_start_link(const char *filename_out, const char **link_inputs, int num_link_inputs) {
+    // Returns the stream to write the assembly to, or NULL if the driver
+    // couldn't be started. link_inputs are other files to link in, like
+    // objects or C files.
+    xcc_assert(!link_pid);
+
+    int pipe_fds[2];
+    if (pipe(pipe_fds)) {
+        perror("pipe(link)");
+        return NULL;
+    }
+
+    // "-x none" goes back to guessing the language from the extension, for
+    // the other inputs
+    int num_args = 0;
+    const char **args = xcc_malloc(sizeof(char *) * (num_link_inputs + 10));
+    args[num_args++] = LINKER_DRIVER;
+    args[num_args++] = "-x";
+    args[num_args++] = "assembler";
+    args[num_args++] = "-";
+    args[num_args++] = "-x";
+    args[num_args++] = "none";
+    for (int i = 0; i < num_link_inputs; ++i) {
+        args[num_args++] = link_inputs[i];
+    }
+    args[num_args++] = "-o";
+    args[num_args++] = filename_out;
+    args[num_args++] = NULL;
+
+    posix_spawn_file_actions_t file_actions;
+    posix_spawn_file_actions_init(&file_actions);
+    posix_spawn_file_actions_adddup2(&file_actions, pipe_fds[0], STDIN_FILENO);
+    posix_spawn_file_actions_addclose(&file_actions, pipe_fds[0]);
+    posix_spawn_file_actions_addclose(&file_actions, pipe_fds[1]);
+
+    // In a process group of its own, so that aborting can stop the
+    // assembler and linker it starts too
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+
+    int spawn_error = posix_spawnp(
+        &link_pid, LINKER_DRIVER, &file_actions, &attributes, (char **) args, environ
+    );
+
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&file_actions);
+    xcc_free(args);
+    close(pipe_fds[0]);
+
+    if (spawn_error) {
+        fprintf(stderr, "Couldn't run `%s`: %s\n", LINKER_DRIVER, strerror(spawn_error));
+        close(pipe_fds[1]);
+        link_pid = 0;
+        return NULL;
+    }
+
+    link_filename_out = filename_out;
+
+    link_stream = fdopen(pipe_fds[1], "w");
+    xcc_assert_msg(link_stream, "fdopen() failed for the link pipe");
+    return link_stream;
+}
+
+static bool wait_for_link(int *status) {
+    // Reaps the driver, returning false if that failed
+    bool has_exited = true;
+    while (waitpid(link_pid, status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid(link)");
+            has_exited = false;
+            break;
+        }
+    }
+
+    link_pid = 0;
+    link_filename_out = NULL;
+    link_stream = NULL;
+    return has_exited;
+}
+
+bool driver_finish_link(FILE *assembly_stream) {
+    // Closes the pipe, so the assembler sees the end of its input, and
+    // waits for the link. Returns false if it failed, which the driver has
+    // already explained on stderr.
+    xcc_assert(link_pid);
+    xcc_assert(assembly_stream == link_stream);
+
+    bool has_closed = !fclose(assembly_stream);
+    if (!has_closed) perror("close(link)");
+
+    int status;
+    bool has_exited = wait_for_link(&status);
+    return has_closed && has_exited && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void driver_abort_link(void) {
+    // For when compiling fails partway through, so the driver doesn't try
+    // to link half a program. SIGTERM gives the driver the chance to delete
+    // its temporary objects, and the output is removed afterwards, as it is
+    // when xcc writes the output itself.
+    if (!link_pid) return;
+
+    const char *filename_out = link_filename_out;
+    kill(-link_pid, SIGTERM);
+
+    // Whatever assembly is still buffered would otherwise be flushed into
+    // the pipe at exit, after the driver has gone, and SIGPIPE would kill
+    // xcc
+    __fpurge(link_stream);
+    fclose(link_stream);
+
+    int status;
+    wait_for_link(&status);
+    remove(filename_out);
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "xcc.h"
+
+FILE *driver_start_link(const char *filename_out, const char **link_inputs, int num_link_inputs);
+bool driver_finish_link(FILE *assembly_stream);
+void driver_abort_link(void);
@@ -0,0 +1,252 @@
+// ELF64 relocatable object files
+//
+// The object has a single .text section holding every function, a symbol
+// for each function (and for each function called but not defined), and a
+// relocation for every call, so that the system linker can put it together
+// with other objects.
+#include <elf.h>
+#include <stdint.h>
+#include "xcc.h"
+
+enum {
+    SECTION_NULL, SECTION_TEXT, SECTION_RELA_TEXT, SECTION_SYMTAB, SECTION_STRTAB,
+    SECTION_NOTE_GNU_STACK, SECTION_SHSTRTAB,
+
+    NUM_SECTIONS
+};
+
+// the null symbol, the source file and the .text section come before the
+// global symbols
+#define NUM_LOCAL_SYMBOLS 3
+
+typedef struct {
+    Elf64_Sym *symbols;
+    size_t num_symbols;
+    size_t num_symbols_allocated;
+
+    Elf64_Rela *relocations;
+    size_t num_relocations;
+    size_t num_relocations_allocated;
+
+    char *strings;
+    size_t strings_size;
+    size_t strings_allocated;
+
+    // from a global symbol's name to its index
+    SymbolTable symbol_indices;
+} ElfWriter;
+
+static uint32_t add_string(ElfWriter *writer, const char *string) {
+    uint32_t offset = writer->strings_size;
+    size_t length = strlen(string);
+
+    for (size_t i = 0; i <= length; ++i) {
+        char *c;
+        LIST_STRUCT_APPEND_FUNC(char, writer, strings_size, strings_allocated, strings, c);
+        *c = string[i];
+    }
+
+    return offset;
+}
+
+static Elf64_Sym *add_symbol(ElfWriter *writer, const char *name) {
+    Elf64_Sym *symbol;
+    LIST_STRUCT_APPEND_FUNC(Elf64_Sym, writer, num_symbols, num_symbols_allocated, symbols, symbol);
+    memset(symbol, 0, sizeof(Elf64_Sym));
+    symbol->st_name = name ? add_string(writer, name) : 0;
+    return symbol;
+}
+
+static uint32_t global_symbol_index(ElfWriter *writer, const char *name, bool is_definition,
+                                    X64FunctionSymbol *function) {
+    // Symbols which are only called are added as undefined the first time
+    // they're seen
+    int index = symbol_table_find(&writer->symbol_indices, name);
+    if (index >= 0) {
+        xcc_assert_msg(!is_definition, "function defined twice in object");
+        return index;
+    }
+
+    index = writer->num_symbols;
+    symbol_table_add(&writer->symbol_indices, name, index);
+
+    Elf64_Sym *symbol = add_symbol(writer, name);
+    if (is_definition) {
+        symbol->st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+        symbol->st_shndx = SECTION_TEXT;
+        symbol->st_value = function->offset;
+        symbol->st_size = function->size;
+    } else {
+        symbol->st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+        symbol->st_shndx = SHN_UNDEF;
+    }
+
+    return index;
+}
+
+static void build_symbols_and_relocations(ElfWriter *writer, CodeBuffer *code,
+                                          const char *source_filename) {
+    add_symbol(writer, NULL);
+
+    Elf64_Sym *file_symbol = add_symbol(writer, source_filename);
+    file_symbol->st_info = ELF64_ST_INFO(STB_LOCAL, STT_FILE);
+    file_symbol->st_shndx = SHN_ABS;
+
+    Elf64_Sym *section_symbol = add_symbol(writer, NULL);
+    section_symbol->st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    section_symbol->st_shndx = SECTION_TEXT;
+
+    xcc_assert(writer->num_symbols == NUM_LOCAL_SYMBOLS);
+
+    symbol_table_init(&writer->symbol_indices);
+
+    // definitions first, so that calls to functions later in the file
+    // don't make them undefined
+    for (size_t i = 0; i < code->num_functions; ++i) {
+        global_symbol_index(writer, code->functions[i].name, true, &code->functions[i]);
+    }
+
+    for (size_t i = 0; i < code->num_relocations; ++i) {
+        X64Relocation *call = &code->relocations[i];
+        uint32_t symbol_index = global_symbol_index(writer, call->symbol, false, NULL);
+
+        Elf64_Rela *relocation;
+        LIST_STRUCT_APPEND_FUNC(
+            Elf64_Rela, writer, num_relocations, num_relocations_allocated,
+            relocations, relocation
+        );
+        relocation->r_offset = call->offset;
+        relocation->r_info = ELF64_R_INFO(symbol_index, R_X86_64_PLT32);
+        // the field is relative to the end of the call instruction
+        relocation->r_addend = -4;
+    }
+}
+
+static size_t align_offset(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+static bool write_padded(FILE *stream, size_t *offset, size_t to_offset,
+                         const void *data, size_t size) {
+    xcc_assert(*offset <= to_offset);
+
+    for (; *offset < to_offset; ++*offset) {
+        if (fputc(0, stream) == EOF) return false;
+    }
+
+    if (size && fwrite(data, 1, size, stream) != size) return false;
+    *offset += size;
+    return true;
+}
+
+bool elf_write_object(FILE *stream, CodeBuffer *code, const char *source_filename) {
+    // Returns false if writing failed
+    ElfWriter writer;
+    memset(&writer, 0, sizeof(ElfWriter));
+
+    // .strtab starts with an empty string, which is what unnamed symbols use
+    add_string(&writer, "");
+    build_symbols_and_relocations(&writer, code, source_filename);
+
+    const char section_names[] =
+        "\0.text\0.rela.text\0.symtab\0.strtab\0.note.GNU-stack\0.shstrtab";
+
+    Elf64_Shdr sections[NUM_SECTIONS];
+    memset(sections, 0, sizeof(sections));
+
+    size_t offset = sizeof(Elf64_Ehdr);
+
+    struct {
+        int section;
+        const char *name;
+        Elf64_Word type;
+        Elf64_Xword flags;
+        const void *data;
+        size_t size;
+        size_t alignment;
+        size_t entry_size;
+    } contents[] = {
+        { SECTION_TEXT, ".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR,
+          code->bytes, code->num_bytes, 16, 0 },
+        { SECTION_RELA_TEXT, ".rela.text", SHT_RELA, SHF_INFO_LINK,
+          writer.relocations, writer.num_relocations * sizeof(Elf64_Rela), 8, sizeof(Elf64_Rela) },
+        { SECTION_SYMTAB, ".symtab", SHT_SYMTAB, 0,
+          writer.symbols, writer.num_symbols * sizeof(Elf64_Sym), 8, sizeof(Elf64_Sym) },
+        { SECTION_STRTAB, ".strtab", SHT_STRTAB, 0,
+          writer.strings, writer.strings_size, 1, 0 },
+        // marks the stack as non-executable
+        { SECTION_NOTE_GNU_STACK, ".note.GNU-stack", SHT_PROGBITS, 0, NULL, 0, 1, 0 },
+        { SECTION_SHSTRTAB, ".shstrtab", SHT_STRTAB, 0,
+          section_names, sizeof(section_names), 1, 0 },
+    };
+    int num_contents = sizeof(contents) / sizeof(contents[0]);
+
+    for (int i = 0; i < num_contents; ++i) {
+        Elf64_Shdr *section = &sections[contents[i].section];
+
+        // names are found in section_names rather than hard coding offsets
+        const char *name = section_names + 1;
+        while (strcmp(name, contents[i].name)) {
+            name += strlen(name) + 1;
+            xcc_assert(name < section_names + sizeof(section_names));
+        }
+
+        offset = align_offset(offset, contents[i].alignment);
+
+        section->sh_name = name - section_names;
+        section->sh_type = contents[i].type;
+        section->sh_flags = contents[i].flags;
+        section->sh_offset = offset;
+        section->sh_size = contents[i].size;
+        section->sh_addralign = contents[i].alignment;
+        section->sh_entsize = contents[i].entry_size;
+
+        offset += contents[i].size;
+    }
+
+    sections[SECTION_RELA_TEXT].sh_link = SECTION_SYMTAB;
+    sections[SECTION_RELA_TEXT].sh_info = SECTION_TEXT;
+    sections[SECTION_SYMTAB].sh_link = SECTION_STRTAB;
+    sections[SECTION_SYMTAB].sh_info = NUM_LOCAL_SYMBOLS;
+
+    size_t section_headers_offset = align_offset(offset, 8);
+
+    Elf64_Ehdr header;
+    memset(&header, 0, sizeof(Elf64_Ehdr));
+    memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS64;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    header.e_type = ET_REL;
+    header.e_machine = EM_X86_64;
+    header.e_version = EV_CURRENT;
+    header.e_shoff = section_headers_offset;
+    header.e_ehsize = sizeof(Elf64_Ehdr);
+    header.e_shentsize = sizeof(Elf64_Shdr);
+    header.e_shnum = NUM_SECTIONS;
+    header.e_shstrndx = SECTION_SHSTRTAB;
+
+    size_t written = 0;
+    bool success = write_padded(stream, &written, 0, &header, sizeof(Elf64_Ehdr));
+
+    for (int i = 0; i < num_contents && success; ++i) {
+        success = write_padded(
+            stream, &written, sections[contents[i].section].sh_offset,
+            contents[i].data, contents[i].size
+        );
+    }
+
+    if (success) {
+        success = write_padded(
+            stream, &written, section_headers_offset, sections, sizeof(sections)
+        );
+    }
+
+    xcc_free(writer.symbols);
+    xcc_free(writer.relocations);
+    xcc_free(writer.strings);
+    symbol_table_free(&writer.symbol_indices);
+
+    return success;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "xcc.h"
+
+bool elf_write_object(FILE *stream, CodeBuffer *code, const char *source_filename);
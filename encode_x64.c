@@ -0,0 +1,512 @@
+// Encodes x64 instructions straight into machine code, for writing object
+// files without going through an assembler
+#include <stdint.h>
+#include "xcc.h"
+
+#define REX_BASE 0x40
+#define REX_W 0x08
+#define REX_R 0x04
+#define REX_B 0x01
+
+int encode_x64_register_number(RegLoc reg) {
+    // The numbers used in the encodings, which are in a different order to
+    // the RegLoc enum
+    switch(reg) {
+        case REG_RAX: return 0;
+        case REG_RCX: return 1;
+        case REG_RDX: return 2;
+        case REG_RBX: return 3;
+        case REG_RSP: return 4;
+        case REG_RBP: return 5;
+        case REG_RSI: return 6;
+        case REG_RDI: return 7;
+        case REG_R8: return 8;
+        case REG_R9: return 9;
+        case REG_R10: return 10;
+        case REG_R11: return 11;
+        case REG_R12: return 12;
+        case REG_R13: return 13;
+        case REG_R14: return 14;
+        case REG_R15: return 15;
+        case REG_LAST: xcc_assert_not_reached();
+    }
+    xcc_assert_not_reached();
+}
+
+CodeBuffer *encode_x64_new_buffer(void) {
+    CodeBuffer *buffer = xcc_malloc(sizeof(CodeBuffer));
+    memset(buffer, 0, sizeof(CodeBuffer));
+    return buffer;
+}
+
+void encode_x64_free_buffer(CodeBuffer *buffer) {
+    xcc_free(buffer->bytes);
+    xcc_free(buffer->functions);
+    xcc_free(buffer->relocations);
+    xcc_free(buffer->label_offsets);
+    xcc_free(buffer->label_uses);
+    xcc_free(buffer);
+}
+
+static void emit_byte(CodeBuffer *buffer, unsigned char byte) {
+    unsigned char *new_byte;
+    LIST_STRUCT_APPEND_FUNC(unsigned char, buffer, num_bytes, num_bytes_allocated, bytes, new_byte);
+    *new_byte = byte;
+}
+
+static void emit_int32(CodeBuffer *buffer, int32_t value) {
+    uint32_t bits = value;
+    for(int i = 0; i < 4; ++i) {
+        emit_byte(buffer, (bits >> (8 * i)) & 0xff);
+    }
+}
+
+static void emit_int64(CodeBuffer *buffer, int64_t value) {
+    uint64_t bits = value;
+    for(int i = 0; i < 8; ++i) {
+        emit_byte(buffer, (bits >> (8 * i)) & 0xff);
+    }
+}
+
+static void patch_int32(CodeBuffer *buffer, size_t offset, int32_t value) {
+    xcc_assert(offset + 4 <= buffer->num_bytes);
+
+    uint32_t bits = value;
+    for(int i = 0; i < 4; ++i) {
+        buffer->bytes[offset + i] = (bits >> (8 * i)) & 0xff;
+    }
+}
+
+static bool fits_in_int8(long long value) {
+    return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+static bool fits_in_int32(long long value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static void emit_nops(CodeBuffer *buffer, size_t count) {
+    // The recommended multi-byte nops, so that padding which is run through
+    // takes as few instructions as possible
+    static const unsigned char nops[9][9] = {
+        { 0x90 },
+        { 0x66, 0x90 },
+        { 0x0f, 0x1f, 0x00 },
+        { 0x0f, 0x1f, 0x40, 0x00 },
+        { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+        { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+        { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+        { 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        { 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    };
+
+    while(count > 0) {
+        size_t length = count < 9 ? count : 9;
+        for(size_t i = 0; i < length; ++i) {
+            emit_byte(buffer, nops[length - 1][i]);
+        }
+        count -= length;
+    }
+}
+
+void encode_x64_align(CodeBuffer *buffer, int alignment) {
+    // Offsets are only aligned within the buffer, which is enough since
+    // every function starts on a boundary at least this big
+    xcc_assert(alignment > 0 && alignment <= X64_FUNCTION_ALIGNMENT);
+
+    size_t misalignment = buffer->num_bytes % alignment;
+    if(misalignment) emit_nops(buffer, alignment - misalignment);
+}
+
+void encode_x64_begin_function(CodeBuffer *buffer, const char *name) {
+    encode_x64_align(buffer, X64_FUNCTION_ALIGNMENT);
+
+    X64FunctionSymbol *function;
+    LIST_STRUCT_APPEND_FUNC(
+        X64FunctionSymbol, buffer, num_functions, num_functions_allocated, functions, function
+    );
+    function->name = name;
+    function->offset = buffer->num_bytes;
+    function->size = 0;
+
+    buffer->num_label_offsets = 0;
+    buffer->num_label_uses = 0;
+}
+
+void encode_x64_end_function(CodeBuffer *buffer) {
+    xcc_assert(buffer->num_functions > 0);
+
+    for(size_t i = 0; i < buffer->num_label_uses; ++i) {
+        X64LabelUse *use = &buffer->label_uses[i];
+        xcc_assert((size_t) use->label < buffer->num_label_offsets);
+
+        long long label_offset = buffer->label_offsets[use->label];
+        xcc_assert_msg(label_offset >= 0, "jump to a label which was never defined");
+
+        // relative to the end of the instruction, which the field is always at
+        patch_int32(buffer, use->offset, label_offset - (long long) (use->offset + 4));
+    }
+
+    buffer->num_label_offsets = 0;
+    buffer->num_label_uses = 0;
+
+    X64FunctionSymbol *function = &buffer->functions[buffer->num_functions - 1];
+    function->size = buffer->num_bytes - function->offset;
+}
+
+void encode_x64_label(CodeBuffer *buffer, int label) {
+    xcc_assert(label >= 0);
+
+    while(buffer->num_label_offsets <= (size_t) label) {
+        long long *new_offset;
+        LIST_STRUCT_APPEND_FUNC(
+            long long, buffer, num_label_offsets, num_label_offsets_allocated,
+            label_offsets, new_offset
+        );
+        *new_offset = -1;
+    }
+
+    xcc_assert_msg(buffer->label_offsets[label] < 0, "label defined twice");
+    buffer->label_offsets[label] = buffer->num_bytes;
+}
+
+static void emit_label_use(CodeBuffer *buffer, X64Operand *operand) {
+    xcc_assert(operand->type == OPERAND_LABEL);
+
+    X64LabelUse *use;
+    LIST_STRUCT_APPEND_FUNC(
+        X64LabelUse, buffer, num_label_uses, num_label_uses_allocated, label_uses, use
+    );
+    use->offset = buffer->num_bytes;
+    use->label = operand->label;
+    emit_int32(buffer, 0);
+}
+
+static void emit_relocation(CodeBuffer *buffer, X64Operand *operand) {
+    xcc_assert(operand->type == OPERAND_SYMBOL);
+
+    X64Relocation *relocation;
+    LIST_STRUCT_APPEND_FUNC(
+        X64Relocation, buffer, num_relocations, num_relocations_allocated,
+        relocations, relocation
+    );
+    relocation->offset = buffer->num_bytes;
+    relocation->symbol = operand->symbol;
+    emit_int32(buffer, 0);
+}
+
+static bool needs_rex_for_byte_register(X64Operand *operand) {
+    // Without a REX prefix, the byte registers numbered 4-7 are
+    // %ah/%ch/%dh/%bh rather than %spl/%bpl/%sil/%dil
+    if(operand->type != OPERAND_REG || operand->size != 1) return false;
+
+    int number = encode_x64_register_number(operand->reg);
+    return number >= 4 && number <= 7;
+}
+
+static void emit_modrm_instruction(CodeBuffer *buffer, int size, const unsigned char *opcode,
+                                   int opcode_length, int reg_field, X64Operand *reg_operand,
+                                   X64Operand *rm) {
+    // reg_field is either a register number or an opcode extension, and
+    // reg_operand is the register it came from (if any)
+    xcc_assert(rm->type == OPERAND_REG || rm->type == OPERAND_MEMORY);
+
+    int rm_number = encode_x64_register_number(
+        rm->type == OPERAND_REG ? rm->reg : rm->memory.base
+    );
+
+    if(size == 2) emit_byte(buffer, 0x66);
+
+    unsigned char rex = REX_BASE;
+    if(size == 8) rex |= REX_W;
+    if(reg_field >= 8) rex |= REX_R;
+    if(rm_number >= 8) rex |= REX_B;
+
+    bool force_rex = needs_rex_for_byte_register(rm)
+        || (reg_operand && needs_rex_for_byte_register(reg_operand));
+    if(rex != REX_BASE || force_rex) emit_byte(buffer, rex);
+
+    for(int i = 0; i < opcode_length; ++i) {
+        emit_byte(buffer, opcode[i]);
+    }
+
+    int reg_bits = (reg_field & 7) << 3;
+
+    if(rm->type == OPERAND_REG) {
+        emit_byte(buffer, 0xc0 | reg_bits | (rm_number & 7));
+        return;
+    }
+
+    int displacement = rm->memory.displacement;
+
+    // %rbp and %r13 can't be used without a displacement, since that
+    // encoding means rip-relative instead
+    int mod;
+    if(displacement == 0 && (rm_number & 7) != 5) {
+        mod = 0x00;
+    } else if(fits_in_int8(displacement)) {
+        mod = 0x40;
+    } else {
+        mod = 0x80;
+    }
+
+    emit_byte(buffer, mod | reg_bits | (rm_number & 7));
+
+    // %rsp and %r12 as a base always need a SIB byte
+    if((rm_number & 7) == 4) emit_byte(buffer, 0x24);
+
+    if(mod == 0x40) {
+        emit_byte(buffer, displacement & 0xff);
+    } else if(mod == 0x80) {
+        emit_int32(buffer, displacement);
+    }
+}
+
+static void emit_single_opcode_instruction(CodeBuffer *buffer, int size, unsigned char opcode,
+                                           int reg_field, X64Operand *reg_operand,
+                                           X64Operand *rm) {
+    emit_modrm_instruction(buffer, size, &opcode, 1, reg_field, reg_operand, rm);
+}
+
+static void encode_mov(CodeBuffer *buffer, int size, X64Operand *src, X64Operand *dest) {
+    bool is_byte = size == 1;
+
+    if(src->type == OPERAND_REG) {
+        int reg_field = encode_x64_register_number(src->reg);
+        emit_single_opcode_instruction(buffer, size, is_byte ? 0x88 : 0x89, reg_field, src, dest);
+    } else if(src->type == OPERAND_MEMORY) {
+        xcc_assert(dest->type == OPERAND_REG);
+        int reg_field = encode_x64_register_number(dest->reg);
+        emit_single_opcode_instruction(buffer, size, is_byte ? 0x8a : 0x8b, reg_field, dest, src);
+    } else if(src->type == OPERAND_IMMEDIATE) {
+        long long value = src->immediate;
+
+        if(size == 8 && !fits_in_int32(value)) {
+            // movabs, which is the only way to get a full 64 bit immediate
+            xcc_assert_msg(dest->type == OPERAND_REG, "64 bit immediate stored to memory");
+            int number = encode_x64_register_number(dest->reg);
+            emit_byte(buffer, REX_BASE | REX_W | (number >= 8 ? REX_B : 0));
+            emit_byte(buffer, 0xb8 + (number & 7));
+            emit_int64(buffer, value);
+            return;
+        }
+
+        emit_single_opcode_instruction(buffer, size, is_byte ? 0xc6 : 0xc7, 0, NULL, dest);
+
+        if(is_byte) {
+            emit_byte(buffer, value & 0xff);
+        } else if(size == 2) {
+            emit_byte(buffer, value & 0xff);
+            emit_byte(buffer, (value >> 8) & 0xff);
+        } else {
+            emit_int32(buffer, value);
+        }
+    } else {
+        xcc_assert_not_reached();
+    }
+}
+
+static void encode_arithmetic(CodeBuffer *buffer, int size, int opcode_base, int extension,
+                              X64Operand *src, X64Operand *dest) {
+    // add, sub, xor and cmp all follow the same pattern, from a base opcode
+    // for the register forms and an extension for the immediate forms
+    bool is_byte = size == 1;
+
+    if(src->type == OPERAND_REG) {
+        int reg_field = encode_x64_register_number(src->reg);
+        emit_single_opcode_instruction(
+            buffer, size, opcode_base + (is_byte ? 0 : 1), reg_field, src, dest
+        );
+    } else if(src->type == OPERAND_MEMORY) {
+        xcc_assert(dest->type == OPERAND_REG);
+        int reg_field = encode_x64_register_number(dest->reg);
+        emit_single_opcode_instruction(
+            buffer, size, opcode_base + (is_byte ? 2 : 3), reg_field, dest, src
+        );
+    } else if(src->type == OPERAND_IMMEDIATE) {
+        long long value = src->immediate;
+        xcc_assert(fits_in_int32(value));
+
+        if(is_byte) {
+            emit_single_opcode_instruction(buffer, size, 0x80, extension, NULL, dest);
+            emit_byte(buffer, value & 0xff);
+        } else if(fits_in_int8(value)) {
+            emit_single_opcode_instruction(buffer, size, 0x83, extension, NULL, dest);
+            emit_byte(buffer, value & 0xff);
+        } else {
+            emit_single_opcode_instruction(buffer, size, 0x81, extension, NULL, dest);
+            emit_int32(buffer, value);
+        }
+    } else {
+        xcc_assert_not_reached();
+    }
+}
+
+static void encode_movsx(CodeBuffer *buffer, X64Operand *src, X64Operand *dest) {
+    xcc_assert(dest->type == OPERAND_REG);
+    xcc_assert(src->size < dest->size);
+
+    int reg_field = encode_x64_register_number(dest->reg);
+
+    if(src->size == 4) {
+        xcc_assert(dest->size == 8);
+        emit_single_opcode_instruction(buffer, dest->size, 0x63, reg_field, dest, src);
+    } else {
+        xcc_assert(src->size == 1 || src->size == 2);
+        unsigned char opcode[] = { 0x0f, src->size == 1 ? 0xbe : 0xbf };
+        emit_modrm_instruction(buffer, dest->size, opcode, 2, reg_field, dest, src);
+    }
+}
+
+static void encode_push_or_pop(CodeBuffer *buffer, unsigned char opcode_base, X64Operand *operand) {
+    xcc_assert(operand->type == OPERAND_REG);
+
+    int number = encode_x64_register_number(operand->reg);
+    if(number >= 8) emit_byte(buffer, REX_BASE | REX_B);
+    emit_byte(buffer, opcode_base + (number & 7));
+}
+
+void encode_x64_instruction(CodeBuffer *buffer, X64Instruction *instruction) {
+    int size = instruction->size;
+    X64Operand *first = instruction->num_operands >= 1 ? &instruction->operands[0] : NULL;
+    X64Operand *second = instruction->num_operands >= 2 ? &instruction->operands[1] : NULL;
+
+    switch(instruction->opcode) {
+        case X64_MOV:
+            encode_mov(buffer, size, first, second);
+            return;
+        case X64_ADD:
+            encode_arithmetic(buffer, size, 0x00, 0, first, second);
+            return;
+        case X64_SUB:
+            encode_arithmetic(buffer, size, 0x28, 5, first, second);
+            return;
+        case X64_XOR:
+            encode_arithmetic(buffer, size, 0x30, 6, first, second);
+            return;
+        case X64_CMP:
+            encode_arithmetic(buffer, size, 0x38, 7, first, second);
+            return;
+        case X64_TEST: {
+            // test is symmetric, so only the register to memory form exists
+            X64Operand *reg = first->type == OPERAND_REG ? first : second;
+            X64Operand *rm = reg == first ? second : first;
+            xcc_assert(reg->type == OPERAND_REG);
+
+            emit_single_opcode_instruction(
+                buffer, size, size == 1 ? 0x84 : 0x85,
+                encode_x64_register_number(reg->reg), reg, rm
+            );
+            return;
+        }
+        case X64_IMUL: {
+            xcc_assert(second->type == OPERAND_REG);
+            xcc_assert_msg(size != 1, "there is no two operand byte imul");
+
+            if(first->type == OPERAND_IMMEDIATE) {
+                // the three operand form, with the destination as the source
+                long long value = first->immediate;
+                xcc_assert(fits_in_int32(value));
+
+                int reg_field = encode_x64_register_number(second->reg);
+                bool is_short = fits_in_int8(value);
+                emit_single_opcode_instruction(
+                    buffer, size, is_short ? 0x6b : 0x69, reg_field, second, second
+                );
+
+                if(is_short) {
+                    emit_byte(buffer, value & 0xff);
+                } else {
+                    emit_int32(buffer, value);
+                }
+                return;
+            }
+
+            unsigned char opcode[] = { 0x0f, 0xaf };
+            emit_modrm_instruction(
+                buffer, size, opcode, 2, encode_x64_register_number(second->reg), second, first
+            );
+            return;
+        }
+        case X64_SET: {
+            xcc_assert(first->size == 1);
+
+            unsigned char opcode[] = { 0x0f, 0x90 | instruction->condition };
+            emit_modrm_instruction(buffer, 1, opcode, 2, 0, NULL, first);
+            return;
+        }
+        case X64_MOVSX:
+            encode_movsx(buffer, first, second);
+            return;
+        case X64_PUSH:
+            encode_push_or_pop(buffer, 0x50, first);
+            return;
+        case X64_POP:
+            encode_push_or_pop(buffer, 0x58, first);
+            return;
+        case X64_JMP:
+            // always the 32 bit form, so jumps never need to be relaxed
+            emit_byte(buffer, 0xe9);
+            emit_label_use(buffer, first);
+            return;
+        case X64_JCC:
+            emit_byte(buffer, 0x0f);
+            emit_byte(buffer, 0x80 | instruction->condition);
+            emit_label_use(buffer, first);
+            return;
+        case X64_CALL:
+            emit_byte(buffer, 0xe8);
+            emit_relocation(buffer, first);
+            return;
+        case X64_RET:
+            emit_byte(buffer, 0xc3);
+            return;
+        case X64_PARALLEL_MOV:
+            xcc_assert_not_reached_msg("parallel moves are resolved before encoding");
+    }
+    xcc_assert_not_reached();
+}
+
+void encode_x64_append(CodeBuffer *buffer, CodeBuffer *other) {
+    // Adds the code from other onto the end of buffer, for putting together
+    // functions which were encoded separately
+    xcc_assert_msg(other->num_label_uses == 0, "appending a function which wasn't ended");
+
+    encode_x64_align(buffer, X64_FUNCTION_ALIGNMENT);
+    size_t base_offset = buffer->num_bytes;
+
+    if(other->num_bytes) {
+        if(buffer->num_bytes + other->num_bytes > buffer->num_bytes_allocated) {
+            size_t new_allocated = 2 * (buffer->num_bytes + other->num_bytes);
+            unsigned char *new_bytes = xcc_malloc(new_allocated);
+            if(buffer->bytes) {
+                memcpy(new_bytes, buffer->bytes, buffer->num_bytes);
+                xcc_free(buffer->bytes);
+            }
+            buffer->bytes = new_bytes;
+            buffer->num_bytes_allocated = new_allocated;
+        }
+
+        memcpy(buffer->bytes + buffer->num_bytes, other->bytes, other->num_bytes);
+        buffer->num_bytes += other->num_bytes;
+    }
+
+    for(size_t i = 0; i < other->num_functions; ++i) {
+        X64FunctionSymbol *function;
+        LIST_STRUCT_APPEND_FUNC(
+            X64FunctionSymbol, buffer, num_functions, num_functions_allocated, functions, function
+        );
+        *function = other->functions[i];
+        function->offset += base_offset;
+    }
+
+    for(size_t i = 0; i < other->num_relocations; ++i) {
+        X64Relocation *relocation;
+        LIST_STRUCT_APPEND_FUNC(
+            X64Relocation, buffer, num_relocations, num_relocations_allocated,
+            relocations, relocation
+        );
+        *relocation = other->relocations[i];
+        relocation->offset += base_offset;
+    }
+}
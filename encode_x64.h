@@ -0,0 +1,113 @@
+#pragma once
+
+#include "xcc.h"
+
+// Instructions as the x64 generator builds them, before they're either
+// printed as assembly or encoded into machine code
+
+typedef enum {
+    X64_MOV, X64_ADD, X64_SUB, X64_IMUL, X64_XOR, X64_CMP, X64_TEST,
+    X64_SET, X64_MOVSX, X64_PUSH, X64_POP, X64_JMP, X64_JCC, X64_CALL,
+    X64_RET,
+
+    // moves in the same group all happen at once, and are turned into
+    // plain moves before anything is printed or encoded
+    X64_PARALLEL_MOV
+} X64Opcode;
+
+// The values are the condition codes in the instruction encodings
+typedef enum {
+    X64_COND_Z = 0x4, X64_COND_NZ = 0x5,
+    X64_COND_L = 0xc, X64_COND_GE = 0xd, X64_COND_LE = 0xe, X64_COND_G = 0xf
+} X64Condition;
+
+// Virtual registers are only there until register allocation
+typedef enum {
+    OPERAND_NONE, OPERAND_REG, OPERAND_MEMORY, OPERAND_IMMEDIATE,
+    OPERAND_LABEL, OPERAND_SYMBOL, OPERAND_VREG
+} X64OperandType;
+
+typedef struct {
+    X64OperandType type;
+    int size;
+
+    union {
+        RegLoc reg;
+        struct {
+            RegLoc base;
+            int base_vreg; // used instead of base unless it's -1
+            int displacement;
+        } memory;
+        int vreg;
+        long long immediate;
+        int label;
+        const char *symbol;
+    };
+} X64Operand;
+
+// Operands are in AT&T order, so the destination is last
+typedef struct {
+    X64Opcode opcode;
+    X64Condition condition; // for X64_SET and X64_JCC
+    int move_group; // for X64_PARALLEL_MOV
+    int size;
+    int num_operands;
+    X64Operand operands[2];
+} X64Instruction;
+
+typedef struct {
+    size_t offset; // of the 32 bit field to patch
+    int label;
+} X64LabelUse;
+
+typedef struct {
+    size_t offset;
+    const char *symbol;
+} X64Relocation;
+
+typedef struct {
+    const char *name;
+    size_t offset;
+    size_t size;
+} X64FunctionSymbol;
+
+// Machine code, along with the functions in it and the calls out of it.
+// Symbol names aren't copied, so they need to outlive the buffer.
+typedef struct {
+    unsigned char *bytes;
+    size_t num_bytes;
+    size_t num_bytes_allocated;
+
+    X64FunctionSymbol *functions;
+    size_t num_functions;
+    size_t num_functions_allocated;
+
+    // calls to be resolved by the linker, each with a 32 bit field at offset
+    X64Relocation *relocations;
+    size_t num_relocations;
+    size_t num_relocations_allocated;
+
+    // labels are only defined for the function being encoded, and jumps to
+    // them are patched at the end of the function
+    long long *label_offsets;
+    size_t num_label_offsets;
+    size_t num_label_offsets_allocated;
+
+    X64LabelUse *label_uses;
+    size_t num_label_uses;
+    size_t num_label_uses_allocated;
+} CodeBuffer;
+
+// Functions start on a boundary of this many bytes, so that anything in
+// them can be aligned up to it
+#define X64_FUNCTION_ALIGNMENT 16
+
+int encode_x64_register_number(RegLoc reg);
+CodeBuffer *encode_x64_new_buffer(void);
+void encode_x64_free_buffer(CodeBuffer *buffer);
+void encode_x64_begin_function(CodeBuffer *buffer, const char *name);
+void encode_x64_end_function(CodeBuffer *buffer);
+void encode_x64_label(CodeBuffer *buffer, int label);
+void encode_x64_align(CodeBuffer *buffer, int alignment);
+void encode_x64_instruction(CodeBuffer *buffer, X64Instruction *instruction);
+void encode_x64_append(CodeBuffer *buffer, CodeBuffer *other);
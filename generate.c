@@ -2,10 +2,14 @@
 
 
 // TODO: make this not use global variables
-static FILE *output_stream = NULL;
-static bool has_begun_current_line = false;
+// These are per-thread so that functions can be generated in parallel,
+// each into its own buffer
+static _Thread_local FILE *output_stream = NULL;
+static _Thread_local CodeBuffer *code_buffer = NULL;
+static _Thread_local bool has_begun_current_line = false;
 
-int unique_label_num = 0;
+static _Thread_local int unique_label_num = 0;
+static _Thread_local int label_namespace = 0;
 
 #define OUT_STREAM output_stream
 
@@ -41,6 +45,20 @@ void generate_set_output(FILE *stream) {
     output_stream = stream;
 }
 
+FILE *generate_get_output(void) {
+    return output_stream;
+}
+
+void generate_set_code_buffer(CodeBuffer *buffer) {
+    // When set, instructions are encoded into the buffer instead of being
+    // written out as assembly
+    code_buffer = buffer;
+}
+
+CodeBuffer *generate_get_code_buffer(void) {
+    return code_buffer;
+}
+
 void generate_asm(const char *line) {
     xcc_assert(output_stream);
 
@@ -49,6 +67,18 @@ void generate_asm(const char *line) {
     generate_end_of_line();
 }
 
+void generate_set_label_namespace(int namespace) {
+    // Labels are numbered from zero within each namespace, so the numbering
+    // in one function doesn't depend on what was generated before it
+    xcc_assert(namespace >= 0);
+    label_namespace = namespace;
+    unique_label_num = 0;
+}
+
+int get_label_namespace(void) {
+    return label_namespace;
+}
+
 int get_unique_label_num(void) {
     return unique_label_num++;
 }
\ No newline at end of file
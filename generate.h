@@ -6,6 +6,14 @@ void generate_asm_no_indent(void);
 void generate_asm_partial(const char *line);
 void generate_asm_integer(long long val);
 int get_unique_label_num(void);
+int get_label_namespace(void);
+void generate_set_label_namespace(int namespace);
 void generate_asm(const char *line);
 void generate_set_output(FILE *stream);
+FILE *generate_get_output(void);
+void generate_set_code_buffer(CodeBuffer *buffer);
+CodeBuffer *generate_get_code_buffer(void);
+void generate_x64_set_optimise(bool is_optimise);
+void generate_x64_begin(const char *filename);
+void generate_x64_top_level(AST *ast, int index);
 void generate_x64(AST *ast, const char *filename);
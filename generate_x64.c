@@ -73,6 +73,19 @@ static const char *reg_type_to_asm_name_1(RegLoc reg) {
     xcc_assert_not_reached();
 }
 
+static const char *reg_type_to_asm_name(RegLoc reg, int size) {
+    if (size == 8) {
+        return reg_type_to_asm_name_8(reg);
+    } else if (size == 4) {
+        return reg_type_to_asm_name_4(reg);
+    } else if (size == 1) {
+        return reg_type_to_asm_name_1(reg);
+    }
+
+    // TODO: two-byte registers
+    xcc_assert_not_reached();
+}
+
 static void generate_size_suffix(int size) {
     if (size == 1) {
         generate_asm_partial("b");
@@ -87,36 +100,197 @@ static void generate_size_suffix(int size) {
     }
 }
 
-static void generate_asm_pos(ValuePosition *pos) {
+static void generate_label(int label_num) {
+    xcc_assert(label_num >= 0);
+
+    generate_asm_partial(".L");
+    generate_asm_integer(get_label_namespace());
+    generate_asm_partial("_");
+    generate_asm_integer(label_num);
+}
+
+static long long literal_value_in_size(long long value, int size) {
+    // The low bytes of value, sign extended, so that the immediate is in
+    // range for the instruction
+    int shift = 64 - 8 * size;
+    return (long long) ((unsigned long long) value << shift) >> shift;
+}
+
+static X64Operand operand_pos(ValuePosition *pos) {
     if(pos->type == POS_STACK) {
-        generate_asm_integer(-pos->stack_offset);
-        generate_asm_partial("(%rbp)"); // TODO: omit frame pointer
+        return operand_memory(REG_RBP, -pos->stack_offset, pos->size); // TODO: omit frame pointer
     } else if(pos->type == POS_REG) {
-        const char *reg_name = NULL;
-
-        if (pos->size == 8) {
-            reg_name = reg_type_to_asm_name_8(pos->register_num);
-        } else if (pos->size == 4) {
-            reg_name = reg_type_to_asm_name_4(pos->register_num);
-        } else if (pos->size == 1) {
-            reg_name = reg_type_to_asm_name_1(pos->register_num);
-        } else {
-            // TODO: two-byte registers
-            xcc_assert_not_reached();
+        return operand_reg(pos->register_num, pos->size);
+    } else if(pos->type == POS_LITERAL) {
+        return operand_immediate(literal_value_in_size(pos->literal_value, pos->size), pos->size);
+    }
+    xcc_assert_not_reached_msg("TODO: operand_pos");
+}
+
+static void generate_asm_operand(X64Operand *operand) {
+    if(operand->type == OPERAND_REG) {
+        generate_asm_partial(reg_type_to_asm_name(operand->reg, operand->size));
+    } else if(operand->type == OPERAND_MEMORY) {
+        xcc_assert(operand->memory.base_vreg < 0);
+        if(operand->memory.displacement != 0) {
+            generate_asm_integer(operand->memory.displacement);
         }
+        generate_asm_partial("(");
+        generate_asm_partial(reg_type_to_asm_name_8(operand->memory.base));
+        generate_asm_partial(")");
+    } else if(operand->type == OPERAND_IMMEDIATE) {
+        generate_asm_partial("$");
+        generate_asm_integer(operand->immediate);
+    } else if(operand->type == OPERAND_LABEL) {
+        generate_label(operand->label);
+    } else if(operand->type == OPERAND_SYMBOL) {
+        generate_asm_partial(operand->symbol);
+    } else {
+        xcc_assert_not_reached();
+    }
+}
+
+static const char *condition_to_asm_name(X64Condition condition) {
+    switch(condition) {
+        case X64_COND_Z: return "z";
+        case X64_COND_NZ: return "nz";
+        case X64_COND_L: return "l";
+        case X64_COND_GE: return "ge";
+        case X64_COND_LE: return "le";
+        case X64_COND_G: return "g";
+    }
+    xcc_assert_not_reached();
+}
 
-        generate_asm_partial(reg_name);
+static void generate_asm_instruction(X64Instruction *instruction) {
+    switch(instruction->opcode) {
+        case X64_MOV: generate_asm_partial("mov"); break;
+        case X64_ADD: generate_asm_partial("add"); break;
+        case X64_SUB: generate_asm_partial("sub"); break;
+        case X64_IMUL: generate_asm_partial("imul"); break;
+        case X64_XOR: generate_asm_partial("xor"); break;
+        case X64_CMP: generate_asm_partial("cmp"); break;
+        case X64_TEST: generate_asm_partial("test"); break;
+        case X64_SET: generate_asm_partial("set"); break;
+        case X64_MOVSX: generate_asm_partial("movsx"); break;
+        case X64_PUSH: generate_asm_partial("push"); break;
+        case X64_POP: generate_asm_partial("pop"); break;
+        case X64_JMP: generate_asm_partial("jmp"); break;
+        case X64_JCC: generate_asm_partial("j"); break;
+        case X64_CALL: generate_asm_partial("call"); break;
+        case X64_RET: generate_asm_partial("ret"); break;
+        case X64_PARALLEL_MOV: xcc_assert_not_reached();
+    }
+
+    if(instruction->opcode == X64_SET || instruction->opcode == X64_JCC) {
+        generate_asm_partial(condition_to_asm_name(instruction->condition));
+    } else if(instruction->opcode == X64_MOVSX) {
+        // the suffix is the size being extended from
+        generate_size_suffix(instruction->operands[0].size);
+    } else if(instruction->size) {
+        generate_size_suffix(instruction->size);
+    }
+
+    for(int i = 0; i < instruction->num_operands; ++i) {
+        generate_asm_partial(i == 0 ? " " : ", ");
+        generate_asm_operand(&instruction->operands[i]);
+    }
+    generate_asm("");
+}
+
+static void output_instruction(X64Instruction *instruction) {
+    CodeBuffer *code_buffer = generate_get_code_buffer();
+    if(code_buffer) {
+        encode_x64_instruction(code_buffer, instruction);
     } else {
-        xcc_assert_not_reached_msg("TODO: generate_asm_pos");
+        generate_asm_instruction(instruction);
     }
 }
 
-static void generate_label(int label_num) {
-    xcc_assert(label_num >= 0);
+static void output_label(int label_num) {
+    CodeBuffer *code_buffer = generate_get_code_buffer();
+    if(code_buffer) {
+        encode_x64_label(code_buffer, label_num);
+    } else {
+        generate_label(label_num);
+        generate_asm(":");
+    }
+}
 
-    generate_asm_partial(".L");
-    generate_asm_integer(label_num);
-    generate_asm_partial("");
+static void output_alignment(int alignment) {
+    CodeBuffer *code_buffer = generate_get_code_buffer();
+    if(code_buffer) {
+        encode_x64_align(code_buffer, alignment);
+    } else {
+        generate_asm_partial(".balign ");
+        generate_asm_integer(alignment);
+        generate_asm("");
+    }
+}
+
+static void output_function(X64Function *func) {
+    for(int i = 0; i < func->num_blocks; ++i) {
+        X64Block *block = &func->blocks[i];
+        if(block->alignment) output_alignment(block->alignment);
+        if(block->label >= 0) output_label(block->label);
+
+        for(int j = 0; j < block->num_instructions; ++j) {
+            output_instruction(&block->instructions[j]);
+        }
+    }
+}
+
+// Instructions are collected into the function being generated, and only
+// output once every pass has run over it. Like the output, it's per-thread
+// so that functions can be generated in parallel.
+static _Thread_local X64Function *current_function;
+
+static void generate_instruction(X64Instruction *instruction) {
+    xcc_assert(current_function->num_blocks > 0);
+    machine_x64_append(&current_function->blocks[current_function->num_blocks - 1], instruction);
+}
+
+static void generate_op(X64Opcode opcode, int size, int num_operands,
+                        X64Operand first, X64Operand second) {
+    X64Instruction instruction = machine_x64_instruction(opcode, size, num_operands, first, second);
+    generate_instruction(&instruction);
+}
+
+static void generate_op_2(X64Opcode opcode, int size, X64Operand src, X64Operand dest) {
+    generate_op(opcode, size, 2, src, dest);
+}
+
+static void generate_op_1(X64Opcode opcode, int size, X64Operand operand) {
+    generate_op(opcode, size, 1, operand, operand_none());
+}
+
+static void generate_conditional_op(X64Opcode opcode, X64Condition condition, X64Operand operand) {
+    X64Instruction instruction = machine_x64_instruction(opcode, 0, 1, operand, operand_none());
+    instruction.condition = condition;
+    generate_instruction(&instruction);
+}
+
+static void generate_parallel_move(int group, int size, X64Operand from, X64Operand to) {
+    // group is from machine_x64_new_move_group, and is shared by every move
+    // which happens at the same time
+    X64Instruction instruction = machine_x64_instruction(X64_PARALLEL_MOV, size, 2, from, to);
+    instruction.move_group = group;
+    generate_instruction(&instruction);
+}
+
+static void generate_return(void) {
+    // the epilogue goes in once the frame is known
+    generate_op(X64_RET, 8, 0, operand_none(), operand_none());
+}
+
+static void generate_block(int label_num) {
+    // label_num is -1 for a block which is only ever fallen into
+    machine_x64_new_block(current_function, label_num);
+}
+
+static void generate_label_definition(int label_num) {
+    xcc_assert(label_num >= 0);
+    generate_block(label_num);
 }
 
 static bool val_pos_is_memory(ValuePosition *a) {
@@ -130,22 +304,51 @@ static bool val_pos_is_writable(ValuePosition *a) {
     return a->type == POS_STACK || a->type == POS_REG;
 }
 
+static void generate_literal_move(long long value, ValuePosition *to) {
+    // Picks the shortest encoding: xor for zero, movl for anything which is
+    // zero extended into the full register, and movabs only for values
+    // which need all 64 bits
+    value = literal_value_in_size(value, to->size);
+
+    if(to->type == POS_REG && to->size >= 4) {
+        if(value == 0) {
+            X64Operand reg = operand_reg(to->register_num, 4);
+            generate_op_2(X64_XOR, 4, reg, reg);
+            return;
+        } else if(value >= 0 && value <= 0xffffffffLL) {
+            generate_op_2(
+                X64_MOV, 4, operand_immediate(value, 4), operand_reg(to->register_num, 4)
+            );
+            return;
+        }
+    }
+
+    if(to->size == 8 && value != (int) value && to->type != POS_REG) {
+        // there's no 64 bit immediate store
+        ValuePosition *temp_reg = value_pos_reg(REG_R11, to->size, to->is_signed);
+        generate_literal_move(value, temp_reg);
+        generate_op_2(X64_MOV, 8, operand_pos(temp_reg), operand_pos(to));
+        return;
+    }
+
+    generate_op_2(X64_MOV, to->size, operand_immediate(value, to->size), operand_pos(to));
+}
+
 static void move_value_raw(ValuePosition *a, ValuePosition *b) {
     xcc_assert(val_pos_is_writable(b));
 
+    if(a->type == POS_LITERAL) {
+        xcc_assert(a->size == b->size);
+        generate_literal_move(a->literal_value, b);
+        return;
+    }
+
     // Moves value at a into b, but at least one must not be in memory
     xcc_assert(!val_pos_is_memory(a) || !val_pos_is_memory(b));
 
     xcc_assert(a->size == b->size);
 
-    generate_asm_partial("mov");
-    generate_size_suffix(a->size);
-    generate_asm_partial(" ");
-
-    generate_asm_pos(a);
-    generate_asm_partial(", ");
-    generate_asm_pos(b);
-    generate_asm("");
+    generate_op_2(X64_MOV, a->size, operand_pos(a), operand_pos(b));
 }
 
 static ValuePosition *move_value_into_temp_reg(ValuePosition *pos) {
@@ -156,6 +359,15 @@ static ValuePosition *move_value_into_temp_reg(ValuePosition *pos) {
     return temp_reg;
 }
 
+static ValuePosition *possibly_move_literal_to_temp(ValuePosition *pos) {
+    // For operands which can't be immediates
+    if(pos->type == POS_LITERAL) {
+        return move_value_into_temp_reg(pos);
+    } else {
+        return pos;
+    }
+}
+
 static ValuePosition *possibly_move_to_temp(ValuePosition *a, ValuePosition *b) {
     // Returns a if at least one of a and b is not memory, otherwise moves
     // a into a temporary register and returns that
@@ -182,19 +394,14 @@ static void generate_move(ValuePosition *from, ValuePosition *to) {
 }
 
 static void generate_integer_literal_expression(AST *ast) {
-    // TODO: make AST_INTEGER_LITERAL have a literal value pos instead
-    if (ast->pos->size == 4) {
-        generate_asm_partial("movl $");
-    } else if (ast->pos->size == 8) {
-        generate_asm_partial("movq $");
-    } else {
-        xcc_assert_not_reached();
-    }
+    // nothing to do for an immediate, which goes straight into whatever
+    // instruction uses it
+    if (ast->pos->type == POS_LITERAL) return;
 
-    generate_asm_integer(ast->integer_literal_val);
-    generate_asm_partial(", ");
-    generate_asm_pos(ast->pos);
-    generate_asm("");
+    int size = ast->pos->size;
+    xcc_assert(size == 4 || size == 8);
+
+    generate_literal_move(ast->integer_literal_val, ast->pos);
 }
 
 static void generate_expression(GenContext *ctx, AST *ast);
@@ -203,8 +410,8 @@ static void generate_statement(GenContext *ctx, AST *ast);
 static void generate_binary_arithmetic_expression(GenContext *ctx, AST *ast) {
     xcc_assert(ast->num_nodes == 2);
 
-    generate_expression(ctx, ast->nodes[0]);
-    generate_expression(ctx, ast->nodes[1]);
+    generate_expression(ctx, ast_nth_evaluated(ast, 0));
+    generate_expression(ctx, ast_nth_evaluated(ast, 1));
 
     ValuePosition *a = ast->nodes[0]->pos;
     ValuePosition *b = ast->nodes[1]->pos;
@@ -228,40 +435,28 @@ static void generate_binary_arithmetic_expression(GenContext *ctx, AST *ast) {
         second_arg = NULL;
     }
 
-    const char *opcode = NULL;
+    X64Opcode opcode;
     if (ast->type == AST_ADD) {
-        opcode = "add";
+        opcode = X64_ADD;
     } else if (ast->type == AST_SUBTRACT) {
-        opcode = "sub";
+        opcode = X64_SUB;
+    } else {
+        xcc_assert_not_reached();
     }
 
-    xcc_assert(opcode);
-
     if(first_arg && second_arg) {
         generate_move(first_arg, dest);
         second_arg = possibly_move_to_temp(second_arg, dest);
 
-        generate_asm_partial(opcode);
-        generate_size_suffix(ast->pos->size);
-        generate_asm_partial(" ");
-
-        generate_asm_partial(" ");
-        generate_asm_pos(second_arg);
-        generate_asm_partial(", ");
-        generate_asm_pos(dest);
-        generate_asm("");
+        generate_op_2(opcode, ast->pos->size, operand_pos(second_arg), operand_pos(dest));
+    } else if(dest->type == POS_REG && !value_pos_is_same(b, dest)) {
+        // a register destination can be worked on directly
+        generate_move(a, dest);
+        generate_op_2(opcode, ast->pos->size, operand_pos(b), operand_pos(dest));
     } else {
         ValuePosition *temp_reg_a = move_value_into_temp_reg(a);
 
-        generate_asm_partial(opcode);
-        generate_size_suffix(ast->pos->size);
-        generate_asm_partial(" ");
-
-        generate_asm_partial(" ");
-        generate_asm_pos(b);
-        generate_asm_partial(", ");
-        generate_asm_pos(temp_reg_a);
-        generate_asm("");
+        generate_op_2(opcode, ast->pos->size, operand_pos(b), operand_pos(temp_reg_a));
 
         generate_move(temp_reg_a, dest);
     }
@@ -273,8 +468,8 @@ static void generate_multiply_expression(GenContext *ctx, AST *ast) {
 
     xcc_assert(ast->num_nodes == 2);
 
-    generate_expression(ctx, ast->nodes[0]);
-    generate_expression(ctx, ast->nodes[1]);
+    generate_expression(ctx, ast_nth_evaluated(ast, 0));
+    generate_expression(ctx, ast_nth_evaluated(ast, 1));
 
     ValuePosition *a = ast->nodes[0]->pos;
     ValuePosition *b = ast->nodes[1]->pos;
@@ -287,69 +482,103 @@ static void generate_multiply_expression(GenContext *ctx, AST *ast) {
     ValuePosition *multiplication_reg = value_pos_reg(REG_RAX, dest->size, dest->is_signed);
 
     generate_move(a, multiplication_reg);
-    generate_asm_partial("imul");
-    generate_size_suffix(dest->size);
-    generate_asm_partial(" ");
-    generate_asm_pos(b);
-    generate_asm_partial(", ");
-    generate_asm_pos(multiplication_reg);
-    generate_asm("");
+    generate_op_2(X64_IMUL, dest->size, operand_pos(b), operand_pos(multiplication_reg));
 
     generate_move(multiplication_reg, dest);
 }
 
-static void generate_comparison_expression(GenContext *ctx, AST *ast) {
-    // uses rax!
-    RegLoc comparison_register = REG_RAX;
+static X64Condition comparison_condition(bool is_less, bool is_or_equal, bool is_swapped) {
+    // For cmp a, b, which compares b with a, so the condition is the other
+    // way round unless the operands have been swapped
+    if (is_less) {
+        if (is_or_equal) return is_swapped ? X64_COND_LE : X64_COND_GE;
+        return is_swapped ? X64_COND_L : X64_COND_G;
+    } else {
+        if (is_or_equal) return is_swapped ? X64_COND_GE : X64_COND_LE;
+        return is_swapped ? X64_COND_G : X64_COND_L;
+    }
+}
 
+static X64Condition inverse_condition(X64Condition condition) {
+    switch(condition) {
+        case X64_COND_Z: return X64_COND_NZ;
+        case X64_COND_NZ: return X64_COND_Z;
+        case X64_COND_L: return X64_COND_GE;
+        case X64_COND_GE: return X64_COND_L;
+        case X64_COND_LE: return X64_COND_G;
+        case X64_COND_G: return X64_COND_LE;
+    }
+    xcc_assert_not_reached();
+}
+
+static bool is_comparison(AST *ast) {
+    return ast->type == AST_CMP_LT || ast->type == AST_CMP_LT_EQ
+        || ast->type == AST_CMP_GT || ast->type == AST_CMP_GT_EQ;
+}
+
+static void generate_comparison_operands(GenContext *ctx, AST *ast) {
     xcc_assert(ast->num_nodes == 2);
 
-    generate_expression(ctx, ast->nodes[0]);
-    generate_expression(ctx, ast->nodes[1]);
+    generate_expression(ctx, ast_nth_evaluated(ast, 0));
+    generate_expression(ctx, ast_nth_evaluated(ast, 1));
+}
 
+static X64Condition generate_compare(AST *ast) {
+    // Compares the operands, which have already been worked out, and
+    // returns the condition which holds when the comparison is true
     ValuePosition *a = ast->nodes[0]->pos;
     ValuePosition *b = ast->nodes[1]->pos;
-    ValuePosition *dest = ast->pos;
 
-    int is_signed = dest->is_signed;
-
-    generate_asm_partial("xorq ");
-    generate_asm_partial(" ");
-    generate_asm_pos(value_pos_reg(comparison_register, 8, is_signed));
-    generate_asm_partial(", ");
-    generate_asm_pos(value_pos_reg(comparison_register, 8, is_signed));
-    generate_asm("");
+    // The second operand of cmp can't be an immediate, so a literal there
+    // is compared the other way round, which flips the condition
+    bool is_swapped = b->type == POS_LITERAL && a->type != POS_LITERAL;
+    if (is_swapped) {
+        ValuePosition *swap = a;
+        a = b;
+        b = swap;
+    }
 
+    b = possibly_move_literal_to_temp(b);
     a = possibly_move_to_temp(a, b);
-    generate_asm_partial("cmp");
-    generate_size_suffix(a->size);
-    generate_asm_partial(" ");
-    generate_asm_pos(a);
-    generate_asm_partial(", ");
-    generate_asm_pos(b);
-    generate_asm("");
-
-    generate_asm_partial("set");
+    generate_op_2(X64_CMP, a->size, operand_pos(a), operand_pos(b));
 
+    X64Condition condition;
     if (ast->type == AST_CMP_LT) {
-        generate_asm_partial("g");
+        condition = comparison_condition(true, false, is_swapped);
     } else if (ast->type == AST_CMP_LT_EQ) {
-        generate_asm_partial("ge");
+        condition = comparison_condition(true, true, is_swapped);
     } else if (ast->type == AST_CMP_GT) {
-        generate_asm_partial("l");
+        condition = comparison_condition(false, false, is_swapped);
     } else if (ast->type == AST_CMP_GT_EQ) {
-        generate_asm_partial("le");
+        condition = comparison_condition(false, true, is_swapped);
     } else {
         xcc_assert_not_reached();
     }
 
-    generate_asm_partial(" ");
-    generate_asm_pos(value_pos_reg(comparison_register, 1, is_signed));
-    generate_asm("");
+    return condition;
+}
+
+static void generate_comparison_expression(GenContext *ctx, AST *ast) {
+    // uses rax!
+    RegLoc comparison_register = REG_RAX;
+
+    generate_comparison_operands(ctx, ast);
+
+    ValuePosition *dest = ast->pos;
+    int is_signed = dest->is_signed;
+
+    generate_op_2(
+        X64_XOR, 8, operand_reg(comparison_register, 8), operand_reg(comparison_register, 8)
+    );
+
+    X64Condition condition = generate_compare(ast);
+    generate_conditional_op(X64_SET, condition, operand_reg(comparison_register, 1));
 
     generate_move(value_pos_reg(comparison_register, dest->size, is_signed), dest);
 }
 
+#define MAX_REGISTER_ARGUMENTS 6
+
 static RegLoc argument_index_to_register(int index) {
     if(index == 0) {
         return REG_RDI;
@@ -367,22 +596,34 @@ static RegLoc argument_index_to_register(int index) {
     xcc_assert_not_reached_msg("TODO: implement case for more than 6 args");
 }
 
+static void generate_argument_moves(AST *ast) {
+    // The arguments are moved into place all at once, since they can
+    // already be in each other's registers
+    int num_args = ast->num_nodes - 1;
+    xcc_assert_msg(num_args <= MAX_REGISTER_ARGUMENTS, "TODO: implement case for more than 6 args");
+    int group = machine_x64_new_move_group(current_function);
+
+    for(int i = 0; i < num_args; ++i) {
+        ValuePosition *from = ast->nodes[i + 1]->pos;
+        generate_parallel_move(
+            group, from->size, operand_pos(from), operand_reg(argument_index_to_register(i), from->size)
+        );
+    }
+}
+
 static void generate_call_expression(GenContext *ctx, AST *ast) {
     xcc_assert(ast->num_nodes >= 1);
     xcc_assert(ast->nodes[0]->pos->type == POS_FUNC_NAME);
 
+    // Every argument is worked out before any are put in place, since
+    // working one out can need the argument registers
     for(int i = 1; i < ast->num_nodes; ++i) {
-        AST *argument_ast = ast->nodes[i];
-        generate_expression(ctx, argument_ast);
-
-        RegLoc arg_reg = argument_index_to_register(i - 1);
-        generate_move(argument_ast->pos, value_pos_reg(
-            arg_reg, argument_ast->pos->size, argument_ast->pos->is_signed
-        ));
+        generate_expression(ctx, ast->nodes[i]);
     }
 
-    generate_asm_partial("call ");
-    generate_asm(ast->nodes[0]->pos->func_name);
+    generate_argument_moves(ast);
+
+    generate_op_1(X64_CALL, 0, operand_symbol(ast->nodes[0]->pos->func_name));
 
     if (ast->pos->type != POS_VOID) {
         generate_move(value_pos_reg(REG_RAX, ast->pos->size, ast->pos->is_signed), ast->pos);
@@ -410,29 +651,21 @@ static void generate_int_conversion(GenContext *ctx, AST *ast) {
         ValuePosition *from_reg = NULL;
         // ValuePosition *to_reg = NULL;
 
-        if (val_pos_is_memory(from)) {
+        if (from->type != POS_REG) {
             from_reg = move_value_into_temp_reg(from);
         } else {
             from_reg = from;
         }
 
-        generate_asm_partial("movsx");
-        generate_size_suffix(size_from);
-        // generate_size_suffix(size_to);
-
-        generate_asm_partial(" ");
-        generate_asm_pos(from_reg);
-        generate_asm_partial(", ");
-
         ValuePosition *to_reg = NULL;
 
         if (val_pos_is_memory(to)) {
             to_reg = value_pos_reg(REG_R11, to->size, to->is_signed);
-            generate_asm_pos(to_reg);
-        } else {
-            generate_asm_pos(to);
         }
-        generate_asm("");
+
+        generate_op_2(
+            X64_MOVSX, size_to, operand_pos(from_reg), operand_pos(to_reg ? to_reg : to)
+        );
 
         if (to_reg != NULL) {
             generate_move(to_reg, to);
@@ -465,23 +698,18 @@ static void generate_dereference(GenContext *ctx, AST *ast) {
     ValuePosition *from = ast->nodes[0]->pos;
     ValuePosition *to = ast->pos;
 
-    if (val_pos_is_memory(from)) {
+    if (from->type != POS_REG) {
         from = move_value_into_temp_reg(from);
     }
-    xcc_assert(from->type = POS_REG); // TODO: there are other cases to think about
 
     ValuePosition *to_temp = to;
     if (val_pos_is_memory(to_temp)) {
         to_temp = value_pos_reg(REG_R11, to->size, to->is_signed);;
     }
 
-    generate_asm_partial("mov");
-    generate_size_suffix(to->size);
-    generate_asm_partial(" ("); // TODO: does this always work?
-    generate_asm_pos(from);
-    generate_asm_partial("), ");
-    generate_asm_pos(to_temp);
-    generate_asm("");
+    generate_op_2(
+        X64_MOV, to->size, operand_memory(from->register_num, 0, to->size), operand_pos(to_temp)
+    );
 
     if (!value_pos_is_same(to, to_temp)) {
         move_value_raw(to_temp, to);
@@ -536,47 +764,54 @@ static void generate_expression(GenContext *ctx, AST *ast) {
     }
 }
 
+static void generate_condition_jump(GenContext *ctx, AST *condition, bool is_jump_if_true, int label_num) {
+    // Jumps to label_num if condition is is_jump_if_true. A comparison is
+    // branched on straight from its cmp, which the jcc follows directly so
+    // that the two can be fused, and its result is never worked out.
+    X64Condition when_true;
+
+    if (is_comparison(condition)) {
+        generate_comparison_operands(ctx, condition);
+        when_true = generate_compare(condition);
+    } else {
+        generate_expression(ctx, condition);
+        ValuePosition *pos = condition->pos;
+
+        if (pos->type == POS_LITERAL) {
+            bool is_true = pos->literal_value != 0;
+            if (is_true == is_jump_if_true) generate_op_1(X64_JMP, 0, operand_label(label_num));
+            return;
+        }
+
+        ValuePosition *condition_reg = possibly_move_to_temp(pos, pos);
+        generate_op_2(X64_TEST, pos->size, operand_pos(condition_reg), operand_pos(condition_reg));
+        when_true = X64_COND_NZ;
+    }
+
+    X64Condition condition_code = is_jump_if_true ? when_true : inverse_condition(when_true);
+    generate_conditional_op(X64_JCC, condition_code, operand_label(label_num));
+}
+
 static void generate_if(GenContext *ctx, AST *ast) {
     xcc_assert(ast->type == AST_IF);
     xcc_assert(ast->num_nodes == 2 || ast->num_nodes == 3);
     bool has_else = ast->num_nodes == 3;
 
-    generate_expression(ctx, ast->nodes[0]);
-
     int skip_to_after_if_label = get_unique_label_num();
     int skip_to_after_else = has_else ? get_unique_label_num() : -1;
 
-    ValuePosition *condition_reg = possibly_move_to_temp(
-        ast->nodes[0]->pos, ast->nodes[0]->pos
-    );
-
-    // TODO: always using a test instruction is very inefficent
-    generate_asm_partial("test");
-    generate_size_suffix(ast->nodes[0]->pos->size);
-    generate_asm_partial(" ");
-    generate_asm_pos(condition_reg);
-    generate_asm_partial(", ");
-    generate_asm_pos(condition_reg);
-    generate_asm("");
-
-    generate_asm_partial("jz ");
-    generate_label(skip_to_after_if_label);
-    generate_asm("");
+    generate_condition_jump(ctx, ast->nodes[0], false, skip_to_after_if_label);
 
     generate_statement(ctx, ast->nodes[1]);
     if (has_else) {
-        generate_asm_partial("jmp ");
-        generate_label(skip_to_after_else);
-        generate_asm("");
+        generate_op_1(X64_JMP, 0, operand_label(skip_to_after_else));
     }
 
-    generate_label(skip_to_after_if_label);
-    generate_asm(":");
+    generate_label_definition(skip_to_after_if_label);
 
     if (has_else) {
         generate_statement(ctx, ast->nodes[2]);
-        generate_label(skip_to_after_else);
-        generate_asm(":");
+        generate_label_definition(skip_to_after_else);
     }
 }
 
@@ -584,38 +819,18 @@ static void generate_while(GenContext *ctx, AST *ast) {
     xcc_assert(ast->type == AST_WHILE);
     xcc_assert(ast->num_nodes == 2);
 
+    // Rotated so that the condition is checked once on the way in, and then
+    // at the bottom, where a single jcc goes back round
     int beginning_label = get_unique_label_num();
     int end_label = get_unique_label_num();
 
-    generate_label(beginning_label);
-    generate_asm(":");
-
-    generate_expression(ctx, ast->nodes[0]);
-    ValuePosition *condition_reg = possibly_move_to_temp(
-        ast->nodes[0]->pos, ast->nodes[0]->pos
-    );
-
-    // TODO: always using a test instruction is very inefficent
-    generate_asm_partial("test");
-    generate_size_suffix(ast->nodes[0]->pos->size);
-    generate_asm_partial(" ");
-    generate_asm_pos(condition_reg);
-    generate_asm_partial(", ");
-    generate_asm_pos(condition_reg);
-    generate_asm("");
-
-    generate_asm_partial("jz ");
-    generate_label(end_label);
-    generate_asm("");
+    generate_condition_jump(ctx, ast->nodes[0], false, end_label);
+    generate_label_definition(beginning_label);
 
     generate_statement(ctx, ast->nodes[1]);
 
-    generate_asm_partial("jmp ");
-    generate_label(beginning_label);
-    generate_asm("");
-
-    generate_label(end_label);
-    generate_asm(":");
+    generate_condition_jump(ctx, ast->nodes[0], true, beginning_label);
+    generate_label_definition(end_label);
 }
 
 static void generate_statement(GenContext *ctx, AST *ast) {
@@ -629,15 +844,7 @@ static void generate_statement(GenContext *ctx, AST *ast) {
             generate_move(expression->pos, value_pos_reg(REG_RAX, expression->pos->size, expression->pos->is_signed));
         }
 
-        // epilogue
-        if (ctx->reserved_stack_space != 0) {
-            generate_asm_partial("addq $");
-            generate_asm_integer(ctx->reserved_stack_space);
-            generate_asm(", %rsp");
-            generate_asm("popq %rbp");
-        }
-
-        generate_asm("retq");
+        generate_return();
     } else if(ast->type == AST_STATEMENT_EXPRESSION) {
         xcc_assert(ast->num_nodes == 1);
         generate_expression(ctx, ast->nodes[0]);
@@ -691,55 +898,577 @@ static void generate_param_loading(AST *ast) {
     }
 }
 
+// Lowering from the IR, for -O
+//
+// Every value is a virtual register numbered by its id, or an immediate if
+// it's a constant which fits, so each instruction is lowered on its own and
+// register allocation sorts out where everything goes afterwards. Phis are
+// copied into at the end of each predecessor as a parallel move, and the
+// edges are split beforehand so that a block ending in a branch never has to.
+
+static bool is_optimising = false;
+
+typedef struct {
+    IRFunction *func;
+
+    // by block id, or -1 for a block which is only ever fallen into
+    int *block_labels;
+
+    // by value id, for comparisons only ever branched on, which are done
+    // where the branch is rather than being worked out
+    bool *is_fused;
+} IRGenContext;
+
+static bool is_immediate_value(IRInstruction *value) {
+    // Like literals, constants are immediate operands when they fit
+    if(value->opcode != IR_CONST) return false;
+    return value->size < 8 || value->constant == (int) value->constant;
+}
+
+static X64Operand ir_operand(IRInstruction *value) {
+    if(is_immediate_value(value)) {
+        return operand_immediate(literal_value_in_size(value->constant, value->size), value->size);
+    }
+    return operand_vreg(value->id, value->size);
+}
+
+static X64Operand ir_operand_in_register(IRInstruction *value) {
+    // For operands which can't be immediates
+    X64Operand operand = ir_operand(value);
+    if(operand.type != OPERAND_IMMEDIATE) return operand;
+
+    X64Operand temp = operand_vreg(machine_x64_new_vreg(current_function), value->size);
+    generate_op_2(X64_MOV, value->size, operand, temp);
+    return temp;
+}
+
+static IRBlock *ir_next_block(IRGenContext *ctx, IRBlock *block) {
+    int index = block->id + 1;
+    return index < ctx->func->num_blocks ? ctx->func->blocks[index] : NULL;
+}
+
+static void ir_generate_jump(IRGenContext *ctx, IRBlock *block, IRBlock *target) {
+    if(target == ir_next_block(ctx, block)) return;
+
+    xcc_assert(ctx->block_labels[target->id] >= 0);
+    generate_op_1(X64_JMP, 0, operand_label(ctx->block_labels[target->id]));
+}
+
+static void ir_generate_arithmetic(IRInstruction *instruction) {
+    IRInstruction *a = instruction->operands[0];
+    IRInstruction *b = instruction->operands[1];
+    X64Operand dest = ir_operand(instruction);
+
+    X64Opcode opcode;
+    if(instruction->opcode == IR_ADD) {
+        opcode = X64_ADD;
+    } else if(instruction->opcode == IR_SUB) {
+        opcode = X64_SUB;
+    } else {
+        xcc_assert(instruction->opcode == IR_MUL);
+        opcode = X64_IMUL;
+    }
+
+    // an immediate is better as the operand than moved in first
+    if(instruction->opcode != IR_SUB && is_immediate_value(a) && !is_immediate_value(b)) {
+        IRInstruction *swap = a;
+        a = b;
+        b = swap;
+    }
+
+    generate_op_2(X64_MOV, dest.size, ir_operand(a), dest);
+    generate_op_2(opcode, dest.size, ir_operand(b), dest);
+}
+
+static X64Condition ir_generate_compare(IRInstruction *instruction) {
+    // Returns the condition which holds after the cmp when the comparison
+    // is true
+    X64Operand a = ir_operand(instruction->operands[0]);
+    X64Operand b = ir_operand(instruction->operands[1]);
+
+    bool is_swapped = b.type == OPERAND_IMMEDIATE && a.type != OPERAND_IMMEDIATE;
+    if(is_swapped) {
+        X64Operand swap = a;
+        a = b;
+        b = swap;
+    }
+    if(b.type == OPERAND_IMMEDIATE) {
+        b = ir_operand_in_register(instruction->operands[1]);
+    }
+
+    generate_op_2(X64_CMP, a.size, a, b);
+
+    bool is_less = instruction->opcode == IR_CMP_LT || instruction->opcode == IR_CMP_LT_EQ;
+    bool is_or_equal = instruction->opcode == IR_CMP_LT_EQ || instruction->opcode == IR_CMP_GT_EQ;
+    return comparison_condition(is_less, is_or_equal, is_swapped);
+}
+
+static bool ir_is_comparison(IRInstruction *instruction) {
+    IROpcode opcode = instruction->opcode;
+    return opcode == IR_CMP_LT || opcode == IR_CMP_GT || opcode == IR_CMP_LT_EQ || opcode == IR_CMP_GT_EQ;
+}
+
+static void ir_generate_comparison(IRGenContext *ctx, IRInstruction *instruction) {
+    if(ctx->is_fused[instruction->id]) return;
+
+    // The result is zeroed before the cmp, since that would change the
+    // flags after it, and is set only once it's done
+    X64Operand dest = operand_vreg(instruction->id, 4);
+    generate_op_2(X64_XOR, 4, dest, dest);
+
+    X64Condition condition = ir_generate_compare(instruction);
+    generate_conditional_op(X64_SET, condition, operand_vreg(instruction->id, 1));
+}
+
+static void ir_generate_sign_extension(IRInstruction *instruction) {
+    IRInstruction *from = instruction->operands[0];
+    X64Operand dest = ir_operand(instruction);
+
+    if(is_immediate_value(from)) {
+        generate_op_2(X64_MOV, dest.size, operand_immediate(from->constant, dest.size), dest);
+    } else {
+        generate_op_2(X64_MOVSX, dest.size, ir_operand(from), dest);
+    }
+}
+
+static void ir_generate_truncation(IRInstruction *instruction) {
+    // the low bytes are where the value already is, being little endian
+    IRInstruction *from = instruction->operands[0];
+    X64Operand dest = ir_operand(instruction);
+
+    X64Operand truncated_from;
+    if(is_immediate_value(from)) {
+        truncated_from = operand_immediate(literal_value_in_size(from->constant, dest.size), dest.size);
+    } else {
+        truncated_from = operand_vreg(from->id, dest.size);
+    }
+    generate_op_2(X64_MOV, dest.size, truncated_from, dest);
+}
+
+static void ir_generate_load(IRInstruction *instruction) {
+    X64Operand pointer = ir_operand_in_register(instruction->operands[0]);
+    X64Operand dest = ir_operand(instruction);
+
+    generate_op_2(X64_MOV, dest.size, operand_vreg_memory(pointer.vreg, 0, dest.size), dest);
+}
+
+static void ir_generate_call(IRInstruction *instruction) {
+    int num_args = instruction->num_operands;
+    xcc_assert_msg(num_args <= MAX_REGISTER_ARGUMENTS, "TODO: implement case for more than 6 args");
+    int group = machine_x64_new_move_group(current_function);
+
+    for(int i = 0; i < num_args; ++i) {
+        X64Operand from = ir_operand(instruction->operands[i]);
+        generate_parallel_move(
+            group, from.size, from, operand_reg(argument_index_to_register(i), from.size)
+        );
+    }
+
+    generate_op_1(X64_CALL, 0, operand_symbol(instruction->func_name));
+
+    if(instruction->size != 0) {
+        X64Operand dest = ir_operand(instruction);
+        generate_op_2(X64_MOV, dest.size, operand_reg(REG_RAX, dest.size), dest);
+    }
+}
+
+static void ir_generate_phi_copies(IRBlock *block, IRBlock *target) {
+    int predecessor_index = ir_predecessor_index(target, block);
+    int group = machine_x64_new_move_group(current_function);
+
+    for(int i = 0; i < target->num_instructions; ++i) {
+        IRInstruction *phi = target->instructions[i];
+        if(phi->opcode != IR_PHI) break;
+
+        X64Operand dest = ir_operand(phi);
+        generate_parallel_move(group, dest.size, ir_operand(phi->operands[predecessor_index]), dest);
+    }
+}
+
+static void ir_generate_branch(IRGenContext *ctx, IRBlock *block, IRInstruction *instruction) {
+    IRInstruction *condition = instruction->operands[0];
+    IRBlock *if_true = instruction->targets[0];
+    IRBlock *if_false = instruction->targets[1];
+
+    if(is_immediate_value(condition)) {
+        ir_generate_jump(ctx, block, condition->constant ? if_true : if_false);
+        return;
+    }
+
+    // the jcc goes straight after the cmp or test, so they can be fused
+    X64Condition when_true;
+    if(ctx->is_fused[condition->id]) {
+        when_true = ir_generate_compare(condition);
+    } else {
+        X64Operand condition_operand = ir_operand(condition);
+        generate_op_2(X64_TEST, condition_operand.size, condition_operand, condition_operand);
+        when_true = X64_COND_NZ;
+    }
+
+    if(if_true == ir_next_block(ctx, block)) {
+        generate_conditional_op(
+            X64_JCC, inverse_condition(when_true), operand_label(ctx->block_labels[if_false->id])
+        );
+    } else {
+        generate_conditional_op(X64_JCC, when_true, operand_label(ctx->block_labels[if_true->id]));
+        ir_generate_jump(ctx, block, if_false);
+    }
+}
+
+static bool ir_is_rotated_back_edge(IRGenContext *ctx, IRBlock *block, IRBlock *target) {
+    // A loop header which does nothing but work out its condition is copied
+    // to the bottom of the loop, so that going round only takes one branch
+    // and the header itself is only the check on the way in
+    if(target->id > block->id) return false;
+
+    IRInstruction *terminator = ir_terminator(target);
+    if(terminator->opcode != IR_BRANCH) return false;
+
+    for(int i = 0; i < target->num_instructions; ++i) {
+        IRInstruction *instruction = target->instructions[i];
+        if(instruction == terminator || instruction->opcode == IR_PHI) continue;
+        if(is_immediate_value(instruction) || ctx->is_fused[instruction->id]) continue;
+        return false;
+    }
+    return true;
+}
+
+static void ir_generate_instruction(IRGenContext *ctx, IRBlock *block, IRInstruction *instruction) {
+    switch(instruction->opcode) {
+        case IR_CONST:
+            // an immediate goes straight into whatever uses it
+            if(!is_immediate_value(instruction)) {
+                generate_op_2(
+                    X64_MOV, instruction->size, operand_immediate(instruction->constant, instruction->size),
+                    ir_operand(instruction)
+                );
+            }
+            return;
+        case IR_PARAM:
+        case IR_PHI:
+            // already where they need to be
+            return;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+            ir_generate_arithmetic(instruction);
+            return;
+        case IR_CMP_LT:
+        case IR_CMP_GT:
+        case IR_CMP_LT_EQ:
+        case IR_CMP_GT_EQ:
+            ir_generate_comparison(ctx, instruction);
+            return;
+        case IR_SIGN_EXTEND:
+            ir_generate_sign_extension(instruction);
+            return;
+        case IR_TRUNCATE:
+            ir_generate_truncation(instruction);
+            return;
+        case IR_LOAD:
+            ir_generate_load(instruction);
+            return;
+        case IR_CALL:
+            ir_generate_call(instruction);
+            return;
+        case IR_JUMP: {
+            IRBlock *target = instruction->targets[0];
+            ir_generate_phi_copies(block, target);
+
+            if(ir_is_rotated_back_edge(ctx, block, target)) {
+                ir_generate_branch(ctx, block, ir_terminator(target));
+            } else {
+                ir_generate_jump(ctx, block, target);
+            }
+            return;
+        }
+        case IR_BRANCH:
+            ir_generate_branch(ctx, block, instruction);
+            return;
+        case IR_RETURN:
+            if(instruction->num_operands == 1) {
+                X64Operand value = ir_operand(instruction->operands[0]);
+                generate_op_2(X64_MOV, value.size, value, operand_reg(REG_RAX, value.size));
+            }
+            generate_return();
+            return;
+    }
+    xcc_assert_not_reached();
+}
+
+static void ir_label_targets(IRGenContext *ctx, IRBlock *from, IRBlock *block) {
+    // Labels block's successors for being jumped to from the end of from
+    for(int i = 0; i < ir_num_successors(block); ++i) {
+        IRBlock *successor = ir_successor(block, i);
+        if(successor != ir_next_block(ctx, from) && ctx->block_labels[successor->id] < 0) {
+            ctx->block_labels[successor->id] = get_unique_label_num();
+        }
+    }
+}
+
+static void ir_assign_labels(IRGenContext *ctx) {
+    // Every block jumped to rather than fallen into needs a label
+    IRFunction *func = ctx->func;
+    ctx->block_labels = xcc_malloc(sizeof(int) * func->num_blocks);
+    for(int i = 0; i < func->num_blocks; ++i) {
+        ctx->block_labels[i] = -1;
+    }
+
+    for(int i = 0; i < func->num_blocks; ++i) {
+        IRBlock *block = func->blocks[i];
+        IRInstruction *terminator = ir_terminator(block);
+
+        // a rotated back edge goes wherever the loop header would have
+        if(terminator->opcode == IR_JUMP && ir_is_rotated_back_edge(ctx, block, terminator->targets[0])) {
+            ir_label_targets(ctx, block, terminator->targets[0]);
+        } else {
+            ir_label_targets(ctx, block, block);
+        }
+    }
+}
+
+static void ir_find_fused_comparisons(IRGenContext *ctx) {
+    // A comparison can be left until the branch at the end of its block if
+    // that's its only use, since its operands are still there by then
+    IRFunction *func = ctx->func;
+    int *num_uses = xcc_malloc(sizeof(int) * func->num_values);
+    ctx->is_fused = xcc_malloc(sizeof(bool) * func->num_values);
+    memset(num_uses, 0, sizeof(int) * func->num_values);
+    memset(ctx->is_fused, 0, sizeof(bool) * func->num_values);
+
+    for(int i = 0; i < func->num_blocks; ++i) {
+        IRBlock *block = func->blocks[i];
+        for(int j = 0; j < block->num_instructions; ++j) {
+            IRInstruction *instruction = block->instructions[j];
+            for(int k = 0; k < instruction->num_operands; ++k) {
+                num_uses[instruction->operands[k]->id]++;
+            }
+        }
+    }
+
+    for(int i = 0; i < func->num_blocks; ++i) {
+        IRInstruction *terminator = ir_terminator(func->blocks[i]);
+        if(terminator->opcode != IR_BRANCH) continue;
+
+        IRInstruction *condition = terminator->operands[0];
+        if(ir_is_comparison(condition) && condition->block == func->blocks[i] && num_uses[condition->id] == 1) {
+            ctx->is_fused[condition->id] = true;
+        }
+    }
+
+    xcc_free(num_uses);
+}
+
+static void generate_ir_param_loading(IRGenContext *ctx) {
+    // The parameters are moved out all at once, since they can be given
+    // each other's argument registers
+    IRBlock *entry = ctx->func->blocks[0];
+    int group = machine_x64_new_move_group(current_function);
+
+    for(int i = 0; i < entry->num_instructions; ++i) {
+        IRInstruction *param = entry->instructions[i];
+        if(param->opcode != IR_PARAM) continue;
+
+        X64Operand dest = ir_operand(param);
+        RegLoc arg_reg = argument_index_to_register(param->constant);
+        generate_parallel_move(group, dest.size, operand_reg(arg_reg, dest.size), dest);
+    }
+}
+
+static void generate_ir_function(AST *ast) {
+    IRFunction *func = ir_build_function(ast);
+    ir_split_critical_edges(func);
+    ir_verify(func);
+    if(xcc_verbose()) ir_dump(func, "built");
+
+    ir_hoist_loop_invariants(func);
+    ir_verify(func);
+    if(xcc_verbose()) ir_dump(func, "hoisted");
+
+    IRGenContext ctx;
+    ctx.func = func;
+    ir_find_fused_comparisons(&ctx);
+    ir_assign_labels(&ctx);
+
+    current_function->num_vregs = func->num_values;
+    generate_ir_param_loading(&ctx);
+
+    for(int i = 0; i < func->num_blocks; ++i) {
+        IRBlock *block = func->blocks[i];
+
+        // the entry carries on from the parameter loading
+        if(i > 0 || ctx.block_labels[i] >= 0) {
+            generate_block(ctx.block_labels[i]);
+        }
+
+        for(int j = 0; j < block->num_instructions; ++j) {
+            ir_generate_instruction(&ctx, block, block->instructions[j]);
+        }
+    }
+
+    xcc_free(ctx.block_labels);
+    xcc_free(ctx.is_fused);
+    ir_free_function(func);
+
+    regalloc_x64_function(current_function);
+}
+
 static void generate_function(AST *ast) {
     xcc_assert(ast->type == AST_FUNCTION_DEFINITION);
     xcc_assert(ast->num_nodes == 3);
 
     const char *name = ast->declaration->name;
 
-    generate_asm_partial(".global ");
-    generate_asm(name);
+    CodeBuffer *code_buffer = generate_get_code_buffer();
+    if(code_buffer) {
+        encode_x64_begin_function(code_buffer, name);
+    } else {
+        generate_asm_partial(".global ");
+        generate_asm(name);
 
-    generate_asm_no_indent();
-    generate_asm_partial(name);
-    generate_asm(":");
+        generate_asm_no_indent();
+        generate_asm_partial(name);
+        generate_asm(":");
+    }
 
-    AST *body = ast->nodes[2];
+    current_function = machine_x64_new_function();
+    generate_block(-1);
 
-    int stack_space = body->block_max_stack_depth;
-    xcc_assert(stack_space >= 0);
+    if(is_optimising) {
+        generate_ir_function(ast);
+    } else {
+        AST *body = ast->nodes[2];
 
-    // prologue
-    if(stack_space > 0) {
-        // TODO: omit-frame-pointer
-        generate_asm("pushq %rbp");
-        generate_asm("movq %rsp, %rbp");
-        generate_asm_partial("subq $");
-        generate_asm_integer(stack_space);
-        generate_asm(", %rsp");
+        GenContext ctx;
+        ctx.reserved_stack_space = body->block_max_stack_depth;
+        xcc_assert(ctx.reserved_stack_space >= 0);
+        current_function->frame_size = ctx.reserved_stack_space;
+
+        generate_param_loading(ast->nodes[1]);
+        generate_body(&ctx, body);
     }
 
-    GenContext ctx;
-    ctx.reserved_stack_space = stack_space;
+    // every operand is in its final place by now
+    machine_x64_resolve_parallel_moves(current_function);
+    machine_x64_legalise(current_function);
+    machine_x64_insert_frame(current_function);
+    peephole_x64_function(current_function);
+    machine_x64_align_loops(current_function);
+
+    output_function(current_function);
+    machine_x64_free_function(current_function);
+    current_function = NULL;
 
-    generate_param_loading(ast->nodes[1]);
-    generate_body(&ctx, body);
+    if(code_buffer) encode_x64_end_function(code_buffer);
 }
 
-void generate_x64(AST *ast, const char *filename) {
-    xcc_assert(ast->type == AST_PROGRAM);
+typedef struct {
+    AST *program;
+    char **buffers;
+    size_t *buffer_lengths;
+
+    // for encoding machine code rather than writing assembly
+    bool is_encoding;
+    CodeBuffer **code_buffers;
+} FunctionBuffers;
+
+static void generate_function_task(void *data, int index) {
+    FunctionBuffers *function_buffers = data;
+    AST *ast = function_buffers->program->nodes[index];
+
+    if(ast->type != AST_FUNCTION_DEFINITION) return;
+
+    if(function_buffers->is_encoding) {
+        CodeBuffer *code_buffer = encode_x64_new_buffer();
+        function_buffers->code_buffers[index] = code_buffer;
+
+        generate_set_code_buffer(code_buffer);
+        generate_x64_top_level(ast, index);
+        return;
+    }
+
+    FILE *buffer_stream = open_memstream(
+        &function_buffers->buffers[index], &function_buffers->buffer_lengths[index]
+    );
+    xcc_assert_msg(buffer_stream, "open_memstream() failed");
+
+    generate_set_output(buffer_stream);
+    generate_x64_top_level(ast, index);
+
+    xcc_assert_msg(!fclose(buffer_stream), "failed to close function buffer");
+}
+
+void generate_x64_set_optimise(bool is_optimise) {
+    is_optimising = is_optimise;
+}
+
+void generate_x64_begin(const char *filename) {
+    if(generate_get_code_buffer()) return;
 
     generate_asm_no_indent();
     generate_asm_partial("# Generated assembly for ");
     generate_asm_partial(filename);
     generate_asm("");
 
+    // the stack doesn't need to be executable
+    generate_asm(".section .note.GNU-stack,\"\",@progbits");
+
     generate_asm(".section .text");
     generate_asm(".align 4");
+}
+
+void generate_x64_top_level(AST *ast, int index) {
+    // index is the position of ast in the program, and is used to keep
+    // label names unique
+    if(ast->type != AST_FUNCTION_DEFINITION) return;
+
+    generate_set_label_namespace(index);
+    generate_function(ast);
+}
+
+void generate_x64(AST *ast, const char *filename) {
+    xcc_assert(ast->type == AST_PROGRAM);
+
+    FILE *output = generate_get_output();
+    CodeBuffer *code_buffer = generate_get_code_buffer();
+
+    generate_x64_begin(filename);
+
+    // Every function is generated into its own buffer (possibly on another
+    // thread), and the buffers are written out in source order so the
+    // output doesn't depend on the number of threads
+    FunctionBuffers function_buffers;
+    function_buffers.program = ast;
+    function_buffers.buffers = xcc_malloc(sizeof(char *) * ast->num_nodes);
+    function_buffers.buffer_lengths = xcc_malloc(sizeof(size_t) * ast->num_nodes);
+    function_buffers.is_encoding = code_buffer != NULL;
+    function_buffers.code_buffers = xcc_malloc(sizeof(CodeBuffer *) * ast->num_nodes);
+    for(int i = 0; i < ast->num_nodes; ++i) {
+        function_buffers.buffers[i] = NULL;
+        function_buffers.buffer_lengths[i] = 0;
+        function_buffers.code_buffers[i] = NULL;
+    }
+
+    parallel_for(ast->num_nodes, generate_function_task, &function_buffers);
 
     for(int i = 0; i < ast->num_nodes; ++i) {
-        if(ast->nodes[i]->type == AST_DECLARATION) continue;
+        CodeBuffer *function_code = function_buffers.code_buffers[i];
+        if(function_code) {
+            encode_x64_append(code_buffer, function_code);
+            encode_x64_free_buffer(function_code);
+        }
 
-        generate_function(ast->nodes[i]);
+        char *buffer = function_buffers.buffers[i];
+        if(!buffer) continue;
+
+        size_t length = function_buffers.buffer_lengths[i];
+        xcc_assert_msg(fwrite(buffer, 1, length, output) == length, "failed to write output");
+        free(buffer); // allocated by open_memstream
     }
+
+    xcc_free(function_buffers.buffers);
+    xcc_free(function_buffers.buffer_lengths);
+    xcc_free(function_buffers.code_buffers);
+    generate_set_output(output);
+    generate_set_code_buffer(code_buffer);
 }
\ No newline at end of file
@@ -0,0 +1,717 @@
+// A register bytecode interpreter
+//
+// Every value already has a stack slot from value_pos_allocate, so the
+// registers are just those slots, as byte offsets into the function's
+// frame. Instructions are 32 bit words: an opcode followed by a fixed
+// number of operands for that opcode, except for calls, which are followed
+// by their arguments. Dispatch is through computed gotos.
+//
+// Functions which aren't defined in the program are found with dlsym, and
+// called natively with every argument passed as a 64 bit integer.
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdint.h>
+#include "xcc.h"
+
+typedef enum {
+    OP_CONST,        // kind, dest, low 32 bits, high 32 bits
+    OP_MOVE,         // kind, dest, src
+    OP_ADD,          // kind, dest, a, b
+    OP_SUBTRACT,     // kind, dest, a, b
+    OP_MULTIPLY,     // kind, dest, a, b
+    OP_CMP_LT,       // kind, dest kind, dest, a, b
+    OP_CMP_GT,       // kind, dest kind, dest, a, b
+    OP_CMP_LT_EQ,    // kind, dest kind, dest, a, b
+    OP_CMP_GT_EQ,    // kind, dest kind, dest, a, b
+    OP_SIGN_EXTEND,  // src kind, dest kind, dest, src
+    OP_LOAD,         // kind, dest, pointer
+    OP_JUMP,         // target
+    OP_JUMP_IF_ZERO, // kind, condition, target
+    OP_CALL,         // function, dest kind, dest, number of args, then kind and slot for each
+    OP_RETURN,       // kind, src
+    OP_RETURN_VOID,
+
+    NUM_OPS
+} InterpOp;
+
+// The size and signedness of an operand, packed into one word. Void is 0.
+#define KIND(size, is_signed) ((size) | ((is_signed) << 8))
+#define KIND_SIZE(kind) ((kind) & 0xff)
+#define KIND_IS_SIGNED(kind) ((kind) >> 8)
+
+#define INTERP_STACK_SIZE (8 * 1024 * 1024)
+// Every interpreted call is also a native call, so the program runs on a
+// thread with a stack of this size, stopping before the last of it is used
+#define INTERP_NATIVE_STACK_SIZE (256 * 1024 * 1024)
+#define INTERP_NATIVE_STACK_RESERVE (1024 * 1024)
+#define INTERP_MAX_NATIVE_ARGS 6
+
+typedef struct {
+    int32_t kind;
+    int32_t slot;
+} InterpParam;
+
+typedef struct {
+    const char *name;
+    bool is_defined;
+
+    size_t code_start;
+    int frame_size;
+    InterpParam *params;
+    int num_params;
+
+    void *native; // for functions which aren't defined
+} InterpFunction;
+
+typedef struct {
+    size_t code_offset; // of the target word to patch
+    int label;
+} InterpLabelUse;
+
+struct InterpProgram {
+    int32_t *code;
+    size_t code_size;
+    size_t code_allocated;
+
+    InterpFunction *functions;
+    size_t num_functions;
+    size_t num_functions_allocated;
+
+    // from names to indices into functions
+    SymbolTable function_indices;
+
+    // for the function being lowered
+    int frame_size;
+
+    long long *label_targets;
+    size_t num_label_targets;
+    size_t num_label_targets_allocated;
+
+    InterpLabelUse *label_uses;
+    size_t num_label_uses;
+    size_t num_label_uses_allocated;
+
+    // while running: where an error jumps back to, and how far down the
+    // native stack can go
+    jmp_buf error_jump;
+    uintptr_t native_stack_limit;
+};
+
+InterpProgram *interp_new_program(void) {
+    InterpProgram *program = xcc_malloc(sizeof(InterpProgram));
+    memset(program, 0, sizeof(InterpProgram));
+
+    symbol_table_init(&program->function_indices);
+    return program;
+}
+
+void interp_free_program(InterpProgram *program) {
+    for (size_t i = 0; i < program->num_functions; ++i) {
+        xcc_free(program->functions[i].params);
+    }
+
+    xcc_free(program->code);
+    xcc_free(program->functions);
+    symbol_table_free(&program->function_indices);
+    xcc_free(program->label_targets);
+    xcc_free(program->label_uses);
+    xcc_free(program);
+}
+
+static int function_index(InterpProgram *program, const char *name) {
+    // Functions are added the first time they're called or defined, since
+    // calls can come before the definition
+    int index = symbol_table_find(&program->function_indices, name);
+    if (index >= 0) return index;
+
+    InterpFunction *function;
+    LIST_STRUCT_APPEND_FUNC(
+        InterpFunction, program, num_functions, num_functions_allocated, functions, function
+    );
+    memset(function, 0, sizeof(InterpFunction));
+    function->name = name;
+
+    index = program->num_functions - 1;
+    symbol_table_add(&program->function_indices, name, index);
+    return index;
+}
+
+static void emit(InterpProgram *program, int32_t word) {
+    int32_t *new_word;
+    LIST_STRUCT_APPEND_FUNC(int32_t, program, code_size, code_allocated, code, new_word);
+    *new_word = word;
+}
+
+static int32_t pos_kind(ValuePosition *pos) {
+    if (pos->type == POS_VOID) return 0;
+    return KIND(pos->size, pos->is_signed);
+}
+
+static int32_t pos_slot(InterpProgram *program, ValuePosition *pos) {
+    // The frame is indexed upwards from the bottom of the native stack frame
+    xcc_assert(pos->type == POS_STACK);
+
+    int32_t slot = program->frame_size - pos->stack_offset;
+    xcc_assert(slot >= 0 && slot + pos->size <= program->frame_size);
+    return slot;
+}
+
+static void emit_operand(InterpProgram *program, ValuePosition *pos) {
+    emit(program, pos_slot(program, pos));
+}
+
+static int new_label(InterpProgram *program) {
+    long long *target;
+    LIST_STRUCT_APPEND_FUNC(
+        long long, program, num_label_targets, num_label_targets_allocated, label_targets, target
+    );
+    *target = -1;
+    return program->num_label_targets - 1;
+}
+
+static void define_label(InterpProgram *program, int label) {
+    xcc_assert(program->label_targets[label] < 0);
+    program->label_targets[label] = program->code_size;
+}
+
+static void emit_label_use(InterpProgram *program, int label) {
+    InterpLabelUse *use;
+    LIST_STRUCT_APPEND_FUNC(
+        InterpLabelUse, program, num_label_uses, num_label_uses_allocated, label_uses, use
+    );
+    use->code_offset = program->code_size;
+    use->label = label;
+    emit(program, -1);
+}
+
+static void emit_move(InterpProgram *program, ValuePosition *from, ValuePosition *to) {
+    xcc_assert(from->size == to->size);
+    if (value_pos_is_same(from, to)) return;
+
+    emit(program, OP_MOVE);
+    emit(program, pos_kind(to));
+    emit_operand(program, to);
+    emit_operand(program, from);
+}
+
+static void lower_expression(InterpProgram *program, AST *ast);
+static void lower_statement(InterpProgram *program, AST *ast);
+
+static void lower_binary_expression(InterpProgram *program, AST *ast) {
+    xcc_assert(ast->num_nodes == 2);
+
+    lower_expression(program, ast_nth_evaluated(ast, 0));
+    lower_expression(program, ast_nth_evaluated(ast, 1));
+
+    ValuePosition *a = ast->nodes[0]->pos;
+    ValuePosition *b = ast->nodes[1]->pos;
+
+    InterpOp op;
+    switch (ast->type) {
+        case AST_ADD: op = OP_ADD; break;
+        case AST_SUBTRACT: op = OP_SUBTRACT; break;
+        case AST_MULTIPLY: op = OP_MULTIPLY; break;
+        case AST_CMP_LT: op = OP_CMP_LT; break;
+        case AST_CMP_GT: op = OP_CMP_GT; break;
+        case AST_CMP_LT_EQ: op = OP_CMP_LT_EQ; break;
+        case AST_CMP_GT_EQ: op = OP_CMP_GT_EQ; break;
+        default: xcc_assert_not_reached();
+    }
+
+    emit(program, op);
+    emit(program, pos_kind(a));
+    if (op >= OP_CMP_LT && op <= OP_CMP_GT_EQ) {
+        emit(program, pos_kind(ast->pos));
+    }
+    emit_operand(program, ast->pos);
+    emit_operand(program, a);
+    emit_operand(program, b);
+}
+
+static void lower_call_expression(InterpProgram *program, AST *ast) {
+    xcc_assert(ast->num_nodes >= 1);
+    xcc_assert(ast->nodes[0]->pos->type == POS_FUNC_NAME);
+
+    for (int i = 1; i < ast->num_nodes; ++i) {
+        lower_expression(program, ast->nodes[i]);
+    }
+
+    emit(program, OP_CALL);
+    emit(program, function_index(program, ast->nodes[0]->pos->func_name));
+    emit(program, pos_kind(ast->pos));
+    emit(program, ast->pos->type == POS_VOID ? 0 : pos_slot(program, ast->pos));
+    emit(program, ast->num_nodes - 1);
+
+    for (int i = 1; i < ast->num_nodes; ++i) {
+        emit(program, pos_kind(ast->nodes[i]->pos));
+        emit_operand(program, ast->nodes[i]->pos);
+    }
+}
+
+static void lower_int_conversion(InterpProgram *program, AST *ast) {
+    xcc_assert(ast->num_nodes == 1);
+    lower_expression(program, ast->nodes[0]);
+
+    ValuePosition *from = ast->nodes[0]->pos;
+    ValuePosition *to = ast->pos;
+    xcc_assert(from->size != to->size);
+
+    if (from->size < to->size) {
+        emit(program, OP_SIGN_EXTEND);
+        emit(program, pos_kind(from));
+        emit(program, pos_kind(to));
+        emit_operand(program, to);
+        emit_operand(program, from);
+    } else {
+        // the low bytes of from, which are at the same offset
+        ValuePosition truncated_from = *from;
+        truncated_from.size = to->size;
+        truncated_from.alignment = to->alignment;
+        truncated_from.is_signed = to->is_signed;
+        emit_move(program, &truncated_from, to);
+    }
+}
+
+static void lower_expression(InterpProgram *program, AST *ast) {
+    if (ast->type == AST_INTEGER_LITERAL) {
+        uint64_t value = ast->integer_literal_val;
+
+        emit(program, OP_CONST);
+        emit(program, pos_kind(ast->pos));
+        emit_operand(program, ast->pos);
+        emit(program, (int32_t) (uint32_t) value);
+        emit(program, (int32_t) (uint32_t) (value >> 32));
+    } else if (
+        ast->type == AST_ADD || ast->type == AST_SUBTRACT || ast->type == AST_MULTIPLY ||
+        ast->type == AST_CMP_LT || ast->type == AST_CMP_GT ||
+        ast->type == AST_CMP_LT_EQ || ast->type == AST_CMP_GT_EQ
+    ) {
+        lower_binary_expression(program, ast);
+    } else if (ast->type == AST_CALL) {
+        lower_call_expression(program, ast);
+    } else if (ast->type == AST_IDENT_USE) {
+        // the value is already in the variable's slot
+    } else if (ast->type == AST_ASSIGN) {
+        xcc_assert(ast->num_nodes == 2);
+
+        lower_expression(program, ast->nodes[0]);
+        lower_expression(program, ast->nodes[1]);
+
+        ValuePosition *from = ast->nodes[1]->pos;
+        ValuePosition *to = ast->nodes[0]->pos;
+
+        emit_move(program, from, to);
+        if (!value_pos_is_same(to, ast->pos)) {
+            emit_move(program, from, ast->pos);
+        }
+    } else if (ast->type == AST_CONVERT_TO_INT) {
+        lower_int_conversion(program, ast);
+    } else if (ast->type == AST_DEREFERENCE) {
+        xcc_assert(ast->num_nodes == 1);
+        lower_expression(program, ast->nodes[0]);
+
+        emit(program, OP_LOAD);
+        emit(program, pos_kind(ast->pos));
+        emit_operand(program, ast->pos);
+        emit_operand(program, ast->nodes[0]->pos);
+    } else {
+        xcc_assert_not_reached_msg("unknown expression");
+    }
+}
+
+static void lower_condition_jump(InterpProgram *program, AST *condition, int label) {
+    lower_expression(program, condition);
+
+    emit(program, OP_JUMP_IF_ZERO);
+    emit(program, pos_kind(condition->pos));
+    emit_operand(program, condition->pos);
+    emit_label_use(program, label);
+}
+
+static void lower_statement(InterpProgram *program, AST *ast) {
+    if (ast->type == AST_RETURN_STMT) {
+        xcc_assert(ast->num_nodes <= 1);
+
+        if (ast->num_nodes == 1) {
+            lower_expression(program, ast->nodes[0]);
+
+            emit(program, OP_RETURN);
+            emit(program, pos_kind(ast->nodes[0]->pos));
+            emit_operand(program, ast->nodes[0]->pos);
+        } else {
+            emit(program, OP_RETURN_VOID);
+        }
+    } else if (ast->type == AST_STATEMENT_EXPRESSION) {
+        xcc_assert(ast->num_nodes == 1);
+        lower_expression(program, ast->nodes[0]);
+    } else if (ast->type == AST_IF) {
+        xcc_assert(ast->num_nodes == 2 || ast->num_nodes == 3);
+        bool has_else = ast->num_nodes == 3;
+
+        int after_if_label = new_label(program);
+        int after_else_label = has_else ? new_label(program) : -1;
+
+        lower_condition_jump(program, ast->nodes[0], after_if_label);
+        lower_statement(program, ast->nodes[1]);
+
+        if (has_else) {
+            emit(program, OP_JUMP);
+            emit_label_use(program, after_else_label);
+        }
+
+        define_label(program, after_if_label);
+
+        if (has_else) {
+            lower_statement(program, ast->nodes[2]);
+            define_label(program, after_else_label);
+        }
+    } else if (ast->type == AST_WHILE) {
+        xcc_assert(ast->num_nodes == 2);
+
+        int beginning_label = new_label(program);
+        int end_label = new_label(program);
+
+        define_label(program, beginning_label);
+        lower_condition_jump(program, ast->nodes[0], end_label);
+        lower_statement(program, ast->nodes[1]);
+
+        emit(program, OP_JUMP);
+        emit_label_use(program, beginning_label);
+        define_label(program, end_label);
+    } else if (ast->type == AST_DECLARATOR_GROUP) {
+        if (ast->num_nodes == 2) {
+            // declaration with initialisation
+            lower_expression(program, ast->nodes[1]);
+            emit_move(program, ast->nodes[1]->pos, ast->declaration->pos);
+        }
+    } else if (ast->type == AST_BLOCK_STATEMENT) {
+        for (int i = 0; i < ast->num_nodes; ++i) {
+            lower_statement(program, ast->nodes[i]);
+        }
+    } else if (ast->type == AST_DECLARATION) {
+        for (int i = 1; i < ast->num_nodes; ++i) {
+            lower_statement(program, ast->nodes[i]);
+        }
+    } else {
+        xcc_assert_not_reached_msg("unknown statement");
+    }
+}
+
+static void lower_params(InterpProgram *program, InterpFunction *function, AST *ast) {
+    xcc_assert(ast->type == AST_DECLARATOR_GROUP);
+    xcc_assert(ast->num_nodes == 1);
+    ast = ast->nodes[0];
+    xcc_assert(ast->type == AST_DECLARATOR_FUNC);
+
+    function->num_params = ast->num_nodes - 1;
+    function->params = xcc_malloc(sizeof(InterpParam) * function->num_params);
+
+    for (int i = 1; i < ast->num_nodes; ++i) {
+        AST *param = ast->nodes[i];
+        xcc_assert(param->type == AST_PARAMETER);
+        xcc_assert(param->declaration->pos);
+
+        function->params[i - 1].kind = pos_kind(param->declaration->pos);
+        function->params[i - 1].slot = pos_slot(program, param->declaration->pos);
+    }
+}
+
+void interp_add_top_level(InterpProgram *program, AST *ast) {
+    if (ast->type != AST_FUNCTION_DEFINITION) return;
+    xcc_assert(ast->num_nodes == 3);
+
+    // lowering the body can add functions, which moves this one
+    int index = function_index(program, ast->declaration->name);
+    InterpFunction *function = &program->functions[index];
+    xcc_assert(!function->is_defined);
+
+    AST *body = ast->nodes[2];
+    xcc_assert(body->block_max_stack_depth >= 0);
+
+    program->frame_size = body->block_max_stack_depth;
+    program->num_label_targets = 0;
+    program->num_label_uses = 0;
+
+    function->is_defined = true;
+    function->code_start = program->code_size;
+    function->frame_size = program->frame_size;
+    lower_params(program, function, ast->nodes[1]);
+
+    lower_statement(program, body);
+
+    // falling off the end without a return
+    emit(program, OP_RETURN_VOID);
+
+    for (size_t i = 0; i < program->num_label_uses; ++i) {
+        InterpLabelUse *use = &program->label_uses[i];
+        long long target = program->label_targets[use->label];
+        xcc_assert(target >= 0);
+        program->code[use->code_offset] = target;
+    }
+}
+
+static inline int64_t load_value(const unsigned char *p, int32_t kind) {
+    // Slots aren't necessarily aligned, so everything goes through memcpy
+    bool is_signed = KIND_IS_SIGNED(kind);
+
+    switch (KIND_SIZE(kind)) {
+        case 1: {
+            uint8_t value;
+            memcpy(&value, p, sizeof(value));
+            return is_signed ? (int64_t) (int8_t) value : (int64_t) value;
+        }
+        case 2: {
+            uint16_t value;
+            memcpy(&value, p, sizeof(value));
+            return is_signed ? (int64_t) (int16_t) value : (int64_t) value;
+        }
+        case 4: {
+            uint32_t value;
+            memcpy(&value, p, sizeof(value));
+            return is_signed ? (int64_t) (int32_t) value : (int64_t) value;
+        }
+        case 8: {
+            int64_t value;
+            memcpy(&value, p, sizeof(value));
+            return value;
+        }
+    }
+    xcc_assert_not_reached();
+}
+
+static inline void store_value(unsigned char *p, int32_t kind, uint64_t value) {
+    // x64 is little endian, so the first bytes are the low ones
+    memcpy(p, &value, KIND_SIZE(kind));
+}
+
+static int64_t run_function(InterpProgram *program, InterpFunction *function,
+                            unsigned char *frame, unsigned char *stack_end);
+
+NORETURN static void runtime_error(InterpProgram *program) {
+    // After the message has been printed, stops the program
+    longjmp(program->error_jump, 1);
+}
+
+static int64_t call_native(InterpProgram *program, InterpFunction *function,
+                           const int32_t *call, unsigned char *frame) {
+    // Integer and pointer arguments all go in registers, so passing six
+    // 64 bit arguments works for any function taking up to six of them
+    int num_args = call[4];
+    if (num_args > INTERP_MAX_NATIVE_ARGS) {
+        fprintf(stderr, "Can't call `%s` with more than %d arguments\n", function->name, INTERP_MAX_NATIVE_ARGS);
+        runtime_error(program);
+    }
+
+    int64_t args[INTERP_MAX_NATIVE_ARGS] = { 0 };
+    for (int i = 0; i < num_args; ++i) {
+        args[i] = load_value(frame + call[6 + 2 * i], call[5 + 2 * i]);
+    }
+
+    typedef int64_t (*NativeFunction)(int64_t, int64_t, int64_t, int64_t, int64_t, int64_t);
+    NativeFunction native = (NativeFunction) function->native;
+    return native(args[0], args[1], args[2], args[3], args[4], args[5]);
+}
+
+static const int32_t *run_call(InterpProgram *program, const int32_t *call,
+                               unsigned char *frame, unsigned char *stack_end,
+                               int frame_size) {
+    // Returns the instruction after the call
+    InterpFunction *callee = &program->functions[call[1]];
+    int32_t dest_kind = call[2];
+    int num_args = call[4];
+
+    int64_t result;
+    if (callee->is_defined) {
+        xcc_assert(num_args == callee->num_params);
+
+        unsigned char *callee_frame = frame + ((frame_size + 15) & ~15);
+        if (callee_frame + callee->frame_size > stack_end || (uintptr_t) &callee < program->native_stack_limit) {
+            fprintf(stderr, "Interpreter stack overflow in `%s`\n", callee->name);
+            runtime_error(program);
+        }
+
+        for (int i = 0; i < num_args; ++i) {
+            InterpParam *param = &callee->params[i];
+            store_value(
+                callee_frame + param->slot, param->kind,
+                load_value(frame + call[6 + 2 * i], call[5 + 2 * i])
+            );
+        }
+
+        result = run_function(program, callee, callee_frame, stack_end);
+    } else {
+        result = call_native(program, callee, call, frame);
+    }
+
+    if (dest_kind) store_value(frame + call[3], dest_kind, result);
+    return call + 5 + 2 * num_args;
+}
+
+static int64_t run_function(InterpProgram *program, InterpFunction *function,
+                            unsigned char *frame, unsigned char *stack_end) {
+    static const void *dispatch_table[NUM_OPS] = {
+        [OP_CONST] = &&op_const,
+        [OP_MOVE] = &&op_move,
+        [OP_ADD] = &&op_add,
+        [OP_SUBTRACT] = &&op_subtract,
+        [OP_MULTIPLY] = &&op_multiply,
+        [OP_CMP_LT] = &&op_cmp_lt,
+        [OP_CMP_GT] = &&op_cmp_gt,
+        [OP_CMP_LT_EQ] = &&op_cmp_lt_eq,
+        [OP_CMP_GT_EQ] = &&op_cmp_gt_eq,
+        [OP_SIGN_EXTEND] = &&op_sign_extend,
+        [OP_LOAD] = &&op_load,
+        [OP_JUMP] = &&op_jump,
+        [OP_JUMP_IF_ZERO] = &&op_jump_if_zero,
+        [OP_CALL] = &&op_call,
+        [OP_RETURN] = &&op_return,
+        [OP_RETURN_VOID] = &&op_return_void,
+    };
+
+    const int32_t *code = program->code;
+    const int32_t *ip = code + function->code_start;
+
+// Arithmetic is done unsigned, so that overflow wraps like it does natively
+#define DISPATCH() goto *dispatch_table[*ip]
+#define LOAD(operand, kind) load_value(frame + (operand), (kind))
+#define BINARY_OP(operator) \
+    store_value(frame + ip[2], ip[1], (uint64_t) LOAD(ip[3], ip[1]) operator (uint64_t) LOAD(ip[4], ip[1])); \
+    ip += 5; \
+    DISPATCH();
+// Comparisons are always signed, like the setcc instructions the native
+// code uses
+#define COMPARISON_OP(operator) \
+    store_value( \
+        frame + ip[3], ip[2], \
+        LOAD(ip[4], ip[1] | KIND(0, true)) operator LOAD(ip[5], ip[1] | KIND(0, true)) \
+    ); \
+    ip += 6; \
+    DISPATCH();
+
+    DISPATCH();
+
+op_const:
+    store_value(frame + ip[2], ip[1], (uint64_t) (uint32_t) ip[3] | ((uint64_t) (uint32_t) ip[4] << 32));
+    ip += 5;
+    DISPATCH();
+op_move:
+    store_value(frame + ip[2], ip[1], LOAD(ip[3], ip[1]));
+    ip += 4;
+    DISPATCH();
+op_add:
+    BINARY_OP(+)
+op_subtract:
+    BINARY_OP(-)
+op_multiply:
+    BINARY_OP(*)
+op_cmp_lt:
+    COMPARISON_OP(<)
+op_cmp_gt:
+    COMPARISON_OP(>)
+op_cmp_lt_eq:
+    COMPARISON_OP(<=)
+op_cmp_gt_eq:
+    COMPARISON_OP(>=)
+op_sign_extend:
+    store_value(frame + ip[3], ip[2], LOAD(ip[4], ip[1]));
+    ip += 5;
+    DISPATCH();
+op_load: {
+    const unsigned char *pointer = (const unsigned char *) (uintptr_t) LOAD(ip[3], KIND(8, false));
+    store_value(frame + ip[2], ip[1], load_value(pointer, ip[1]));
+    ip += 4;
+    DISPATCH();
+}
+op_jump:
+    ip = code + ip[1];
+    DISPATCH();
+op_jump_if_zero:
+    ip = LOAD(ip[2], ip[1]) ? ip + 4 : code + ip[3];
+    DISPATCH();
+op_call:
+    ip = run_call(program, ip, frame, stack_end, function->frame_size);
+    DISPATCH();
+op_return:
+    return LOAD(ip[2], ip[1]);
+op_return_void:
+    return 0;
+
+#undef DISPATCH
+#undef LOAD
+#undef BINARY_OP
+#undef COMPARISON_OP
+}
+
+static bool link_natives(InterpProgram *program) {
+    // Returns false if a function isn't defined anywhere
+    for (size_t i = 0; i < program->num_functions; ++i) {
+        InterpFunction *function = &program->functions[i];
+        if (function->is_defined || function->native) continue;
+
+        function->native = dlsym(RTLD_DEFAULT, function->name);
+        if (!function->native) {
+            fprintf(stderr, "Undefined reference to `%s`\n", function->name);
+            return false;
+        }
+    }
+    return true;
+}
+
+typedef struct {
+    InterpProgram *program;
+    InterpFunction *main_function;
+    int exit_code;
+    bool has_run;
+} InterpRun;
+
+static void *run_main(void *arg) {
+    InterpRun *run = arg;
+    InterpProgram *program = run->program;
+
+    program->native_stack_limit =
+        (uintptr_t) &run - (INTERP_NATIVE_STACK_SIZE - INTERP_NATIVE_STACK_RESERVE);
+
+    unsigned char *stack = xcc_malloc(INTERP_STACK_SIZE);
+    xcc_assert(run->main_function->frame_size <= INTERP_STACK_SIZE);
+
+    run->has_run = true;
+    if (setjmp(program->error_jump)) {
+        run->has_run = false;
+    } else {
+        run->exit_code = (int) run_function(
+            program, run->main_function, stack, stack + INTERP_STACK_SIZE
+        );
+    }
+
+    xcc_free(stack);
+    return NULL;
+}
+
+bool interp_run(InterpProgram *program, int *exit_code) {
+    // Returns false if the program couldn't be started or stopped with an
+    // error, otherwise sets exit_code to what main returned
+    if (!link_natives(program)) return false;
+
+    int main_index = symbol_table_find(&program->function_indices, "main");
+    if (main_index < 0 || !program->functions[main_index].is_defined) {
+        fprintf(stderr, "No main function to run\n");
+        return false;
+    }
+    InterpRun run;
+    run.program = program;
+    run.main_function = &program->functions[main_index];
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, INTERP_NATIVE_STACK_SIZE);
+
+    pthread_t thread;
+    int err = pthread_create(&thread, &attributes, run_main, &run);
+    xcc_assert_msg(!err, "pthread_create() failed");
+    err = pthread_join(thread, NULL);
+    xcc_assert_msg(!err, "pthread_join() failed");
+    pthread_attr_destroy(&attributes);
+
+    *exit_code = run.exit_code;
+    return run.has_run;
+}
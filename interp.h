@@ -0,0 +1,12 @@
+#pragma once
+
+#include "xcc.h"
+
+// Bytecode lowered from the allocated AST, which can be run straight away
+// instead of generating machine code
+typedef struct InterpProgram InterpProgram;
+
+InterpProgram *interp_new_program(void);
+void interp_add_top_level(InterpProgram *program, AST *ast);
+bool interp_run(InterpProgram *program, int *exit_code);
+void interp_free_program(InterpProgram *program);
@@ -0,0 +1,576 @@
+// The SSA intermediate representation, and what every pass over it needs:
+// building blocks and instructions, dominators, a verifier and a dump
+#include "xcc.h"
+
+IRFunction *ir_new_function(const char *name) {
+    IRFunction *func = xcc_malloc(sizeof(IRFunction));
+    memset(func, 0, sizeof(IRFunction));
+    func->name = name;
+    return func;
+}
+
+static void free_instruction(IRInstruction *instruction) {
+    xcc_free(instruction->operands);
+    xcc_free(instruction);
+}
+
+void ir_free_function(IRFunction *func) {
+    for(int i = 0; i < func->num_blocks; ++i) {
+        IRBlock *block = func->blocks[i];
+
+        for(int j = 0; j < block->num_instructions; ++j) {
+            free_instruction(block->instructions[j]);
+        }
+        xcc_free(block->instructions);
+        xcc_free(block->predecessors);
+        xcc_free(block);
+    }
+
+    xcc_free(func->blocks);
+    xcc_free(func);
+}
+
+IRBlock *ir_new_block(IRFunction *func) {
+    IRBlock *block = xcc_malloc(sizeof(IRBlock));
+    memset(block, 0, sizeof(IRBlock));
+    block->id = func->num_blocks;
+
+    IRBlock **new_block;
+    LIST_STRUCT_APPEND_FUNC(IRBlock *, func, num_blocks, num_blocks_allocated, blocks, new_block);
+    *new_block = block;
+
+    return block;
+}
+
+static IRInstruction *new_instruction(IRFunction *func, IRBlock *block, IROpcode opcode,
+                                      int size, bool is_signed) {
+    IRInstruction *instruction = xcc_malloc(sizeof(IRInstruction));
+    memset(instruction, 0, sizeof(IRInstruction));
+    instruction->opcode = opcode;
+    instruction->id = func->num_values++;
+    instruction->block = block;
+    instruction->size = size;
+    instruction->is_signed = is_signed;
+    return instruction;
+}
+
+bool ir_is_terminator(IROpcode opcode) {
+    return opcode == IR_JUMP || opcode == IR_BRANCH || opcode == IR_RETURN;
+}
+
+IRInstruction *ir_terminator(IRBlock *block) {
+    // NULL if the block hasn't been finished yet
+    if(block->num_instructions == 0) return NULL;
+
+    IRInstruction *last = block->instructions[block->num_instructions - 1];
+    return ir_is_terminator(last->opcode) ? last : NULL;
+}
+
+IRInstruction *ir_append(IRFunction *func, IRBlock *block, IROpcode opcode, int size, bool is_signed) {
+    xcc_assert_msg(!ir_terminator(block), "IR: appending to a finished block");
+
+    IRInstruction *instruction = new_instruction(func, block, opcode, size, is_signed);
+
+    IRInstruction **new_instruction_ptr;
+    LIST_STRUCT_APPEND_FUNC(
+        IRInstruction *, block, num_instructions, num_instructions_allocated, instructions,
+        new_instruction_ptr
+    );
+    *new_instruction_ptr = instruction;
+
+    return instruction;
+}
+
+IRInstruction *ir_insert(IRFunction *func, IRBlock *block, int index, IROpcode opcode,
+                         int size, bool is_signed) {
+    xcc_assert(index >= 0 && index <= block->num_instructions);
+    IRInstruction *instruction = new_instruction(func, block, opcode, size, is_signed);
+
+    IRInstruction **new_instruction_ptr;
+    LIST_STRUCT_APPEND_FUNC(
+        IRInstruction *, block, num_instructions, num_instructions_allocated, instructions,
+        new_instruction_ptr
+    );
+    (void) new_instruction_ptr;
+
+    for(int i = block->num_instructions - 1; i > index; --i) {
+        block->instructions[i] = block->instructions[i - 1];
+    }
+    block->instructions[index] = instruction;
+
+    return instruction;
+}
+
+IRInstruction *ir_insert_phi(IRFunction *func, IRBlock *block, int size, bool is_signed) {
+    // Phis go at the start of the block, and which order they're in doesn't
+    // matter since they all take effect at once
+    return ir_insert(func, block, 0, IR_PHI, size, is_signed);
+}
+
+void ir_add_operand(IRInstruction *instruction, IRInstruction *operand) {
+    IRInstruction **new_operand;
+    LIST_STRUCT_APPEND_FUNC(
+        IRInstruction *, instruction, num_operands, num_operands_allocated, operands, new_operand
+    );
+    *new_operand = operand;
+}
+
+static void add_predecessor(IRBlock *block, IRBlock *predecessor) {
+    IRBlock **new_predecessor;
+    LIST_STRUCT_APPEND_FUNC(
+        IRBlock *, block, num_predecessors, num_predecessors_allocated, predecessors,
+        new_predecessor
+    );
+    *new_predecessor = predecessor;
+}
+
+void ir_set_jump(IRFunction *func, IRBlock *block, IRBlock *target) {
+    IRInstruction *jump = ir_append(func, block, IR_JUMP, 0, false);
+    jump->targets[0] = target;
+    add_predecessor(target, block);
+}
+
+void ir_set_branch(IRFunction *func, IRBlock *block, IRInstruction *condition,
+                   IRBlock *if_true, IRBlock *if_false) {
+    IRInstruction *branch = ir_append(func, block, IR_BRANCH, 0, false);
+    ir_add_operand(branch, condition);
+    branch->targets[0] = if_true;
+    branch->targets[1] = if_false;
+    add_predecessor(if_true, block);
+    add_predecessor(if_false, block);
+}
+
+int ir_num_successors(IRBlock *block) {
+    IRInstruction *terminator = ir_terminator(block);
+    xcc_assert(terminator);
+
+    switch(terminator->opcode) {
+        case IR_JUMP: return 1;
+        case IR_BRANCH: return 2;
+        case IR_RETURN: return 0;
+        default: xcc_assert_not_reached();
+    }
+}
+
+IRBlock *ir_successor(IRBlock *block, int index) {
+    xcc_assert(index >= 0 && index < ir_num_successors(block));
+    return ir_terminator(block)->targets[index];
+}
+
+int ir_predecessor_index(IRBlock *block, IRBlock *predecessor) {
+    for(int i = 0; i < block->num_predecessors; ++i) {
+        if(block->predecessors[i] == predecessor) return i;
+    }
+    xcc_assert_not_reached_msg("IR: not a predecessor");
+}
+
+IRBlock *ir_split_edge(IRFunction *func, IRBlock *from, IRBlock *to) {
+    // Puts a new block on the edge, laid out just before to. It takes from's
+    // place as a predecessor, so to's phis don't need changing.
+    IRBlock *middle = ir_new_block(func);
+
+    int to_index = to->id;
+    for(int i = func->num_blocks - 1; i > to_index; --i) {
+        func->blocks[i] = func->blocks[i - 1];
+        func->blocks[i]->id = i;
+    }
+    func->blocks[to_index] = middle;
+    middle->id = to_index;
+
+    IRInstruction *jump = ir_append(func, middle, IR_JUMP, 0, false);
+    jump->targets[0] = to;
+    add_predecessor(middle, from);
+
+    to->predecessors[ir_predecessor_index(to, from)] = middle;
+
+    IRInstruction *terminator = ir_terminator(from);
+    int target_index = terminator->targets[0] == to ? 0 : 1;
+    xcc_assert(terminator->targets[target_index] == to);
+    terminator->targets[target_index] = middle;
+
+    return middle;
+}
+
+void ir_split_critical_edges(IRFunction *func) {
+    // An edge from a block with several successors to one with several
+    // predecessors has nowhere for copies on just that edge to go
+    for(int i = 0; i < func->num_blocks; ++i) {
+        IRBlock *block = func->blocks[i];
+        if(ir_num_successors(block) < 2) continue;
+
+        for(int j = 0; j < ir_num_successors(block); ++j) {
+            IRBlock *successor = ir_successor(block, j);
+            if(successor->num_predecessors > 1) {
+                ir_split_edge(func, block, successor);
+            }
+        }
+    }
+}
+
+void ir_remove_instruction(IRBlock *block, int index) {
+    xcc_assert(index >= 0 && index < block->num_instructions);
+    free_instruction(block->instructions[index]);
+
+    block->num_instructions--;
+    for(int i = index; i < block->num_instructions; ++i) {
+        block->instructions[i] = block->instructions[i + 1];
+    }
+}
+
+void ir_move_instruction(IRInstruction *instruction, IRBlock *block, int index) {
+    // index is into block as it is once the instruction has been taken out
+    IRBlock *from = instruction->block;
+    int from_index = 0;
+    while(from->instructions[from_index] != instruction) from_index++;
+
+    from->num_instructions--;
+    for(int i = from_index; i < from->num_instructions; ++i) {
+        from->instructions[i] = from->instructions[i + 1];
+    }
+
+    xcc_assert(index >= 0 && index <= block->num_instructions);
+    IRInstruction **new_instruction_ptr;
+    LIST_STRUCT_APPEND_FUNC(
+        IRInstruction *, block, num_instructions, num_instructions_allocated, instructions,
+        new_instruction_ptr
+    );
+    (void) new_instruction_ptr;
+
+    for(int i = block->num_instructions - 1; i > index; --i) {
+        block->instructions[i] = block->instructions[i - 1];
+    }
+    block->instructions[index] = instruction;
+    instruction->block = block;
+}
+
+void ir_replace_uses(IRFunction *func, IRInstruction *old_value, IRInstruction *new_value) {
+    for(int i = 0; i < func->num_blocks; ++i) {
+        IRBlock *block = func->blocks[i];
+
+        for(int j = 0; j < block->num_instructions; ++j) {
+            IRInstruction *instruction = block->instructions[j];
+
+            for(int k = 0; k < instruction->num_operands; ++k) {
+                if(instruction->operands[k] == old_value) instruction->operands[k] = new_value;
+            }
+        }
+    }
+}
+
+static void number_postorder(IRBlock *block, int *next_number) {
+    // reverse_postorder is the postorder number until they're all numbered
+    block->reverse_postorder = -2; // being visited
+
+    for(int i = 0; i < ir_num_successors(block); ++i) {
+        IRBlock *successor = ir_successor(block, i);
+        if(successor->reverse_postorder == -1) number_postorder(successor, next_number);
+    }
+
+    block->reverse_postorder = (*next_number)++;
+}
+
+static IRBlock *intersect_dominators(IRBlock *a, IRBlock *b) {
+    while(a != b) {
+        while(a->reverse_postorder > b->reverse_postorder) a = a->idom;
+        while(b->reverse_postorder > a->reverse_postorder) b = b->idom;
+    }
+    return a;
+}
+
+void ir_compute_dominators(IRFunction *func) {
+    // Cooper, Harvey and Kennedy's "A Simple, Fast Dominance Algorithm".
+    // Unreachable blocks are left without an immediate dominator.
+    xcc_assert(func->num_blocks > 0);
+
+    for(int i = 0; i < func->num_blocks; ++i) {
+        func->blocks[i]->reverse_postorder = -1;
+        func->blocks[i]->idom = NULL;
+    }
+
+    int num_reachable = 0;
+    number_postorder(func->blocks[0], &num_reachable);
+
+    IRBlock **order = xcc_malloc(sizeof(IRBlock *) * num_reachable);
+    for(int i = 0; i < func->num_blocks; ++i) {
+        IRBlock *block = func->blocks[i];
+        if(block->reverse_postorder < 0) continue;
+
+        block->reverse_postorder = num_reachable - 1 - block->reverse_postorder;
+        order[block->reverse_postorder] = block;
+    }
+
+    IRBlock *entry = func->blocks[0];
+    entry->idom = entry;
+
+    bool is_changed = true;
+    while(is_changed) {
+        is_changed = false;
+
+        for(int i = 1; i < num_reachable; ++i) {
+            IRBlock *block = order[i];
+            IRBlock *new_idom = NULL;
+
+            for(int j = 0; j < block->num_predecessors; ++j) {
+                IRBlock *predecessor = block->predecessors[j];
+                if(!predecessor->idom) continue;
+
+                new_idom = new_idom ? intersect_dominators(predecessor, new_idom) : predecessor;
+            }
+
+            if(new_idom != block->idom) {
+                block->idom = new_idom;
+                is_changed = true;
+            }
+        }
+    }
+
+    xcc_free(order);
+}
+
+bool ir_dominates(IRBlock *a, IRBlock *b) {
+    if(!b->idom) return false;
+
+    while(b != a) {
+        if(b->idom == b) return false;
+        b = b->idom;
+    }
+    return true;
+}
+
+static bool is_value_defined_before(IRInstruction *value, IRInstruction *user) {
+    // For uses in the same block
+    IRBlock *block = user->block;
+    for(int i = 0; i < block->num_instructions; ++i) {
+        if(block->instructions[i] == value) return true;
+        if(block->instructions[i] == user) return false;
+    }
+    xcc_assert_not_reached();
+}
+
+static void verify_operand_sizes(IRInstruction *instruction) {
+    IRInstruction **operands = instruction->operands;
+    int num_operands = instruction->num_operands;
+
+    switch(instruction->opcode) {
+        case IR_CONST:
+        case IR_PARAM:
+            xcc_assert_msg(num_operands == 0 && instruction->size > 0, "IR: bad constant or parameter");
+            break;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+            xcc_assert_msg(num_operands == 2, "IR: arithmetic needs two operands");
+            xcc_assert_msg(
+                operands[0]->size == instruction->size && operands[1]->size == instruction->size,
+                "IR: arithmetic on mismatched sizes"
+            );
+            break;
+        case IR_CMP_LT:
+        case IR_CMP_GT:
+        case IR_CMP_LT_EQ:
+        case IR_CMP_GT_EQ:
+            xcc_assert_msg(num_operands == 2, "IR: comparison needs two operands");
+            xcc_assert_msg(operands[0]->size == operands[1]->size, "IR: comparison of mismatched sizes");
+            break;
+        case IR_SIGN_EXTEND:
+            xcc_assert_msg(num_operands == 1 && operands[0]->size < instruction->size, "IR: bad sign extension");
+            break;
+        case IR_TRUNCATE:
+            xcc_assert_msg(num_operands == 1 && operands[0]->size > instruction->size, "IR: bad truncation");
+            break;
+        case IR_LOAD:
+            xcc_assert_msg(num_operands == 1 && operands[0]->size == 8, "IR: load needs a pointer");
+            break;
+        case IR_CALL:
+            xcc_assert_msg(instruction->func_name, "IR: call without a function");
+            break;
+        case IR_PHI:
+            for(int i = 0; i < num_operands; ++i) {
+                xcc_assert_msg(operands[i]->size == instruction->size, "IR: phi of mismatched sizes");
+            }
+            break;
+        case IR_JUMP:
+            xcc_assert_msg(num_operands == 0, "IR: jump with operands");
+            break;
+        case IR_BRANCH:
+            xcc_assert_msg(num_operands == 1, "IR: branch needs a condition");
+            break;
+        case IR_RETURN:
+            xcc_assert_msg(num_operands <= 1, "IR: return of more than one value");
+            break;
+    }
+}
+
+static void verify_block(IRFunction *func, IRBlock *block, int block_index, bool *is_defined) {
+    xcc_assert_msg(block->id == block_index, "IR: block ids out of order");
+    xcc_assert_msg(ir_terminator(block), "IR: block without a terminator");
+
+    if(block_index == 0) {
+        xcc_assert_msg(block->num_predecessors == 0, "IR: jump to the entry block");
+    } else {
+        xcc_assert_msg(block->idom, "IR: unreachable block");
+    }
+
+    bool is_past_phis = false;
+
+    for(int i = 0; i < block->num_instructions; ++i) {
+        IRInstruction *instruction = block->instructions[i];
+        xcc_assert_msg(instruction->block == block, "IR: instruction in the wrong block");
+        xcc_assert_msg(
+            !ir_is_terminator(instruction->opcode) || i == block->num_instructions - 1,
+            "IR: terminator in the middle of a block"
+        );
+
+        if(instruction->opcode == IR_PHI) {
+            xcc_assert_msg(!is_past_phis, "IR: phi after the start of a block");
+            xcc_assert_msg(
+                instruction->num_operands == block->num_predecessors,
+                "IR: phi without an operand for each predecessor"
+            );
+        } else {
+            is_past_phis = true;
+        }
+
+        verify_operand_sizes(instruction);
+
+        for(int j = 0; j < instruction->num_operands; ++j) {
+            IRInstruction *operand = instruction->operands[j];
+            xcc_assert_msg(operand && operand->size > 0, "IR: operand without a value");
+            xcc_assert_msg(is_defined[operand->id], "IR: operand from outside the function");
+
+            // a phi's operand is used at the end of its predecessor
+            IRBlock *use_block = instruction->opcode == IR_PHI ? block->predecessors[j] : block;
+
+            if(operand->block == use_block && instruction->opcode != IR_PHI) {
+                xcc_assert_msg(is_value_defined_before(operand, instruction), "IR: value used before it's set");
+            } else {
+                xcc_assert_msg(ir_dominates(operand->block, use_block), "IR: value doesn't dominate its use");
+            }
+        }
+    }
+
+    // Every edge appears once as a successor and once as a predecessor
+    for(int i = 0; i < ir_num_successors(block); ++i) {
+        IRBlock *successor = ir_successor(block, i);
+        xcc_assert_msg(successor->id < func->num_blocks && func->blocks[successor->id] == successor,
+                       "IR: jump out of the function");
+        ir_predecessor_index(successor, block);
+    }
+
+    for(int i = 0; i < block->num_predecessors; ++i) {
+        IRBlock *predecessor = block->predecessors[i];
+        bool is_successor = false;
+
+        for(int j = 0; j < ir_num_successors(predecessor); ++j) {
+            is_successor = is_successor || ir_successor(predecessor, j) == block;
+        }
+        xcc_assert_msg(is_successor, "IR: predecessor which doesn't jump to the block");
+    }
+}
+
+void ir_verify(IRFunction *func) {
+    // Internal errors for anything that isn't valid SSA
+    xcc_assert_msg(func->num_blocks > 0, "IR: function without an entry block");
+    ir_compute_dominators(func);
+
+    bool *is_defined = xcc_malloc(sizeof(bool) * (func->num_values + 1));
+    memset(is_defined, 0, sizeof(bool) * (func->num_values + 1));
+
+    for(int i = 0; i < func->num_blocks; ++i) {
+        IRBlock *block = func->blocks[i];
+
+        for(int j = 0; j < block->num_instructions; ++j) {
+            IRInstruction *instruction = block->instructions[j];
+            xcc_assert_msg(instruction->id >= 0 && instruction->id < func->num_values, "IR: bad value id");
+            xcc_assert_msg(!is_defined[instruction->id], "IR: value set twice");
+            is_defined[instruction->id] = true;
+        }
+    }
+
+    for(int i = 0; i < func->num_blocks; ++i) {
+        verify_block(func, func->blocks[i], i, is_defined);
+    }
+
+    xcc_free(is_defined);
+}
+
+static const char *opcode_name(IROpcode opcode) {
+    switch(opcode) {
+        case IR_CONST: return "const";
+        case IR_PARAM: return "param";
+        case IR_ADD: return "add";
+        case IR_SUB: return "sub";
+        case IR_MUL: return "mul";
+        case IR_CMP_LT: return "lt";
+        case IR_CMP_GT: return "gt";
+        case IR_CMP_LT_EQ: return "le";
+        case IR_CMP_GT_EQ: return "ge";
+        case IR_SIGN_EXTEND: return "sext";
+        case IR_TRUNCATE: return "trunc";
+        case IR_LOAD: return "load";
+        case IR_CALL: return "call";
+        case IR_PHI: return "phi";
+        case IR_JUMP: return "jump";
+        case IR_BRANCH: return "branch";
+        case IR_RETURN: return "return";
+    }
+    xcc_assert_not_reached();
+}
+
+static void dump_instruction(FILE *stream, IRInstruction *instruction) {
+    fprintf(stream, "    ");
+    if(instruction->size) {
+        fprintf(stream, "v%d = %s.%c%d", instruction->id, opcode_name(instruction->opcode),
+                instruction->is_signed ? 's' : 'u', instruction->size);
+    } else {
+        fprintf(stream, "%s", opcode_name(instruction->opcode));
+    }
+
+    if(instruction->opcode == IR_CONST || instruction->opcode == IR_PARAM) {
+        fprintf(stream, " %lld", instruction->constant);
+    } else if(instruction->opcode == IR_CALL) {
+        fprintf(stream, " %s", instruction->func_name);
+    }
+
+    for(int i = 0; i < instruction->num_operands; ++i) {
+        fprintf(stream, "%s v%d", i == 0 && instruction->opcode != IR_CALL ? "" : ",",
+                instruction->operands[i]->id);
+        if(instruction->opcode == IR_PHI) {
+            fprintf(stream, " (block %d)", instruction->block->predecessors[i]->id);
+        }
+    }
+
+    for(int i = 0; i < 2 && instruction->targets[i]; ++i) {
+        fprintf(stream, "%s block %d", i == 0 && !instruction->num_operands ? "" : ",",
+                instruction->targets[i]->id);
+    }
+    fprintf(stream, "\n");
+}
+
+void ir_dump(IRFunction *func, const char *header) {
+    // Written out all at once, since functions are compiled in parallel
+    char *text = NULL;
+    size_t length = 0;
+    FILE *stream = open_memstream(&text, &length);
+    xcc_assert_msg(stream, "open_memstream() failed");
+
+    fprintf(stream, " IR, %s, for %s:\n", header, func->name);
+
+    for(int i = 0; i < func->num_blocks; ++i) {
+        IRBlock *block = func->blocks[i];
+        fprintf(stream, "  block %d", block->id);
+
+        for(int j = 0; j < block->num_predecessors; ++j) {
+            fprintf(stream, "%s%d", j == 0 ? " (from " : ", ", block->predecessors[j]->id);
+        }
+        fprintf(stream, "%s:\n", block->num_predecessors ? ")" : "");
+
+        for(int j = 0; j < block->num_instructions; ++j) {
+            dump_instruction(stream, block->instructions[j]);
+        }
+    }
+
+    xcc_assert_msg(!fclose(stream), "failed to close IR dump");
+    fputs(text, stderr);
+    free(text); // allocated by open_memstream
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "xcc.h"
+
+// A three address intermediate representation in SSA form, which functions
+// are built into once they've been checked when compiling with -O. Values
+// are only ever set once, and control flow is between basic blocks.
+
+typedef enum {
+    IR_CONST, IR_PARAM,
+    IR_ADD, IR_SUB, IR_MUL,
+    IR_CMP_LT, IR_CMP_GT, IR_CMP_LT_EQ, IR_CMP_GT_EQ,
+    IR_SIGN_EXTEND, IR_TRUNCATE,
+    IR_LOAD, IR_CALL, IR_PHI,
+
+    // every block ends in exactly one of these
+    IR_JUMP, IR_BRANCH, IR_RETURN
+} IROpcode;
+
+typedef struct IRBlock IRBlock;
+
+// An instruction which produces a value is that value
+typedef struct IRInstruction {
+    IROpcode opcode;
+    int id;
+    IRBlock *block;
+
+    // of the value, or 0 for an instruction without one
+    int size;
+    bool is_signed;
+
+    struct IRInstruction **operands;
+    int num_operands;
+    int num_operands_allocated;
+
+    long long constant; // for IR_CONST, or the index of an IR_PARAM
+    const char *func_name; // for IR_CALL
+
+    // for IR_JUMP, and IR_BRANCH's targets when true and false
+    IRBlock *targets[2];
+} IRInstruction;
+
+struct IRBlock {
+    int id;
+
+    IRInstruction **instructions;
+    int num_instructions;
+    int num_instructions_allocated;
+
+    // a phi has an operand for each of these, in the same order
+    IRBlock **predecessors;
+    int num_predecessors;
+    int num_predecessors_allocated;
+
+    // filled in by ir_compute_dominators
+    IRBlock *idom;
+    int reverse_postorder;
+};
+
+typedef struct {
+    const char *name;
+    int num_params;
+
+    // in the order they're laid out, starting with the entry
+    IRBlock **blocks;
+    int num_blocks;
+    int num_blocks_allocated;
+
+    // every value's id is less than this
+    int num_values;
+} IRFunction;
+
+IRFunction *ir_new_function(const char *name);
+void ir_free_function(IRFunction *func);
+IRBlock *ir_new_block(IRFunction *func);
+IRInstruction *ir_append(IRFunction *func, IRBlock *block, IROpcode opcode, int size, bool is_signed);
+IRInstruction *ir_insert(IRFunction *func, IRBlock *block, int index, IROpcode opcode,
+                         int size, bool is_signed);
+IRInstruction *ir_insert_phi(IRFunction *func, IRBlock *block, int size, bool is_signed);
+void ir_add_operand(IRInstruction *instruction, IRInstruction *operand);
+void ir_set_jump(IRFunction *func, IRBlock *block, IRBlock *target);
+void ir_set_branch(IRFunction *func, IRBlock *block, IRInstruction *condition,
+                   IRBlock *if_true, IRBlock *if_false);
+bool ir_is_terminator(IROpcode opcode);
+IRInstruction *ir_terminator(IRBlock *block);
+int ir_num_successors(IRBlock *block);
+IRBlock *ir_successor(IRBlock *block, int index);
+int ir_predecessor_index(IRBlock *block, IRBlock *predecessor);
+IRBlock *ir_split_edge(IRFunction *func, IRBlock *from, IRBlock *to);
+void ir_split_critical_edges(IRFunction *func);
+void ir_remove_instruction(IRBlock *block, int index);
+void ir_move_instruction(IRInstruction *instruction, IRBlock *block, int index);
+void ir_replace_uses(IRFunction *func, IRInstruction *old_value, IRInstruction *new_value);
+void ir_compute_dominators(IRFunction *func);
+bool ir_dominates(IRBlock *a, IRBlock *b);
+void ir_verify(IRFunction *func);
+void ir_dump(IRFunction *func, const char *header);
@@ -0,0 +1,493 @@
+// Building the SSA form of a function from its checked AST
+//
+// Locals are never stored anywhere, since nothing can take their address,
+// so they become SSA values as the function is built. This follows Braun et
+// al.'s "Simple and Efficient Construction of Static Single Assignment Form":
+// a read of a local looks back through the blocks before it, adding phis
+// where paths join. A block is sealed once all of its predecessors are known,
+// and until then a read adds a phi whose operands are filled in on sealing.
+#include "xcc.h"
+
+typedef struct {
+    IRInstruction *phi;
+    int variable;
+} IncompletePhi;
+
+typedef struct {
+    // the value each local has at the end of the block so far, by index
+    IRInstruction **definitions;
+    int num_definitions;
+    int num_definitions_allocated;
+
+    IncompletePhi *incomplete_phis;
+    int num_incomplete_phis;
+    int num_incomplete_phis_allocated;
+
+    bool is_sealed;
+} BlockState;
+
+typedef struct {
+    IRFunction *func;
+
+    // NULL after a return, where nothing can be reached
+    IRBlock *current;
+
+    // the order the blocks are laid out in, which isn't the order they're
+    // made in since a branch's targets are made before what's in them
+    IRBlock **layout;
+    int num_layout;
+    int num_layout_allocated;
+
+    Declaration **variables;
+    int num_variables;
+    int num_variables_allocated;
+
+    // by the id each block was made with
+    BlockState *states;
+    int num_states;
+    int num_states_allocated;
+} IRBuilder;
+
+static int value_size(Type *type) {
+    return type_get_size(type);
+}
+
+static bool value_is_signed(Type *type) {
+    return type->type_type == TYPE_INTEGER && integer_type_is_signed(type);
+}
+
+static IRBlock *new_block(IRBuilder *builder) {
+    IRBlock *block = ir_new_block(builder->func);
+
+    BlockState *state;
+    LIST_STRUCT_APPEND_FUNC(BlockState, builder, num_states, num_states_allocated, states, state);
+    memset(state, 0, sizeof(BlockState));
+    xcc_assert(builder->num_states == builder->func->num_blocks);
+
+    return block;
+}
+
+static void place_block(IRBuilder *builder, IRBlock *block) {
+    // Starts building into the block, after those already placed
+    IRBlock **placed;
+    LIST_STRUCT_APPEND_FUNC(IRBlock *, builder, num_layout, num_layout_allocated, layout, placed);
+    *placed = block;
+
+    builder->current = block;
+}
+
+static int variable_index(IRBuilder *builder, Declaration *declaration) {
+    for(int i = 0; i < builder->num_variables; ++i) {
+        if(builder->variables[i] == declaration) return i;
+    }
+
+    Declaration **variable;
+    LIST_STRUCT_APPEND_FUNC(
+        Declaration *, builder, num_variables, num_variables_allocated, variables, variable
+    );
+    *variable = declaration;
+
+    return builder->num_variables - 1;
+}
+
+static void write_variable(IRBuilder *builder, int variable, IRBlock *block, IRInstruction *value) {
+    BlockState *state = &builder->states[block->id];
+
+    while(state->num_definitions <= variable) {
+        IRInstruction **definition;
+        LIST_STRUCT_APPEND_FUNC(
+            IRInstruction *, state, num_definitions, num_definitions_allocated, definitions,
+            definition
+        );
+        *definition = NULL;
+    }
+
+    state->definitions[variable] = value;
+}
+
+static IRInstruction *read_variable(IRBuilder *builder, int variable, IRBlock *block);
+
+static void add_phi_operands(IRBuilder *builder, int variable, IRInstruction *phi) {
+    IRBlock *block = phi->block;
+    for(int i = 0; i < block->num_predecessors; ++i) {
+        ir_add_operand(phi, read_variable(builder, variable, block->predecessors[i]));
+    }
+}
+
+static IRInstruction *read_variable_recursive(IRBuilder *builder, int variable, IRBlock *block) {
+    Type *type = builder->variables[variable]->type;
+    BlockState *state = &builder->states[block->id];
+    IRInstruction *value;
+
+    if(!state->is_sealed) {
+        value = ir_insert_phi(builder->func, block, value_size(type), value_is_signed(type));
+
+        IncompletePhi *incomplete;
+        LIST_STRUCT_APPEND_FUNC(
+            IncompletePhi, state, num_incomplete_phis, num_incomplete_phis_allocated,
+            incomplete_phis, incomplete
+        );
+        incomplete->phi = value;
+        incomplete->variable = variable;
+    } else if(block->num_predecessors == 1) {
+        value = read_variable(builder, variable, block->predecessors[0]);
+    } else if(block->num_predecessors == 0) {
+        // read before it's been set, so any value will do
+        xcc_assert(block == builder->func->blocks[0]);
+        value = ir_insert(builder->func, block, 0, IR_CONST, value_size(type), value_is_signed(type));
+        value->constant = 0;
+    } else {
+        // the phi is written first, so that a loop back to here finds it
+        value = ir_insert_phi(builder->func, block, value_size(type), value_is_signed(type));
+        write_variable(builder, variable, block, value);
+        add_phi_operands(builder, variable, value);
+    }
+
+    write_variable(builder, variable, block, value);
+    return value;
+}
+
+static IRInstruction *read_variable(IRBuilder *builder, int variable, IRBlock *block) {
+    BlockState *state = &builder->states[block->id];
+    if(variable < state->num_definitions && state->definitions[variable]) {
+        return state->definitions[variable];
+    }
+
+    return read_variable_recursive(builder, variable, block);
+}
+
+static void seal_block(IRBuilder *builder, IRBlock *block) {
+    BlockState *state = &builder->states[block->id];
+    xcc_assert(!state->is_sealed);
+
+    for(int i = 0; i < state->num_incomplete_phis; ++i) {
+        IncompletePhi *incomplete = &builder->states[block->id].incomplete_phis[i];
+        add_phi_operands(builder, incomplete->variable, incomplete->phi);
+    }
+
+    // adding operands can add to the states, so state might have moved
+    state = &builder->states[block->id];
+    state->is_sealed = true;
+}
+
+static IRInstruction *build_expression(IRBuilder *builder, AST *ast);
+
+static IRInstruction *append_value(IRBuilder *builder, IROpcode opcode, AST *ast) {
+    // An instruction producing the value of ast
+    return ir_append(
+        builder->func, builder->current, opcode,
+        value_size(ast->value_type), value_is_signed(ast->value_type)
+    );
+}
+
+static IRInstruction *build_binary(IRBuilder *builder, AST *ast) {
+    IROpcode opcode;
+    switch(ast->type) {
+        case AST_ADD: opcode = IR_ADD; break;
+        case AST_SUBTRACT: opcode = IR_SUB; break;
+        case AST_MULTIPLY: opcode = IR_MUL; break;
+        case AST_CMP_LT: opcode = IR_CMP_LT; break;
+        case AST_CMP_GT: opcode = IR_CMP_GT; break;
+        case AST_CMP_LT_EQ: opcode = IR_CMP_LT_EQ; break;
+        case AST_CMP_GT_EQ: opcode = IR_CMP_GT_EQ; break;
+        default: xcc_assert_not_reached();
+    }
+
+    IRInstruction *left = build_expression(builder, ast->nodes[0]);
+    IRInstruction *right = build_expression(builder, ast->nodes[1]);
+
+    IRInstruction *instruction = append_value(builder, opcode, ast);
+    ir_add_operand(instruction, left);
+    ir_add_operand(instruction, right);
+    return instruction;
+}
+
+static IRInstruction *build_conversion(IRBuilder *builder, AST *ast) {
+    IRInstruction *from = build_expression(builder, ast->nodes[0]);
+    int size_to = value_size(ast->value_type);
+
+    // the same bits, just looked at differently
+    if(from->size == size_to) return from;
+
+    IRInstruction *instruction;
+    if(from->size < size_to) {
+        xcc_assert_msg(from->is_signed, "TODO: handle unsigned conversion");
+        instruction = append_value(builder, IR_SIGN_EXTEND, ast);
+    } else {
+        instruction = append_value(builder, IR_TRUNCATE, ast);
+    }
+
+    ir_add_operand(instruction, from);
+    return instruction;
+}
+
+static IRInstruction *build_call(IRBuilder *builder, AST *ast) {
+    xcc_assert(ast->num_nodes >= 1);
+    xcc_assert(ast->nodes[0]->type == AST_IDENT_USE);
+
+    IRInstruction **args = xcc_malloc(sizeof(IRInstruction *) * ast->num_nodes);
+    for(int i = 1; i < ast->num_nodes; ++i) {
+        args[i] = build_expression(builder, ast->nodes[i]);
+    }
+
+    int size = ast->value_type->type_type == TYPE_VOID ? 0 : value_size(ast->value_type);
+    IRInstruction *call = ir_append(
+        builder->func, builder->current, IR_CALL, size,
+        size && value_is_signed(ast->value_type)
+    );
+    call->func_name = ast->nodes[0]->declaration->name;
+
+    for(int i = 1; i < ast->num_nodes; ++i) {
+        ir_add_operand(call, args[i]);
+    }
+    xcc_free(args);
+
+    return call;
+}
+
+static IRInstruction *build_expression(IRBuilder *builder, AST *ast) {
+    if(ast->type == AST_INTEGER_LITERAL) {
+        IRInstruction *constant = append_value(builder, IR_CONST, ast);
+        constant->constant = ast->integer_literal_val;
+        return constant;
+    } else if(ast_is_binary_expression(ast)) {
+        return build_binary(builder, ast);
+    } else if(ast->type == AST_IDENT_USE) {
+        int variable = variable_index(builder, ast->declaration);
+        return read_variable(builder, variable, builder->current);
+    } else if(ast->type == AST_ASSIGN) {
+        xcc_assert(ast->num_nodes == 2 && ast->nodes[0]->type == AST_IDENT_USE);
+
+        IRInstruction *value = build_expression(builder, ast->nodes[1]);
+        int variable = variable_index(builder, ast->nodes[0]->declaration);
+        write_variable(builder, variable, builder->current, value);
+        return value;
+    } else if(ast->type == AST_CONVERT_TO_INT) {
+        return build_conversion(builder, ast);
+    } else if(ast->type == AST_DEREFERENCE) {
+        IRInstruction *pointer = build_expression(builder, ast->nodes[0]);
+        IRInstruction *load = append_value(builder, IR_LOAD, ast);
+        ir_add_operand(load, pointer);
+        return load;
+    } else if(ast->type == AST_CALL) {
+        return build_call(builder, ast);
+    }
+
+    xcc_assert_not_reached_msg("unknown expression");
+}
+
+static void build_statement(IRBuilder *builder, AST *ast);
+
+static void build_if(IRBuilder *builder, AST *ast) {
+    bool has_else = ast->num_nodes == 3;
+    IRInstruction *condition = build_expression(builder, ast->nodes[0]);
+
+    IRBlock *then_block = new_block(builder);
+    IRBlock *else_block = new_block(builder);
+    ir_set_branch(builder->func, builder->current, condition, then_block, else_block);
+    seal_block(builder, then_block);
+    seal_block(builder, else_block);
+
+    place_block(builder, then_block);
+    build_statement(builder, ast->nodes[1]);
+    IRBlock *then_end = builder->current;
+
+    if(!has_else) {
+        // the block after the if is the else block
+        if(then_end) ir_set_jump(builder->func, then_end, else_block);
+        place_block(builder, else_block);
+        return;
+    }
+
+    place_block(builder, else_block);
+    build_statement(builder, ast->nodes[2]);
+    IRBlock *else_end = builder->current;
+
+    if(!then_end && !else_end) {
+        // both return, so nothing after the if can be reached
+        builder->current = NULL;
+        return;
+    }
+
+    IRBlock *join = new_block(builder);
+    if(then_end) ir_set_jump(builder->func, then_end, join);
+    if(else_end) ir_set_jump(builder->func, else_end, join);
+    seal_block(builder, join);
+    place_block(builder, join);
+}
+
+static void build_while(IRBuilder *builder, AST *ast) {
+    IRBlock *header = new_block(builder);
+    ir_set_jump(builder->func, builder->current, header);
+    place_block(builder, header);
+
+    IRInstruction *condition = build_expression(builder, ast->nodes[0]);
+    IRBlock *body = new_block(builder);
+    IRBlock *exit = NULL;
+
+    // a constant condition has been folded, so it's always true
+    if(condition->opcode == IR_CONST) {
+        xcc_assert(condition->constant);
+        ir_set_jump(builder->func, builder->current, body);
+    } else {
+        exit = new_block(builder);
+        ir_set_branch(builder->func, builder->current, condition, body, exit);
+        seal_block(builder, exit);
+    }
+    seal_block(builder, body);
+
+    place_block(builder, body);
+    build_statement(builder, ast->nodes[1]);
+    if(builder->current) ir_set_jump(builder->func, builder->current, header);
+
+    // the header's predecessors are only all known once the body's done
+    seal_block(builder, header);
+
+    if(exit) {
+        place_block(builder, exit);
+    } else {
+        builder->current = NULL;
+    }
+}
+
+static void build_statement(IRBuilder *builder, AST *ast) {
+    // nothing after a return needs building
+    if(!builder->current) return;
+
+    if(ast->type == AST_RETURN_STMT) {
+        IRInstruction *value = ast->num_nodes == 1 ? build_expression(builder, ast->nodes[0]) : NULL;
+
+        IRInstruction *ret = ir_append(builder->func, builder->current, IR_RETURN, 0, false);
+        if(value) ir_add_operand(ret, value);
+
+        builder->current = NULL;
+    } else if(ast->type == AST_STATEMENT_EXPRESSION) {
+        build_expression(builder, ast->nodes[0]);
+    } else if(ast->type == AST_IF) {
+        build_if(builder, ast);
+    } else if(ast->type == AST_WHILE) {
+        build_while(builder, ast);
+    } else if(ast->type == AST_DECLARATOR_GROUP) {
+        if(ast->num_nodes == 2) {
+            IRInstruction *value = build_expression(builder, ast->nodes[1]);
+            int variable = variable_index(builder, ast->declaration);
+            write_variable(builder, variable, builder->current, value);
+        }
+    } else if(ast->type == AST_BLOCK_STATEMENT) {
+        for(int i = 0; i < ast->num_nodes; ++i) {
+            build_statement(builder, ast->nodes[i]);
+        }
+    } else if(ast->type == AST_DECLARATION) {
+        for(int i = 1; i < ast->num_nodes; ++i) {
+            build_statement(builder, ast->nodes[i]);
+        }
+    } else {
+        xcc_assert_not_reached_msg("unknown statement");
+    }
+}
+
+static void build_params(IRBuilder *builder, AST *ast) {
+    // The parameters all arrive at once, at the start of the function
+    AST *declarator_group = ast->nodes[1];
+    xcc_assert(declarator_group->num_nodes == 1);
+    AST *declarator = declarator_group->nodes[0];
+    xcc_assert(declarator->type == AST_DECLARATOR_FUNC);
+
+    for(int i = 1; i < declarator->num_nodes; ++i) {
+        AST *param = declarator->nodes[i];
+        xcc_assert(param->type == AST_PARAMETER);
+        Declaration *declaration = param->declaration;
+
+        IRInstruction *value = ir_append(
+            builder->func, builder->current, IR_PARAM,
+            value_size(declaration->type), value_is_signed(declaration->type)
+        );
+        value->constant = i - 1;
+        write_variable(builder, variable_index(builder, declaration), builder->current, value);
+    }
+
+    builder->func->num_params = declarator->num_nodes - 1;
+}
+
+static void remove_trivial_phis(IRFunction *func) {
+    // A phi whose operands are all the same value, apart from itself, is
+    // just that value. Removing one can make others trivial.
+    bool is_changed = true;
+    while(is_changed) {
+        is_changed = false;
+
+        for(int i = 0; i < func->num_blocks; ++i) {
+            IRBlock *block = func->blocks[i];
+
+            for(int j = 0; j < block->num_instructions; ++j) {
+                IRInstruction *phi = block->instructions[j];
+                if(phi->opcode != IR_PHI) break;
+
+                IRInstruction *same = NULL;
+                bool is_trivial = true;
+                for(int k = 0; k < phi->num_operands && is_trivial; ++k) {
+                    IRInstruction *operand = phi->operands[k];
+                    if(operand == same || operand == phi) continue;
+
+                    is_trivial = same == NULL;
+                    same = operand;
+                }
+
+                if(!is_trivial) continue;
+                xcc_assert_msg(same, "IR: phi of nothing but itself");
+
+                ir_replace_uses(func, phi, same);
+                ir_remove_instruction(block, j);
+                j--;
+                is_changed = true;
+            }
+        }
+    }
+}
+
+static void finish_layout(IRBuilder *builder) {
+    // Puts the blocks in the order they were placed in
+    IRFunction *func = builder->func;
+    xcc_assert(builder->num_layout == func->num_blocks);
+
+    for(int i = 0; i < func->num_blocks; ++i) {
+        func->blocks[i] = builder->layout[i];
+        func->blocks[i]->id = i;
+    }
+}
+
+IRFunction *ir_build_function(AST *ast) {
+    xcc_assert(ast->type == AST_FUNCTION_DEFINITION);
+    xcc_assert(ast->num_nodes == 3);
+
+    IRBuilder builder;
+    memset(&builder, 0, sizeof(IRBuilder));
+    builder.func = ir_new_function(ast->declaration->name);
+
+    IRBlock *entry = new_block(&builder);
+    seal_block(&builder, entry);
+    place_block(&builder, entry);
+
+    build_params(&builder, ast);
+    build_statement(&builder, ast->nodes[2]);
+
+    // falling off the end returns nothing in particular
+    if(builder.current) {
+        ir_append(builder.func, builder.current, IR_RETURN, 0, false);
+    }
+
+    for(int i = 0; i < builder.num_states; ++i) {
+        xcc_assert(builder.states[i].is_sealed);
+        xcc_free(builder.states[i].definitions);
+        xcc_free(builder.states[i].incomplete_phis);
+    }
+
+    finish_layout(&builder);
+    remove_trivial_phis(builder.func);
+
+    xcc_free(builder.layout);
+    xcc_free(builder.variables);
+    xcc_free(builder.states);
+
+    return builder.func;
+}
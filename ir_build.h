@@ -0,0 +1,5 @@
+#pragma once
+
+#include "xcc.h"
+
+IRFunction *ir_build_function(AST *ast);
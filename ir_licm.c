@@ -0,0 +1,200 @@
+// Loop invariant code motion: a value worked out inside a loop only from
+// values defined outside it is the same on every iteration, so it's moved
+// out to the loop's preheader and worked out once.
+//
+// Loops are found from their back edges, edges to a block which dominates
+// the block they come from. Critical edges have been split by now, so a loop
+// with a single way in is entered from a block which only jumps to the
+// header, and that block is the preheader.
+#include "xcc.h"
+
+typedef struct {
+    IRFunction *func;
+
+    // the reachable blocks, in reverse postorder
+    IRBlock **order;
+    int num_reachable;
+
+    // by block id, for the loop being looked at
+    bool *is_in_loop;
+    IRBlock **worklist;
+} LICMContext;
+
+static bool is_reachable(IRBlock *block) {
+    return block->reverse_postorder >= 0;
+}
+
+static bool is_back_edge(IRBlock *from, IRBlock *to) {
+    return is_reachable(from) && ir_dominates(to, from);
+}
+
+static void mark_loop_body(LICMContext *ctx, IRBlock *header) {
+    // Everything which reaches a back edge without going through the header
+    memset(ctx->is_in_loop, 0, sizeof(bool) * ctx->func->num_blocks);
+    ctx->is_in_loop[header->id] = true;
+
+    int num_pending = 0;
+    for(int i = 0; i < header->num_predecessors; ++i) {
+        IRBlock *latch = header->predecessors[i];
+        if(!is_back_edge(latch, header) || ctx->is_in_loop[latch->id]) continue;
+
+        ctx->is_in_loop[latch->id] = true;
+        ctx->worklist[num_pending++] = latch;
+    }
+
+    while(num_pending > 0) {
+        IRBlock *block = ctx->worklist[--num_pending];
+
+        for(int i = 0; i < block->num_predecessors; ++i) {
+            IRBlock *predecessor = block->predecessors[i];
+            if(!is_reachable(predecessor) || ctx->is_in_loop[predecessor->id]) continue;
+
+            ctx->is_in_loop[predecessor->id] = true;
+            ctx->worklist[num_pending++] = predecessor;
+        }
+    }
+}
+
+static IRBlock *find_preheader(LICMContext *ctx, IRBlock *header) {
+    // NULL if the loop can be entered from more than one block
+    IRBlock *preheader = NULL;
+    for(int i = 0; i < header->num_predecessors; ++i) {
+        IRBlock *predecessor = header->predecessors[i];
+        if(!is_reachable(predecessor) || ctx->is_in_loop[predecessor->id]) continue;
+
+        if(preheader) return NULL;
+        preheader = predecessor;
+    }
+
+    if(preheader && ir_num_successors(preheader) != 1) return NULL;
+    return preheader;
+}
+
+static bool loop_has_call(LICMContext *ctx) {
+    for(int i = 0; i < ctx->num_reachable; ++i) {
+        IRBlock *block = ctx->order[i];
+        if(!ctx->is_in_loop[block->id]) continue;
+
+        for(int j = 0; j < block->num_instructions; ++j) {
+            if(block->instructions[j]->opcode == IR_CALL) return true;
+        }
+    }
+    return false;
+}
+
+static bool is_run_every_iteration(LICMContext *ctx, IRBlock *header, IRBlock *block) {
+    // True if the block runs on every way round the loop and every way out of
+    // it, so working out its values before the loop can't add a load which
+    // wouldn't have happened
+    for(int i = 0; i < ctx->num_reachable; ++i) {
+        IRBlock *other = ctx->order[i];
+        if(!ctx->is_in_loop[other->id]) continue;
+
+        bool is_exit_or_latch = false;
+        for(int j = 0; j < ir_num_successors(other); ++j) {
+            IRBlock *successor = ir_successor(other, j);
+            if(!ctx->is_in_loop[successor->id] || successor == header) is_exit_or_latch = true;
+        }
+
+        if(is_exit_or_latch && !ir_dominates(block, other)) return false;
+    }
+    return true;
+}
+
+static bool is_invariant(LICMContext *ctx, IRBlock *header, IRInstruction *instruction,
+                         bool has_call) {
+    switch(instruction->opcode) {
+        case IR_CONST:
+        case IR_ADD: case IR_SUB: case IR_MUL:
+        case IR_CMP_LT: case IR_CMP_GT: case IR_CMP_LT_EQ: case IR_CMP_GT_EQ:
+        case IR_SIGN_EXTEND: case IR_TRUNCATE:
+            break;
+
+        case IR_LOAD:
+            // Nothing stores to memory but a call, and a load mustn't be
+            // moved somewhere it might fault when it wouldn't have before
+            if(has_call || !is_run_every_iteration(ctx, header, instruction->block)) return false;
+            break;
+
+        default:
+            return false;
+    }
+
+    for(int i = 0; i < instruction->num_operands; ++i) {
+        if(ctx->is_in_loop[instruction->operands[i]->block->id]) return false;
+    }
+    return true;
+}
+
+static bool hoist_from_loop(LICMContext *ctx, IRBlock *header) {
+    mark_loop_body(ctx, header);
+
+    IRBlock *preheader = find_preheader(ctx, header);
+    if(!preheader) return false;
+
+    bool has_call = loop_has_call(ctx);
+    bool is_hoisted = false;
+
+    // In reverse postorder a value's definition is reached before its uses
+    // outside phis, so an invariant's operands have already been hoisted
+    for(int i = 0; i < ctx->num_reachable; ++i) {
+        IRBlock *block = ctx->order[i];
+        if(!ctx->is_in_loop[block->id]) continue;
+
+        int j = 0;
+        while(j < block->num_instructions) {
+            IRInstruction *instruction = block->instructions[j];
+
+            if(is_invariant(ctx, header, instruction, has_call)) {
+                ir_move_instruction(instruction, preheader, preheader->num_instructions - 1);
+                is_hoisted = true;
+            } else {
+                j++;
+            }
+        }
+    }
+
+    return is_hoisted;
+}
+
+void ir_hoist_loop_invariants(IRFunction *func) {
+    ir_compute_dominators(func);
+
+    LICMContext ctx;
+    ctx.func = func;
+    ctx.order = xcc_malloc(sizeof(IRBlock *) * func->num_blocks);
+    ctx.is_in_loop = xcc_malloc(sizeof(bool) * func->num_blocks);
+    ctx.worklist = xcc_malloc(sizeof(IRBlock *) * func->num_blocks);
+
+    ctx.num_reachable = 0;
+    for(int i = 0; i < func->num_blocks; ++i) {
+        if(is_reachable(func->blocks[i])) ctx.num_reachable++;
+    }
+    for(int i = 0; i < func->num_blocks; ++i) {
+        IRBlock *block = func->blocks[i];
+        if(is_reachable(block)) ctx.order[block->reverse_postorder] = block;
+    }
+
+    // Moving a value out of an inner loop can leave it invariant in the loop
+    // around that, so carry on until nothing moves. The blocks don't change,
+    // so neither do the dominators.
+    bool is_changed = true;
+    while(is_changed) {
+        is_changed = false;
+
+        for(int i = 0; i < ctx.num_reachable; ++i) {
+            IRBlock *header = ctx.order[i];
+
+            bool is_header = false;
+            for(int j = 0; j < header->num_predecessors; ++j) {
+                if(is_back_edge(header->predecessors[j], header)) is_header = true;
+            }
+
+            if(is_header && hoist_from_loop(&ctx, header)) is_changed = true;
+        }
+    }
+
+    xcc_free(ctx.order);
+    xcc_free(ctx.is_in_loop);
+    xcc_free(ctx.worklist);
+}
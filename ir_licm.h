@@ -0,0 +1,5 @@
+#pragma once
+
+#include "xcc.h"
+
+void ir_hoist_loop_invariants(IRFunction *func);
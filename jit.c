@@ -0,0 +1,180 @@
+// Runs encoded code in memory, without writing an object file or linking
+//
+// Calls between the program's own functions go straight to them. Anything
+// else is looked up with dlsym, in xcc itself (so libc) and any libraries
+// loaded with --load, and is called through a stub which jumps to the
+// absolute address, since it may be too far away for a 32 bit call.
+#include <dlfcn.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "xcc.h"
+
+// jmp *0(%rip), followed by the 8 byte address, padded to 16 bytes
+#define STUB_SIZE 16
+
+typedef struct {
+    const char *name;
+    bool is_external;
+    size_t offset; // of the function, or of its stub if external
+    void *address; // for externals
+} JitSymbol;
+
+typedef struct {
+    JitSymbol *symbols;
+    size_t num_symbols;
+    size_t num_symbols_allocated;
+
+    SymbolTable symbol_indices;
+    size_t num_stubs;
+} JitSymbolTable;
+
+bool jit_load_library(const char *filename) {
+    // Loaded globally, so its symbols are found by the dlsym in jit_run.
+    // It's never closed, since the program may have stashed pointers into it.
+    if (!dlopen(filename, RTLD_NOW | RTLD_GLOBAL)) {
+        fprintf(stderr, "Couldn't load `%s`: %s\n", filename, dlerror());
+        return false;
+    }
+    return true;
+}
+
+static JitSymbol *find_symbol(JitSymbolTable *table, const char *name) {
+    // NULL if there isn't one with that name
+    int index = symbol_table_find(&table->symbol_indices, name);
+    return index >= 0 ? &table->symbols[index] : NULL;
+}
+
+static JitSymbol *add_symbol(JitSymbolTable *table, const char *name) {
+    // The pointer is only good until the next symbol is added
+    JitSymbol *symbol;
+    LIST_STRUCT_APPEND_FUNC(JitSymbol, table, num_symbols, num_symbols_allocated, symbols, symbol);
+    memset(symbol, 0, sizeof(JitSymbol));
+    symbol->name = name;
+
+    symbol_table_add(&table->symbol_indices, name, table->num_symbols - 1);
+    return symbol;
+}
+
+static void free_symbol_table(JitSymbolTable *table) {
+    xcc_free(table->symbols);
+    symbol_table_free(&table->symbol_indices);
+}
+
+static bool build_symbol_table(JitSymbolTable *table, CodeBuffer *code, size_t stubs_offset) {
+    memset(table, 0, sizeof(JitSymbolTable));
+    symbol_table_init(&table->symbol_indices);
+
+    for (size_t i = 0; i < code->num_functions; ++i) {
+        xcc_assert_msg(!find_symbol(table, code->functions[i].name), "function defined twice");
+
+        JitSymbol *symbol = add_symbol(table, code->functions[i].name);
+        symbol->is_external = false;
+        symbol->offset = code->functions[i].offset;
+    }
+
+    for (size_t i = 0; i < code->num_relocations; ++i) {
+        const char *name = code->relocations[i].symbol;
+        if (find_symbol(table, name)) continue;
+
+        void *address = dlsym(RTLD_DEFAULT, name);
+        if (!address) {
+            fprintf(stderr, "Undefined reference to `%s`\n", name);
+            return false;
+        }
+
+        JitSymbol *symbol = add_symbol(table, name);
+        symbol->is_external = true;
+        symbol->offset = stubs_offset + STUB_SIZE * table->num_stubs++;
+        symbol->address = address;
+    }
+
+    return true;
+}
+
+static void write_stubs(JitSymbolTable *table, unsigned char *memory) {
+    for (size_t i = 0; i < table->num_symbols; ++i) {
+        JitSymbol *symbol = &table->symbols[i];
+        if (!symbol->is_external) continue;
+
+        unsigned char *stub = memory + symbol->offset;
+        const unsigned char jump[] = { 0xff, 0x25, 0x00, 0x00, 0x00, 0x00 };
+        memcpy(stub, jump, sizeof(jump));
+
+        uint64_t address = (uintptr_t) symbol->address;
+        memcpy(stub + sizeof(jump), &address, sizeof(address));
+        memset(stub + sizeof(jump) + sizeof(address), 0xcc, STUB_SIZE - sizeof(jump) - sizeof(address));
+    }
+}
+
+static void write_perf_map(CodeBuffer *code, unsigned char *memory) {
+    // Lets perf name the functions, which it otherwise only sees as
+    // anonymous executable memory
+    char filename[64];
+    snprintf(filename, sizeof(filename), "/tmp/perf-%d.map", (int) getpid());
+
+    FILE *perf_map = fopen(filename, "w");
+    if (!perf_map) return; // profiling is best effort
+
+    for (size_t i = 0; i < code->num_functions; ++i) {
+        X64FunctionSymbol *function = &code->functions[i];
+        fprintf(
+            perf_map, "%lx %lx %s\n",
+            (unsigned long) (uintptr_t) (memory + function->offset),
+            (unsigned long) function->size, function->name
+        );
+    }
+
+    fclose(perf_map);
+}
+
+bool jit_run(CodeBuffer *code, bool emit_perf_map, int *exit_code) {
+    // Returns false if the program couldn't be started, otherwise sets
+    // exit_code to what main returned
+    size_t stubs_offset = (code->num_bytes + STUB_SIZE - 1) & ~(size_t) (STUB_SIZE - 1);
+
+    JitSymbolTable table;
+    if (!build_symbol_table(&table, code, stubs_offset)) {
+        free_symbol_table(&table);
+        return false;
+    }
+
+    JitSymbol *main_symbol = find_symbol(&table, "main");
+    if (!main_symbol || main_symbol->is_external) {
+        fprintf(stderr, "No main function to run\n");
+        free_symbol_table(&table);
+        return false;
+    }
+
+    size_t memory_size = stubs_offset + STUB_SIZE * table.num_stubs;
+    unsigned char *memory = mmap(
+        NULL, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+    );
+    xcc_assert_msg(memory != MAP_FAILED, "mmap() failed for the jit");
+
+    memcpy(memory, code->bytes, code->num_bytes);
+    memset(memory + code->num_bytes, 0xcc, stubs_offset - code->num_bytes);
+    write_stubs(&table, memory);
+
+    for (size_t i = 0; i < code->num_relocations; ++i) {
+        X64Relocation *relocation = &code->relocations[i];
+        JitSymbol *symbol = find_symbol(&table, relocation->symbol);
+        xcc_assert(symbol);
+
+        // relative to the end of the call instruction
+        int32_t displacement = (long long) symbol->offset - (long long) (relocation->offset + 4);
+        memcpy(memory + relocation->offset, &displacement, sizeof(displacement));
+    }
+
+    // never writable and executable at the same time
+    xcc_assert_msg(!mprotect(memory, memory_size, PROT_READ | PROT_EXEC), "mprotect() failed for the jit");
+
+    if (emit_perf_map) write_perf_map(code, memory);
+
+    int (*main_function)(void) = (int (*)(void)) (memory + main_symbol->offset);
+    free_symbol_table(&table);
+
+    *exit_code = main_function();
+
+    munmap(memory, memory_size);
+    return true;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "xcc.h"
+
+bool jit_load_library(const char *filename);
+bool jit_run(CodeBuffer *code, bool emit_perf_map, int *exit_code);
@@ -1,6 +1,9 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "xcc.h"
 
 static void lex_a_token(Lexer *lexer);
+static bool read_more_source(Lexer *lexer);
 static void retract_token(Lexer *lexer);
 // static void retract_tokens(Lexer *lexer, int old_num);
 
@@ -37,6 +40,7 @@ const char *lex_token_type_to_string(TokenType type) {
         case TOK_LT_OR_EQ: return "LT_OR_EQ";
         case TOK_GT: return "GT";
         case TOK_GT_OR_EQ: return "GT_OR_EQ";
+        case TOK_COUNT: break;
     }
 
     return "INVALID";
@@ -124,7 +128,7 @@ void lex_print_source_with_token_range(Token *start, Token *end) {
     Token *alt_token = start->alternative_source_token;
 
     if (alt_token) {
-        printf("Expanded from\n");
+        fprintf(stderr, "Expanded from\n");
         lex_print_source_with_token_range(alt_token, alt_token);
     }
 }
@@ -169,6 +173,7 @@ static Token *accept_token(Lexer *lexer, TokenType type, int tok_length) {
     char *new_contents = xcc_malloc(tok_length + 1);
     new_token->contents = new_contents;
     new_token->contents_length = tok_length;
+    new_token->owns_contents = true;
     new_token->source_length = tok_length;
     new_token->source_column_num = lexer->current_col_num;
     new_token->source_line_num = lexer->current_line_num;
@@ -187,7 +192,9 @@ static Token *accept_token(Lexer *lexer, TokenType type, int tok_length) {
 }
 
 static void free_token(Token *token) {
-    xcc_free(token->contents);
+    if (token->owns_contents) {
+        xcc_free(token->contents);
+    }
 }
 
 static void retract_token(Lexer *lexer) {
@@ -208,19 +215,47 @@ void lex_free_lexer(Lexer *lexer) {
     }
     if (lexer->tokens) xcc_free(lexer->tokens);
 
-    while (lexer->macros) {
-        PreprocessorMacro *old_macro = lexer->macros;
-        lexer->macros = lexer->macros->next_macro;
+    for (size_t i = 0; i < lexer->num_macro_buckets; ++i) {
+        while (lexer->macro_buckets[i]) {
+            PreprocessorMacro *old_macro = lexer->macro_buckets[i];
+            lexer->macro_buckets[i] = old_macro->next_macro;
 
-        for (int i = 0; i < old_macro->number_tokens; ++i) {
-            free_token(&old_macro->contents[i]);
+            for (int j = 0; j < old_macro->number_tokens; ++j) {
+                free_token(&old_macro->contents[j]);
+            }
+            xcc_free(old_macro->contents);
+            if (old_macro->param_indices) xcc_free(old_macro->param_indices);
+            xcc_free(old_macro->name);
+            xcc_free(old_macro);
         }
-        xcc_free(old_macro->contents);
-        xcc_free(old_macro->name);
-        xcc_free(old_macro);
     }
+    if (lexer->macro_buckets) xcc_free(lexer->macro_buckets);
 
-    xcc_free(lexer->source);
+    // only left over when an error stopped a macro expansion
+    for (size_t i = 0; i < lexer->num_macro_args; ++i) {
+        free_token(&lexer->macro_args[i]);
+    }
+    if (lexer->macro_args) xcc_free(lexer->macro_args);
+    if (lexer->macro_arg_starts) xcc_free(lexer->macro_arg_starts);
+
+    while (lexer->included_files) {
+        IncludedFile *old_file = lexer->included_files;
+        lexer->included_files = old_file->next_file;
+
+        xcc_free(old_file->path);
+        free((void *) old_file->real_path); // allocated by realpath()
+        xcc_free(old_file->source);
+        if (old_file->include_guard) xcc_free(old_file->include_guard);
+        xcc_free(old_file);
+    }
+
+    if (lexer->conditionals) xcc_free(lexer->conditionals);
+
+    if (lexer->source_mapping_size) {
+        munmap((void *) lexer->source, lexer->source_mapping_size);
+    } else {
+        xcc_free(lexer->source);
+    }
     xcc_free(lexer->source_filename);
 
     xcc_free(lexer);
@@ -335,6 +370,108 @@ static void lexing_error(Lexer *lexer, const char *msg) {
     }
 }
 
+PreprocessorMacro *lex_find_macro(Lexer *lexer, const char *name, size_t name_length) {
+    if (lexer->num_macros == 0) return NULL;
+
+    unsigned int hash = symbol_table_hash(name, name_length);
+    PreprocessorMacro *macro = lexer->macro_buckets[hash & (lexer->num_macro_buckets - 1)];
+
+    for (; macro; macro = macro->next_macro) {
+        if (
+            macro->hash == hash && macro->name_length == name_length &&
+            !memcmp(macro->name, name, name_length)
+        ) {
+            return macro;
+        }
+    }
+
+    return NULL;
+}
+
+static void grow_macro_table(Lexer *lexer) {
+    size_t new_num_buckets = lexer->num_macro_buckets ? lexer->num_macro_buckets * 2 : 64;
+    PreprocessorMacro **new_buckets = xcc_malloc(sizeof(PreprocessorMacro *) * new_num_buckets);
+    memset(new_buckets, 0, sizeof(PreprocessorMacro *) * new_num_buckets);
+
+    // Walking each chain from the front and pushing onto the new one reverses
+    // it, so collect it first to keep newer definitions ahead of older ones
+    for (size_t i = 0; i < lexer->num_macro_buckets; ++i) {
+        PreprocessorMacro *reversed = NULL;
+        PreprocessorMacro *macro = lexer->macro_buckets[i];
+        while (macro) {
+            PreprocessorMacro *next_macro = macro->next_macro;
+            macro->next_macro = reversed;
+            reversed = macro;
+            macro = next_macro;
+        }
+
+        while (reversed) {
+            PreprocessorMacro *next_macro = reversed->next_macro;
+            PreprocessorMacro **bucket = &new_buckets[reversed->hash & (new_num_buckets - 1)];
+            reversed->next_macro = *bucket;
+            *bucket = reversed;
+            reversed = next_macro;
+        }
+    }
+
+    if (lexer->macro_buckets) xcc_free(lexer->macro_buckets);
+    lexer->macro_buckets = new_buckets;
+    lexer->num_macro_buckets = new_num_buckets;
+}
+
+static void insert_macro(Lexer *lexer, PreprocessorMacro *macro) {
+    // Redefinitions go in front of the old definition, shadowing it
+    if ((lexer->num_macros + 1) * 4 > lexer->num_macro_buckets * 3) {
+        grow_macro_table(lexer);
+    }
+
+    PreprocessorMacro **bucket = &lexer->macro_buckets[macro->hash & (lexer->num_macro_buckets - 1)];
+    macro->next_macro = *bucket;
+    *bucket = macro;
+    lexer->num_macros++;
+}
+
+void lex_add_macro(Lexer *lexer, PreprocessorMacro *macro) {
+    // For macros that didn't come from a #define, takes ownership
+    macro->name_length = strlen(macro->name);
+    macro->hash = symbol_table_hash(macro->name, macro->name_length);
+    insert_macro(lexer, macro);
+
+    if (macro->is_function_like) {
+        lexer->num_function_like_macros++;
+    }
+}
+
+static void lex_macro_params(Lexer *lexer) {
+    // Lexes the `(a, b)` after a function-like macro's name, leaving the
+    // parameter names at the end of the token list
+    advance_one_char(lexer);
+    try_lex_comments_and_whitespace(lexer, false);
+
+    if (lexer->source[lexer->index] == ')') {
+        advance_one_char(lexer);
+        return;
+    }
+
+    while (true) {
+        try_lex_comments_and_whitespace(lexer, false);
+        if (!try_lex_an_identifier(lexer)) {
+            lexing_error(lexer, "expected parameter name in macro definition");
+        }
+        try_lex_comments_and_whitespace(lexer, false);
+
+        char c = lexer->source[lexer->index];
+        if (c == ')') {
+            advance_one_char(lexer);
+            return;
+        }
+        if (c != ',') {
+            lexing_error(lexer, "expected , or ) after macro parameter");
+        }
+        advance_one_char(lexer);
+    }
+}
+
 static void handle_define_preprocessor(Lexer *lexer) {
     Token *macro_name_token = try_lex_an_identifier(lexer);
 
@@ -342,44 +479,578 @@ static void handle_define_preprocessor(Lexer *lexer) {
         lexing_error(lexer, "expected macro after #define");
     }
 
-    char *macro_name_buffer = xcc_malloc(strlen(macro_name_token->contents + 1));
+    size_t macro_name_length = macro_name_token->contents_length;
+    char *macro_name_buffer = xcc_malloc(macro_name_length + 1);
     strcpy(macro_name_buffer, macro_name_token->contents);
 
     retract_token(lexer);
 
+    // Only a `(` straight after the name makes it function-like
+    bool is_function_like = lexer->source[lexer->index] == '(';
+    int params_start = lexer->num_tokens;
+    if (is_function_like) {
+        lex_macro_params(lexer);
+    }
+    int number_params = lexer->num_tokens - params_start;
+
     try_lex_comments_and_whitespace(lexer, false);
 
+    lexer->defining_params_start = params_start;
+    lexer->num_defining_params = number_params;
+
     int old_num_tokens = lexer->num_tokens;
 
-    while (lexer->source[lexer->index] != '\n' && lexer->source[lexer->index] != '\0') {
+    while (true) {
+        int line_num = lexer->current_line_num;
+        try_lex_comments_and_whitespace(lexer, false);
+        if (lexer->current_line_num != line_num) {
+            break; // a comment swallowed the newline
+        }
+
+        char c = lexer->source[lexer->index];
+        if (c == '\n') {
+            advance_one_char(lexer);
+            break;
+        }
+        if (c == '\0') break;
+
         lex_a_token(lexer);
     }
-    advance_one_char(lexer);
+
+    lexer->num_defining_params = 0;
 
     int total_tokens = lexer->num_tokens - old_num_tokens;
     Token *token_buffer = xcc_malloc(sizeof(Token) * total_tokens);
-    memcpy(token_buffer, &lexer->tokens[old_num_tokens], total_tokens * sizeof(Token));
+    if (total_tokens) {
+        memcpy(token_buffer, &lexer->tokens[old_num_tokens], total_tokens * sizeof(Token));
+    }
+
+    int *param_indices = NULL;
+    if (is_function_like && total_tokens) {
+        param_indices = xcc_malloc(sizeof(int) * total_tokens);
+
+        for (int i = 0; i < total_tokens; ++i) {
+            param_indices[i] = -1;
+            if (token_buffer[i].type != TOK_IDENTIFIER) continue;
+
+            for (int j = 0; j < number_params; ++j) {
+                if (!strcmp(token_buffer[i].contents, lexer->tokens[params_start + j].contents)) {
+                    param_indices[i] = j;
+                    break;
+                }
+            }
+        }
+    }
 
     PreprocessorMacro *new_macro = xcc_malloc(sizeof(PreprocessorMacro));
     new_macro->name = macro_name_buffer;
+    new_macro->name_length = macro_name_length;
+    new_macro->hash = symbol_table_hash(macro_name_buffer, macro_name_length);
     new_macro->contents = token_buffer;
     new_macro->number_tokens = total_tokens;
-    new_macro->next_macro = lexer->macros;
-    lexer->macros = new_macro;
+    new_macro->is_function_like = is_function_like;
+    new_macro->number_params = number_params;
+    new_macro->param_indices = param_indices;
+    insert_macro(lexer, new_macro);
+
+    if (is_function_like) {
+        lexer->num_function_like_macros++;
+    }
 
-    // retract_tokens(lexer, old_num_tokens);
-    // Don't retract_tokens because we jusy copy
-    // the contents pointers, so that'll get freed
-    // later
+    // The body tokens now belong to the macro, so they're dropped without
+    // freeing their contents, unlike the parameter names
     lexer->num_tokens = old_num_tokens;
+    while (lexer->num_tokens > params_start) {
+        retract_token(lexer);
+    }
+}
+
+static void finish_preprocessor_line(Lexer *lexer) {
+    // Skips to the start of the next line, which should only have
+    // whitespace and comments left on it.
+    int old_line_num = lexer->current_line_num;
+    try_lex_comments_and_whitespace(lexer, false);
+
+    if (lexer->current_line_num != old_line_num) {
+        return; // a comment swallowed the newline
+    }
+
+    char c = lexer->source[lexer->index];
+    if (c == '\n') {
+        advance_one_char(lexer);
+    } else if (c != '\0') {
+        lexing_error(lexer, "unexpected text after preprocessor directive");
+    }
+}
+
+static void skip_rest_of_line(Lexer *lexer) {
+    while (lexer->source[lexer->index] != '\n' && lexer->source[lexer->index] != '\0') {
+        advance_one_char(lexer);
+    }
+    if (lexer->source[lexer->index] == '\n') {
+        advance_one_char(lexer);
+    }
+}
+
+static const char *skip_blank_text(const char *c) {
+    // Skips whitespace and comments without a lexer, for looking ahead
+    while (true) {
+        if (is_char_whitespace(*c)) {
+            ++c;
+        } else if (c[0] == '/' && c[1] == '/') {
+            while (*c != '\n' && *c != '\0') ++c;
+        } else {
+            return c;
+        }
+    }
+}
+
+static const char *find_directive_name(const char *line, size_t *name_length) {
+    // Returns the name of the directive on the line, or NULL if there isn't one
+    const char *c = line;
+    while (*c == ' ' || *c == '\t' || *c == '\r') ++c;
+    if (*c != '#') return NULL;
+    ++c;
+    while (*c == ' ' || *c == '\t') ++c;
+
+    const char *name = c;
+    while (char_can_be_in_ident(*c, c - name)) ++c;
+    *name_length = c - name;
+
+    return name;
+}
+
+static bool directive_name_is(const char *name, size_t name_length, const char *match) {
+    return name_length == strlen(match) && !memcmp(name, match, name_length);
+}
+
+static const char *find_end_of_conditional_branch(const char *line, const char *end, int *num_lines, int *depth) {
+    // Returns the start of the line with the #elif, #else or #endif that ends
+    // the branch `line` is in, or `end` if there isn't one. Only lines that
+    // start with `#` are looked at, everything else is skipped with memchr.
+    // The nesting depth is kept in *depth so that the scan can be resumed
+    // from `end` once more source has been read.
+    while (line < end) {
+        size_t name_length;
+        const char *name = find_directive_name(line, &name_length);
+
+        if (name) {
+            if (
+                directive_name_is(name, name_length, "if") ||
+                directive_name_is(name, name_length, "ifdef") ||
+                directive_name_is(name, name_length, "ifndef")
+            ) {
+                ++*depth;
+            } else if (directive_name_is(name, name_length, "endif")) {
+                if (*depth == 0) return line;
+                --*depth;
+            } else if (
+                *depth == 0 && (
+                    directive_name_is(name, name_length, "else") ||
+                    directive_name_is(name, name_length, "elif")
+                )
+            ) {
+                return line;
+            }
+        }
+
+        const char *newline = memchr(line, '\n', end - line);
+        if (!newline) break;
+        line = newline + 1;
+        ++*num_lines;
+    }
+
+    return end;
+}
+
+static char *find_include_guard(const char *source) {
+    // Recognises a file wrapped in `#ifndef NAME ... #endif` with only
+    // whitespace and comments outside of it, and returns NAME
+    const char *end = source + strlen(source);
+
+    size_t name_length;
+    const char *name = find_directive_name(skip_blank_text(source), &name_length);
+    if (!name || !directive_name_is(name, name_length, "ifndef")) return NULL;
+
+    const char *c = name + name_length;
+    while (*c == ' ' || *c == '\t') ++c;
+    const char *guard = c;
+    while (char_can_be_in_ident(*c, c - guard)) ++c;
+    size_t guard_length = c - guard;
+    if (guard_length == 0) return NULL;
+
+    const char *newline = memchr(c, '\n', end - c);
+    if (!newline) return NULL;
+
+    int num_lines = 0;
+    int depth = 0;
+    const char *line = find_end_of_conditional_branch(newline + 1, end, &num_lines, &depth);
+    if (line == end) return NULL;
+
+    name = find_directive_name(line, &name_length);
+    if (!directive_name_is(name, name_length, "endif")) return NULL;
+    if (*skip_blank_text(name + name_length) != '\0') return NULL;
+
+    char *guard_buf = xcc_malloc(guard_length + 1);
+    memcpy(guard_buf, guard, guard_length);
+    guard_buf[guard_length] = '\0';
+
+    return guard_buf;
+}
+
+static void check_conditionals_closed(Lexer *lexer) {
+    // Conditionals can't span the end of a file
+    if (lexer->num_conditionals > lexer->num_outer_conditionals) {
+        PreprocessorConditional *conditional = &lexer->conditionals[lexer->num_conditionals - 1];
+        prog_error("unterminated conditional directive", &conditional->directive_token);
+    }
+}
+
+#define MAX_INCLUDE_DEPTH 200
+
+static IncludedFile *find_or_read_included_file(Lexer *lexer, const char *path) {
+    char *real_path = realpath(path, NULL);
+    if (!real_path) {
+        lexing_error(lexer, "couldn't find included file");
+    }
+
+    for (IncludedFile *file = lexer->included_files; file; file = file->next_file) {
+        if (!strcmp(file->real_path, real_path)) {
+            free(real_path);
+            return file;
+        }
+    }
+
+    FILE *stream = fopen(real_path, "r");
+    if (!stream) {
+        lexing_error(lexer, "couldn't open included file");
+    }
+    const char *source = lex_read_file(stream);
+    fclose(stream);
+
+    IncludedFile *file = xcc_malloc(sizeof(IncludedFile));
+    char *path_buf = xcc_malloc(strlen(path) + 1);
+    strcpy(path_buf, path);
+    file->path = path_buf;
+    file->real_path = real_path;
+    file->source = source;
+    file->is_pragma_once = false;
+    file->has_been_included = false;
+    file->include_guard = find_include_guard(source);
+
+    file->next_file = lexer->included_files;
+    lexer->included_files = file;
+
+    return file;
+}
+
+static void lex_included_file(Lexer *lexer, IncludedFile *file) {
+    // Lexes the whole file in place of the directive, appending to the same
+    // token list and using the same macros
+    Lexer saved_state;
+    memcpy(&saved_state, lexer, sizeof(Lexer));
+
+    lexer->source = file->source;
+    lexer->source_length = strlen(file->source);
+    lexer->index = 0;
+    lexer->current_line_num = 1;
+    lexer->current_col_num = 1;
+    lexer->seen_nonwhitespace_on_line = false;
+    lexer->current_start_of_line_char = file->source;
+    lexer->source_filename = file->path;
+    lexer->current_file = file;
+    lexer->include_depth++;
+    lexer->num_outer_conditionals = lexer->num_conditionals;
+
+    file->has_been_included = true;
+
+    while (lexer->index != lexer->source_length) {
+        lex_a_token(lexer);
+    }
+    check_conditionals_closed(lexer);
+
+    lexer->source = saved_state.source;
+    lexer->source_length = saved_state.source_length;
+    lexer->index = saved_state.index;
+    lexer->current_line_num = saved_state.current_line_num;
+    lexer->current_col_num = saved_state.current_col_num;
+    lexer->seen_nonwhitespace_on_line = saved_state.seen_nonwhitespace_on_line;
+    lexer->current_start_of_line_char = saved_state.current_start_of_line_char;
+    lexer->source_filename = saved_state.source_filename;
+    lexer->current_file = saved_state.current_file;
+    lexer->include_depth--;
+    lexer->num_outer_conditionals = saved_state.num_outer_conditionals;
+}
+
+static void handle_include_preprocessor(Lexer *lexer) {
+    if (lexer->source[lexer->index] == '<') {
+        lexing_error(lexer, "system headers aren't supported, use #include \"...\"");
+    }
+    if (lexer->source[lexer->index] != '"') {
+        lexing_error(lexer, "expected \"filename\" after #include");
+    }
+    advance_one_char(lexer);
+
+    int name_start = lexer->index;
+    while (lexer->source[lexer->index] != '"') {
+        char c = lexer->source[lexer->index];
+        if (c == '\n' || c == '\0') {
+            lexing_error(lexer, "unterminated filename after #include");
+        }
+        advance_one_char(lexer);
+    }
+    int name_length = lexer->index - name_start;
+    advance_one_char(lexer);
+
+    if (lexer->include_depth >= MAX_INCLUDE_DEPTH) {
+        lexing_error(lexer, "#include nested too deeply");
+    }
+
+    // Quoted includes are relative to the directory of the including file
+    const char *includer = lexer->source_filename;
+    const char *last_slash = strrchr(includer, '/');
+    int dir_length = (last_slash && lexer->source[name_start] != '/') ? last_slash - includer + 1 : 0;
+
+    char *path = xcc_malloc(dir_length + name_length + 1);
+    memcpy(path, includer, dir_length);
+    memcpy(path + dir_length, &lexer->source[name_start], name_length);
+    path[dir_length + name_length] = '\0';
+
+    IncludedFile *file = find_or_read_included_file(lexer, path);
+    xcc_free(path);
+
+    finish_preprocessor_line(lexer);
+
+    if (file->is_pragma_once && file->has_been_included) {
+        return;
+    }
+    if (file->include_guard && lex_find_macro(lexer, file->include_guard, strlen(file->include_guard))) {
+        return; // every line would be skipped anyway
+    }
+
+    lex_included_file(lexer, file);
+}
+
+static void handle_pragma_preprocessor(Lexer *lexer) {
+    Token *pragma_token = try_lex_an_identifier(lexer);
+
+    if (pragma_token && !strcmp(pragma_token->contents, "once")) {
+        retract_token(lexer);
+
+        if (lexer->current_file) {
+            lexer->current_file->is_pragma_once = true;
+        }
+        finish_preprocessor_line(lexer);
+        return;
+    }
+
+    if (pragma_token) {
+        retract_token(lexer);
+    }
+
+    // unknown pragmas are ignored
+    skip_rest_of_line(lexer);
+}
+
+static Token make_directive_token(Lexer *lexer) {
+    // Points at the `#` of the directive, for errors about the directive
+    // as a whole. It isn't added to the token list.
+    Token token;
+    token.type = TOK_UNKNOWN;
+    token.contents = "#";
+    token.contents_length = 1;
+    token.owns_contents = false;
+    token.source_length = 1;
+    token.source_line_num = lexer->current_line_num;
+    token.source_column_num = lexer->current_col_num;
+    token.start_of_line = lexer->current_start_of_line_char;
+    token.source_filename = lexer->source_filename;
+    token.alternative_source_token = NULL;
+
+    return token;
+}
+
+static void skip_conditional_branch(Lexer *lexer) {
+    // Moves to the start of the line that ends the current branch, without
+    // lexing anything in between
+    int num_lines = 0;
+    int depth = 0;
+    const char *line = &lexer->source[lexer->index];
+
+    while (true) {
+        const char *end = &lexer->source[lexer->source_length];
+        line = find_end_of_conditional_branch(line, end, &num_lines, &depth);
+        if (line != end) break;
+
+        if (!read_more_source(lexer)) {
+            PreprocessorConditional *conditional = &lexer->conditionals[lexer->num_conditionals - 1];
+            prog_error("unterminated conditional directive", &conditional->directive_token);
+        }
+    }
+
+    lexer->index = line - lexer->source;
+    lexer->current_line_num += num_lines;
+    lexer->current_col_num = 1;
+    lexer->current_start_of_line_char = line;
+    lexer->seen_nonwhitespace_on_line = false;
+}
+
+static bool lex_macro_is_defined(Lexer *lexer, const char *msg) {
+    Token *name_token = try_lex_an_identifier(lexer);
+    if (!name_token) {
+        lexing_error(lexer, msg);
+    }
+
+    bool is_defined = lex_find_macro(lexer, name_token->contents, name_token->contents_length) != NULL;
+    retract_token(lexer);
+
+    return is_defined;
+}
+
+static bool evaluate_preprocessor_condition(Lexer *lexer) {
+    // Only simple conditions are supported: an integer, a macro defined as a
+    // single integer, or `defined NAME`, each optionally negated with `!`.
+    // Undefined identifiers are 0.
+    try_lex_comments_and_whitespace(lexer, false);
+
+    if (lexer->source[lexer->index] == '!') {
+        advance_one_char(lexer);
+        return !evaluate_preprocessor_condition(lexer);
+    }
+
+    Token *token;
+    if ((token = try_lex_an_integer(lexer))) {
+        bool value = strtoll(token->contents, NULL, 10) != 0;
+        retract_token(lexer);
+        return value;
+    }
+
+    if (!(token = try_lex_an_identifier(lexer))) {
+        lexing_error(lexer, "unsupported condition in #if");
+    }
+
+    if (!strcmp(token->contents, "defined")) {
+        retract_token(lexer);
+        try_lex_comments_and_whitespace(lexer, false);
+
+        bool has_paren = lexer->source[lexer->index] == '(';
+        if (has_paren) {
+            advance_one_char(lexer);
+            try_lex_comments_and_whitespace(lexer, false);
+        }
+
+        bool is_defined = lex_macro_is_defined(lexer, "expected macro after defined");
+
+        if (has_paren) {
+            try_lex_comments_and_whitespace(lexer, false);
+            if (lexer->source[lexer->index] != ')') {
+                lexing_error(lexer, "expected ) after defined(");
+            }
+            advance_one_char(lexer);
+        }
+
+        return is_defined;
+    }
+
+    PreprocessorMacro *macro = lex_find_macro(lexer, token->contents, token->contents_length);
+    if (!macro) {
+        retract_token(lexer);
+        return false;
+    }
+
+    if (macro->is_function_like || macro->number_tokens != 1 || macro->contents[0].type != TOK_INT_LITERAL) {
+        prog_error("macro in #if must be defined as a single integer", token);
+    }
+
+    bool value = strtoll(macro->contents[0].contents, NULL, 10) != 0;
+    retract_token(lexer);
+    return value;
+}
+
+static void begin_conditional(Lexer *lexer, Token *directive_token, bool condition) {
+    PreprocessorConditional *conditional;
+    LIST_STRUCT_APPEND_FUNC(
+        PreprocessorConditional, lexer, num_conditionals,
+        num_conditionals_allocated, conditionals, conditional
+    );
+    conditional->has_taken_branch = condition;
+    conditional->has_seen_else = false;
+    conditional->directive_token = *directive_token;
+
+    finish_preprocessor_line(lexer);
+
+    if (!condition) {
+        skip_conditional_branch(lexer);
+    }
+}
+
+static PreprocessorConditional *current_conditional(Lexer *lexer, Token *directive_token, const char *msg) {
+    if (lexer->num_conditionals == lexer->num_outer_conditionals) {
+        prog_error(msg, directive_token);
+    }
+
+    return &lexer->conditionals[lexer->num_conditionals - 1];
+}
+
+static void handle_elif_preprocessor(Lexer *lexer, Token *directive_token) {
+    PreprocessorConditional *conditional = current_conditional(lexer, directive_token, "#elif without #if");
+    if (conditional->has_seen_else) {
+        prog_error("#elif after #else", directive_token);
+    }
+
+    if (conditional->has_taken_branch) {
+        // the condition isn't even looked at
+        skip_rest_of_line(lexer);
+        skip_conditional_branch(lexer);
+        return;
+    }
+
+    bool condition = evaluate_preprocessor_condition(lexer);
+    finish_preprocessor_line(lexer);
+
+    if (condition) {
+        conditional->has_taken_branch = true;
+    } else {
+        skip_conditional_branch(lexer);
+    }
+}
+
+static void handle_else_preprocessor(Lexer *lexer, Token *directive_token) {
+    PreprocessorConditional *conditional = current_conditional(lexer, directive_token, "#else without #if");
+    if (conditional->has_seen_else) {
+        prog_error("#else after #else", directive_token);
+    }
+    conditional->has_seen_else = true;
+
+    finish_preprocessor_line(lexer);
+
+    if (conditional->has_taken_branch) {
+        skip_conditional_branch(lexer);
+    } else {
+        conditional->has_taken_branch = true;
+    }
+}
+
+static void handle_endif_preprocessor(Lexer *lexer, Token *directive_token) {
+    current_conditional(lexer, directive_token, "#endif without #if");
+    lexer->num_conditionals--;
+
+    finish_preprocessor_line(lexer);
 }
 
 static bool try_lex_a_preprocessor(Lexer *lexer) {
     if (lexer->source[lexer->index] != '#') return false;
+
+    Token directive_token = make_directive_token(lexer);
     advance_one_char(lexer);
 
-    if (lexer->source[lexer->index] == '\n' || lexer->source[lexer->index] == '\0') {
-        // null directive, apparently it's a thing
+    int line_num = lexer->current_line_num;
+    try_lex_comments_and_whitespace(lexer, false);
+
+    if (lexer->current_line_num != line_num || lexer->source[lexer->index] == '\0') {
+        return true; // null directive, apparently it's a thing
+    }
+    if (lexer->source[lexer->index] == '\n') {
         advance_one_char(lexer);
         return true;
     }
@@ -394,6 +1065,34 @@ static bool try_lex_a_preprocessor(Lexer *lexer) {
     if (strcmp(command_token->contents, "define") == 0) {
         retract_token(lexer);
         handle_define_preprocessor(lexer);
+    } else if (strcmp(command_token->contents, "include") == 0) {
+        retract_token(lexer);
+        handle_include_preprocessor(lexer);
+    } else if (strcmp(command_token->contents, "pragma") == 0) {
+        retract_token(lexer);
+        handle_pragma_preprocessor(lexer);
+    } else if (strcmp(command_token->contents, "if") == 0) {
+        retract_token(lexer);
+        begin_conditional(lexer, &directive_token, evaluate_preprocessor_condition(lexer));
+    } else if (strcmp(command_token->contents, "ifdef") == 0) {
+        retract_token(lexer);
+        begin_conditional(
+            lexer, &directive_token, lex_macro_is_defined(lexer, "expected macro after #ifdef")
+        );
+    } else if (strcmp(command_token->contents, "ifndef") == 0) {
+        retract_token(lexer);
+        begin_conditional(
+            lexer, &directive_token, !lex_macro_is_defined(lexer, "expected macro after #ifndef")
+        );
+    } else if (strcmp(command_token->contents, "elif") == 0) {
+        retract_token(lexer);
+        handle_elif_preprocessor(lexer, &directive_token);
+    } else if (strcmp(command_token->contents, "else") == 0) {
+        retract_token(lexer);
+        handle_else_preprocessor(lexer, &directive_token);
+    } else if (strcmp(command_token->contents, "endif") == 0) {
+        retract_token(lexer);
+        handle_endif_preprocessor(lexer, &directive_token);
     } else {
         // TODO: handle more preprocessor commands
         prog_error("unknown preprocessor command", command_token);
@@ -402,40 +1101,178 @@ static bool try_lex_a_preprocessor(Lexer *lexer) {
     return true;
 }
 
-static bool potentially_match_macro(Lexer *lexer, Token *ident_token) {
-    PreprocessorMacro *macro = lexer->macros;
+static bool is_defining_param(Lexer *lexer, Token *ident_token) {
+    for (int i = 0; i < lexer->num_defining_params; ++i) {
+        if (!strcmp(lexer->tokens[lexer->defining_params_start + i].contents, ident_token->contents)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void collect_macro_args(Lexer *lexer, PreprocessorMacro *macro, size_t name_index, size_t arg_starts_base) {
+    // Lexes the arguments into the token list after the macro's name, which
+    // expands any macros in them, then moves them into lexer->macro_args.
+    // Only parens and commas straight from the source delimit arguments.
+    // Macros expanded in the arguments push their own argument starts after
+    // arg_starts_base and pop them again before returning.
+    try_lex_comments_and_whitespace(lexer, true);
+    xcc_assert(lexer->source[lexer->index] == '(');
+    advance_one_char(lexer);
+
+    size_t args_start = lexer->num_tokens;
+    size_t *arg_start;
+    LIST_STRUCT_APPEND_FUNC(
+        size_t, lexer, num_macro_arg_starts,
+        num_macro_arg_starts_allocated, macro_arg_starts, arg_start
+    );
+    *arg_start = 0;
+
+    int depth = 0;
+    while (true) {
+        if (lexer->index >= lexer->source_length && !read_more_source(lexer)) {
+            prog_error("unterminated arguments to macro", &lexer->tokens[name_index]);
+        }
+
+        size_t old_num_tokens = lexer->num_tokens;
+        lex_a_token(lexer);
 
-    while (macro && strcmp(ident_token->contents, macro->name) != 0) {
-        macro = macro->next_macro;
+        if (lexer->num_tokens != old_num_tokens + 1) continue;
+        Token *token = &lexer->tokens[old_num_tokens];
+        if (token->alternative_source_token) continue;
+
+        if (token->type == TOK_OPEN_PAREN) {
+            ++depth;
+        } else if (token->type == TOK_CLOSE_PAREN && depth > 0) {
+            --depth;
+        } else if (token->type == TOK_CLOSE_PAREN) {
+            retract_token(lexer);
+            break;
+        } else if (token->type == TOK_COMMA && depth == 0) {
+            retract_token(lexer);
+            LIST_STRUCT_APPEND_FUNC(
+                size_t, lexer, num_macro_arg_starts,
+                num_macro_arg_starts_allocated, macro_arg_starts, arg_start
+            );
+            *arg_start = lexer->num_tokens - args_start;
+        }
+    }
+
+    size_t num_arg_tokens = lexer->num_tokens - args_start;
+    size_t num_args = lexer->num_macro_arg_starts - arg_starts_base;
+    if (macro->number_params == 0 && num_arg_tokens == 0) {
+        num_args = 0; // `()` passes no arguments rather than one empty one
+    }
+    if (num_args != macro->number_params) {
+        prog_error("wrong number of arguments to macro", &lexer->tokens[name_index]);
+    }
+
+    // the arguments' contents move with them
+    lexer->num_macro_args = 0;
+    for (size_t i = 0; i < num_arg_tokens; ++i) {
+        Token *arg;
+        LIST_STRUCT_APPEND_FUNC(
+            Token, lexer, num_macro_args, num_macro_args_allocated, macro_args, arg
+        );
+        *arg = lexer->tokens[args_start + i];
+    }
+    lexer->num_tokens = args_start;
+}
+
+static void append_macro_arg(Lexer *lexer, size_t arg_starts_base, int param) {
+    size_t start = lexer->macro_arg_starts[arg_starts_base + param];
+    size_t end = lexer->num_macro_args;
+    if (arg_starts_base + param + 1 < lexer->num_macro_arg_starts) {
+        end = lexer->macro_arg_starts[arg_starts_base + param + 1];
     }
 
+    for (size_t i = start; i < end; ++i) {
+        Token *arg = &lexer->macro_args[i];
+        *append_empty_token(lexer) = *arg;
+
+        // the first use takes over the contents and any later ones borrow them
+        arg->owns_contents = false;
+    }
+}
+
+static bool next_char_is_open_paren(Lexer *lexer) {
+    // The arguments can start on a later line, which might not have been
+    // read yet
+    while (true) {
+        const char *c = skip_blank_text(&lexer->source[lexer->index]);
+        if (*c != '\0' || !read_more_source(lexer)) {
+            return *c == '(';
+        }
+    }
+}
+
+static bool potentially_match_macro(Lexer *lexer, Token *ident_token) {
+    PreprocessorMacro *macro = lex_find_macro(lexer, ident_token->contents, ident_token->contents_length);
     if (!macro) return false;
 
-    Token ident_token_copy;
-    memcpy(&ident_token_copy, ident_token, sizeof(Token));
+    if (is_defining_param(lexer, ident_token)) return false;
+
+    if (macro->is_function_like && !next_char_is_open_paren(lexer)) {
+        return false; // without arguments it's a normal identifier
+    }
+
+    size_t name_index = lexer->num_tokens - 1;
+    size_t arg_starts_base = lexer->num_macro_arg_starts;
+    if (macro->is_function_like) {
+        collect_macro_args(lexer, macro, name_index, arg_starts_base);
+    }
 
-    retract_token(lexer); // remove lexed identifier token
+    Token name_token;
+    memcpy(&name_token, &lexer->tokens[name_index], sizeof(Token));
+    retract_token(lexer); // remove lexed identifier token, only its position is used
 
+    // Expansions share the contents of the macro's tokens, which live as
+    // long as the lexer
     for (int i = 0; i < macro->number_tokens; ++i) {
+        if (macro->param_indices && macro->param_indices[i] >= 0) {
+            append_macro_arg(lexer, arg_starts_base, macro->param_indices[i]);
+            continue;
+        }
+
         Token *old_token = &macro->contents[i];
         Token *new_token = append_empty_token(lexer);
 
-        // memcpy(new_token, old_token, sizeof(Token));
-
-        char *new_contents = xcc_malloc(old_token->contents_length + 1);
-        strcpy(new_contents, old_token->contents);
-        new_token->contents = new_contents;
+        new_token->contents = old_token->contents;
         new_token->contents_length = old_token->contents_length;
-        new_token->source_column_num = ident_token->source_column_num;
-        new_token->source_filename = ident_token->source_filename;
-        new_token->source_length = ident_token->source_length;
-        new_token->source_line_num = ident_token->source_line_num;
-        new_token->start_of_line = ident_token->start_of_line;
+        new_token->owns_contents = false;
+        new_token->source_column_num = name_token.source_column_num;
+        new_token->source_filename = name_token.source_filename;
+        new_token->source_length = name_token.source_length;
+        new_token->source_line_num = name_token.source_line_num;
+        new_token->start_of_line = name_token.start_of_line;
         new_token->type = old_token->type;
 
         new_token->alternative_source_token = old_token;
     }
 
+    if (macro->is_function_like) {
+        // unused arguments still own their contents
+        for (size_t i = 0; i < lexer->num_macro_args; ++i) {
+            free_token(&lexer->macro_args[i]);
+        }
+        lexer->num_macro_args = 0;
+        lexer->num_macro_arg_starts = arg_starts_base;
+    }
+
+    // The expansion can end with the name of a function-like macro whose
+    // arguments come after it in the source, like `H(1, 2)` after
+    // `#define H G`. A macro's own name in its expansion isn't expanded again.
+    if (lexer->num_tokens > name_index) {
+        Token *last_token = &lexer->tokens[lexer->num_tokens - 1];
+        PreprocessorMacro *next_macro = last_token->type == TOK_IDENTIFIER
+            ? lex_find_macro(lexer, last_token->contents, last_token->contents_length)
+            : NULL;
+
+        if (next_macro && next_macro != macro && next_macro->is_function_like) {
+            potentially_match_macro(lexer, last_token);
+        }
+    }
+
     return true;
 }
 
@@ -510,14 +1347,120 @@ static void lex_a_token(Lexer *lexer) {
     xcc_assert_not_reached();
 }
 
-static Lexer *lex_source(const char *source, const char *filename) {
-    // Takes ownership of source
+// Sources smaller than this are never worth splitting up
+#define LEX_PARALLEL_MIN_CHUNK_SIZE (256 * 1024)
+
+// so that tests can split small sources
+static int parallel_min_chunk_size = LEX_PARALLEL_MIN_CHUNK_SIZE;
+
+void lex_set_parallel_min_chunk_size(int size) {
+    xcc_assert(size > 0);
+    parallel_min_chunk_size = size;
+}
+
+static void lex_until(Lexer *lexer, int end_index) {
+    while(lexer->index != end_index) {
+        lex_a_token(lexer);
+    }
+}
+
+static int find_end_of_preprocessor_region(Lexer *lexer) {
+    // A `#` anywhere starts a directive, and directives change how everything
+    // after them is lexed, so everything up to the end of the last line with
+    // a `#` on it is lexed sequentially.
+    int last_hash = lexer->source_length - 1;
+    while (last_hash >= 0 && lexer->source[last_hash] != '#') {
+        --last_hash;
+    }
+    if (last_hash < 0) return 0;
+
+    const char *end_of_line = memchr(
+        &lexer->source[last_hash], '\n', lexer->source_length - last_hash
+    );
+    if (!end_of_line) return lexer->source_length;
+
+    return end_of_line - lexer->source + 1;
+}
+
+static void lex_chunk_task(void *data, int index) {
+    Lexer *chunks = data;
+    lex_until(&chunks[index], chunks[index].source_length);
+}
+
+static void lex_remainder_in_parallel(Lexer *lexer, int num_chunks) {
+    // Every chunk starts at the beginning of a line and no token can span a
+    // newline, so each chunk can be lexed on its own into a separate token
+    // vector. By now the macro table is complete, and chunks only read it.
+    Lexer *chunks = xcc_malloc(sizeof(Lexer) * num_chunks);
+
+    int chunk_start = lexer->index;
+    int remaining_length = lexer->source_length - chunk_start;
+    int line_num = lexer->current_line_num;
+
+    for (int i = 0; i < num_chunks; ++i) {
+        int chunk_end = lexer->source_length;
+
+        if (i != num_chunks - 1) {
+            int target_end = lexer->index + (int) ((long long) remaining_length * (i + 1) / num_chunks);
+            if (target_end < chunk_start) target_end = chunk_start;
+
+            const char *newline = memchr(
+                &lexer->source[target_end], '\n', lexer->source_length - target_end
+            );
+            chunk_end = newline ? newline - lexer->source + 1 : lexer->source_length;
+        }
+
+        Lexer *chunk = &chunks[i];
+        memcpy(chunk, lexer, sizeof(Lexer));
+        chunk->num_tokens = 0;
+        chunk->num_tokens_allocated = 0;
+        chunk->tokens = NULL;
+        chunk->index = chunk_start;
+        chunk->source_length = chunk_end;
+        chunk->current_line_num = line_num;
+        chunk->current_col_num = 1;
+        chunk->current_start_of_line_char = &lexer->source[chunk_start];
+        chunk->seen_nonwhitespace_on_line = false;
+
+        for (int j = chunk_start; j < chunk_end; ++j) {
+            if (lexer->source[j] == '\n') ++line_num;
+        }
+        chunk_start = chunk_end;
+    }
+
+    parallel_for(num_chunks, lex_chunk_task, chunks);
+
+    for (int i = 0; i < num_chunks; ++i) {
+        Lexer *chunk = &chunks[i];
+
+        for (size_t j = 0; j < chunk->num_tokens; ++j) {
+            // ownership of the token contents moves to the main lexer
+            *append_empty_token(lexer) = chunk->tokens[j];
+        }
+        xcc_free(chunk->tokens);
+
+        lexer->index = chunk->index;
+        lexer->current_line_num = chunk->current_line_num;
+        lexer->current_col_num = chunk->current_col_num;
+        lexer->current_start_of_line_char = chunk->current_start_of_line_char;
+        lexer->seen_nonwhitespace_on_line = chunk->seen_nonwhitespace_on_line;
+    }
+
+    xcc_free(chunks);
+}
+
+static Lexer *new_lexer(const char *source, int source_length, const char *filename, struct PrecompiledHeader *pch) {
     Lexer *lexer = xcc_malloc(sizeof(Lexer));
 
     lexer->source = source;
-    lexer->source_length = strlen(source);
+    lexer->source_length = source_length;
     lexer->index = 0;
 
+    lexer->input_fd = -1;
+    lexer->source_mapping_size = 0;
+    lexer->source_bytes_read = 0;
+    lexer->held_back_char = '\0';
+
     lexer->current_col_num = 1;
     lexer->current_line_num = 1;
     lexer->seen_nonwhitespace_on_line = false;
@@ -530,31 +1473,148 @@ static Lexer *lex_source(const char *source, const char *filename) {
     lexer->num_tokens = 0;
     lexer->num_tokens_allocated = 0;
     lexer->tokens = NULL;
-    lexer->macros = NULL;
 
-    while(lexer->index != lexer->source_length) {
+    lexer->macro_buckets = NULL;
+    lexer->num_macro_buckets = 0;
+    lexer->num_macros = 0;
+    lexer->num_function_like_macros = 0;
+    lexer->defining_params_start = 0;
+    lexer->num_defining_params = 0;
+
+    lexer->macro_args = NULL;
+    lexer->num_macro_args = 0;
+    lexer->num_macro_args_allocated = 0;
+    lexer->macro_arg_starts = NULL;
+    lexer->num_macro_arg_starts = 0;
+    lexer->num_macro_arg_starts_allocated = 0;
+
+    lexer->included_files = NULL;
+    lexer->current_file = NULL;
+    lexer->include_depth = 0;
+
+    lexer->conditionals = NULL;
+    lexer->num_conditionals = 0;
+    lexer->num_conditionals_allocated = 0;
+    lexer->num_outer_conditionals = 0;
+
+    if (pch) {
+        pch_define_macros(pch, lexer);
+    }
+
+    return lexer;
+}
+
+static Lexer *lex_source(const char *source, const char *filename, struct PrecompiledHeader *pch) {
+    // Takes ownership of source
+    Lexer *lexer = new_lexer(source, strlen(source), filename, pch);
+
+    lex_until(lexer, find_end_of_preprocessor_region(lexer));
+
+    int remaining_length = lexer->source_length - lexer->index;
+    int num_chunks = remaining_length / parallel_min_chunk_size;
+    if (num_chunks > parallel_get_num_threads()) {
+        num_chunks = parallel_get_num_threads();
+    }
+
+    // Arguments to function-like macros can span lines, so a chunk boundary
+    // could split them
+    if (num_chunks >= 2 && lexer->num_function_like_macros == 0) {
+        lex_remainder_in_parallel(lexer, num_chunks);
+    } else {
+        lex_until(lexer, lexer->source_length);
+    }
+    check_conditionals_closed(lexer);
+    accept_token(lexer, TOK_EOF, 0);
+
+    return lexer;
+}
+
+// Address space reserved for a streamed source, which is only backed by
+// memory as it's written to. Tokens point into the source, so it can't be
+// moved to grow it.
+#define STREAMED_SOURCE_RESERVATION ((size_t) 1 << 31)
+#define STREAM_READ_SIZE (64 * 1024)
+
+static bool read_more_source(Lexer *lexer) {
+    // Reads until at least one more complete line of a streamed main source
+    // is available, returning false if there was no more. The line being
+    // read is held back so that no token is split across reads.
+    if (lexer->input_fd < 0 || lexer->current_file) return false;
+
+    char *source = (char *) lexer->source;
+    size_t old_length = lexer->source_length;
+    size_t new_length;
+
+    source[old_length] = lexer->held_back_char;
+
+    while (true) {
+        if (lexer->source_bytes_read + STREAM_READ_SIZE + 1 > lexer->source_mapping_size) {
+            xcc_assert_msg(false, "source file too big");
+        }
+
+        ssize_t num_read = read(lexer->input_fd, &source[lexer->source_bytes_read], STREAM_READ_SIZE);
+        if (num_read < 0 && errno == EINTR) continue;
+        xcc_assert_msg(num_read >= 0, "error reading file");
+
+        if (num_read == 0) {
+            // the rest of the mapping is still zeroed, so it's terminated
+            lexer->input_fd = -1;
+            new_length = lexer->source_bytes_read;
+            break;
+        }
+
+        char *new_data = &source[lexer->source_bytes_read];
+        xcc_assert_msg(!memchr(new_data, '\0', num_read), "null character in file");
+        lexer->source_bytes_read += num_read;
+
+        char *last_newline = new_data + num_read - 1;
+        while (last_newline >= new_data && *last_newline != '\n') {
+            --last_newline;
+        }
+        if (last_newline >= new_data) {
+            new_length = last_newline - source + 1;
+            break;
+        }
+    }
+
+    lexer->source_length = new_length;
+    lexer->held_back_char = source[new_length];
+    source[new_length] = '\0';
+
+    return new_length != old_length;
+}
+
+static Lexer *lex_stream(int fd, const char *filename, struct PrecompiledHeader *pch) {
+    // Lexes lines as they arrive, so lexing overlaps with whatever is
+    // writing the source. Nothing can be lexed in parallel without knowing
+    // where the source ends.
+    char *source = mmap(
+        NULL, STREAMED_SOURCE_RESERVATION, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+    );
+    xcc_assert_msg(source != MAP_FAILED, "couldn't reserve memory for source");
+
+    Lexer *lexer = new_lexer(source, 0, filename, pch);
+    lexer->input_fd = fd;
+    lexer->source_mapping_size = STREAMED_SOURCE_RESERVATION;
+
+    while (lexer->index != lexer->source_length || read_more_source(lexer)) {
         lex_a_token(lexer);
     }
+    check_conditionals_closed(lexer);
     accept_token(lexer, TOK_EOF, 0);
 
     return lexer;
 }
 
-static const char *read_file(FILE *stream) {
+const char *lex_read_file(FILE *stream) {
     // Caller takes ownership of return value
-    size_t buf_length = 1024;
+    size_t buf_length = 4096;
     size_t source_length = 0;
     char *buf = xcc_malloc(buf_length);
 
-    while(!feof(stream)) {
-        int c = fgetc(stream);
-        if(c == EOF) {
-            xcc_assert_msg(!ferror(stream), "error reading file");
-            break;
-        }
-        xcc_assert_msg(c, "null character in file");
-
-        if(source_length + 1 >= buf_length) {
+    while (true) {
+        if (source_length + 1 >= buf_length) {
             size_t new_buf_length = buf_length * 2;
             char *new_buf = xcc_malloc(new_buf_length);
             memcpy(new_buf, buf, source_length);
@@ -564,18 +1624,57 @@ static const char *read_file(FILE *stream) {
             buf = new_buf;
         }
 
-        buf[source_length] = c;
-        ++source_length;
+        size_t num_read = fread(&buf[source_length], 1, buf_length - source_length - 1, stream);
+        source_length += num_read;
+
+        if (num_read == 0) {
+            xcc_assert_msg(!ferror(stream), "error reading file");
+            break;
+        }
     }
 
+    xcc_assert_msg(!memchr(buf, '\0', source_length), "null character in file");
     xcc_assert(source_length < buf_length);
     buf[source_length] = '\0';
 
     return buf;
 }
 
-Lexer *lex_file(FILE *stream, const char *filename) {
-    const char *source = read_file(stream);
+Lexer *lex_file(FILE *stream, const char *filename, struct PrecompiledHeader *pch) {
+    struct stat stream_stat;
+    if (fstat(fileno(stream), &stream_stat) || S_ISREG(stream_stat.st_mode)) {
+        return lex_source(lex_read_file(stream), filename, pch);
+    }
+
+    return lex_stream(fileno(stream), filename, pch);
+}
+
+Lexer *lex_string(const char *source, const char *filename) {
+    // Lexes a copy of source, for a caller which has to carry on after a
+    // program error. Returns NULL once an error has been reported.
+    size_t source_length = strlen(source);
+    char *source_copy = xcc_malloc(source_length + 1);
+    memcpy(source_copy, source, source_length + 1);
+
+    Lexer *lexer = new_lexer(source_copy, source_length, filename, NULL);
+    const char *source_filename = lexer->source_filename;
+
+    ProgErrorRecovery recovery;
+    prog_error_push_recovery(&recovery);
+    if (!setjmp(recovery.jump_buffer)) {
+        lex_until(lexer, lexer->source_length);
+        check_conditionals_closed(lexer);
+        accept_token(lexer, TOK_EOF, 0);
+    }
+    prog_error_pop_recovery(&recovery);
+
+    if (recovery.has_abandoned) {
+        // an error in an included file leaves the lexer pointing at it
+        lexer->source = source_copy;
+        lexer->source_filename = source_filename;
+        lex_free_lexer(lexer);
+        return NULL;
+    }
 
-    return lex_source(source, filename);
+    return lexer;
 }
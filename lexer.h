@@ -31,7 +31,9 @@ typedef enum {
 
     TOK_PLUS, TOK_MINUS, TOK_STAR, TOK_SLASH, TOK_PERCENT,
 
-    TOK_LT, TOK_LT_OR_EQ, TOK_GT, TOK_GT_OR_EQ
+    TOK_LT, TOK_LT_OR_EQ, TOK_GT, TOK_GT_OR_EQ,
+
+    TOK_COUNT // not a token, just how many types there are
 } TokenType;
 
 typedef struct Token {
@@ -39,6 +41,7 @@ typedef struct Token {
 
     const char *contents;
     size_t contents_length;
+    bool owns_contents; // false when borrowed from a macro definition
 
     int source_line_num;
     int source_column_num;
@@ -52,12 +55,40 @@ typedef struct Token {
 
 typedef struct PreprocessorMacro {
     const char *name;
+    size_t name_length;
+    unsigned int hash;
     Token *contents;
     int number_tokens;
 
-    struct PreprocessorMacro *next_macro;
+    bool is_function_like;
+    int number_params;
+    // For each token in contents, the parameter replacing it or -1. NULL
+    // unless function-like.
+    int *param_indices;
+
+    struct PreprocessorMacro *next_macro; // in the same hash bucket
 } PreprocessorMacro;
 
+typedef struct IncludedFile {
+    const char *path; // as written relative to the includer, for messages
+    const char *real_path;
+    const char *source;
+
+    bool is_pragma_once;
+    bool has_been_included;
+    // Macro named by an #ifndef wrapping the whole file, or NULL. Once it's
+    // defined, including the file again can't produce anything.
+    char *include_guard;
+
+    struct IncludedFile *next_file;
+} IncludedFile;
+
+typedef struct {
+    bool has_taken_branch; // an earlier branch of this #if was lexed
+    bool has_seen_else;
+    Token directive_token; // for errors, contents is a string literal
+} PreprocessorConditional;
+
 typedef struct {
     size_t num_tokens;
     size_t num_tokens_allocated;
@@ -67,13 +98,50 @@ typedef struct {
     int source_length;
     int index;
 
+    // While the main source is still arriving from a pipe, lines are lexed
+    // as they're read. source_length only covers complete lines, and the
+    // character after them is held back to make room for a '\0'.
+    int input_fd; // -1 once everything has been read
+    size_t source_mapping_size; // 0 unless the source is mmapped
+    size_t source_bytes_read;
+    char held_back_char;
+
     int current_line_num;
     int current_col_num;
     bool seen_nonwhitespace_on_line;
     const char *current_start_of_line_char;
     const char *source_filename;
 
-    PreprocessorMacro *macros;
+    // Hash table of macros, chained through next_macro
+    PreprocessorMacro **macro_buckets;
+    size_t num_macro_buckets;
+    size_t num_macros;
+    int num_function_like_macros;
+
+    // Parameters of the function-like macro being defined, which are lexed
+    // into the token list just before its body and aren't expanded in it
+    size_t defining_params_start;
+    int num_defining_params;
+
+    // Reused by every function-like macro expansion, so that they don't
+    // allocate once these have grown big enough
+    Token *macro_args;
+    size_t num_macro_args;
+    size_t num_macro_args_allocated;
+    size_t *macro_arg_starts;
+    size_t num_macro_arg_starts;
+    size_t num_macro_arg_starts_allocated;
+
+    // Every file included so far, each read only once
+    IncludedFile *included_files;
+    IncludedFile *current_file; // NULL for the main source file
+    int include_depth;
+
+    // Open #if blocks, innermost last
+    PreprocessorConditional *conditionals;
+    size_t num_conditionals;
+    size_t num_conditionals_allocated;
+    size_t num_outer_conditionals; // opened by the files including this one
 } Lexer;
 
 const char *lex_token_type_to_string(TokenType type);
@@ -81,4 +149,10 @@ void lex_free_lexer(Lexer *lexer);
 void lex_dump_token(Token *token);
 void lex_print_source_with_token_range(Token *start, Token *end);
 void lex_dump_lexer_state(Lexer *lexer);
-Lexer *lex_file(FILE *stream, const char *filename);
+struct PrecompiledHeader;
+void lex_add_macro(Lexer *lexer, PreprocessorMacro *macro);
+PreprocessorMacro *lex_find_macro(Lexer *lexer, const char *name, size_t name_length);
+Lexer *lex_file(FILE *stream, const char *filename, struct PrecompiledHeader *pch);
+Lexer *lex_string(const char *source, const char *filename);
+const char *lex_read_file(FILE *stream);
+void lex_set_parallel_min_chunk_size(int size);
@@ -0,0 +1,427 @@
+// The instructions of a function, held until every pass has run over them
+//
+// Code generation appends to blocks here rather than printing or encoding
+// straight away, and register allocation, the peephole optimiser and
+// finally output all run over the whole function in turn.
+#include "xcc.h"
+
+X64Operand operand_reg(RegLoc reg, int size) {
+    X64Operand operand;
+    operand.type = OPERAND_REG;
+    operand.size = size;
+    operand.reg = reg;
+    return operand;
+}
+
+X64Operand operand_memory(RegLoc base, int displacement, int size) {
+    X64Operand operand;
+    operand.type = OPERAND_MEMORY;
+    operand.size = size;
+    operand.memory.base = base;
+    operand.memory.base_vreg = -1;
+    operand.memory.displacement = displacement;
+    return operand;
+}
+
+X64Operand operand_vreg_memory(int base_vreg, int displacement, int size) {
+    X64Operand operand = operand_memory(REG_LAST, displacement, size);
+    operand.memory.base_vreg = base_vreg;
+    return operand;
+}
+
+X64Operand operand_immediate(long long value, int size) {
+    X64Operand operand;
+    operand.type = OPERAND_IMMEDIATE;
+    operand.size = size;
+    operand.immediate = value;
+    return operand;
+}
+
+X64Operand operand_label(int label) {
+    X64Operand operand;
+    operand.type = OPERAND_LABEL;
+    operand.size = 0;
+    operand.label = label;
+    return operand;
+}
+
+X64Operand operand_symbol(const char *symbol) {
+    X64Operand operand;
+    operand.type = OPERAND_SYMBOL;
+    operand.size = 0;
+    operand.symbol = symbol;
+    return operand;
+}
+
+X64Operand operand_vreg(int vreg, int size) {
+    X64Operand operand;
+    operand.type = OPERAND_VREG;
+    operand.size = size;
+    operand.vreg = vreg;
+    return operand;
+}
+
+X64Operand operand_none(void) {
+    X64Operand operand;
+    operand.type = OPERAND_NONE;
+    operand.size = 0;
+    return operand;
+}
+
+X64Instruction machine_x64_instruction(X64Opcode opcode, int size, int num_operands,
+                                       X64Operand first, X64Operand second) {
+    // Unused operands should be OPERAND_NONE
+    X64Instruction instruction;
+    instruction.opcode = opcode;
+    instruction.condition = X64_COND_Z;
+    instruction.move_group = -1;
+    instruction.size = size;
+    instruction.num_operands = num_operands;
+    instruction.operands[0] = first;
+    instruction.operands[1] = second;
+    return instruction;
+}
+
+bool machine_x64_same_location(X64Operand *a, X64Operand *b) {
+    // Whether a and b are the same register, virtual register or stack
+    // slot, whatever the sizes they're looked at with
+    if(a->type != b->type) return false;
+
+    if(a->type == OPERAND_REG) {
+        return a->reg == b->reg;
+    } else if(a->type == OPERAND_VREG) {
+        return a->vreg == b->vreg;
+    } else if(a->type == OPERAND_MEMORY) {
+        return a->memory.base == b->memory.base && a->memory.base_vreg == b->memory.base_vreg
+            && a->memory.displacement == b->memory.displacement;
+    }
+    return false;
+}
+
+X64Function *machine_x64_new_function(void) {
+    X64Function *func = xcc_malloc(sizeof(X64Function));
+    memset(func, 0, sizeof(X64Function));
+    return func;
+}
+
+void machine_x64_free_function(X64Function *func) {
+    for(int i = 0; i < func->num_blocks; ++i) {
+        xcc_free(func->blocks[i].instructions);
+    }
+    xcc_free(func->blocks);
+    xcc_free(func);
+}
+
+X64Block *machine_x64_new_block(X64Function *func, int label) {
+    X64Block *block;
+    LIST_STRUCT_APPEND_FUNC(X64Block, func, num_blocks, num_blocks_allocated, blocks, block);
+    memset(block, 0, sizeof(X64Block));
+    block->label = label;
+    return block;
+}
+
+void machine_x64_append(X64Block *block, X64Instruction *instruction) {
+    X64Instruction *new_instruction;
+    LIST_STRUCT_APPEND_FUNC(
+        X64Instruction, block, num_instructions, num_instructions_allocated, instructions,
+        new_instruction
+    );
+    *new_instruction = *instruction;
+}
+
+int machine_x64_new_vreg(X64Function *func) {
+    return func->num_vregs++;
+}
+
+int machine_x64_new_move_group(X64Function *func) {
+    return func->num_move_groups++;
+}
+
+bool machine_x64_is_in_group(X64Instruction *instruction, X64Instruction *previous) {
+    // Whether instruction carries on the parallel move that previous is in
+    return instruction->opcode == X64_PARALLEL_MOV && previous->opcode == X64_PARALLEL_MOV
+        && instruction->move_group == previous->move_group;
+}
+
+static void append_op(X64Block *block, X64Opcode opcode, int size, X64Operand first, X64Operand second) {
+    X64Instruction instruction = machine_x64_instruction(opcode, size, 2, first, second);
+    machine_x64_append(block, &instruction);
+}
+
+static void append_op_1(X64Block *block, X64Opcode opcode, int size, X64Operand operand) {
+    X64Instruction instruction = machine_x64_instruction(opcode, size, 1, operand, operand_none());
+    machine_x64_append(block, &instruction);
+}
+
+static void replace_instructions(X64Block *block, X64Block *replacement) {
+    xcc_free(block->instructions);
+    block->instructions = replacement->instructions;
+    block->num_instructions = replacement->num_instructions;
+    block->num_instructions_allocated = replacement->num_instructions_allocated;
+}
+
+static void append_move(X64Block *block, X64Operand from, X64Operand to, int size) {
+    // Picks the shorter encodings of literal moves to registers, which is
+    // fine since the flags are never live across a parallel move
+    if(from.type == OPERAND_IMMEDIATE && to.type == OPERAND_REG && size >= 4) {
+        int shift = 64 - 8 * size;
+        long long value = (long long) ((unsigned long long) from.immediate << shift) >> shift;
+
+        if(value == 0) {
+            append_op(block, X64_XOR, 4, operand_reg(to.reg, 4), operand_reg(to.reg, 4));
+            return;
+        } else if(value > 0 && value <= 0xffffffffLL) {
+            append_op(block, X64_MOV, 4, operand_immediate(value, 4), operand_reg(to.reg, 4));
+            return;
+        }
+    }
+
+    append_op(block, X64_MOV, size, from, to);
+}
+
+static void sequence_parallel_moves(X64Block *out, X64Instruction *moves, int num_moves) {
+    // A move is only done once nothing else still needs what's in its
+    // destination, and a cycle is broken by moving through RAX, which leaves
+    // R11 for moves between memory
+    X64Operand *from = xcc_malloc(sizeof(X64Operand) * num_moves);
+    bool *is_moved = xcc_malloc(sizeof(bool) * num_moves);
+    int num_moved = 0;
+
+    for(int i = 0; i < num_moves; ++i) {
+        from[i] = moves[i].operands[0];
+        is_moved[i] = machine_x64_same_location(&from[i], &moves[i].operands[1]);
+        if(is_moved[i]) num_moved++;
+    }
+
+    while(num_moved < num_moves) {
+        int ready = -1;
+
+        for(int i = 0; i < num_moves && ready < 0; ++i) {
+            if(is_moved[i]) continue;
+
+            bool is_needed = false;
+            for(int j = 0; j < num_moves; ++j) {
+                if(j != i && !is_moved[j] && machine_x64_same_location(&from[j], &moves[i].operands[1])) {
+                    is_needed = true;
+                }
+            }
+
+            if(!is_needed) ready = i;
+        }
+
+        if(ready < 0) {
+            // every remaining move is part of a cycle
+            for(ready = 0; is_moved[ready]; ++ready);
+            X64Operand cycle_reg = operand_reg(REG_RAX, from[ready].size);
+            append_move(out, from[ready], cycle_reg, moves[ready].size);
+            from[ready] = cycle_reg;
+            continue;
+        }
+
+        append_move(out, from[ready], moves[ready].operands[1], moves[ready].size);
+        is_moved[ready] = true;
+        num_moved++;
+    }
+
+    xcc_free(from);
+    xcc_free(is_moved);
+}
+
+void machine_x64_resolve_parallel_moves(X64Function *func) {
+    // Needs every operand to be in its final place
+    for(int i = 0; i < func->num_blocks; ++i) {
+        X64Block *block = &func->blocks[i];
+        X64Block out;
+        memset(&out, 0, sizeof(X64Block));
+
+        int j = 0;
+        while(j < block->num_instructions) {
+            if(block->instructions[j].opcode != X64_PARALLEL_MOV) {
+                machine_x64_append(&out, &block->instructions[j++]);
+                continue;
+            }
+
+            int end = j;
+            do {
+                end++;
+            } while(end < block->num_instructions
+                && machine_x64_is_in_group(&block->instructions[end], &block->instructions[end - 1]));
+
+            sequence_parallel_moves(&out, &block->instructions[j], end - j);
+            j = end;
+        }
+
+        replace_instructions(block, &out);
+    }
+}
+
+static bool uses_temp_reg(X64Operand *operand) {
+    return (operand->type == OPERAND_REG && operand->reg == REG_R11)
+        || (operand->type == OPERAND_MEMORY && operand->memory.base == REG_R11);
+}
+
+static void legalise_instruction(X64Block *out, X64Instruction instruction) {
+    // Register allocation can put any value in memory, so this fixes up
+    // whatever that leaves which can't be encoded, through R11
+    if(instruction.num_operands != 2) {
+        machine_x64_append(out, &instruction);
+        return;
+    }
+
+    X64Opcode opcode = instruction.opcode;
+    X64Operand *first = &instruction.operands[0];
+    X64Operand *second = &instruction.operands[1];
+    bool is_same = machine_x64_same_location(first, second);
+
+    if(opcode == X64_MOV && is_same) return;
+
+    if(opcode == X64_XOR && is_same && second->type == OPERAND_MEMORY) {
+        append_op(out, X64_MOV, instruction.size, operand_immediate(0, second->size), *second);
+        return;
+    }
+
+    if(opcode == X64_TEST && is_same && second->type == OPERAND_MEMORY) {
+        append_op(out, X64_CMP, instruction.size, operand_immediate(0, second->size), *second);
+        return;
+    }
+
+    if(opcode == X64_MOV && first->type == OPERAND_IMMEDIATE && second->type == OPERAND_MEMORY
+            && first->immediate != (int) first->immediate) {
+        // there's no 64 bit immediate store
+        X64Operand temp_reg = operand_reg(REG_R11, second->size);
+        append_op(out, X64_MOV, instruction.size, *first, temp_reg);
+        append_op(out, X64_MOV, instruction.size, temp_reg, *second);
+        return;
+    }
+
+    if((opcode == X64_IMUL || opcode == X64_MOVSX) && second->type == OPERAND_MEMORY) {
+        // the destination has to be a register
+        xcc_assert(!uses_temp_reg(first));
+
+        X64Operand dest = *second;
+        X64Operand temp_reg = operand_reg(REG_R11, dest.size);
+        if(opcode == X64_IMUL) append_op(out, X64_MOV, dest.size, dest, temp_reg);
+
+        *second = temp_reg;
+        machine_x64_append(out, &instruction);
+        append_op(out, X64_MOV, dest.size, temp_reg, dest);
+        return;
+    }
+
+    if(first->type == OPERAND_MEMORY && second->type == OPERAND_MEMORY) {
+        X64Operand temp_reg = operand_reg(REG_R11, first->size);
+        append_op(out, X64_MOV, first->size, *first, temp_reg);
+        *first = temp_reg;
+    }
+
+    machine_x64_append(out, &instruction);
+}
+
+void machine_x64_legalise(X64Function *func) {
+    for(int i = 0; i < func->num_blocks; ++i) {
+        X64Block *block = &func->blocks[i];
+        X64Block out;
+        memset(&out, 0, sizeof(X64Block));
+
+        for(int j = 0; j < block->num_instructions; ++j) {
+            legalise_instruction(&out, block->instructions[j]);
+        }
+
+        replace_instructions(block, &out);
+    }
+}
+
+static void append_saved_registers(X64Function *func, X64Block *out, bool is_saving) {
+    // The callee saved registers the function uses go at the top of its
+    // frame, the first (in RegLoc order) at -8(%rbp)
+    int offset = 0;
+
+    for(int reg = 0; reg < REG_LAST; ++reg) {
+        if(!(func->saved_registers & (1u << reg))) continue;
+
+        offset += VALUE_POS_SAVED_REGISTER_SIZE;
+        X64Operand slot = operand_memory(REG_RBP, -offset, VALUE_POS_SAVED_REGISTER_SIZE);
+        X64Operand saved_reg = operand_reg(reg, VALUE_POS_SAVED_REGISTER_SIZE);
+
+        if(is_saving) {
+            append_op(out, X64_MOV, VALUE_POS_SAVED_REGISTER_SIZE, saved_reg, slot);
+        } else {
+            append_op(out, X64_MOV, VALUE_POS_SAVED_REGISTER_SIZE, slot, saved_reg);
+        }
+    }
+
+    xcc_assert(offset <= func->frame_size);
+}
+
+static bool has_call(X64Function *func) {
+    for(int i = 0; i < func->num_blocks; ++i) {
+        X64Block *block = &func->blocks[i];
+
+        for(int j = 0; j < block->num_instructions; ++j) {
+            if(block->instructions[j].opcode == X64_CALL) return true;
+        }
+    }
+    return false;
+}
+
+void machine_x64_insert_frame(X64Function *func) {
+    // Puts the prologue at the start and the epilogue before every return,
+    // once register allocation knows how big the frame is
+    xcc_assert(func->num_blocks > 0);
+
+    // The return address leaves the stack 8 bytes off the 16 byte alignment
+    // calls need, and pushing %rbp puts it back, so a function which calls
+    // anything has a frame even when there's nothing in it
+    xcc_assert(func->frame_size % 16 == 0);
+    bool has_frame = func->frame_size > 0 || has_call(func);
+
+    for(int i = 0; i < func->num_blocks; ++i) {
+        X64Block *block = &func->blocks[i];
+        X64Block out;
+        memset(&out, 0, sizeof(X64Block));
+
+        if(i == 0 && has_frame) {
+            append_op_1(&out, X64_PUSH, 8, operand_reg(REG_RBP, 8));
+            append_op(&out, X64_MOV, 8, operand_reg(REG_RSP, 8), operand_reg(REG_RBP, 8));
+        }
+        if(i == 0 && func->frame_size > 0) {
+            append_op(&out, X64_SUB, 8, operand_immediate(func->frame_size, 8), operand_reg(REG_RSP, 8));
+        }
+        if(i == 0) append_saved_registers(func, &out, true);
+
+        for(int j = 0; j < block->num_instructions; ++j) {
+            X64Instruction *instruction = &block->instructions[j];
+
+            if(instruction->opcode == X64_RET) {
+                append_saved_registers(func, &out, false);
+
+                if(func->frame_size > 0) {
+                    append_op(&out, X64_ADD, 8, operand_immediate(func->frame_size, 8), operand_reg(REG_RSP, 8));
+                }
+                if(has_frame) append_op_1(&out, X64_POP, 8, operand_reg(REG_RBP, 8));
+            }
+
+            machine_x64_append(&out, instruction);
+        }
+
+        replace_instructions(block, &out);
+    }
+}
+
+void machine_x64_align_loops(X64Function *func) {
+    // A block jumped back to is the top of a loop
+    for(int i = 0; i < func->num_blocks; ++i) {
+        X64Block *block = &func->blocks[i];
+
+        for(int j = 0; j < block->num_instructions; ++j) {
+            X64Instruction *instruction = &block->instructions[j];
+            if(instruction->opcode != X64_JMP && instruction->opcode != X64_JCC) continue;
+
+            for(int target = 0; target <= i; ++target) {
+                if(func->blocks[target].label == instruction->operands[0].label) {
+                    func->blocks[target].alignment = X64_LOOP_ALIGNMENT;
+                }
+            }
+        }
+    }
+}
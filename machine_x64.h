@@ -0,0 +1,58 @@
+#pragma once
+
+#include "xcc.h"
+
+// A function as x64 instructions, in blocks in the order they're laid out.
+// Operands can be virtual registers until register allocation, and passes
+// run over the whole function before anything is printed or encoded.
+
+// Loops start on a boundary of this many bytes, so that the instructions
+// at the top of each iteration are fetched together
+#define X64_LOOP_ALIGNMENT 16
+
+typedef struct {
+    int label; // -1 for a block which is only ever fallen into
+    int alignment; // in bytes, or 0 if it doesn't matter
+
+    X64Instruction *instructions;
+    int num_instructions;
+    int num_instructions_allocated;
+} X64Block;
+
+typedef struct {
+    X64Block *blocks;
+    int num_blocks;
+    int num_blocks_allocated;
+
+    int num_vregs;
+    int num_move_groups;
+
+    // set by register allocation: the frame below the saved %rbp, and a bit
+    // for each callee saved register used, by RegLoc
+    int frame_size;
+    unsigned int saved_registers;
+} X64Function;
+
+X64Operand operand_reg(RegLoc reg, int size);
+X64Operand operand_memory(RegLoc base, int displacement, int size);
+X64Operand operand_vreg_memory(int base_vreg, int displacement, int size);
+X64Operand operand_immediate(long long value, int size);
+X64Operand operand_label(int label);
+X64Operand operand_symbol(const char *symbol);
+X64Operand operand_vreg(int vreg, int size);
+X64Operand operand_none(void);
+X64Instruction machine_x64_instruction(X64Opcode opcode, int size, int num_operands,
+                                       X64Operand first, X64Operand second);
+bool machine_x64_same_location(X64Operand *a, X64Operand *b);
+
+X64Function *machine_x64_new_function(void);
+void machine_x64_free_function(X64Function *func);
+X64Block *machine_x64_new_block(X64Function *func, int label);
+void machine_x64_append(X64Block *block, X64Instruction *instruction);
+int machine_x64_new_vreg(X64Function *func);
+int machine_x64_new_move_group(X64Function *func);
+bool machine_x64_is_in_group(X64Instruction *instruction, X64Instruction *previous);
+void machine_x64_resolve_parallel_moves(X64Function *func);
+void machine_x64_legalise(X64Function *func);
+void machine_x64_insert_frame(X64Function *func);
+void machine_x64_align_loops(X64Function *func);
@@ -42,4 +42,48 @@ bool check_for_return(AST *ast) {
     }
 
     return has_return;
-}
\ No newline at end of file
+}
+
+static bool check_or_recover(void (*check)(AST *ast), AST *ast) {
+    // Returns false if any of the check was abandoned, which can happen
+    // without a new error when it runs into an earlier one
+    ProgErrorRecovery recovery;
+
+    prog_error_push_recovery(&recovery);
+    if(!setjmp(recovery.jump_buffer)) {
+        check(ast);
+    }
+    prog_error_pop_recovery(&recovery);
+
+    return !recovery.has_abandoned;
+}
+
+static void check_function_returns(AST *ast) {
+    check_for_return(ast);
+}
+
+bool check_top_level(ResolutionList *res_list, AST *program_ast, AST *declaration_ast, bool checks_body) {
+    // Returns false if the declaration had any errors. The checks recover
+    // from an error by skipping the statement it's in, so that one compile
+    // reports as many errors as it can. Without checks_body, a function
+    // definition's body was skipped by the parser and only its declarator
+    // is checked.
+    int old_num_errors = xcc_num_prog_errors();
+
+    resolve_top_level(res_list, program_ast, declaration_ast);
+    if(xcc_num_prog_errors() != old_num_errors) return false;
+
+    // A statement abandoned by typing is left partly untyped, even when
+    // that didn't add an error
+    bool is_checked = check_or_recover(check_lvalue, declaration_ast);
+    is_checked = check_or_recover(type_propogate, declaration_ast) && is_checked;
+    is_checked = is_checked && xcc_num_prog_errors() == old_num_errors;
+
+    // typing adds the implicit returns, so it has to have succeeded
+    if(is_checked && checks_body) {
+        is_checked = check_or_recover(check_function_returns, declaration_ast);
+        is_checked = is_checked && xcc_num_prog_errors() == old_num_errors;
+    }
+
+    return is_checked;
+}
@@ -3,4 +3,5 @@
 #include "xcc.h"
 
 void check_lvalue(AST *ast);
-bool check_for_return(AST *ast);
\ No newline at end of file
+bool check_for_return(AST *ast);
+bool check_top_level(ResolutionList *res_list, AST *program_ast, AST *declaration_ast, bool checks_body);
@@ -0,0 +1,68 @@
+// A very small thread pool for running independent pieces of work
+#include <pthread.h>
+#include "xcc.h"
+
+static int num_threads = 1;
+
+typedef struct {
+    ParallelTask task;
+    void *data;
+    int count;
+    int next_index;
+} ParallelJob;
+
+void parallel_set_num_threads(int new_num_threads) {
+    xcc_assert(new_num_threads >= 1);
+    num_threads = new_num_threads;
+}
+
+int parallel_get_num_threads(void) {
+    return num_threads;
+}
+
+static void *parallel_worker(void *arg) {
+    ParallelJob *job = arg;
+
+    while (true) {
+        // Hand out indices one at a time, so that a few huge pieces of
+        // work don't leave the other threads idle
+        int index = __atomic_fetch_add(&job->next_index, 1, __ATOMIC_RELAXED);
+        if (index >= job->count) break;
+
+        job->task(job->data, index);
+    }
+
+    return NULL;
+}
+
+void parallel_for(int count, ParallelTask task, void *data) {
+    // Runs task(data, i) for each 0 <= i < count, in no particular order,
+    // and returns once all of them have finished.
+    ParallelJob job;
+    job.task = task;
+    job.data = data;
+    job.count = count;
+    job.next_index = 0;
+
+    int num_workers = num_threads < count ? num_threads : count;
+
+    if (num_workers <= 1) {
+        parallel_worker(&job);
+        return;
+    }
+
+    // The calling thread does its share of the work too
+    pthread_t *workers = xcc_malloc(sizeof(pthread_t) * (num_workers - 1));
+    for (int i = 0; i < num_workers - 1; ++i) {
+        int err = pthread_create(&workers[i], NULL, parallel_worker, &job);
+        xcc_assert_msg(!err, "pthread_create() failed");
+    }
+
+    parallel_worker(&job);
+
+    for (int i = 0; i < num_workers - 1; ++i) {
+        int err = pthread_join(workers[i], NULL);
+        xcc_assert_msg(!err, "pthread_join() failed");
+    }
+    xcc_free(workers);
+}
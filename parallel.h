@@ -0,0 +1,9 @@
+#pragma once
+
+#include "xcc.h"
+
+typedef void (*ParallelTask)(void *data, int index);
+
+void parallel_set_num_threads(int num_threads);
+int parallel_get_num_threads(void);
+void parallel_for(int count, ParallelTask task, void *data);
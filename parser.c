@@ -1,10 +1,5 @@
 #include "xcc.h"
 
-typedef struct {
-    Lexer *lexer;
-    int current_token;
-} Parser;
-
 static Token *current_token(Parser *parser) {
     return &parser->lexer->tokens[parser->current_token];
 }
@@ -166,109 +161,76 @@ static AST *parse_unary_prefix(Parser *parser) {
     }
 }
 
-static AST *parse_multiplicative(Parser *parser) {
-    AST *a = parse_unary_prefix(parser);
-
-    while (accept(parser, TOK_STAR) || accept(parser, TOK_SLASH)) {
-        Token *token = prev_token(parser);
-
-        AST *b = parse_unary_prefix(parser);
-
-        ASTType ast_type = token->type == TOK_STAR ? AST_MULTIPLY : AST_DIVIDE;
-        AST *add_ast = ast_new(ast_type, token);
-        ast_append(add_ast, a);
-        ast_append(add_ast, b);
-        a = add_ast;
-    }
-
-    return a;
-}
-
-static AST *parse_additive(Parser *parser) {
-    AST *a = parse_multiplicative(parser);
-
-    while (accept(parser, TOK_PLUS) || accept(parser, TOK_MINUS)) {
-        Token *token = prev_token(parser);
-
-        AST *b = parse_multiplicative(parser);
-
-        ASTType ast_type = token->type == TOK_PLUS ? AST_ADD : AST_SUBTRACT;
-        AST *add_ast = ast_new(ast_type, token);
-        ast_append(add_ast, a);
-        ast_append(add_ast, b);
-        a = add_ast;
-    }
-
-    return a;
+typedef struct {
+    int precedence; // 0 if the token isn't a binary operator
+    bool is_right_associative;
+    bool is_comparison;
+    ASTType ast_type;
+} BinaryOperator;
+
+// Indexed by token type, higher precedence binds tighter.
+static const BinaryOperator binary_operators[] = {
+    // technically assignment is not to-spec but in that case it's probably
+    // not an lvalue anyway, this is also apparently how many other compilers work
+    [TOK_EQUALS] = { 1, true, false, AST_ASSIGN },
+
+    [TOK_LT] = { 2, false, true, AST_CMP_LT },
+    [TOK_GT] = { 2, false, true, AST_CMP_GT },
+    [TOK_LT_OR_EQ] = { 2, false, true, AST_CMP_LT_EQ },
+    [TOK_GT_OR_EQ] = { 2, false, true, AST_CMP_GT_EQ },
+
+    [TOK_PLUS] = { 3, false, false, AST_ADD },
+    [TOK_MINUS] = { 3, false, false, AST_SUBTRACT },
+
+    [TOK_STAR] = { 4, false, false, AST_MULTIPLY },
+    [TOK_SLASH] = { 4, false, false, AST_DIVIDE },
+};
+
+#define NUM_BINARY_OPERATOR_ENTRIES ((int) (sizeof(binary_operators) / sizeof(binary_operators[0])))
+#define LOWEST_BINARY_PRECEDENCE 1
+
+static const BinaryOperator *current_binary_operator(Parser *parser) {
+    TokenType type = current_token(parser)->type;
+    if (type >= NUM_BINARY_OPERATOR_ENTRIES) return NULL;
+
+    const BinaryOperator *op = &binary_operators[type];
+    return op->precedence ? op : NULL;
 }
 
-static AST *parse_comparison(Parser *parser) {
-    AST *a = parse_additive(parser);
+static AST *parse_binary(Parser *parser, int min_precedence) {
+    // Precedence climbing: every binary operator is handled by this one loop,
+    // recursing only to parse a right hand side that binds tighter.
+    AST *a = parse_unary_prefix(parser);
 
     int number_chained = 0;
+    const BinaryOperator *op;
 
-    while (accept(parser, TOK_LT) || accept(parser, TOK_GT) ||
-            accept(parser, TOK_LT_OR_EQ) || accept(parser, TOK_GT_OR_EQ)) {
-
-        if (number_chained >= 1) {
-            // TODO: this should technically be a warning, but I don't have
-            // the code for that yet, so I'll do an error
-            parse_error(parser, "sus chaining of comparison operators");
-        }
+    while ((op = current_binary_operator(parser)) && op->precedence >= min_precedence) {
+        Token *op_token = advance(parser);
 
-        Token *comparison_token = prev_token(parser);
-        TokenType token_type = comparison_token->type;
-        ASTType ast_type;
-
-        if (token_type == TOK_LT) {
-            ast_type = AST_CMP_LT;
-        } else if (token_type == TOK_GT) {
-            ast_type = AST_CMP_GT;
-        } else if (token_type == TOK_LT_OR_EQ) {
-            ast_type = AST_CMP_LT_EQ;
-        } else if (token_type == TOK_GT_OR_EQ) {
-            ast_type = AST_CMP_GT_EQ;
-        } else {
-            xcc_assert_not_reached();
+        if (op->is_comparison) {
+            if (number_chained >= 1) {
+                // TODO: this should technically be a warning, but I don't have
+                // the code for that yet, so I'll do an error
+                parse_error(parser, "sus chaining of comparison operators");
+            }
+            number_chained++;
         }
 
-        AST *comparison_ast = ast_new(ast_type, comparison_token);
-
-        AST *b = parse_additive(parser);
-
-        ast_append(comparison_ast, a);
-        ast_append(comparison_ast, b);
-
-        a = comparison_ast;
-
-        number_chained++;
-    }
-
-    return a;
-}
-
-static AST *parse_assignment(Parser *parser) {
-    // technically this is not to-spec but in that case it's probably not an lvalue anyway
-    // this is also apparently how many other compilers work
-    AST *a = parse_comparison(parser);
-
-    if (accept(parser, TOK_EQUALS)) {
-        AST *assignment_ast = ast_new(AST_ASSIGN, prev_token(parser));
-        // The call to parse_assignment rather than parse_additive
-        // here allows assignment to be right associative
-        AST *b = parse_assignment(parser);
-
-        ast_append(assignment_ast, a);
-        ast_append(assignment_ast, b);
+        int next_min_precedence = op->is_right_associative ? op->precedence : op->precedence + 1;
+        AST *b = parse_binary(parser, next_min_precedence);
 
-        a = assignment_ast;
+        AST *binary_ast = ast_new(op->ast_type, op_token);
+        ast_append(binary_ast, a);
+        ast_append(binary_ast, b);
+        a = binary_ast;
     }
 
     return a;
 }
 
 static AST *parse_expression(Parser *parser) {
-    return parse_assignment(parser);
+    return parse_binary(parser, LOWEST_BINARY_PRECEDENCE);
 }
 
 static AST *parse_if(Parser *parser) {
@@ -329,12 +291,70 @@ static AST *parse_statement(Parser *parser) {
     }
 }
 
+static void skip_past_error(Parser *parser) {
+    // Skips to just after the `;` or `}` which ends the statement or
+    // declaration that had an error, stopping before a `}` which closes an
+    // enclosing block
+    int depth = 0;
+
+    while (current_token(parser)->type != TOK_EOF) {
+        TokenType type = current_token(parser)->type;
+
+        if (type == TOK_CLOSE_CURLY) {
+            if (depth == 0) return;
+            advance(parser);
+            if (--depth == 0) return;
+        } else {
+            advance(parser);
+            if (type == TOK_OPEN_CURLY) depth++;
+            if (type == TOK_SEMICOLON && depth == 0) return;
+        }
+    }
+
+    parser->has_skipped_to_eof = true;
+}
+
+static AST *parse_statement_or_recover(Parser *parser) {
+    // Returns NULL if the statement had an error
+    ProgErrorRecovery recovery;
+    AST *statement = NULL;
+
+    prog_error_push_recovery(&recovery);
+    if (!setjmp(recovery.jump_buffer)) {
+        statement = parse_statement(parser);
+    } else {
+        skip_past_error(parser);
+    }
+    prog_error_pop_recovery(&recovery);
+
+    return statement;
+}
+
 static AST *parse_block(Parser *parser) {
     AST *body_ast = ast_new(AST_BLOCK_STATEMENT, prev_token(parser));
 
     while (!accept(parser, TOK_CLOSE_CURLY)) {
-        AST *statement = parse_statement(parser);
-        ast_append(body_ast, statement);
+        if (parser->has_skipped_to_eof) break;
+
+        AST *statement = parse_statement_or_recover(parser);
+        if (statement) ast_append(body_ast, statement);
+    }
+
+    return body_ast;
+}
+
+static AST *skip_block(Parser *parser) {
+    // The braces have to match, since the block has parsed before
+    AST *body_ast = ast_new(AST_BLOCK_STATEMENT, prev_token(parser));
+
+    int depth = 1;
+    while (depth > 0) {
+        TokenType type = current_token(parser)->type;
+        xcc_assert(type != TOK_EOF);
+        advance(parser);
+
+        if (type == TOK_OPEN_CURLY) depth++;
+        if (type == TOK_CLOSE_CURLY) depth--;
     }
 
     return body_ast;
@@ -446,7 +466,7 @@ static AST *parse_declaration(Parser *parser, bool as_parameter) {
         }
 
         declaration->type = AST_FUNCTION_DEFINITION;
-        ast_append(declaration, parse_block(parser));
+        ast_append(declaration, parser->skips_function_body ? skip_block(parser) : parse_block(parser));
         return declaration;
     }
 
@@ -457,27 +477,51 @@ static AST *parse_declaration(Parser *parser, bool as_parameter) {
     return declaration;
 }
 
-static AST *parse_unit(Parser *parser) {
-    AST *program_ast = ast_new(AST_PROGRAM, current_token(parser));
+void parser_init(Parser *parser, Lexer *lexer) {
+    parser->lexer = lexer;
+    parser->current_token = 0;
+    parser->has_skipped_to_eof = false;
+    parser->skips_function_body = false;
+}
 
-    while (current_token(parser)->type != TOK_EOF) {
-        AST *declaration_ast = parse_declaration(parser, false);
-        ast_append(program_ast, declaration_ast);
+AST *parse_top_level_declaration(Parser *parser) {
+    // Returns NULL once the end of the file is reached. Declarations with
+    // an error are skipped.
+    const char *old_stage = xcc_get_prog_error_stage();
+    xcc_set_prog_error_stage("Parse");
+
+    AST *declaration_ast = NULL;
+
+    while (!declaration_ast && current_token(parser)->type != TOK_EOF) {
+        ProgErrorRecovery recovery;
+        Token *start_token = current_token(parser);
+
+        prog_error_push_recovery(&recovery);
+        if (!setjmp(recovery.jump_buffer)) {
+            declaration_ast = parse_declaration(parser, false);
+        } else {
+            skip_past_error(parser);
+
+            // a stray `}` isn't inside anything, so it has to be skipped here
+            if (current_token(parser) == start_token) advance(parser);
+        }
+        prog_error_pop_recovery(&recovery);
     }
 
-    return program_ast;
+    xcc_set_prog_error_stage(old_stage);
+    return declaration_ast;
 }
 
 AST *parse_program(Lexer *lexer) {
     Parser parser;
-    parser.lexer = lexer;
-    parser.current_token = 0;
+    parser_init(&parser, lexer);
 
-    const char *old_stage = xcc_get_prog_error_stage();
-    xcc_set_prog_error_stage("Parse");
-    AST *program_ast = parse_unit(&parser);
-    xcc_set_prog_error_stage(old_stage);
+    AST *program_ast = ast_new(AST_PROGRAM, current_token(&parser));
 
+    AST *declaration_ast;
+    while ((declaration_ast = parse_top_level_declaration(&parser))) {
+        ast_append(program_ast, declaration_ast);
+    }
 
     return program_ast;
-}
\ No newline at end of file
+}
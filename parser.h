@@ -2,4 +2,19 @@
 
 #include "xcc.h"
 
+typedef struct {
+    Lexer *lexer;
+    int current_token;
+
+    // set once skipping past an error reaches the end of the file, when
+    // blocks that are still open have already been reported
+    bool has_skipped_to_eof;
+
+    // For a function definition which is already known to parse, when only
+    // its declarator is wanted. The body is left empty.
+    bool skips_function_body;
+} Parser;
+
+void parser_init(Parser *parser, Lexer *lexer);
+AST *parse_top_level_declaration(Parser *parser);
 AST *parse_program(Lexer *lexer);
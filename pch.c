@@ -0,0 +1,513 @@
+// Precompiled headers
+//
+// The file is a header followed by arrays of fixed size records and then a
+// string table, which records refer to by offset. It's loaded with mmap and
+// strings are used straight from the mapping, so nothing is copied for them.
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "xcc.h"
+
+#define PCH_MAGIC "XCCPCH1"
+
+typedef struct {
+    char magic[8];
+    uint32_t num_types;
+    uint32_t num_type_params;
+    uint32_t num_declarations;
+    uint32_t num_macros;
+    uint32_t num_tokens;
+    uint32_t strings_size;
+} PchHeader;
+
+typedef struct {
+    uint8_t type_type;
+    uint8_t integer_type;
+    uint8_t is_const;
+    uint8_t is_volatile;
+    uint8_t is_restrict;
+    int32_t array_size;
+    int32_t underlying; // index of an earlier type, or -1
+    uint32_t first_param; // into the type params, for functions
+} PchType;
+
+typedef struct {
+    uint32_t name;
+    uint32_t type;
+    uint32_t decl_type;
+} PchDeclaration;
+
+typedef struct {
+    uint32_t name;
+    uint32_t first_token;
+    uint32_t number_tokens;
+    uint32_t is_function_like;
+    uint32_t number_params;
+} PchMacro;
+
+typedef struct {
+    uint32_t type;
+    uint32_t contents;
+    uint32_t contents_length;
+    int32_t source_line_num;
+    int32_t source_column_num;
+    uint32_t source_length;
+    uint32_t start_of_line; // just that line of the source
+    uint32_t source_filename;
+    int32_t param_index;
+} PchToken;
+
+struct PrecompiledHeader {
+    void *mapping;
+    size_t mapping_size;
+
+    PchHeader *header;
+    PchDeclaration *declarations;
+    PchMacro *macros;
+    PchToken *tokens;
+    const char *strings;
+
+    Type **types;
+};
+
+typedef struct {
+    PchType *types;
+    size_t num_types;
+    size_t num_types_allocated;
+
+    uint32_t *type_params;
+    size_t num_type_params;
+    size_t num_type_params_allocated;
+
+    PchDeclaration *declarations;
+    size_t num_declarations;
+    size_t num_declarations_allocated;
+
+    PchMacro *macros;
+    size_t num_macros;
+    size_t num_macros_allocated;
+
+    PchToken *tokens;
+    size_t num_tokens;
+    size_t num_tokens_allocated;
+
+    char *strings;
+    size_t strings_size;
+    size_t strings_allocated;
+
+    // Tokens next to each other mostly share these, so the last ones are
+    // remembered rather than writing them again
+    const char *last_line;
+    uint32_t last_line_offset;
+    const char *last_filename;
+    uint32_t last_filename_offset;
+} PchWriter;
+
+static uint32_t write_string(PchWriter *writer, const char *string, size_t length) {
+    uint32_t offset = writer->strings_size;
+
+    for (size_t i = 0; i <= length; ++i) {
+        char *c;
+        LIST_STRUCT_APPEND_FUNC(char, writer, strings_size, strings_allocated, strings, c);
+        *c = i < length ? string[i] : '\0';
+    }
+
+    return offset;
+}
+
+static uint32_t write_line(PchWriter *writer, const char *start_of_line) {
+    if (start_of_line != writer->last_line) {
+        size_t length = strcspn(start_of_line, "\n");
+        writer->last_line = start_of_line;
+        writer->last_line_offset = write_string(writer, start_of_line, length);
+    }
+    return writer->last_line_offset;
+}
+
+static uint32_t write_filename(PchWriter *writer, const char *filename) {
+    if (filename != writer->last_filename) {
+        writer->last_filename = filename;
+        writer->last_filename_offset = write_string(writer, filename, strlen(filename));
+    }
+    return writer->last_filename_offset;
+}
+
+static uint32_t write_type(PchWriter *writer, Type *type) {
+    // Types are written after everything they refer to, so they can be
+    // created in order when loading. Shared types are written once per use,
+    // which only really happens for integers, and those are shared on
+    // loading anyway.
+    int32_t underlying = type->underlying ? (int32_t) write_type(writer, type->underlying) : -1;
+
+    uint32_t *param_types = NULL;
+    int num_params = type->type_type == TYPE_FUNCTION ? type->array_size : 0;
+    if (num_params) {
+        param_types = xcc_malloc(sizeof(uint32_t) * num_params);
+        for (int i = 0; i < num_params; ++i) {
+            param_types[i] = write_type(writer, type->function_param_types[i]);
+        }
+    }
+
+    uint32_t first_param = writer->num_type_params;
+    for (int i = 0; i < num_params; ++i) {
+        uint32_t *param;
+        LIST_STRUCT_APPEND_FUNC(
+            uint32_t, writer, num_type_params, num_type_params_allocated, type_params, param
+        );
+        *param = param_types[i];
+    }
+    if (param_types) xcc_free(param_types);
+
+    PchType *pch_type;
+    LIST_STRUCT_APPEND_FUNC(PchType, writer, num_types, num_types_allocated, types, pch_type);
+    pch_type->type_type = type->type_type;
+    pch_type->integer_type = type->integer_type;
+    pch_type->is_const = type->is_const;
+    pch_type->is_volatile = type->is_volatile;
+    pch_type->is_restrict = type->is_restrict;
+    pch_type->array_size = type->array_size;
+    pch_type->underlying = underlying;
+    pch_type->first_param = first_param;
+
+    return writer->num_types - 1;
+}
+
+static void write_declarations(PchWriter *writer, Declaration *declaration) {
+    // The list is newest first, so recurse to write them oldest first
+    if (!declaration) return;
+    write_declarations(writer, declaration->next_in_list);
+
+    if (declaration->definition_ast) {
+        prog_error_ast("function definitions can't be precompiled", declaration->definition_ast);
+    }
+    if (declaration->decl_type == DECL_PARAM_TYPE) return; // parameter names in prototypes
+
+    if (declaration->decl_type != DECL_FUNC_PROTOTYPE) {
+        prog_error_ast("only function prototypes can be precompiled", declaration->last_declaration_ast);
+    }
+    xcc_assert(declaration->scope_level == 0);
+
+    uint32_t type = write_type(writer, declaration->type);
+
+    PchDeclaration *pch_declaration;
+    LIST_STRUCT_APPEND_FUNC(
+        PchDeclaration, writer, num_declarations, num_declarations_allocated,
+        declarations, pch_declaration
+    );
+    pch_declaration->name = write_string(writer, declaration->name, strlen(declaration->name));
+    pch_declaration->type = type;
+    pch_declaration->decl_type = declaration->decl_type;
+}
+
+static bool is_macro_shadowed(Lexer *lexer, PreprocessorMacro *macro) {
+    // The newest definition of a name is the first one found
+    return lex_find_macro(lexer, macro->name, macro->name_length) != macro;
+}
+
+static void write_macro(PchWriter *writer, PreprocessorMacro *macro) {
+    uint32_t first_token = writer->num_tokens;
+
+    for (int i = 0; i < macro->number_tokens; ++i) {
+        Token *token = &macro->contents[i];
+
+        PchToken *pch_token;
+        LIST_STRUCT_APPEND_FUNC(PchToken, writer, num_tokens, num_tokens_allocated, tokens, pch_token);
+        pch_token->type = token->type;
+        pch_token->contents = write_string(writer, token->contents, token->contents_length);
+        pch_token->contents_length = token->contents_length;
+        pch_token->source_line_num = token->source_line_num;
+        pch_token->source_column_num = token->source_column_num;
+        pch_token->source_length = token->source_length;
+        pch_token->start_of_line = write_line(writer, token->start_of_line);
+        pch_token->source_filename = write_filename(writer, token->source_filename);
+        pch_token->param_index = macro->param_indices ? macro->param_indices[i] : -1;
+    }
+
+    PchMacro *pch_macro;
+    LIST_STRUCT_APPEND_FUNC(PchMacro, writer, num_macros, num_macros_allocated, macros, pch_macro);
+    pch_macro->name = write_string(writer, macro->name, macro->name_length);
+    pch_macro->first_token = first_token;
+    pch_macro->number_tokens = macro->number_tokens;
+    pch_macro->is_function_like = macro->is_function_like;
+    pch_macro->number_params = macro->number_params;
+}
+
+static void write_array(FILE *stream, const void *data, size_t item_size, size_t count) {
+    if (count && fwrite(data, item_size, count, stream) != count) {
+        perror("fwrite(pch)");
+        exit(1);
+    }
+}
+
+void pch_write(const char *filename, Lexer *lexer, ResolutionList *res_list) {
+    PchWriter writer;
+    memset(&writer, 0, sizeof(PchWriter));
+
+    write_declarations(&writer, res_list->all_declarations_head);
+
+    for (size_t i = 0; i < lexer->num_macro_buckets; ++i) {
+        for (PreprocessorMacro *macro = lexer->macro_buckets[i]; macro; macro = macro->next_macro) {
+            // only the definition in effect at the end of the header matters
+            if (!is_macro_shadowed(lexer, macro)) {
+                write_macro(&writer, macro);
+            }
+        }
+    }
+
+    PchHeader header;
+    memset(&header, 0, sizeof(PchHeader));
+    memcpy(header.magic, PCH_MAGIC, sizeof(PCH_MAGIC));
+    header.num_types = writer.num_types;
+    header.num_type_params = writer.num_type_params;
+    header.num_declarations = writer.num_declarations;
+    header.num_macros = writer.num_macros;
+    header.num_tokens = writer.num_tokens;
+    header.strings_size = writer.strings_size;
+
+    FILE *stream = fopen(filename, "wb");
+    if (!stream) {
+        perror("open(pch)");
+        exit(1);
+    }
+
+    write_array(stream, &header, sizeof(PchHeader), 1);
+    write_array(stream, writer.types, sizeof(PchType), writer.num_types);
+    write_array(stream, writer.type_params, sizeof(uint32_t), writer.num_type_params);
+    write_array(stream, writer.declarations, sizeof(PchDeclaration), writer.num_declarations);
+    write_array(stream, writer.macros, sizeof(PchMacro), writer.num_macros);
+    write_array(stream, writer.tokens, sizeof(PchToken), writer.num_tokens);
+    write_array(stream, writer.strings, 1, writer.strings_size);
+
+    if (fclose(stream)) {
+        perror("close(pch)");
+        exit(1);
+    }
+
+    if (writer.types) xcc_free(writer.types);
+    if (writer.type_params) xcc_free(writer.type_params);
+    if (writer.declarations) xcc_free(writer.declarations);
+    if (writer.macros) xcc_free(writer.macros);
+    if (writer.tokens) xcc_free(writer.tokens);
+    if (writer.strings) xcc_free(writer.strings);
+}
+
+static bool pch_is_valid(PrecompiledHeader *pch, size_t size) {
+    // Everything after the header is sized by it, and every record only
+    // refers to things in the file, so bad files are rejected up front
+    if (size < sizeof(PchHeader)) return false;
+
+    PchHeader *header = pch->header;
+    if (memcmp(header->magic, PCH_MAGIC, sizeof(PCH_MAGIC))) return false;
+
+    size_t expected_size = sizeof(PchHeader)
+        + (size_t) header->num_types * sizeof(PchType)
+        + (size_t) header->num_type_params * sizeof(uint32_t)
+        + (size_t) header->num_declarations * sizeof(PchDeclaration)
+        + (size_t) header->num_macros * sizeof(PchMacro)
+        + (size_t) header->num_tokens * sizeof(PchToken)
+        + header->strings_size;
+    if (size != expected_size) return false;
+    if (header->strings_size == 0 || pch->strings[header->strings_size - 1] != '\0') return false;
+
+    PchType *types = (PchType *) (header + 1);
+    uint32_t *type_params = (uint32_t *) (types + header->num_types);
+
+    for (uint32_t i = 0; i < header->num_types; ++i) {
+        PchType *type = &types[i];
+        if (type->underlying >= (int32_t) i) return false;
+        if (type->type_type == TYPE_INTEGER && type->integer_type >= TYPE_INTEGER_LAST) return false;
+
+        if (type->type_type == TYPE_FUNCTION) {
+            if (type->array_size < 0 || type->underlying < 0) return false;
+            if ((size_t) type->first_param + type->array_size > header->num_type_params) return false;
+
+            for (int j = 0; j < type->array_size; ++j) {
+                if (type_params[type->first_param + j] >= i) return false;
+            }
+        } else if (type->type_type == TYPE_POINTER) {
+            if (type->underlying < 0) return false;
+        } else if (type->type_type != TYPE_INTEGER && type->type_type != TYPE_VOID) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->num_declarations; ++i) {
+        PchDeclaration *declaration = &pch->declarations[i];
+        if (declaration->name >= header->strings_size) return false;
+        if (declaration->type >= header->num_types) return false;
+        if (declaration->decl_type != DECL_FUNC_PROTOTYPE) return false;
+    }
+
+    for (uint32_t i = 0; i < header->num_macros; ++i) {
+        PchMacro *macro = &pch->macros[i];
+        if (macro->name >= header->strings_size) return false;
+        if ((size_t) macro->first_token + macro->number_tokens > header->num_tokens) return false;
+
+        for (uint32_t j = 0; j < macro->number_tokens; ++j) {
+            PchToken *token = &pch->tokens[macro->first_token + j];
+            if (token->param_index >= (int32_t) macro->number_params) return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->num_tokens; ++i) {
+        PchToken *token = &pch->tokens[i];
+        // contents aren't looked up as strings, so the whole range is checked
+        if ((size_t) token->contents + token->contents_length >= header->strings_size) return false;
+        if (token->start_of_line >= header->strings_size) return false;
+        if (token->source_filename >= header->strings_size) return false;
+        if (token->type >= TOK_COUNT) return false;
+    }
+
+    return true;
+}
+
+static void create_types(PrecompiledHeader *pch) {
+    PchHeader *header = pch->header;
+    PchType *pch_types = (PchType *) (header + 1);
+    uint32_t *type_params = (uint32_t *) (pch_types + header->num_types);
+
+    pch->types = xcc_malloc(sizeof(Type *) * header->num_types);
+
+    for (uint32_t i = 0; i < header->num_types; ++i) {
+        PchType *pch_type = &pch_types[i];
+        Type *type;
+
+        if (pch_type->type_type == TYPE_INTEGER) {
+            type = type_new_int(pch_type->integer_type, pch_type->is_const, pch_type->is_volatile);
+        } else if (pch_type->type_type == TYPE_VOID) {
+            type = type_new_void();
+        } else if (pch_type->type_type == TYPE_POINTER) {
+            type = type_new_pointer(pch->types[pch_type->underlying]);
+        } else {
+            xcc_assert(pch_type->type_type == TYPE_FUNCTION);
+
+            int num_params = pch_type->array_size;
+            Type **param_types = xcc_malloc(sizeof(Type *) * num_params);
+            for (int j = 0; j < num_params; ++j) {
+                param_types[j] = pch->types[type_params[pch_type->first_param + j]];
+            }
+            type = type_new_function(pch->types[pch_type->underlying], param_types, num_params);
+        }
+
+        if (pch_type->type_type == TYPE_POINTER || pch_type->type_type == TYPE_FUNCTION) {
+            type->is_const = pch_type->is_const;
+            type->is_volatile = pch_type->is_volatile;
+            type->is_restrict = pch_type->is_restrict;
+        }
+
+        pch->types[i] = type;
+    }
+}
+
+PrecompiledHeader *pch_load(const char *filename) {
+    // Returns NULL after reporting the problem if it can't be loaded
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("open(pch)");
+        return NULL;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat)) {
+        perror("stat(pch)");
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = file_stat.st_size;
+    void *mapping = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Couldn't map precompiled header `%s`\n", filename);
+        return NULL;
+    }
+
+    PrecompiledHeader *pch = xcc_malloc(sizeof(PrecompiledHeader));
+    pch->mapping = mapping;
+    pch->mapping_size = size;
+    pch->types = NULL;
+
+    pch->header = mapping;
+    if (size >= sizeof(PchHeader)) {
+        PchHeader *header = pch->header;
+        PchType *types = (PchType *) (header + 1);
+        uint32_t *type_params = (uint32_t *) (types + header->num_types);
+        pch->declarations = (PchDeclaration *) (type_params + header->num_type_params);
+        pch->macros = (PchMacro *) (pch->declarations + header->num_declarations);
+        pch->tokens = (PchToken *) (pch->macros + header->num_macros);
+        pch->strings = (const char *) (pch->tokens + header->num_tokens);
+    }
+
+    if (!pch_is_valid(pch, size)) {
+        fprintf(stderr, "`%s` isn't a valid precompiled header\n", filename);
+        pch_free(pch);
+        return NULL;
+    }
+
+    create_types(pch);
+
+    return pch;
+}
+
+void pch_define_macros(PrecompiledHeader *pch, Lexer *lexer) {
+    for (uint32_t i = 0; i < pch->header->num_macros; ++i) {
+        PchMacro *pch_macro = &pch->macros[i];
+        const char *name = &pch->strings[pch_macro->name];
+
+        PreprocessorMacro *macro = xcc_malloc(sizeof(PreprocessorMacro));
+        char *name_buffer = xcc_malloc(strlen(name) + 1);
+        strcpy(name_buffer, name);
+        macro->name = name_buffer;
+        macro->number_tokens = pch_macro->number_tokens;
+        macro->contents = xcc_malloc(sizeof(Token) * pch_macro->number_tokens);
+        macro->is_function_like = pch_macro->is_function_like;
+        macro->number_params = pch_macro->number_params;
+        macro->param_indices = NULL;
+        if (macro->is_function_like && macro->number_tokens) {
+            macro->param_indices = xcc_malloc(sizeof(int) * macro->number_tokens);
+        }
+
+        for (uint32_t j = 0; j < pch_macro->number_tokens; ++j) {
+            PchToken *pch_token = &pch->tokens[pch_macro->first_token + j];
+            Token *token = &macro->contents[j];
+
+            // borrowed from the mapping, which outlives the lexer
+            token->type = pch_token->type;
+            token->contents = &pch->strings[pch_token->contents];
+            token->contents_length = pch_token->contents_length;
+            token->owns_contents = false;
+            token->source_line_num = pch_token->source_line_num;
+            token->source_column_num = pch_token->source_column_num;
+            token->source_length = pch_token->source_length;
+            token->start_of_line = &pch->strings[pch_token->start_of_line];
+            token->source_filename = &pch->strings[pch_token->source_filename];
+            token->alternative_source_token = NULL;
+
+            if (macro->param_indices) {
+                macro->param_indices[j] = pch_token->param_index;
+            }
+        }
+
+        lex_add_macro(lexer, macro);
+    }
+}
+
+void pch_add_declarations(PrecompiledHeader *pch, ResolutionList *res_list) {
+    for (uint32_t i = 0; i < pch->header->num_declarations; ++i) {
+        PchDeclaration *pch_declaration = &pch->declarations[i];
+
+        resolve_add_precompiled_declaration(
+            res_list, &pch->strings[pch_declaration->name],
+            pch->types[pch_declaration->type], pch_declaration->decl_type
+        );
+    }
+}
+
+void pch_free(PrecompiledHeader *pch) {
+    // Only once nothing refers to the strings any more
+    if (pch->types) xcc_free(pch->types);
+    munmap(pch->mapping, pch->mapping_size);
+    xcc_free(pch);
+}
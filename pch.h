@@ -0,0 +1,14 @@
+#pragma once
+
+#include "xcc.h"
+
+// A snapshot of the macros, types and top level declarations from compiling
+// a header, so that they don't need to be compiled again for every file
+// which starts with that header
+typedef struct PrecompiledHeader PrecompiledHeader;
+
+void pch_write(const char *filename, Lexer *lexer, ResolutionList *res_list);
+PrecompiledHeader *pch_load(const char *filename);
+void pch_define_macros(PrecompiledHeader *pch, Lexer *lexer);
+void pch_add_declarations(PrecompiledHeader *pch, ResolutionList *res_list);
+void pch_free(PrecompiledHeader *pch);
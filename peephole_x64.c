@@ -0,0 +1,466 @@
+// Peephole optimisation of generated x64
+//
+// The generator works one AST node at a time, so it moves things through
+// RAX and R11 and back out again, reloads what it's just stored, and so on.
+// Instructions are held in a small window and rewritten before being passed
+// on. RAX and R11 are only ever used by the generator for values which are
+// used straight away, so neither is live across a jump, call or label.
+#include "xcc.h"
+
+#define PEEPHOLE_WINDOW_SIZE 16
+
+typedef struct {
+    X64Instruction instructions[PEEPHOLE_WINDOW_SIZE];
+    int num_instructions;
+
+    // where instructions go once they leave the window
+    X64Block *out;
+} PeepholeWindow;
+
+static bool operands_equal(X64Operand *a, X64Operand *b) {
+    if(a->type != b->type || a->size != b->size) return false;
+
+    switch(a->type) {
+        case OPERAND_NONE: return true;
+        case OPERAND_REG: return a->reg == b->reg;
+        case OPERAND_MEMORY:
+            return a->memory.base == b->memory.base && a->memory.base_vreg == b->memory.base_vreg
+                && a->memory.displacement == b->memory.displacement;
+        case OPERAND_IMMEDIATE: return a->immediate == b->immediate;
+        case OPERAND_LABEL: return a->label == b->label;
+        case OPERAND_SYMBOL: return a->symbol == b->symbol;
+        case OPERAND_VREG: return a->vreg == b->vreg;
+    }
+    xcc_assert_not_reached();
+}
+
+static bool is_reg(X64Operand *operand, RegLoc reg) {
+    return operand->type == OPERAND_REG && operand->reg == reg;
+}
+
+static bool operand_uses_reg(X64Operand *operand, RegLoc reg) {
+    return is_reg(operand, reg) || (operand->type == OPERAND_MEMORY && operand->memory.base == reg);
+}
+
+static bool instruction_uses_reg(X64Instruction *instruction, RegLoc reg) {
+    for(int i = 0; i < instruction->num_operands; ++i) {
+        if(operand_uses_reg(&instruction->operands[i], reg)) return true;
+    }
+    return false;
+}
+
+static bool is_temp_reg(X64Operand *operand) {
+    return is_reg(operand, REG_RAX) || is_reg(operand, REG_R11);
+}
+
+static bool is_mov(X64Instruction *instruction, X64OperandType from, X64OperandType to) {
+    return instruction->opcode == X64_MOV
+        && instruction->operands[0].type == from && instruction->operands[1].type == to;
+}
+
+static bool is_control_flow(X64Instruction *instruction) {
+    X64Opcode opcode = instruction->opcode;
+    return opcode == X64_JMP || opcode == X64_JCC || opcode == X64_CALL || opcode == X64_RET;
+}
+
+static bool reads_flags(X64Instruction *instruction) {
+    return instruction->opcode == X64_SET || instruction->opcode == X64_JCC;
+}
+
+static bool writes_flags(X64Instruction *instruction) {
+    switch(instruction->opcode) {
+        case X64_ADD: case X64_SUB: case X64_IMUL: case X64_XOR: case X64_CMP: case X64_TEST:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static X64Operand *destination(X64Instruction *instruction) {
+    // The operand written to, if there is one
+    switch(instruction->opcode) {
+        case X64_MOV: case X64_ADD: case X64_SUB: case X64_IMUL: case X64_XOR: case X64_MOVSX:
+            return &instruction->operands[1];
+        case X64_SET: case X64_POP:
+            return &instruction->operands[0];
+        default:
+            return NULL;
+    }
+}
+
+static bool is_read_only_operand(X64Instruction *instruction, int index) {
+    // Operands which are only read can be a register just as well as memory
+    switch(instruction->opcode) {
+        case X64_MOV: case X64_ADD: case X64_SUB: case X64_IMUL: case X64_XOR: case X64_MOVSX:
+            return index == 0;
+        case X64_CMP: case X64_TEST:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_zeroing(X64Instruction *instruction) {
+    return instruction->opcode == X64_XOR && instruction->size >= 4
+        && instruction->operands[0].type == OPERAND_REG
+        && operands_equal(&instruction->operands[0], &instruction->operands[1]);
+}
+
+static bool writes_whole_reg(X64Instruction *instruction, RegLoc reg) {
+    // True if the old value of reg doesn't matter to the instruction or after
+    // it. 32 bit writes zero the top half, so count as writing all of it.
+    if(instruction->opcode == X64_POP) return is_reg(&instruction->operands[0], reg);
+    if(is_zeroing(instruction)) return is_reg(&instruction->operands[0], reg);
+
+    if(instruction->opcode != X64_MOV && instruction->opcode != X64_MOVSX) return false;
+    return instruction->size >= 4 && is_reg(&instruction->operands[1], reg)
+        && !operand_uses_reg(&instruction->operands[0], reg);
+}
+
+static bool is_temp_dead_after(PeepholeWindow *window, int index, RegLoc reg, bool is_flushing) {
+    for(int i = index + 1; i < window->num_instructions; ++i) {
+        X64Instruction *instruction = &window->instructions[i];
+
+        if(writes_whole_reg(instruction, reg)) return true;
+        if(instruction_uses_reg(instruction, reg)) return false;
+
+        // the return value is the only thing to outlive control flow
+        if(instruction->opcode == X64_RET) return reg != REG_RAX;
+        if(is_control_flow(instruction)) return true;
+    }
+
+    // whatever comes after a flush is a label or the end of the function,
+    // but otherwise it's not known yet
+    return is_flushing;
+}
+
+static bool memory_may_overlap(X64Operand *a, X64Operand *b) {
+    // Slots in the frame can only be reached through rbp, since nothing can
+    // take their address, but anything else could be anywhere
+    if(a->memory.base != REG_RBP || b->memory.base != REG_RBP) return true;
+
+    int a_start = a->memory.displacement;
+    int b_start = b->memory.displacement;
+    return a_start < b_start + b->size && b_start < a_start + a->size;
+}
+
+static void remove_instruction(PeepholeWindow *window, int index) {
+    window->num_instructions--;
+    for(int i = index; i < window->num_instructions; ++i) {
+        window->instructions[i] = window->instructions[i + 1];
+    }
+}
+
+static bool remove_self_move(PeepholeWindow *window, int index) {
+    // Values are only ever read at their own size, so the zero extension
+    // done by a 32 bit move of a register to itself doesn't matter
+    X64Instruction *instruction = &window->instructions[index];
+    if(!is_mov(instruction, OPERAND_REG, OPERAND_REG)) return false;
+    if(instruction->operands[0].reg != instruction->operands[1].reg) return false;
+
+    remove_instruction(window, index);
+    return true;
+}
+
+static bool forward_slot(PeepholeWindow *window, int index) {
+    // After a move between a register and a stack slot they hold the same
+    // value, until either is written. Loads of the slot in that time come
+    // from the register instead, and stores of the register are dropped.
+    X64Instruction *instruction = &window->instructions[index];
+
+    X64Operand *reg;
+    X64Operand *slot;
+    if(is_mov(instruction, OPERAND_REG, OPERAND_MEMORY)) {
+        reg = &instruction->operands[0];
+        slot = &instruction->operands[1];
+    } else if(is_mov(instruction, OPERAND_MEMORY, OPERAND_REG)) {
+        slot = &instruction->operands[0];
+        reg = &instruction->operands[1];
+    } else {
+        return false;
+    }
+
+    // a load through the register it's loading into
+    if(operand_uses_reg(slot, reg->reg)) return false;
+
+    for(int i = index + 1; i < window->num_instructions; ++i) {
+        X64Instruction *later = &window->instructions[i];
+
+        for(int operand = 0; operand < later->num_operands; ++operand) {
+            if(is_read_only_operand(later, operand) && operands_equal(&later->operands[operand], slot)) {
+                later->operands[operand] = *reg;
+                return true;
+            }
+        }
+        if(is_mov(later, OPERAND_REG, OPERAND_MEMORY) && operands_equal(&later->operands[0], reg)
+            && operands_equal(&later->operands[1], slot)) {
+            remove_instruction(window, i);
+            return true;
+        }
+
+        if(is_control_flow(later) || later->opcode == X64_PUSH) return false;
+
+        X64Operand *written = destination(later);
+        if(!written) continue;
+
+        if(written->type == OPERAND_REG) {
+            if(written->reg == reg->reg || written->reg == slot->memory.base) return false;
+        } else if(written->type == OPERAND_MEMORY && memory_may_overlap(written, slot)) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+static bool can_move_directly(int size, X64Operand *from, X64Operand *to) {
+    if(from->type == OPERAND_MEMORY && to->type == OPERAND_MEMORY) return false;
+
+    // there's no 64 bit immediate store
+    bool is_wide_immediate = from->type == OPERAND_IMMEDIATE && size == 8
+        && from->immediate != (int) from->immediate;
+    return !(is_wide_immediate && to->type == OPERAND_MEMORY);
+}
+
+static bool can_use_immediate(X64Opcode opcode, long long value) {
+    if(value != (int) value) return false;
+
+    switch(opcode) {
+        case X64_ADD: case X64_SUB: case X64_IMUL: case X64_XOR: case X64_CMP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool fold_move_chain(PeepholeWindow *window, int index, bool is_flushing) {
+    // A value put in a temp register only to be moved somewhere else goes
+    // there directly, and so does one which is worked on in the temp first
+    if(index + 1 >= window->num_instructions) return false;
+
+    X64Instruction *first = &window->instructions[index];
+    X64Instruction *second = &window->instructions[index + 1];
+
+    X64Operand *temp = destination(first);
+    if(!temp || !is_temp_reg(temp) || !writes_whole_reg(first, temp->reg)) return false;
+    if(first->opcode != X64_MOV && first->opcode != X64_XOR) return false;
+    RegLoc temp_reg = temp->reg;
+
+    // mov a, temp; mov temp, b
+    if(second->opcode == X64_MOV && is_reg(&second->operands[0], temp_reg)) {
+        X64Operand to = second->operands[1];
+        if(operand_uses_reg(&to, temp_reg)) return false;
+        if(!is_temp_dead_after(window, index + 1, temp_reg, is_flushing)) return false;
+
+        if(first->opcode == X64_XOR) {
+            if(to.type == OPERAND_REG) {
+                first->size = 4;
+                first->operands[0] = operand_reg(to.reg, 4);
+                first->operands[1] = first->operands[0];
+            } else {
+                first->opcode = X64_MOV;
+                first->size = second->size;
+                first->operands[0].type = OPERAND_IMMEDIATE;
+                first->operands[0].size = second->size;
+                first->operands[0].immediate = 0;
+                first->operands[1] = to;
+            }
+        } else {
+            if(first->size != second->size) return false;
+            if(!can_move_directly(first->size, &first->operands[0], &to)) return false;
+            first->operands[1] = to;
+        }
+
+        remove_instruction(window, index + 1);
+        return true;
+    }
+
+    // mov a, temp; op temp, b where op only reads temp
+    if(first->opcode == X64_MOV && second->num_operands == 2 && is_read_only_operand(second, 0)
+        && is_reg(&second->operands[0], temp_reg)) {
+        X64Operand from = first->operands[0];
+        X64Operand *other = &second->operands[1];
+
+        if(first->size != second->operands[0].size || operand_uses_reg(other, temp_reg)) return false;
+        if(from.type == OPERAND_MEMORY && other->type == OPERAND_MEMORY) return false;
+        if(from.type == OPERAND_IMMEDIATE && !can_use_immediate(second->opcode, from.immediate)) {
+            return false;
+        }
+        if(!is_temp_dead_after(window, index + 1, temp_reg, is_flushing)) return false;
+
+        second->operands[0] = from;
+        remove_instruction(window, index);
+        return true;
+    }
+
+    // mov a, temp; op s, temp; mov temp, b
+    if(index + 2 >= window->num_instructions || first->opcode != X64_MOV) return false;
+    X64Instruction *third = &window->instructions[index + 2];
+
+    X64Opcode opcode = second->opcode;
+    if(opcode != X64_ADD && opcode != X64_SUB && opcode != X64_IMUL) return false;
+    if(!is_reg(&second->operands[1], temp_reg)) return false;
+    if(!is_mov(third, OPERAND_REG, OPERAND_REG) || third->operands[0].reg != temp_reg) return false;
+    if(second->size != third->size) return false;
+
+    // a movl of an immediate sets the whole register, however wide the op is
+    bool is_zero_extended = first->size == 4 && first->operands[0].type == OPERAND_IMMEDIATE;
+    if(first->size != second->size && !is_zero_extended) return false;
+
+    RegLoc to_reg = third->operands[1].reg;
+    if(to_reg == temp_reg) return false;
+    if(operand_uses_reg(&second->operands[0], temp_reg)) return false;
+    if(operand_uses_reg(&second->operands[0], to_reg)) return false;
+    if(!is_temp_dead_after(window, index + 2, temp_reg, is_flushing)) return false;
+
+    first->operands[1] = operand_reg(to_reg, first->size);
+    second->operands[1] = third->operands[1];
+    remove_instruction(window, index + 2);
+    return true;
+}
+
+static bool fold_comparison_result(PeepholeWindow *window, int index, bool is_flushing) {
+    // xor temp, temp; cmp a, b; set temp; mov temp, reg can set reg directly,
+    // as long as the comparison doesn't use it. The comparison's operands
+    // can be loaded in between the xor and the cmp.
+    if(index < 2 || index + 1 >= window->num_instructions) return false;
+
+    X64Instruction *compare = &window->instructions[index - 1];
+    X64Instruction *set = &window->instructions[index];
+    X64Instruction *move = &window->instructions[index + 1];
+
+    if(compare->opcode != X64_CMP && compare->opcode != X64_TEST) return false;
+    if(set->opcode != X64_SET || set->operands[0].type != OPERAND_REG) return false;
+    if(!is_temp_reg(&set->operands[0])) return false;
+    RegLoc temp_reg = set->operands[0].reg;
+
+    if(!is_mov(move, OPERAND_REG, OPERAND_REG) || move->operands[0].reg != temp_reg) return false;
+    RegLoc to_reg = move->operands[1].reg;
+    if(to_reg == temp_reg || instruction_uses_reg(compare, to_reg)) return false;
+
+    int zero_index = index - 2;
+    for(; zero_index >= 0; --zero_index) {
+        X64Instruction *before = &window->instructions[zero_index];
+        if(is_zeroing(before) && is_reg(&before->operands[0], temp_reg)) break;
+
+        // moves don't touch the flags the xor will set
+        if(before->opcode != X64_MOV) return false;
+        if(instruction_uses_reg(before, temp_reg) || instruction_uses_reg(before, to_reg)) return false;
+    }
+    if(zero_index < 0) return false;
+    if(!is_temp_dead_after(window, index + 1, temp_reg, is_flushing)) return false;
+
+    X64Instruction *zero = &window->instructions[zero_index];
+    zero->size = 4;
+    zero->operands[0] = operand_reg(to_reg, 4);
+    zero->operands[1] = zero->operands[0];
+    set->operands[0] = operand_reg(to_reg, 1);
+    remove_instruction(window, index + 1);
+    return true;
+}
+
+static bool remove_dead_flags(PeepholeWindow *window, int index) {
+    // A compare or test whose flags are overwritten before being read
+    X64Opcode opcode = window->instructions[index].opcode;
+    if(opcode != X64_CMP && opcode != X64_TEST) return false;
+
+    for(int i = index + 1; i < window->num_instructions; ++i) {
+        X64Instruction *later = &window->instructions[i];
+        if(reads_flags(later)) return false;
+
+        if(writes_flags(later) || later->opcode == X64_CALL || later->opcode == X64_RET) {
+            remove_instruction(window, index);
+            return true;
+        }
+
+        if(later->opcode == X64_JMP) return false;
+    }
+
+    return false;
+}
+
+static bool shrink_zeroing(PeepholeWindow *window, int index) {
+    // a 32 bit xor zeroes the whole register, and is shorter
+    X64Instruction *instruction = &window->instructions[index];
+    if(!is_zeroing(instruction) || instruction->size != 8) return false;
+
+    instruction->size = 4;
+    instruction->operands[0].size = 4;
+    instruction->operands[1].size = 4;
+    return true;
+}
+
+static void optimise_window(PeepholeWindow *window, bool is_flushing) {
+    // Each rule either changes something and starts again, or leaves the
+    // window as it was, and all of them make the code shorter or smaller
+    bool is_changed = true;
+    while(is_changed) {
+        is_changed = false;
+
+        for(int i = 0; i < window->num_instructions && !is_changed; ++i) {
+            is_changed = remove_self_move(window, i)
+                || forward_slot(window, i)
+                || fold_move_chain(window, i, is_flushing)
+                || fold_comparison_result(window, i, is_flushing)
+                || remove_dead_flags(window, i)
+                || shrink_zeroing(window, i);
+        }
+    }
+}
+
+static void flush_window(PeepholeWindow *window) {
+    optimise_window(window, true);
+
+    for(int i = 0; i < window->num_instructions; ++i) {
+        machine_x64_append(window->out, &window->instructions[i]);
+    }
+    window->num_instructions = 0;
+}
+
+static void add_to_window(PeepholeWindow *window, X64Instruction *instruction) {
+    if(window->num_instructions == PEEPHOLE_WINDOW_SIZE) {
+        optimise_window(window, false);
+
+        if(window->num_instructions == PEEPHOLE_WINDOW_SIZE) {
+            machine_x64_append(window->out, &window->instructions[0]);
+            remove_instruction(window, 0);
+        }
+    }
+
+    window->instructions[window->num_instructions++] = *instruction;
+
+    // nothing can be moved past control flow
+    if(is_control_flow(instruction)) flush_window(window);
+}
+
+void peephole_x64_function(X64Function *func) {
+    // The window slides over the function in the order it's laid out, and
+    // is only flushed where a label could be jumped to. Until then, what's
+    // left over from one block goes out with the next one it falls into.
+    PeepholeWindow window;
+    window.num_instructions = 0;
+    window.out = NULL;
+
+    X64Block *optimised = xcc_malloc(sizeof(X64Block) * func->num_blocks);
+    memset(optimised, 0, sizeof(X64Block) * func->num_blocks);
+
+    for(int i = 0; i < func->num_blocks; ++i) {
+        X64Block *block = &func->blocks[i];
+        if(block->label >= 0 && window.out) flush_window(&window);
+        window.out = &optimised[i];
+
+        for(int j = 0; j < block->num_instructions; ++j) {
+            add_to_window(&window, &block->instructions[j]);
+        }
+    }
+    if(window.out) flush_window(&window);
+
+    for(int i = 0; i < func->num_blocks; ++i) {
+        X64Block *block = &func->blocks[i];
+        xcc_free(block->instructions);
+        block->instructions = optimised[i].instructions;
+        block->num_instructions = optimised[i].num_instructions;
+        block->num_instructions_allocated = optimised[i].num_instructions_allocated;
+    }
+    xcc_free(optimised);
+}
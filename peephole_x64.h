@@ -0,0 +1,7 @@
+#pragma once
+
+#include "xcc.h"
+
+// Tidies up the instructions of a function once they've all been generated,
+// before they're printed or encoded
+void peephole_x64_function(X64Function *func);
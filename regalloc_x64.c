@@ -0,0 +1,544 @@
+// Linear scan register allocation over virtual registers, for -O
+//
+// The instructions are numbered in the order their blocks are laid out, and
+// every virtual register gets a live interval stretching over everywhere
+// it's live, which is found from the blocks it's live into and out of. The
+// intervals are given registers in order of their starts, and once the
+// registers run out, whichever interval ends last is spilled to the stack.
+// Moves in a parallel group all share a point, since they happen at once.
+#include "xcc.h"
+
+typedef struct {
+    int vreg;
+    int start;
+    int end;
+
+    bool crosses_call;
+    RegLoc hint; // moved to or from, or REG_LAST
+    int size; // the largest it's used at, which its stack slot needs
+
+    bool is_spilled;
+    RegLoc reg;
+    int stack_offset;
+} LiveInterval;
+
+typedef struct {
+    X64Function *func;
+    int num_points;
+
+    // by block, and then by instruction within it
+    int **points;
+    int *block_starts;
+    int *block_ends;
+
+    // num_vregs flags for each block
+    bool *live_in;
+    bool *live_out;
+
+    // by vreg, and only those used are allocated
+    LiveInterval *intervals;
+
+    int *call_points;
+    int num_call_points;
+    int num_call_points_allocated;
+} LinearScan;
+
+// The vregs an instruction touches, at most one per operand
+typedef struct {
+    int vregs[2];
+    bool is_read[2];
+    bool is_written[2];
+    int sizes[2];
+    int num_vregs;
+} VregAccesses;
+
+// RAX and R11 are left for the code generator, and the caller saved ones
+// come first since they're free to use
+static const RegLoc allocatable_registers[] = {
+    REG_R10, REG_RSI, REG_RDI, REG_RDX, REG_RCX, REG_R8, REG_R9,
+    REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15
+};
+#define NUM_ALLOCATABLE_REGISTERS ((int) (sizeof(allocatable_registers) / sizeof(allocatable_registers[0])))
+
+static bool is_callee_saved(RegLoc reg) {
+    return reg == REG_RBX || reg == REG_R12 || reg == REG_R13 || reg == REG_R14 || reg == REG_R15;
+}
+
+static bool is_allocatable(RegLoc reg) {
+    for (int i = 0; i < NUM_ALLOCATABLE_REGISTERS; ++i) {
+        if (allocatable_registers[i] == reg) return true;
+    }
+    return false;
+}
+
+static void find_accesses(X64Instruction *instruction, VregAccesses *accesses) {
+    accesses->num_vregs = 0;
+    X64Opcode opcode = instruction->opcode;
+
+    // xor of a register with itself only zeroes it
+    bool is_zeroing = opcode == X64_XOR && instruction->num_operands == 2
+        && machine_x64_same_location(&instruction->operands[0], &instruction->operands[1]);
+
+    for (int i = 0; i < instruction->num_operands; ++i) {
+        X64Operand *operand = &instruction->operands[i];
+        int index = accesses->num_vregs;
+
+        if (operand->type == OPERAND_MEMORY && operand->memory.base_vreg >= 0) {
+            accesses->vregs[index] = operand->memory.base_vreg;
+            accesses->is_read[index] = true;
+            accesses->is_written[index] = false;
+            accesses->sizes[index] = 8;
+            accesses->num_vregs++;
+            continue;
+        }
+        if (operand->type != OPERAND_VREG) continue;
+
+        // the two operands of a zeroing xor are the one write
+        if (is_zeroing && i == 1) continue;
+
+        bool is_read;
+        bool is_written;
+        switch (opcode) {
+            case X64_MOV: case X64_MOVSX: case X64_PARALLEL_MOV: case X64_POP:
+                is_read = i == 0 && opcode != X64_POP;
+                is_written = !is_read;
+                break;
+            case X64_ADD: case X64_SUB: case X64_IMUL: case X64_XOR:
+                is_read = !is_zeroing;
+                is_written = i == 1 || is_zeroing;
+                break;
+            case X64_SET:
+                // only the low byte is set, so the rest is still needed
+                is_read = true;
+                is_written = true;
+                break;
+            default:
+                is_read = true;
+                is_written = false;
+                break;
+        }
+
+        accesses->vregs[index] = operand->vreg;
+        accesses->is_read[index] = is_read;
+        accesses->is_written[index] = is_written;
+        accesses->sizes[index] = operand->size;
+        accesses->num_vregs++;
+    }
+}
+
+static int find_block_with_label(X64Function *func, int label) {
+    for (int i = 0; i < func->num_blocks; ++i) {
+        if (func->blocks[i].label == label) return i;
+    }
+    xcc_assert_not_reached_msg("jump to a label with no block");
+}
+
+static bool falls_through(X64Function *func, int index) {
+    X64Block *block = &func->blocks[index];
+    if (index + 1 >= func->num_blocks) return false;
+    if (block->num_instructions == 0) return true;
+
+    X64Opcode last = block->instructions[block->num_instructions - 1].opcode;
+    return last != X64_JMP && last != X64_RET;
+}
+
+static void number_instructions(LinearScan *scan) {
+    X64Function *func = scan->func;
+    scan->num_points = 0;
+
+    for (int i = 0; i < func->num_blocks; ++i) {
+        X64Block *block = &func->blocks[i];
+        scan->points[i] = xcc_malloc(sizeof(int) * (block->num_instructions + 1));
+
+        // the entry point, where everything live in is
+        scan->block_starts[i] = scan->num_points++;
+        scan->block_ends[i] = scan->block_starts[i];
+
+        for (int j = 0; j < block->num_instructions; ++j) {
+            X64Instruction *instruction = &block->instructions[j];
+            bool is_in_group = j > 0 && machine_x64_is_in_group(instruction, &block->instructions[j - 1]);
+
+            int point = is_in_group ? scan->num_points - 1 : scan->num_points++;
+            scan->points[i][j] = point;
+            scan->block_ends[i] = point;
+
+            if (instruction->opcode == X64_CALL) {
+                int *call_point;
+                LIST_STRUCT_APPEND_FUNC(
+                    int, scan, num_call_points, num_call_points_allocated, call_points, call_point
+                );
+                *call_point = point;
+            }
+        }
+    }
+}
+
+static void add_live_in(LinearScan *scan, bool *live, int successor) {
+    int num_vregs = scan->func->num_vregs;
+    bool *successor_live_in = &scan->live_in[successor * num_vregs];
+
+    for (int i = 0; i < num_vregs; ++i) {
+        if (successor_live_in[i]) live[i] = true;
+    }
+}
+
+static void find_live_vregs(LinearScan *scan) {
+    // Backwards dataflow until nothing changes. Every jump out of a block
+    // is counted as if it were at the end, which can only make things live
+    // for longer than they need to be.
+    X64Function *func = scan->func;
+    int num_vregs = func->num_vregs;
+    bool *live = xcc_malloc(sizeof(bool) * (num_vregs + 1));
+
+    bool is_changed = true;
+    while (is_changed) {
+        is_changed = false;
+
+        for (int i = func->num_blocks - 1; i >= 0; --i) {
+            X64Block *block = &func->blocks[i];
+            bool *live_out = &scan->live_out[i * num_vregs];
+
+            if (falls_through(func, i)) add_live_in(scan, live_out, i + 1);
+            for (int j = 0; j < block->num_instructions; ++j) {
+                X64Instruction *instruction = &block->instructions[j];
+                if (instruction->opcode == X64_JMP || instruction->opcode == X64_JCC) {
+                    add_live_in(scan, live_out, find_block_with_label(func, instruction->operands[0].label));
+                }
+            }
+
+            memcpy(live, live_out, sizeof(bool) * num_vregs);
+
+            int j = block->num_instructions - 1;
+            while (j >= 0) {
+                // a parallel group reads everything before writing anything
+                int group_start = j;
+                while (group_start > 0 && scan->points[i][group_start - 1] == scan->points[i][j]) {
+                    group_start--;
+                }
+
+                VregAccesses accesses;
+                for (int k = group_start; k <= j; ++k) {
+                    find_accesses(&block->instructions[k], &accesses);
+                    for (int access = 0; access < accesses.num_vregs; ++access) {
+                        if (accesses.is_written[access]) live[accesses.vregs[access]] = false;
+                    }
+                }
+                for (int k = group_start; k <= j; ++k) {
+                    find_accesses(&block->instructions[k], &accesses);
+                    for (int access = 0; access < accesses.num_vregs; ++access) {
+                        if (accesses.is_read[access]) live[accesses.vregs[access]] = true;
+                    }
+                }
+
+                j = group_start - 1;
+            }
+
+            bool *live_in = &scan->live_in[i * num_vregs];
+            if (memcmp(live, live_in, sizeof(bool) * num_vregs)) {
+                memcpy(live_in, live, sizeof(bool) * num_vregs);
+                is_changed = true;
+            }
+        }
+    }
+
+    xcc_free(live);
+}
+
+static void extend_interval(LiveInterval *interval, int point) {
+    if (interval->start < 0 || point < interval->start) interval->start = point;
+    if (point > interval->end) interval->end = point;
+}
+
+static void note_hint(LiveInterval *interval, X64Operand *other) {
+    // a value moved to or from a register is best off already being there
+    if (interval->hint != REG_LAST || other->type != OPERAND_REG) return;
+    if (is_allocatable(other->reg)) interval->hint = other->reg;
+}
+
+static void build_intervals(LinearScan *scan) {
+    X64Function *func = scan->func;
+    int num_vregs = func->num_vregs;
+
+    for (int i = 0; i < num_vregs; ++i) {
+        LiveInterval *interval = &scan->intervals[i];
+        interval->vreg = i;
+        interval->start = -1;
+        interval->end = -1;
+        interval->crosses_call = false;
+        interval->hint = REG_LAST;
+        interval->size = 0;
+        interval->is_spilled = false;
+        interval->reg = REG_LAST;
+        interval->stack_offset = 0;
+    }
+
+    for (int i = 0; i < func->num_blocks; ++i) {
+        X64Block *block = &func->blocks[i];
+
+        for (int j = 0; j < block->num_instructions; ++j) {
+            X64Instruction *instruction = &block->instructions[j];
+            VregAccesses accesses;
+            find_accesses(instruction, &accesses);
+
+            for (int k = 0; k < accesses.num_vregs; ++k) {
+                LiveInterval *interval = &scan->intervals[accesses.vregs[k]];
+                extend_interval(interval, scan->points[i][j]);
+                if (accesses.sizes[k] > interval->size) interval->size = accesses.sizes[k];
+            }
+
+            bool is_move = instruction->opcode == X64_MOV || instruction->opcode == X64_PARALLEL_MOV;
+            if (is_move && instruction->operands[0].type == OPERAND_VREG) {
+                note_hint(&scan->intervals[instruction->operands[0].vreg], &instruction->operands[1]);
+            }
+            if (is_move && instruction->operands[1].type == OPERAND_VREG) {
+                note_hint(&scan->intervals[instruction->operands[1].vreg], &instruction->operands[0]);
+            }
+        }
+
+        // Live out is past the moves at the end, so those can't take the
+        // register of something still needed
+        for (int j = 0; j < num_vregs; ++j) {
+            if (scan->live_in[i * num_vregs + j]) {
+                extend_interval(&scan->intervals[j], scan->block_starts[i]);
+            }
+            if (scan->live_out[i * num_vregs + j]) {
+                extend_interval(&scan->intervals[j], scan->block_ends[i] + 1);
+            }
+        }
+    }
+
+    for (int i = 0; i < num_vregs; ++i) {
+        LiveInterval *interval = &scan->intervals[i];
+        if (interval->start < 0) continue;
+
+        // A value which is never read still needs its register as it's
+        // written, which matters when others are written at the same point
+        if (interval->end == interval->start) interval->end++;
+
+        // call points are in order, so find the first after the start
+        int low = 0;
+        int high = scan->num_call_points;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (scan->call_points[middle] <= interval->start) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        // the arguments are used up before the call, and its result set after
+        interval->crosses_call = low < scan->num_call_points && scan->call_points[low] < interval->end;
+    }
+}
+
+static bool register_is_allowed(LiveInterval *interval, RegLoc reg) {
+    return !interval->crosses_call || is_callee_saved(reg);
+}
+
+static RegLoc choose_register(LiveInterval *interval, LiveInterval **register_owners) {
+    // Returns REG_LAST if there isn't a free register
+    RegLoc hint = interval->hint;
+    if (hint != REG_LAST && !register_owners[hint] && register_is_allowed(interval, hint)) {
+        return hint;
+    }
+
+    for (int i = 0; i < NUM_ALLOCATABLE_REGISTERS; ++i) {
+        RegLoc reg = allocatable_registers[i];
+        if (!register_owners[reg] && register_is_allowed(interval, reg)) {
+            return reg;
+        }
+    }
+
+    return REG_LAST;
+}
+
+static int compare_intervals(const void *a, const void *b) {
+    const LiveInterval *interval_a = *(LiveInterval * const *) a;
+    const LiveInterval *interval_b = *(LiveInterval * const *) b;
+
+    if (interval_a->start != interval_b->start) {
+        return interval_a->start < interval_b->start ? -1 : 1;
+    }
+    return interval_a->vreg - interval_b->vreg;
+}
+
+static void scan_intervals(LinearScan *scan) {
+    int num_vregs = scan->func->num_vregs;
+    LiveInterval **order = xcc_malloc(sizeof(LiveInterval *) * (num_vregs + 1));
+    int num_used = 0;
+
+    for (int i = 0; i < num_vregs; ++i) {
+        if (scan->intervals[i].start >= 0) order[num_used++] = &scan->intervals[i];
+    }
+    if (num_used) {
+        qsort(order, num_used, sizeof(LiveInterval *), compare_intervals);
+    }
+
+    LiveInterval *register_owners[REG_LAST];
+    for (int i = 0; i < REG_LAST; ++i) {
+        register_owners[i] = NULL;
+    }
+
+    for (int i = 0; i < num_used; ++i) {
+        LiveInterval *interval = order[i];
+
+        // A value can take the register of one last used where it's set,
+        // since instructions read their operands before writing
+        for (int j = 0; j < NUM_ALLOCATABLE_REGISTERS; ++j) {
+            RegLoc reg = allocatable_registers[j];
+            if (register_owners[reg] && register_owners[reg]->end <= interval->start) {
+                register_owners[reg] = NULL;
+            }
+        }
+
+        RegLoc reg = choose_register(interval, register_owners);
+
+        if (reg == REG_LAST) {
+            // Under pressure, spill whichever interval ends last
+            LiveInterval *victim = NULL;
+            for (int j = 0; j < NUM_ALLOCATABLE_REGISTERS; ++j) {
+                RegLoc candidate_reg = allocatable_registers[j];
+                LiveInterval *owner = register_owners[candidate_reg];
+
+                if (!owner || !register_is_allowed(interval, candidate_reg)) continue;
+                if (!victim || owner->end > victim->end) victim = owner;
+            }
+
+            if (victim && victim->end > interval->end) {
+                reg = victim->reg;
+                victim->is_spilled = true;
+                victim->reg = REG_LAST;
+            }
+        }
+
+        if (reg == REG_LAST) {
+            interval->is_spilled = true;
+        } else {
+            interval->reg = reg;
+            register_owners[reg] = interval;
+        }
+    }
+
+    xcc_free(order);
+}
+
+static void place_intervals(LinearScan *scan) {
+    // Sets the frame size, with the saved registers at the top of the
+    // frame and the spilled values below them
+    X64Function *func = scan->func;
+    int num_saved_registers = 0;
+    func->saved_registers = 0;
+
+    for (int i = 0; i < func->num_vregs; ++i) {
+        LiveInterval *interval = &scan->intervals[i];
+        if (interval->start < 0 || interval->is_spilled || !is_callee_saved(interval->reg)) continue;
+
+        if (!(func->saved_registers & (1u << interval->reg))) {
+            func->saved_registers |= 1u << interval->reg;
+            num_saved_registers++;
+        }
+    }
+
+    int depth = num_saved_registers * VALUE_POS_SAVED_REGISTER_SIZE;
+
+    for (int i = 0; i < func->num_vregs; ++i) {
+        LiveInterval *interval = &scan->intervals[i];
+        if (interval->start < 0 || !interval->is_spilled) continue;
+
+        interval->stack_offset = align_up(depth + interval->size, interval->size);
+        depth = interval->stack_offset;
+    }
+
+    // Calls need the stack 16 byte aligned, which it is after pushing %rbp
+    // as long as the rest of the frame is a multiple of 16
+    func->frame_size = align_up(depth, 16);
+}
+
+static X64Operand allocated_operand(LinearScan *scan, int vreg, int size) {
+    LiveInterval *interval = &scan->intervals[vreg];
+    xcc_assert(interval->start >= 0);
+
+    if (interval->is_spilled) {
+        return operand_memory(REG_RBP, -interval->stack_offset, size);
+    }
+    return operand_reg(interval->reg, size);
+}
+
+static void rewrite_instructions(LinearScan *scan) {
+    // Every vreg is replaced by where it ended up. A spilled pointer is
+    // loaded into R11 to be used as a base.
+    X64Function *func = scan->func;
+
+    for (int i = 0; i < func->num_blocks; ++i) {
+        X64Block *block = &func->blocks[i];
+        X64Block out;
+        memset(&out, 0, sizeof(X64Block));
+
+        for (int j = 0; j < block->num_instructions; ++j) {
+            X64Instruction instruction = block->instructions[j];
+
+            for (int k = 0; k < instruction.num_operands; ++k) {
+                X64Operand *operand = &instruction.operands[k];
+
+                if (operand->type == OPERAND_VREG) {
+                    *operand = allocated_operand(scan, operand->vreg, operand->size);
+                } else if (operand->type == OPERAND_MEMORY && operand->memory.base_vreg >= 0) {
+                    X64Operand base = allocated_operand(scan, operand->memory.base_vreg, 8);
+
+                    if (base.type == OPERAND_MEMORY) {
+                        X64Instruction load = machine_x64_instruction(
+                            X64_MOV, 8, 2, base, operand_reg(REG_R11, 8)
+                        );
+                        machine_x64_append(&out, &load);
+                        base = operand_reg(REG_R11, 8);
+                    }
+
+                    *operand = operand_memory(base.reg, operand->memory.displacement, operand->size);
+                }
+            }
+
+            machine_x64_append(&out, &instruction);
+        }
+
+        xcc_free(block->instructions);
+        block->instructions = out.instructions;
+        block->num_instructions = out.num_instructions;
+        block->num_instructions_allocated = out.num_instructions_allocated;
+    }
+}
+
+void regalloc_x64_function(X64Function *func) {
+    LinearScan scan;
+    memset(&scan, 0, sizeof(LinearScan));
+    scan.func = func;
+
+    int num_vregs = func->num_vregs;
+    int num_blocks = func->num_blocks;
+    scan.points = xcc_malloc(sizeof(int *) * num_blocks);
+    scan.block_starts = xcc_malloc(sizeof(int) * num_blocks);
+    scan.block_ends = xcc_malloc(sizeof(int) * num_blocks);
+    scan.live_in = xcc_malloc(sizeof(bool) * (num_vregs * num_blocks + 1));
+    scan.live_out = xcc_malloc(sizeof(bool) * (num_vregs * num_blocks + 1));
+    scan.intervals = xcc_malloc(sizeof(LiveInterval) * (num_vregs + 1));
+    memset(scan.live_in, 0, sizeof(bool) * num_vregs * num_blocks);
+    memset(scan.live_out, 0, sizeof(bool) * num_vregs * num_blocks);
+
+    number_instructions(&scan);
+    find_live_vregs(&scan);
+    build_intervals(&scan);
+    scan_intervals(&scan);
+    place_intervals(&scan);
+    rewrite_instructions(&scan);
+
+    for (int i = 0; i < num_blocks; ++i) {
+        xcc_free(scan.points[i]);
+    }
+    xcc_free(scan.points);
+    xcc_free(scan.block_starts);
+    xcc_free(scan.block_ends);
+    xcc_free(scan.live_in);
+    xcc_free(scan.live_out);
+    xcc_free(scan.intervals);
+    xcc_free(scan.call_points);
+}
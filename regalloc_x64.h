@@ -0,0 +1,5 @@
+#pragma once
+
+#include "xcc.h"
+
+void regalloc_x64_function(X64Function *func);
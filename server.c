@@ -0,0 +1,461 @@
+// Checks files for an editor, staying alive between edits, with --server
+//
+// Commands are read from stdin, one per line:
+//
+//   open PATH       reads PATH and checks it
+//   edit PATH LINE NUM_REMOVED NUM_ADDED
+//                   replaces NUM_REMOVED lines, starting at LINE (counting
+//                   from 1), with the NUM_ADDED lines after the command, then
+//                   checks the file again
+//   close PATH
+//   quit
+//
+// The response to open and edit is on stderr, like a compile's: the program
+// errors, then a line with how many there were.
+//
+// Every check lexes the whole file again, and compares the tokens with the
+// last check's. A function definition whose tokens are all the same has only
+// its declarator parsed and checked again, as long as its body had no errors
+// and every top level declaration the body uses is still the same. So an
+// edit inside one function only checks the body of that function.
+#include "xcc.h"
+
+typedef struct {
+    char *name;
+    Type *type;
+    DeclarationType decl_type;
+} ServerDependency;
+
+typedef struct {
+    // where the declaration is in the file's tokens
+    int start_token;
+    int end_token;
+
+    // For a function definition whose body had no errors when it was last
+    // checked, with the top level declarations the body used then
+    bool has_clean_body;
+    ServerDependency *dependencies;
+    int num_dependencies;
+    int num_dependencies_allocated;
+} ServerItem;
+
+typedef struct {
+    ServerItem *items;
+    int num_items;
+    int num_items_allocated;
+} ServerItemList;
+
+typedef struct {
+    char *path;
+    char *source;
+    Lexer *lexer; // from the last check which got past lexing, or NULL
+    ServerItemList items; // every top level declaration in lexer
+} ServerFile;
+
+typedef struct {
+    ServerFile *files;
+    int num_files;
+    int num_files_allocated;
+} Server;
+
+static char *copy_string(const char *s) {
+    char *copy = xcc_malloc(strlen(s) + 1);
+    strcpy(copy, s);
+    return copy;
+}
+
+static void free_items(ServerItemList *list) {
+    for (int i = 0; i < list->num_items; ++i) {
+        ServerItem *item = &list->items[i];
+
+        for (int j = 0; j < item->num_dependencies; ++j) {
+            xcc_free(item->dependencies[j].name);
+        }
+        xcc_free(item->dependencies);
+    }
+    xcc_free(list->items);
+}
+
+static void free_file(ServerFile *file) {
+    xcc_free(file->path);
+    xcc_free(file->source);
+    if (file->lexer) lex_free_lexer(file->lexer);
+    free_items(&file->items);
+}
+
+static ServerFile *find_file(Server *server, const char *path) {
+    for (int i = 0; i < server->num_files; ++i) {
+        if (!strcmp(server->files[i].path, path)) return &server->files[i];
+    }
+    return NULL;
+}
+
+static bool tokens_match(Token *a, Token *b) {
+    return a->type == b->type && a->contents_length == b->contents_length
+        && (!a->contents_length || !memcmp(a->contents, b->contents, a->contents_length));
+}
+
+static void count_same_tokens(Lexer *old_lexer, Lexer *lexer, int *num_same_at_start, int *num_same_at_end) {
+    // How many tokens match at the start, and at the end, not counting the
+    // EOF tokens. The two can overlap, e.g. after adding a declaration which
+    // starts with the same `int` as the one after it, and the declaration
+    // after it should still be found in the tokens that match at the end.
+    int old_num_tokens = old_lexer->num_tokens - 1;
+    int num_tokens = lexer->num_tokens - 1;
+
+    int same_at_start = 0;
+    while (
+        same_at_start < old_num_tokens && same_at_start < num_tokens &&
+        tokens_match(&old_lexer->tokens[same_at_start], &lexer->tokens[same_at_start])
+    ) {
+        same_at_start++;
+    }
+
+    int same_at_end = 0;
+    while (
+        same_at_end < old_num_tokens && same_at_end < num_tokens &&
+        tokens_match(
+            &old_lexer->tokens[old_num_tokens - 1 - same_at_end],
+            &lexer->tokens[num_tokens - 1 - same_at_end]
+        )
+    ) {
+        same_at_end++;
+    }
+
+    *num_same_at_start = same_at_start;
+    *num_same_at_end = same_at_end;
+}
+
+static int moved_start_token(ServerItem *item, Lexer *old_lexer, Lexer *lexer,
+                             int num_same_at_start, int num_same_at_end) {
+    // Where an old declaration starts in the new tokens, or -1 if any of its
+    // tokens changed
+    if (item->end_token <= num_same_at_start) {
+        return item->start_token;
+    }
+
+    int old_num_tokens = old_lexer->num_tokens;
+    if (item->start_token >= old_num_tokens - 1 - num_same_at_end) {
+        return item->start_token + ((int) lexer->num_tokens - old_num_tokens);
+    }
+
+    return -1;
+}
+
+static bool has_dependency(ServerItem *item, const char *name) {
+    for (int i = 0; i < item->num_dependencies; ++i) {
+        if (!strcmp(item->dependencies[i].name, name)) return true;
+    }
+    return false;
+}
+
+static void add_dependencies(ServerItem *item, AST *ast, Declaration *function_declaration) {
+    // Every top level declaration used in a function body, apart from the
+    // function itself, which is checked with the declarator anyway
+    if (ast->type == AST_IDENT_USE) {
+        Declaration *declaration = ast->declaration;
+
+        if (
+            declaration->scope_level == 0 && declaration != function_declaration &&
+            !has_dependency(item, declaration->name)
+        ) {
+            ServerDependency *dependency;
+            LIST_STRUCT_APPEND_FUNC(
+                ServerDependency, item, num_dependencies,
+                num_dependencies_allocated, dependencies, dependency
+            );
+            dependency->name = copy_string(declaration->name);
+            dependency->type = declaration->type;
+            dependency->decl_type = declaration->decl_type;
+        }
+    }
+
+    for (int i = 0; i < ast->num_nodes; ++i) {
+        add_dependencies(item, ast->nodes[i], function_declaration);
+    }
+}
+
+static bool has_same_dependencies(ServerItem *item, ResolutionList *res_list) {
+    // Types are interned, so the same type is the same pointer
+    for (int i = 0; i < item->num_dependencies; ++i) {
+        ServerDependency *dependency = &item->dependencies[i];
+        Declaration *declaration = resolve_find_declaration(res_list, dependency->name);
+
+        if (
+            !declaration || declaration->type != dependency->type ||
+            declaration->decl_type != dependency->decl_type
+        ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void take_body_state(ServerItem *item, ServerItem *old_item) {
+    item->has_clean_body = old_item->has_clean_body;
+    item->dependencies = old_item->dependencies;
+    item->num_dependencies = old_item->num_dependencies;
+    item->num_dependencies_allocated = old_item->num_dependencies_allocated;
+
+    old_item->dependencies = NULL;
+    old_item->num_dependencies = 0;
+    old_item->num_dependencies_allocated = 0;
+}
+
+static void check_file(ServerFile *file) {
+    int old_num_errors = xcc_num_prog_errors();
+
+    // after a lexing error, the next check is compared with the last tokens
+    // that could be lexed
+    Lexer *lexer = lex_string(file->source, file->path);
+    if (!lexer) {
+        fprintf(stderr, "%d program error%s\n", xcc_num_prog_errors() - old_num_errors,
+                xcc_num_prog_errors() - old_num_errors == 1 ? "" : "s");
+        return;
+    }
+
+    int num_same_at_start = 0;
+    int num_same_at_end = 0;
+    if (file->lexer) {
+        count_same_tokens(file->lexer, lexer, &num_same_at_start, &num_same_at_end);
+    }
+
+    Parser parser;
+    parser_init(&parser, lexer);
+
+    AST *program_ast = ast_new(AST_PROGRAM, &lexer->tokens[0]);
+    ResolutionList *res_list = resolve_begin(NULL);
+
+    ServerItemList items;
+    memset(&items, 0, sizeof(ServerItemList));
+    ServerItemList *items_ptr = &items;
+
+    // As in --stream, nothing is checked after a parse error
+    bool has_parse_error = false;
+    int next_old_item = 0;
+    int num_bodies = 0;
+    int num_bodies_checked = 0;
+
+    while (true) {
+        int start_token = parser.current_token;
+
+        // the old declaration starting here, if none of its tokens changed
+        ServerItem *old_item = NULL;
+        while (file->lexer && next_old_item < file->items.num_items) {
+            int old_start_token = moved_start_token(
+                &file->items.items[next_old_item], file->lexer, lexer,
+                num_same_at_start, num_same_at_end
+            );
+
+            if (old_start_token < start_token) {
+                next_old_item++;
+                continue;
+            }
+            if (old_start_token == start_token) {
+                old_item = &file->items.items[next_old_item++];
+            }
+            break;
+        }
+
+        bool reuses_body = !has_parse_error && old_item && old_item->has_clean_body
+            && has_same_dependencies(old_item, res_list);
+
+        int num_errors_before_parse = xcc_num_prog_errors();
+        parser.skips_function_body = reuses_body;
+        AST *declaration_ast = parse_top_level_declaration(&parser);
+        parser.skips_function_body = false;
+
+        has_parse_error = has_parse_error || xcc_num_prog_errors() != num_errors_before_parse;
+        if (!declaration_ast) break;
+        ast_append(program_ast, declaration_ast);
+
+        ServerItem *item;
+        LIST_STRUCT_APPEND_FUNC(ServerItem, items_ptr, num_items, num_items_allocated, items, item);
+        memset(item, 0, sizeof(ServerItem));
+        item->start_token = start_token;
+        item->end_token = parser.current_token;
+
+        if (has_parse_error) {
+            // only parsed, so whatever was known about the body still holds
+            if (old_item) take_body_state(item, old_item);
+            continue;
+        }
+
+        bool is_checked = check_top_level(res_list, program_ast, declaration_ast, !reuses_body);
+        if (declaration_ast->type != AST_FUNCTION_DEFINITION) continue;
+        num_bodies++;
+
+        if (reuses_body) {
+            // An error in the declarator is reported again every time, as
+            // it would be when checking the whole function
+            take_body_state(item, old_item);
+        } else {
+            num_bodies_checked++;
+            if (is_checked) {
+                item->has_clean_body = true;
+                add_dependencies(item, declaration_ast->nodes[2], declaration_ast->declaration);
+            }
+        }
+    }
+
+    ast_free(program_ast);
+    resolve_free(res_list);
+
+    free_items(&file->items);
+    file->items = items;
+    if (file->lexer) lex_free_lexer(file->lexer);
+    file->lexer = lexer;
+
+    int num_errors = xcc_num_prog_errors() - old_num_errors;
+    if (xcc_verbose()) {
+        fprintf(stderr, "Checked %d of %d function bodies\n", num_bodies_checked, num_bodies);
+    }
+    fprintf(stderr, "%d program error%s\n", num_errors, num_errors == 1 ? "" : "s");
+}
+
+static void open_file(Server *server, const char *path) {
+    // Opening a file which is already open reads it again
+    FILE *stream = fopen(path, "r");
+    if (!stream) {
+        fprintf(stderr, "Couldn't open `%s`: %s\n", path, strerror(errno));
+        return;
+    }
+    const char *source = lex_read_file(stream);
+    fclose(stream);
+
+    ServerFile *file = find_file(server, path);
+    if (file) {
+        xcc_free(file->source);
+    } else {
+        Server *server_ptr = server;
+        LIST_STRUCT_APPEND_FUNC(ServerFile, server_ptr, num_files, num_files_allocated, files, file);
+        memset(file, 0, sizeof(ServerFile));
+        file->path = copy_string(path);
+    }
+    file->source = (char *) source;
+
+    check_file(file);
+}
+
+static bool find_line(const char *source, int line, size_t *offset) {
+    // The offset of the start of line (counting from 1), which can be the
+    // end of the source. False if the source is shorter than that.
+    const char *c = source;
+    for (int i = 1; i < line; ++i) {
+        c = strchr(c, '\n');
+        if (!c) return false;
+        c++;
+    }
+
+    *offset = c - source;
+    return true;
+}
+
+static void edit_file(ServerFile *file, int line, int num_removed, const char *added, size_t added_length) {
+    size_t start;
+    size_t end;
+    if (line < 1 || num_removed < 0 || !find_line(file->source, line, &start) ||
+        !find_line(file->source, line + num_removed, &end)) {
+        fprintf(stderr, "Edit past the end of `%s`\n", file->path);
+        return;
+    }
+
+    size_t source_length = strlen(file->source);
+    size_t new_length = source_length - (end - start) + added_length;
+    char *new_source = xcc_malloc(new_length + 1);
+
+    memcpy(new_source, file->source, start);
+    memcpy(new_source + start, added, added_length);
+    memcpy(new_source + start + added_length, file->source + end, source_length - end + 1);
+
+    xcc_free(file->source);
+    file->source = new_source;
+
+    check_file(file);
+}
+
+static bool parse_count(char **saveptr, int *count) {
+    const char *field = strtok_r(NULL, " ", saveptr);
+    if (!field) return false;
+
+    char *end;
+    long value = strtol(field, &end, 10);
+    *count = value;
+    return *field && !*end && value >= 0 && value <= 1 << 30;
+}
+
+int server_run() {
+    // Returns the exit code once stdin ends or says quit
+    Server server;
+    memset(&server, 0, sizeof(Server));
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+
+    while ((line_length = getline(&line, &line_capacity, stdin)) >= 0) {
+        if (line_length > 0 && line[line_length - 1] == '\n') line[line_length - 1] = '\0';
+
+        char *saveptr;
+        const char *command = strtok_r(line, " ", &saveptr);
+        if (!command) continue;
+        if (!strcmp(command, "quit")) break;
+
+        const char *path = strtok_r(NULL, " ", &saveptr);
+        if (!path) {
+            fprintf(stderr, "No file given to `%s`\n", command);
+            continue;
+        }
+
+        ServerFile *file = find_file(&server, path);
+        bool needs_open_file = strcmp(command, "open") != 0;
+        if (needs_open_file && !file) {
+            fprintf(stderr, "`%s` isn't open\n", path);
+            continue;
+        }
+
+        if (!strcmp(command, "open")) {
+            open_file(&server, path);
+        } else if (!strcmp(command, "edit")) {
+            int edit_line, num_removed, num_added;
+            if (
+                !parse_count(&saveptr, &edit_line) || !parse_count(&saveptr, &num_removed) ||
+                !parse_count(&saveptr, &num_added)
+            ) {
+                fprintf(stderr, "Expected `edit PATH LINE NUM_REMOVED NUM_ADDED`\n");
+                continue;
+            }
+
+            // the added lines are read before anything can go wrong, so
+            // that they aren't taken as commands
+            char *added = NULL;
+            size_t added_length = 0;
+            FILE *added_stream = open_memstream(&added, &added_length);
+            xcc_assert_msg(added_stream, "open_memstream() failed");
+
+            for (int i = 0; i < num_added && (line_length = getline(&line, &line_capacity, stdin)) >= 0; ++i) {
+                fputs(line, added_stream);
+                if (line_length == 0 || line[line_length - 1] != '\n') fputc('\n', added_stream);
+            }
+            xcc_assert_msg(!fclose(added_stream), "failed to close edit buffer");
+
+            edit_file(file, edit_line, num_removed, added, added_length);
+            free(added); // allocated by open_memstream()
+        } else if (!strcmp(command, "close")) {
+            free_file(file);
+            *file = server.files[--server.num_files];
+        } else {
+            fprintf(stderr, "Unknown command `%s`\n", command);
+        }
+    }
+
+    free(line); // allocated by getline()
+
+    for (int i = 0; i < server.num_files; ++i) {
+        free_file(&server.files[i]);
+    }
+    xcc_free(server.files);
+    type_free_all();
+
+    return 0;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "xcc.h"
+
+// Checks the files an editor opens and edits, reading commands from stdin
+int server_run();
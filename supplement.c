@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdio.h>
 
 void supplement_print_int(int x) {
@@ -12,6 +13,11 @@ void supplement_print_char_int(int x) {
 void supplement_print_nl(void) {
     printf("\n");
 }
+// calls have to leave the stack 16 byte aligned, which puts the frame
+// pointer on a boundary too
+void supplement_print_stack_alignment(int x) {
+    printf(((uintptr_t) __builtin_frame_address(0) & 15) ? "misaligned" : "aligned");
+}
 
 int supplement_glob_1;
 
@@ -0,0 +1,68 @@
+// Hashing names, and looking them up in a table
+#include "xcc.h"
+
+unsigned int symbol_table_hash(const char *name, size_t length) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void allocate_slots(SymbolTable *table, size_t num_slots) {
+    table->slots = xcc_malloc(sizeof(SymbolTableSlot) * num_slots);
+    memset(table->slots, 0, sizeof(SymbolTableSlot) * num_slots);
+    table->num_slots = num_slots;
+}
+
+void symbol_table_init(SymbolTable *table) {
+    allocate_slots(table, 16);
+    table->num_names = 0;
+}
+
+void symbol_table_free(SymbolTable *table) {
+    xcc_free(table->slots);
+    table->slots = NULL;
+}
+
+static SymbolTableSlot *find_slot(SymbolTable *table, const char *name, unsigned int hash) {
+    // The table is never more than half full, so this always finds either
+    // the name or an empty slot
+    size_t mask = table->num_slots - 1;
+    size_t i = hash & mask;
+    while (table->slots[i].name) {
+        if (table->slots[i].hash == hash && !strcmp(table->slots[i].name, name)) break;
+        i = (i + 1) & mask;
+    }
+    return &table->slots[i];
+}
+
+int symbol_table_find(SymbolTable *table, const char *name) {
+    // The name's index, or -1 if it isn't there
+    SymbolTableSlot *slot = find_slot(table, name, symbol_table_hash(name, strlen(name)));
+    return slot->name ? slot->index : -1;
+}
+
+void symbol_table_add(SymbolTable *table, const char *name, int index) {
+    unsigned int hash = symbol_table_hash(name, strlen(name));
+    SymbolTableSlot *slot = find_slot(table, name, hash);
+    xcc_assert_msg(!slot->name, "name added to a symbol table twice");
+
+    slot->name = name;
+    slot->hash = hash;
+    slot->index = index;
+    table->num_names++;
+
+    if (2 * table->num_names >= table->num_slots) {
+        SymbolTableSlot *old_slots = table->slots;
+        size_t old_num_slots = table->num_slots;
+        allocate_slots(table, 2 * old_num_slots);
+
+        for (size_t i = 0; i < old_num_slots; ++i) {
+            if (old_slots[i].name) *find_slot(table, old_slots[i].name, old_slots[i].hash) = old_slots[i];
+        }
+        xcc_free(old_slots);
+    }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "xcc.h"
+
+// A map from names to indices into an array kept by whatever uses it, with
+// open addressing. Names are borrowed, so they have to outlive the table.
+
+typedef struct {
+    const char *name; // NULL for an empty slot
+    unsigned int hash;
+    int index;
+} SymbolTableSlot;
+
+typedef struct {
+    SymbolTableSlot *slots;
+    size_t num_slots;
+    size_t num_names;
+} SymbolTable;
+
+unsigned int symbol_table_hash(const char *name, size_t length);
+void symbol_table_init(SymbolTable *table);
+void symbol_table_free(SymbolTable *table);
+int symbol_table_find(SymbolTable *table, const char *name);
+void symbol_table_add(SymbolTable *table, const char *name, int index);
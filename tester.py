@@ -4,15 +4,27 @@ import os, subprocess, sys, re
 
 TEST_DIRECTORY = 'tests/'
 NO_MAKE = '--no-make' in sys.argv
+# extra arguments passed to every invocation of xcc, e.g. --xcc-arg=-j4
+EXTRA_XCC_ARGS = [arg.split('=', 1)[1] for arg in sys.argv if arg.startswith('--xcc-arg=')]
+# run the @run! tests in memory, rather than linking them: --jit runs them
+# with xcc --run and --interp with xcc --interp
+IN_MEMORY_RUN_ARG = '--run' if '--jit' in sys.argv else '--interp' if '--interp' in sys.argv else None
 ASSEMBLY_OUTPUT_FILE = 'build/out.S'
+OBJECT_OUTPUT_FILE = 'build/out.o'
 BINARY_OUTPUT_LOCATION = 'build/out'
+PCH_OUTPUT_FILE = 'build/out.pch'
+INSPECTED_ASSEMBLY_FILE = 'build/inspected.S'
+SUPPLEMENT_LIBRARY = 'build/supplement.so'
 
-print(' === Beginning main test suite == ')
+print(' === Beginning main test suite == ' + ' '.join(EXTRA_XCC_ARGS + [IN_MEMORY_RUN_ARG or '']))
 
 if not NO_MAKE:
     subprocess.run(['make', 'all'], check=True)
     print('Compiled xcc')
 
+if IN_MEMORY_RUN_ARG:
+    subprocess.run(['gcc', '-shared', '-fPIC', 'supplement.c', '-o', SUPPLEMENT_LIBRARY], check=True)
+
 SUCCESS = 'success'
 FAILURE = 'failure'
 
@@ -40,16 +52,110 @@ def run_test(test_file_path):
                 param_values.append(line.split(param, 1)[1])
         return param_values
 
+    def check_flags_params():
+        # check that all flags provided were actually checked (prevent mispellings)
+        found_flags = re.findall(r'@[a-z_]+[!:]', source)
+        for flag_in_src in found_flags:
+            if flag_in_src not in checked_flags_params:
+                return (FAILURE, f'unchecked param: {flag_in_src}')
+
+        # this'll have some false positives
+        num_ats = source.count('@')
+        if num_ats > len(found_flags):
+            return (FAILURE, 'possible malformed test flags/params')
+        return (SUCCESS,)
+
+    # the test is opened in xcc --server, then edited, and each check's error
+    # count is compared
+    if has_any_flag('server'):
+        commands = [f'open {test_file_path}']
+        commands += [f'edit {test_file_path} ' + expand_backslash(edit) for edit in get_param_values('server_edit')]
+        commands.append('quit')
+
+        server_captured_output = subprocess.run(
+            ['./xcc', '--server', '-v'] + get_param_values('xcc_arg') + EXTRA_XCC_ARGS,
+            input='\n'.join(commands).encode('utf-8'),
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE
+        )
+        if server_captured_output.returncode != 0:
+            return (FAILURE, f'server exited with {server_captured_output.returncode}', server_captured_output)
+        if server_captured_output.stdout:
+            return (FAILURE, 'gave stdout', server_captured_output)
+
+        decoded_stderr = server_captured_output.stderr.decode('utf-8')
+        error_counts = ' '.join(re.findall(r'^(\d+) program errors?$', decoded_stderr, re.MULTILINE))
+        for expected_error_counts in get_param_values('server_error_counts'):
+            if error_counts != expected_error_counts:
+                return (FAILURE, f'error counts are `{error_counts}`, not `{expected_error_counts}`', server_captured_output)
+
+        for compile_error_line in get_param_values('xcc_msg'):
+            if compile_error_line not in decoded_stderr:
+                return (FAILURE, f"server output doesn't have: `{compile_error_line}`", server_captured_output)
+        for pattern in get_param_values('verbose'):
+            if not re.search(pattern, decoded_stderr, re.MULTILINE):
+                return (FAILURE, f"-v output doesn't match: `{pattern}`", server_captured_output)
+
+        return check_flags_params()
+
+    # a header (relative to the test) to precompile and include
+    pch_args = []
+    for pch_header in get_param_values('pch'):
+        pch_captured_output = subprocess.run(
+            ['./xcc', os.path.join(TEST_DIRECTORY, pch_header), '--emit-pch', PCH_OUTPUT_FILE]
+            + EXTRA_XCC_ARGS,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE
+        )
+        if pch_captured_output.returncode != 0:
+            return (FAILURE, 'precompiling header failed', pch_captured_output)
+        pch_args = ['--include-pch', PCH_OUTPUT_FILE]
+
+    # the source is piped in through stdin and the assembly comes out of stdout
+    is_piped = has_any_flag('pipe')
+
+    xcc_args = get_param_values('xcc_arg') + EXTRA_XCC_ARGS
+    # -c writes an object file rather than assembly, unless a later -S switches back
+    output_modes = [arg for arg in xcc_args if arg in ('-c', '-S')]
+    is_object = output_modes and output_modes[-1] == '-c'
+    output_file = OBJECT_OUTPUT_FILE if is_object else ASSEMBLY_OUTPUT_FILE
+
+    # the output of xcc is then the output of the program
+    is_in_memory_run = IN_MEMORY_RUN_ARG and has_any_flag('run')
+    # otherwise xcc links the program itself, unless it's written out some other way
+    is_linked_by_xcc = (
+        has_any_flag('links', 'run') and not is_object and not is_piped and not is_in_memory_run
+    )
+
+    if is_in_memory_run:
+        output_args = [IN_MEMORY_RUN_ARG, '--load', SUPPLEMENT_LIBRARY]
+    elif is_linked_by_xcc:
+        output_args = ['supplement.c', '-o', BINARY_OUTPUT_LOCATION]
+    else:
+        output_args = ['-S', '-o', '-' if is_piped else output_file]
+
     xcc_captured_output = subprocess.run(
-        ['./xcc', test_file_path, '-o', ASSEMBLY_OUTPUT_FILE]
-        + (['-v'] if has_any_flag('compile_verbose') else []),
+        ['./xcc', '-' if is_piped else test_file_path]
+        + output_args
+        + (['-v'] if has_any_flag('compile_verbose') else [])
+        + pch_args
+        + xcc_args,
+        input=source.encode('utf-8') if is_piped else None,
         stdout=subprocess.PIPE,
         stderr=subprocess.PIPE
     )
 
-    if xcc_captured_output.stdout:
+    if is_in_memory_run:
+        pass
+    elif is_piped:
+        with open(output_file, 'wb') as assembly_file:
+            assembly_file.write(xcc_captured_output.stdout)
+    elif xcc_captured_output.stdout:
         return (FAILURE, 'gave stdout', xcc_captured_output)
 
+    if xcc_captured_output.returncode < 0:
+        return (FAILURE, f"xcc killed by signal {-xcc_captured_output.returncode}", xcc_captured_output)
+
     decoded_stderr = xcc_captured_output.stderr.decode('utf-8')
     if 'assertion failure' in decoded_stderr:
         return (FAILURE, f"compile assertion failure", xcc_captured_output)
@@ -70,28 +176,31 @@ def run_test(test_file_path):
         if not xcc_captured_output.stderr:
             return (FAILURE, 'no stderr given on error', xcc_captured_output)
 
-    if xcc_should_have_been_success:
+    if xcc_should_have_been_success and not is_in_memory_run:
         if xcc_captured_output.returncode != 0:
             return (FAILURE, "compile error", xcc_captured_output)
 
         if not has_any_flag('compile_verbose') and xcc_captured_output.stderr:
             return (FAILURE, "output to stderr but no compile error")
 
-    # TODO: manually assemble and link
-    do_link = has_any_flag('links', 'run')
-    if do_link:
+    # a compile error test can still be linked by xcc, to check it stops the link
+    do_link = has_any_flag('links', 'run') and not xcc_should_have_been_failure
+    if do_link and not is_in_memory_run and not is_linked_by_xcc:
         subprocess.run([
             'gcc', '-o', BINARY_OUTPUT_LOCATION,
-            ASSEMBLY_OUTPUT_FILE, 'supplement.c'
+            output_file, 'supplement.c'
         ], check=True)
 
     do_run = has_any_flag('run')
     if do_run:
-        captured_output = subprocess.run(
-            [BINARY_OUTPUT_LOCATION],
-            stdout=subprocess.PIPE,
-            stderr=subprocess.PIPE
-        )
+        if is_in_memory_run:
+            captured_output = xcc_captured_output
+        else:
+            captured_output = subprocess.run(
+                [BINARY_OUTPUT_LOCATION],
+                stdout=subprocess.PIPE,
+                stderr=subprocess.PIPE
+            )
 
         decoded_stdout = captured_output.stdout.decode('utf-8')
 
@@ -127,17 +236,47 @@ def run_test(test_file_path):
                 )
 
 
-    # check that all flags provided were actually checked (prevent mispellings)
-    found_flags = re.findall(r'@[a-z_]+[!:]', source)
-    for flag_in_src in found_flags:
-        if flag_in_src not in checked_flags_params:
-            return (FAILURE, f'unchecked param: {flag_in_src}')
+    # regexes the assembly or the -v output has to match (or not), from
+    # compiling again with just the test's own arguments so that they're the
+    # same whatever the pass
+    asm_patterns = get_param_values('asm')
+    asm_not_patterns = get_param_values('asm_not')
+    verbose_patterns = get_param_values('verbose')
+
+    if asm_patterns or asm_not_patterns:
+        inspect_captured_output = subprocess.run(
+            ['./xcc', test_file_path] + pch_args + get_param_values('xcc_arg')
+            + ['-S', '-o', INSPECTED_ASSEMBLY_FILE],
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE
+        )
+        if inspect_captured_output.returncode != 0:
+            return (FAILURE, 'compiling to inspect the assembly failed', inspect_captured_output)
+
+        with open(INSPECTED_ASSEMBLY_FILE) as assembly_file:
+            assembly = assembly_file.read()
+
+        for pattern in asm_patterns:
+            if not re.search(pattern, assembly, re.MULTILINE):
+                return (FAILURE, f"assembly doesn't match: `{pattern}`")
+        for pattern in asm_not_patterns:
+            if re.search(pattern, assembly, re.MULTILINE):
+                return (FAILURE, f"assembly matches: `{pattern}`")
+
+    if verbose_patterns:
+        inspect_captured_output = subprocess.run(
+            ['./xcc', test_file_path] + pch_args + get_param_values('xcc_arg')
+            + ['-S', '-o', INSPECTED_ASSEMBLY_FILE, '-v'],
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE
+        )
+        decoded_verbose = inspect_captured_output.stderr.decode('utf-8')
+
+        for pattern in verbose_patterns:
+            if not re.search(pattern, decoded_verbose, re.MULTILINE):
+                return (FAILURE, f"-v output doesn't match: `{pattern}`")
 
-    # this'll have some false positives
-    num_ats = source.count('@')
-    if num_ats > len(found_flags):
-        return (FAILURE, 'possible malformed test flags/params')
-    return (SUCCESS,)
+    return check_flags_params()
 
 
 all_results = []
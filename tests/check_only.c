@@ -0,0 +1,13 @@
+// @compiles!
+// @xcc_arg: --check
+
+int f(int x) {
+    while (x < 10) {
+        x = x + 1;
+    }
+    return x;
+}
+
+int main() {
+    return f(1);
+}
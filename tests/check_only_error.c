@@ -0,0 +1,11 @@
+// @compile_error!
+// @xcc_arg: --check
+// @xcc_msg: function doesn't have a return!
+
+int f(int x) {
+    x = x + 1;
+}
+
+int main() {
+    return f(1);
+}
@@ -0,0 +1,47 @@
+// @run!
+// @run_output_full: 1 2 3 4 5 6
+
+#include "include_guarded_header_notest.h"
+#include "include_guarded_header_notest.h" // skipped thanks to the include guard
+
+#define ENABLED 1
+#define DISABLED 0
+
+int main() {
+#if ENABLED
+    supplement_print_int(1);
+#else
+    this is never lexed
+#endif
+    supplement_print_space(0);
+#ifdef DISABLED
+    supplement_print_int(2);
+#endif
+    supplement_print_space(0);
+#ifndef UNDEFINED_MACRO
+    supplement_print_int(3);
+#endif
+    supplement_print_space(0);
+#if DISABLED
+    #if 1
+    nested and skipped
+    #endif
+#elif !defined(ENABLED)
+    skipped too
+#elif defined GUARDED_VALUE
+    supplement_print_int(GUARDED_VALUE);
+#else
+    also skipped
+#endif
+    supplement_print_space(0);
+  #  if UNDEFINED_MACRO
+    skipped
+  #  endif
+#if 0
+#elif 0
+#else
+    supplement_print_int(5);
+#endif
+    supplement_print_space(0);
+    supplement_print_int(guarded_six());
+}
@@ -0,0 +1,7 @@
+// @compile_error!
+// @xcc_msg: #else without #if!
+
+int main() {
+    return 0;
+}
+#else
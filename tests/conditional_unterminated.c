@@ -0,0 +1,7 @@
+// @compile_error!
+// @xcc_msg: unterminated conditional directive!
+
+int main() {
+#ifdef SOMETHING
+    return 0;
+}
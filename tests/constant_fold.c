@@ -0,0 +1,70 @@
+// @run!
+// @run_output_full: 8 10 -56 44 1 0 7 3 4 6 7
+// @verbose: ─ADD \[TYPE int\]\n[ │]*├─INTEGER_LITERAL \[6\] \[TYPE int\]\n[ │]*└─IDENT_USE \[n\]
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+
+int minus_two(int n) {
+    return n - 1 - 1;
+}
+
+int six_more(int n) {
+    // folded to a single literal, but n isn't known
+    return 2 * 3 + n;
+}
+
+int first_over(int limit) {
+    int i = 0;
+    while (1) {
+        i = i + 1;
+        if (i > limit) {
+            return i;
+        }
+    }
+}
+
+int main() {
+    int x = 2 * 3 + 4;
+    char negative = 200;
+    char wrapped = 300;
+    int reassigned = 1;
+
+    supplement_print_int(minus_two(x));
+    supplement_print_space(0);
+    supplement_print_int(x);
+    supplement_print_space(0);
+    supplement_print_int(negative);
+    supplement_print_space(0);
+    supplement_print_int(wrapped);
+    supplement_print_space(0);
+
+    // only locals which are never assigned to are replaced
+    supplement_print_int(reassigned);
+    supplement_print_space(0);
+    reassigned = 0;
+    supplement_print_int(reassigned);
+    supplement_print_space(0);
+
+    if (x < 5) {
+        supplement_print_int(99);
+    } else {
+        supplement_print_int(7);
+    }
+    supplement_print_space(0);
+    if (3 > 2) {
+        supplement_print_int(3);
+    }
+    if (2 >= 3) {
+        supplement_print_int(99);
+    }
+    while (0) {
+        supplement_print_int(99);
+    }
+    supplement_print_space(0);
+    supplement_print_int(first_over(3));
+    supplement_print_space(0);
+    supplement_print_int(x - 1 + 2 - 5);
+    supplement_print_space(0);
+    supplement_print_int(six_more(1));
+}
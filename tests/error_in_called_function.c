@@ -0,0 +1,19 @@
+// @compile_error!
+// @xcc_msg: unknown identifier!
+// @xcc_msg: 1 program error
+
+int f(int a) {
+    return x;
+}
+
+int g(int p) {
+    // typing abandons the if for f's error, without an error of its own
+    if (f(p)) {
+        int i = 0;
+    }
+    return 0;
+}
+
+int main() {
+    return g(1);
+}
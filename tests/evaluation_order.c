@@ -0,0 +1,40 @@
+// @run!
+// @run_output_full: 0 -115 1 10 40 203 6543
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+
+int identity(int x) {
+    return x;
+}
+
+int digits(int a, int b, int c, int d, int e, int f) {
+    return a * 100000 + b * 10000 + c * 1000 + d * 100 + e * 10 + f;
+}
+
+int main() {
+    int a = 5;
+    int b = 2;
+    int c = 3;
+    int d = 4;
+    int e = 6;
+
+    // the right hand side needs more registers, so is worked out first
+    supplement_print_int(a - (b * c + d * e) + 25);
+    supplement_print_space(0);
+    supplement_print_int(a - (b * c + d * e) * 4);
+    supplement_print_space(0);
+    supplement_print_int(a < (b * c + d * e));
+    supplement_print_space(0);
+
+    // values held over a call
+    supplement_print_int(identity(a) + identity(a));
+    supplement_print_space(0);
+    supplement_print_int(a * b + identity(b * c + d * e) - identity(5) * 3 + 15);
+    supplement_print_space(0);
+    supplement_print_int(identity(identity(a) * 40 + identity(c)));
+    supplement_print_space(0);
+
+    // every argument register is both a source and a destination
+    supplement_print_int(digits(0, 0, a + 1, b + 3, d, c) + 0);
+}
@@ -0,0 +1,61 @@
+// @run!
+// @run_output_full: 1 0 1 1 0 4 10 2 1
+// @asm: below:\n(?:.*\n)*?\s*cmpl %edi, %esi\n\s*jle \.L
+// @asm_not: (?s)\n\s*set[a-z]+ %.*\n\s*set[a-z]+ %
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+
+int below(int a, int b) {
+    if (a < b) return 1;
+    return 0;
+}
+
+int at_least_five(int a) {
+    // the literal is on the wrong side for cmp, so the condition flips
+    if (5 <= a) return 1;
+    else return 0;
+}
+
+int count_up(int limit) {
+    int i = 0;
+    while (i <= limit) i = i + 1;
+    return i - 1;
+}
+
+int sum_down(int n) {
+    int total = 0;
+    while (n > 0) {
+        total = total + n;
+        n = n - 1;
+    }
+    return total;
+}
+
+int kept(int a, int b) {
+    // the comparison is needed as a value as well as being branched on
+    int is_greater = a > b;
+    if (is_greater) return is_greater + 1;
+    return is_greater;
+}
+
+int main() {
+    supplement_print_int(below(1, 2));
+    supplement_print_space(0);
+    supplement_print_int(below(2, 2));
+    supplement_print_space(0);
+    supplement_print_int(at_least_five(5));
+    supplement_print_space(0);
+    supplement_print_int(at_least_five(9));
+    supplement_print_space(0);
+    supplement_print_int(at_least_five(4));
+    supplement_print_space(0);
+    supplement_print_int(count_up(4));
+    supplement_print_space(0);
+    supplement_print_int(sum_down(4));
+    supplement_print_space(0);
+    supplement_print_int(kept(3, 1));
+    supplement_print_space(0);
+    supplement_print_int(kept(1, 3) + 1);
+    return 0;
+}
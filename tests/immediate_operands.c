@@ -0,0 +1,48 @@
+// @run!
+// @run_output_full: 12019 0 1 0 1 44 -5 2100000 -294967296 5
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+
+long zero_extended() {
+    return 4000000000;
+}
+
+int main() {
+    int a = 0;
+    int b = 7;
+    char c = 300;
+
+    while (a < 10) {
+        a = a + 3;
+    }
+    supplement_print_int(a * 1000 + b * 3 - 2);
+    supplement_print_space(0);
+
+    // either side of a comparison, or both, can be a literal
+    supplement_print_int(b < 5);
+    supplement_print_space(0);
+    supplement_print_int(5 < b);
+    supplement_print_space(0);
+    supplement_print_int(5 >= 6);
+    supplement_print_space(0);
+    supplement_print_int(6 >= 6);
+    supplement_print_space(0);
+
+    supplement_print_int(c);
+    supplement_print_space(0);
+    supplement_print_int(0 - 5);
+    supplement_print_space(0);
+    supplement_print_int(b * 300000);
+    supplement_print_space(0);
+    supplement_print_int(zero_extended());
+    supplement_print_space(0);
+
+    if (0) {
+        supplement_print_int(99);
+    }
+    if (1) {
+        supplement_print_int(5);
+    }
+    return 0;
+}
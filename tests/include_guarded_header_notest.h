@@ -0,0 +1,14 @@
+// Included by conditional_compilation.c, several times
+#ifndef INCLUDE_GUARDED_HEADER
+#define INCLUDE_GUARDED_HEADER
+
+#define GUARDED_VALUE 4
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+
+int guarded_six() {
+    return 6;
+}
+
+#endif // INCLUDE_GUARDED_HEADER
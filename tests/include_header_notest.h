@@ -0,0 +1,8 @@
+#pragma once
+// Included by include_pragma_once.c, several times
+
+#include "include_nested_header_notest.h"
+
+int add_one(int x) {
+    return x + ONE;
+}
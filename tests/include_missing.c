@@ -0,0 +1,7 @@
+// @compile_error!
+// @xcc_msg: couldn't find included file!
+
+#include "this_file_does_not_exist.h"
+
+int main() {
+}
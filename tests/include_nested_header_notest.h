@@ -0,0 +1,4 @@
+#pragma once
+#define ONE 1
+void supplement_print_int(int x);
+void supplement_print_space(int x);
\ No newline at end of file
@@ -0,0 +1,12 @@
+// @run!
+// @run_output_full: 42 2
+
+#include "include_header_notest.h"
+#include "include_header_notest.h" // a second definition of add_one would be an error
+#include "include_nested_header_notest.h"
+
+int main() {
+    supplement_print_int(add_one(41));
+    supplement_print_space(0);
+    supplement_print_int(add_one(ONE));
+}
@@ -0,0 +1,79 @@
+// @run!
+// @xcc_arg: -O
+// @run_output_full: 72 12 5 5 90
+// @verbose: IR, hoisted, for scaled_sum:\n  block 0:\n(?:    .*\n)*?    v\d+ = mul\.s4 v1, v2\n
+// @verbose: IR, hoisted, for up_to_pointed:\n  block 0:\n(?:    .*\n)*?    v\d+ = load\.s4 v0\n
+// @verbose: IR, hoisted, for nested:\n  block 0:\n(?:    .*\n)*?    v\d+ = mul\.s4 v1, v2\n
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+void set_glob_1(int x);
+int *get_glob_1_ptr(void);
+
+int scaled_sum(int n, int a, int b) {
+    // a * b is the same every time round
+    int total = 0;
+    int i = 0;
+    while (i < n) {
+        total = total + a * b;
+        i = i + 1;
+    }
+    return total;
+}
+
+int up_to_double(int n) {
+    // and so is the bound
+    int i = 0;
+    while (i < n * 2 + 2) {
+        i = i + 1;
+    }
+    return i;
+}
+
+int up_to_pointed(int *p) {
+    int i = 0;
+    while (i < *p) {
+        i = i + 1;
+    }
+    return i;
+}
+
+int shrinking_bound(int *p) {
+    // the call changes what p points to, so it has to be read again
+    int i = 0;
+    while (i < *p) {
+        set_glob_1(*p - 1);
+        i = i + 1;
+    }
+    return i;
+}
+
+int nested(int n, int a, int b) {
+    // a * b moves out of both loops
+    int total = 0;
+    int i = 0;
+    while (i < n) {
+        int j = 0;
+        while (j < n) {
+            total = total + a * b;
+            j = j + 1;
+        }
+        i = i + 1;
+    }
+    return total;
+}
+
+int main() {
+    supplement_print_int(scaled_sum(4, 3, 6));
+    supplement_print_space(0);
+    supplement_print_int(up_to_double(5));
+    supplement_print_space(0);
+    set_glob_1(5);
+    supplement_print_int(up_to_pointed(get_glob_1_ptr()));
+    supplement_print_space(0);
+    set_glob_1(10);
+    supplement_print_int(shrinking_bound(get_glob_1_ptr()));
+    supplement_print_space(0);
+    supplement_print_int(nested(3, 2, 5));
+    return 0;
+}
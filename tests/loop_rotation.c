@@ -0,0 +1,55 @@
+// @run!
+// @run_output_full: 0 15    3 12
+// @asm: \.balign 16\n\s*(\.L\d+_\d+):\n(?:.*\n)*?\s*j(?:l|g|le|ge) \1\n
+// @asm_not: jmp \.
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+
+int never(int n) {
+    // the check on the way in skips the body entirely
+    int total = 0;
+    while (n < 0) {
+        total = total + 1;
+        n = n + 1;
+    }
+    return total;
+}
+
+int nested(int n) {
+    int total = 0;
+    int i = 0;
+    while (i < n) {
+        int j = 0;
+        while (j <= i) {
+            total = total + 1;
+            j = j + 1;
+        }
+        i = i + 1;
+    }
+    return total;
+}
+
+int checked(int n) {
+    // the condition is still worked out once per iteration plus once more
+    supplement_print_space(0);
+    return n;
+}
+
+int counted(int n) {
+    int i = 0;
+    while (checked(i) < n) {
+        i = i + 1;
+    }
+    return i;
+}
+
+int main() {
+    supplement_print_int(never(0));
+    supplement_print_space(0);
+    supplement_print_int(nested(5));
+    supplement_print_int(counted(3));
+    supplement_print_space(0);
+    supplement_print_int(nested(2) * 4);
+    return 0;
+}
@@ -0,0 +1,57 @@
+// @run!
+// @xcc_arg: -O
+// @run_output_full: 3792 105
+// @asm: over_calls:\n(?:.*\n)*?\s*movq %rbx, -8\(%rbp\)\n
+// @asm: addl -\d+\(%rbp\), %\w+\n
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+
+int pressure(int n) {
+    // more values live round the loop than there are registers, so some
+    // are spilled and the arithmetic works on the stack
+    int a = 1;
+    int b = 2;
+    int c = 3;
+    int d = 4;
+    int e = 5;
+    int f = 6;
+    int g = 7;
+    int h = 8;
+    int i = 9;
+    int j = 10;
+    int k = 11;
+    int l = 12;
+    int m = 13;
+    while (0 < n) {
+        a = a + b;
+        b = b + c;
+        c = c + d;
+        d = d + e;
+        e = e + f;
+        f = f + g;
+        g = g + h;
+        h = h + i;
+        i = i + j;
+        j = j + k;
+        k = k + l;
+        l = l + m;
+        m = m * 2;
+        n = n - 1;
+    }
+    return a + b + c + d + e + f + g + h + i + j + k + l + m;
+}
+
+int over_calls(int a, int b, int c, int d, int e, int f) {
+    // there are only five callee saved registers for the seven values
+    // needed after the call
+    int g = a * b;
+    supplement_print_space(0);
+    return a + b * 2 + c * 3 + d * 4 + e * 5 + f * 6 + g * 7;
+}
+
+int main() {
+    supplement_print_int(pressure(5));
+    supplement_print_int(over_calls(1, 2, 3, 4, 5, 6));
+    return 0;
+}
@@ -0,0 +1,18 @@
+// @compile_error!
+// @xcc_msg: unknown identifier!
+// @xcc_msg: empty return in non-void function!
+// @xcc_msg: expected lvalue to assign to!
+// @xcc_msg: 3 program errors
+
+int f(int x) {
+    return y;
+}
+
+int g() {
+    return;
+}
+
+int main() {
+    3 = f(1);
+    return g();
+}
@@ -0,0 +1,16 @@
+// @compile_error!
+// @xcc_msg: Parse error: need expression!
+// @xcc_msg: Parse error: expected declarator!
+// @xcc_msg: 2 program errors
+
+int f(int x) {
+    return x +;
+}
+
+int g(, int y) {
+    return y;
+}
+
+int main() {
+    return f(1);
+}
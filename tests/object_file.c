@@ -0,0 +1,37 @@
+// @run!
+// @xcc_arg: -c
+// @run_output_full: 21 120 1
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+
+int sum_six(int a, int b, int c, int d, int e, int f);
+
+int factorial(int n) {
+    int result = 1;
+    while (n > 1) {
+        result = result * n;
+        n = n - 1;
+    }
+    return result;
+}
+
+char is_small(int x) {
+    if (x <= 3) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+int main() {
+    supplement_print_int(sum_six(1, 2, 3, 4, 5, 6));
+    supplement_print_space(0);
+    supplement_print_int(factorial(5));
+    supplement_print_space(0);
+    supplement_print_int(is_small(2));
+}
+
+int sum_six(int a, int b, int c, int d, int e, int f) {
+    return a + b + c + d + e + f;
+}
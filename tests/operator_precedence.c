@@ -0,0 +1,18 @@
+// @run!
+// @run_output_full: 3 1 9 4
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+
+int main() {
+    int a;
+    int b;
+    a = b = 1 + 2 * 3 - 4;
+    supplement_print_int(a);
+    supplement_print_space(0);
+    supplement_print_int(a - b + 1 < 2 * a + 3);
+    supplement_print_space(0);
+    supplement_print_int(10 - 2 - 1 * 3 + 4);
+    supplement_print_space(0);
+    supplement_print_int((a < b) + 2 * (1 + 1));
+}
@@ -0,0 +1,37 @@
+// @run!
+// @xcc_arg: -j4
+// @xcc_arg: --lex-chunk-size=64
+// @run_output_full: 6 10 13
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+
+// the source is split into chunks of at least 64 bytes at line ends, so
+// the lines below land in several chunks
+
+int add_three(int a,
+              int b,
+              int c) {
+    return a
+        + b
+        + c;
+}
+
+int longer_name_so_this_line_is_most_of_a_chunk_by_itself(int x) {
+    return x + 9;
+}
+
+
+
+int main() {
+    supplement_print_int(add_three(1, 2, 3));
+    supplement_print_space(0);
+    supplement_print_int(longer_name_so_this_line_is_most_of_a_chunk_by_itself(1));
+    supplement_print_space(0);
+    supplement_print_int(add_three(
+        4,
+        4,
+        5
+    ));
+    return 0;
+}
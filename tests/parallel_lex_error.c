@@ -0,0 +1,27 @@
+// @compile_error!
+// @xcc_arg: -j4
+// @xcc_arg: --lex-chunk-size=64
+// @xcc_msg: parallel_lex_error.c:21:15
+// @xcc_msg: |     return y +;
+// @xcc_msg: parallel_lex_error.c:26:16
+// @xcc_msg: 2 program errors
+
+// Diagnostics from late chunks give the same lines and columns as when the
+// whole source is lexed in one go
+
+int f(int x) {
+    return x;
+}
+
+int g(int x) {
+    return f(x) + f(x) + f(x);
+}
+
+int h(int y) {
+    return y +;
+}
+
+
+int main() {
+    return h(1 2);
+}
@@ -0,0 +1,9 @@
+// Precompiled by precompiled_header.c
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+int add_long(int a, long b);
+int takes_pointers(char **a, int *b);
+
+#define TWO 2
+#define TIMES_TWO(x) ((x) * TWO)
+#define PRINT_THEN_SPACE(value) supplement_print_int(value); supplement_print_space(0);
@@ -0,0 +1,62 @@
+// @run!
+// @run_output_full: 1 0 3 200000 42 26 7
+// @asm_not: mov([lq]) %\w+, (-\d+\(%rbp\))\n\s*mov\1 \2, %
+// @asm: xorl %r10d, %r10d\n\s*cmpl %edi, %esi\n\s*setg %r10b\n
+// @asm_not: xorq %rax, %rax
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+void set_glob_1(int x);
+int *get_glob_1_ptr(void);
+
+int less(int a, int b) {
+    // the result can go in the register of one of the operands
+    int c = a < b;
+    return c;
+}
+
+int compare_results(int a, int b) {
+    return (a < b) + (b >= a) * 2;
+}
+
+int wide(long x) {
+    // needs all 64 bits of the registers it goes through
+    long big = 100000 * x;
+    long bigger = 100000 * big;
+    long sum = bigger + x;
+    return sum - bigger;
+}
+
+int reload(int *p) {
+    int a = *p;
+    set_glob_1(a + 2);
+    // the first load can't be reused
+    return *p;
+}
+
+int chain(int a, int b, int c, int d) {
+    int x = a * b;
+    int y = c * d;
+    x = x + y;
+    return x;
+}
+
+int main() {
+    supplement_print_int(less(1, 2));
+    supplement_print_space(0);
+    supplement_print_int(less(2, 1));
+    supplement_print_space(0);
+    supplement_print_int(compare_results(1, 2));
+    supplement_print_space(0);
+
+    supplement_print_int(wide(200000));
+    supplement_print_space(0);
+
+    set_glob_1(40);
+    supplement_print_int(reload(get_glob_1_ptr()));
+    supplement_print_space(0);
+    supplement_print_int(chain(2, 3, 4, 5));
+    supplement_print_space(0);
+    supplement_print_int(chain(1, 1, 2, 3));
+    return 0;
+}
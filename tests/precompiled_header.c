@@ -0,0 +1,15 @@
+// @run!
+// @pch: pch_header_notest.h
+// @run_output_full: 2 10 7
+
+int add_long(int a, long b); // redeclaring a precompiled prototype is fine
+
+int add_long(int a, long b) {
+    return a + b;
+}
+
+int main() {
+    PRINT_THEN_SPACE(TWO)
+    PRINT_THEN_SPACE(TIMES_TWO(5))
+    supplement_print_int(add_long(3, 4));
+}
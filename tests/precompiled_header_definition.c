@@ -0,0 +1,8 @@
+// @compile_error!
+// @xcc_arg: --emit-pch
+// @xcc_arg: build/out.pch
+// @xcc_msg: function definitions can't be precompiled!
+
+int main() {
+    return 0;
+}
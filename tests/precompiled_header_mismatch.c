@@ -0,0 +1,9 @@
+// @compile_error!
+// @pch: pch_header_notest.h
+// @xcc_msg: redeclaration with incompatible types!
+
+int add_long(int a, int b);
+
+int main() {
+    return 0;
+}
@@ -0,0 +1,23 @@
+// @run!
+// @run_output_full: 7 12 5 36 3 9
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+
+#define x 1000 // parameters shadow macros with the same name
+#define ADD(x, y) ((x) + (y))
+#define SQUARE(x) ((x) * (x))
+#define FIRST(a, b) a
+#define NOTHING() 3
+#define PRINT_THEN_SPACE(value) supplement_print_int(value); supplement_print_space(0);
+
+int main() {
+    PRINT_THEN_SPACE(ADD(3, 4))
+    PRINT_THEN_SPACE(ADD((2 + 4),
+                         6))
+    PRINT_THEN_SPACE(FIRST(5, unused_identifier))
+    PRINT_THEN_SPACE(SQUARE(ADD(2, 4)))
+    PRINT_THEN_SPACE(NOTHING())
+    int SQUARE = 9; // not followed by arguments, so not expanded
+    supplement_print_int(SQUARE);
+}
@@ -0,0 +1,8 @@
+// @compile_error!
+// @xcc_msg: wrong number of arguments to macro!
+
+#define ADD(a, b) a + b
+
+int main() {
+    return ADD(1);
+}
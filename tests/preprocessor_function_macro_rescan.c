@@ -0,0 +1,17 @@
+// @run!
+// @run_output_full: 12 6
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+
+// the name of a function-like macro coming out of an expansion still takes
+// the arguments after it in the source
+#define G(a, b) (a) * (b)
+#define H G
+#define ID(x) x
+
+int main() {
+    supplement_print_int(H(2 + 1, 4));
+    supplement_print_space(0);
+    supplement_print_int(ID(G)(2, 3));
+}
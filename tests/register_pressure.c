@@ -0,0 +1,67 @@
+// @run!
+// @xcc_arg: -O
+// @run_output_full: 192 1007003 120 30 42
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+void set_glob_1(int x);
+int *get_glob_1_ptr();
+
+int add6(int a, int b, int c, int d, int e, int f) {
+    // every parameter stays live over the call
+    supplement_print_space(0);
+    return a + b + c + d + e + f + a * b;
+}
+
+int swap_args(int a, int b) {
+    return add6(b, a, b, a, b, a);
+}
+
+int pressure(int a, int b, int c, int d, int e, int f) {
+    // each product stays live until everything to its right is done, which
+    // is more values at once than there are registers
+    return a * b + (b * c + (c * d + (d * e + (e * f + (f * a + (a * c + (b * d
+        + (c * e + (d * f + (e * a + (f * b + (a * d + (b * e + (c * f
+        + (a * e + b * f)))))))))))))));
+}
+
+int factorial(int n) {
+    int result = 1;
+    int counter = 1;
+    while (counter < n + 1) {
+        result = result * counter;
+        counter = counter + 1;
+    }
+    return result;
+}
+
+int nested_sum(int outer_count, int inner_count) {
+    int sum = 0;
+    int outer = 0;
+    while (outer < outer_count) {
+        int inner = 0;
+        while (inner < inner_count) {
+            sum = sum + outer + inner;
+            inner = inner + 1;
+        }
+        outer = outer + 1;
+    }
+    return sum;
+}
+
+int read_through(int *p, char c) {
+    int widened = c;
+    return *p + widened;
+}
+
+int main() {
+    supplement_print_int(pressure(1, 2, 3, 4, 5, 6));
+    supplement_print_int(swap_args(1000, 1001));
+    supplement_print_space(0);
+    supplement_print_int(factorial(5));
+    supplement_print_space(0);
+    supplement_print_int(nested_sum(3, 4));
+    supplement_print_space(0);
+    set_glob_1(40);
+    supplement_print_int(read_through(get_glob_1_ptr(), 2));
+}
@@ -0,0 +1,11 @@
+// @run!
+// @run_output_full: Hi
+// @rc: 3
+
+int putchar(int c);
+
+int main() {
+    putchar(72);
+    putchar(105);
+    return 3;
+}
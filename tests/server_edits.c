@@ -0,0 +1,28 @@
+// @server!
+// @server_edit: 19 1 1\n    return a + y;
+// @server_edit: 19 1 1\n    return a + 2;
+// @server_edit: 17 0 1\nint unused;
+// @server_edit: 16 1 1\nint *scale;
+// @server_edit: 16 1 1\nint scale = 2;
+// @server_error_counts: 0 1 0 0 1 0
+// @xcc_msg: unknown identifier
+// @verbose: ^Checked 3 of 3 function bodies$
+// @verbose: ^Checked 1 of 3 function bodies$
+// @verbose: ^Checked 0 of 3 function bodies$
+
+// Only a function which was edited, or which uses a declaration that
+// changed, has its body checked again
+
+int scale = 2;
+
+int add_two(int a) {
+    return a + 2;
+}
+
+int twice(int a) {
+    return a * scale;
+}
+
+int main() {
+    return twice(add_two(1));
+}
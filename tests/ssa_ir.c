@@ -0,0 +1,84 @@
+// @run!
+// @xcc_arg: -O
+// @run_output_full: 231 312 55 6  19 11 36
+// @verbose: IR, built, for clamp_sum:\n(?:  .*\n)*?    v\d+ = phi\.s4 v3 \(block 2\), v2 \(block 1\)\n
+// @verbose: IR, built, for sum_to:\n(?:  .*\n)*?    v\d+ = phi\.s4 v1 \(block 0\), v\d+ \(block \d+\)\n
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+
+int rotate(int count) {
+    // the variables swap round on every iteration, so the copies into the
+    // loop's phis form a cycle
+    int a = 1;
+    int b = 2;
+    int c = 3;
+    int t = 0;
+    while (0 < count) {
+        t = a;
+        a = b;
+        b = c;
+        c = t;
+        count = count - 1;
+    }
+    return a * 100 + b * 10 + c;
+}
+
+int fibonacci(int n) {
+    int a = 0;
+    int b = 1;
+    int i = 0;
+    while (i < n) {
+        int next = a + b;
+        a = b;
+        b = next;
+        i = i + 1;
+    }
+    return a;
+}
+
+int clamp_sum(int a, int b, int limit) {
+    // each if only sets the variable on one path, joining with the value
+    // from before it
+    int sum = a + b;
+    if (limit < sum) sum = limit;
+    if (sum < 0) sum = 0;
+    return sum;
+}
+
+int over_calls(int a, int b, int c) {
+    // every parameter is needed after each call
+    int i = 0;
+    while (i < 2) {
+        supplement_print_space(0);
+        a = a + b;
+        b = b + c;
+        i = i + 1;
+    }
+    return a + b + c;
+}
+
+int sum_to(int n) {
+    int total = 0;
+    while (0 < n) {
+        total = total + n;
+        n = n - 1;
+    }
+    return total;
+}
+
+int main() {
+    supplement_print_int(rotate(4));
+    supplement_print_space(0);
+    supplement_print_int(rotate(5));
+    supplement_print_space(0);
+    supplement_print_int(fibonacci(10));
+    supplement_print_space(0);
+    supplement_print_int(clamp_sum(2, 4, 10));
+    supplement_print_int(over_calls(1, 2, 3));
+    supplement_print_space(0);
+    supplement_print_int(clamp_sum(3, 8, 11));
+    supplement_print_space(0);
+    supplement_print_int(sum_to(8));
+    return 0;
+}
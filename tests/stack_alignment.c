@@ -0,0 +1,27 @@
+// @run!
+// @run_output_full: aligned aligned aligned
+
+void supplement_print_space(int x);
+void supplement_print_stack_alignment(int x);
+
+int product_then_call(int a, int b, int c) {
+    // the temporaries leave the frame at a depth which isn't a multiple of 16
+    int x = a * b;
+    supplement_print_stack_alignment(x + c);
+    return x;
+}
+
+int one_local(int a) {
+    int x = a;
+    supplement_print_stack_alignment(x);
+    return x;
+}
+
+int main() {
+    product_then_call(2, 3, 4);
+    supplement_print_space(0);
+    one_local(1);
+    supplement_print_space(0);
+    supplement_print_stack_alignment(0);
+    return 0;
+}
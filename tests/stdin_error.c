@@ -0,0 +1,7 @@
+// @compile_error!
+// @pipe!
+// @xcc_msg: Near "<stdin>:7:
+
+int main() {
+    return 0
+}
@@ -0,0 +1,21 @@
+// @run!
+// @pipe!
+// @run_output_full: 3 12
+
+void supplement_print_int(int x);
+void supplement_print_space(int x);
+
+#define MUL(a, b) ((a) * (b))
+
+#if 0
+int main() {
+    this isn't lexed at all
+}
+#endif
+
+int main() {
+    supplement_print_int(MUL(1,
+                             3));
+    supplement_print_space(0);
+    supplement_print_int(MUL(3, 4));
+}
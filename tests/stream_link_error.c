@@ -0,0 +1,19 @@
+// @links!
+// @compile_error!
+// @xcc_arg: --stream
+// @xcc_msg: unknown identifier!
+// @xcc_msg: 1 program error
+
+// f is already generated into the link pipe when g's error stops the link
+
+int f() {
+    return 1;
+}
+
+int g() {
+    return x;
+}
+
+int main() {
+    return f();
+}
@@ -75,7 +75,7 @@ Type *type_new_int(TypeInteger integer_type, bool is_const, bool is_volatile) {
     return new_type;
 }
 
-static Type *type_new_void(void) {
+Type *type_new_void(void) {
     static Type *void_type = NULL;
 
     if (void_type == NULL) {
@@ -86,6 +86,25 @@ static Type *type_new_void(void) {
     return void_type;
 }
 
+Type *type_new_pointer(Type *underlying) {
+    Type *pointer_type = type_new();
+    pointer_type->type_type = TYPE_POINTER;
+    pointer_type->underlying = underlying;
+
+    return pointer_type;
+}
+
+Type *type_new_function(Type *return_type, Type **param_types, int num_params) {
+    // Takes ownership of param_types
+    Type *function_type = type_new();
+    function_type->type_type = TYPE_FUNCTION;
+    function_type->underlying = return_type;
+    function_type->function_param_types = param_types;
+    function_type->array_size = num_params;
+
+    return function_type;
+}
+
 static Type *copy_type(Type *type) {
     Type *new_type = type_new();
 
@@ -266,6 +285,39 @@ bool integer_type_is_signed(Type *type) {
     xcc_assert_not_reached();
 }
 
+int type_get_size(Type *type) {
+    // This stuff is directly from the ABI
+
+    if (type->type_type == TYPE_INTEGER) {
+        switch (type->integer_type) {
+            case TYPE_BOOL: return 1;
+            case TYPE_CHAR: return 1;
+            case TYPE_SCHAR: return 1;
+            case TYPE_UCHAR: return 1;
+
+            case TYPE_SHORT: return 2;
+            case TYPE_USHORT: return 2;
+
+            case TYPE_INT: return 4;
+            case TYPE_UINT: return 4;
+
+            case TYPE_LONG: return 8;
+            case TYPE_ULONG: return 8;
+
+            case TYPE_LONG_LONG: return 8;
+            case TYPE_ULONG_LONG: return 8;
+
+            case TYPE_INTEGER_LAST: xcc_assert_not_reached();
+        }
+
+        xcc_assert_not_reached();
+    } else if (type->type_type == TYPE_POINTER) {
+        return 8;
+    } else {
+        xcc_assert_not_reached_msg("TODO: size of type");
+    }
+}
+
 static bool is_scalar_type(Type *type) {
     TypeType type_type = type->type_type; // type type type type type type type
 
@@ -650,13 +702,7 @@ static void handle_declarator_func(AST *ast) {
         paramater_types[i] = ast->nodes[i + 1]->value_type;
     }
 
-    Type *function_type = type_new();
-    function_type->type_type = TYPE_FUNCTION;
-    function_type->underlying = return_type;
-    function_type->function_param_types = paramater_types;
-    function_type->array_size = num_params;
-
-    ast->nodes[0]->value_type = function_type;
+    ast->nodes[0]->value_type = type_new_function(return_type, paramater_types, num_params);
     type_propogate(ast->nodes[0]);
 }
 
@@ -665,11 +711,7 @@ static void handle_declarator_pointer(AST *ast) {
     xcc_assert(ast->value_type);
     xcc_assert(ast->num_nodes == 1);
 
-    Type *pointer_type = type_new();
-    pointer_type->type_type = TYPE_POINTER;
-    pointer_type->underlying = ast->value_type;
-
-    ast->nodes[0]->value_type = pointer_type;
+    ast->nodes[0]->value_type = type_new_pointer(ast->value_type);
     type_propogate(ast->nodes[0]);
 }
 
@@ -702,6 +744,18 @@ static void handle_call(AST *ast) {
     ast->value_type = ast->nodes[0]->value_type->underlying;
 }
 
+static void type_propogate_statement_or_recover(AST *statement) {
+    // An error only abandons the rest of this statement, so that the others
+    // in the block are still checked
+    ProgErrorRecovery recovery;
+
+    prog_error_push_recovery(&recovery);
+    if (!setjmp(recovery.jump_buffer)) {
+        type_propogate(statement);
+    }
+    prog_error_pop_recovery(&recovery);
+}
+
 void type_propogate(AST *ast) {
     if (ast->type == AST_PROGRAM) {
         TYPE_PROPOGATE_RECURSE(ast);
@@ -721,7 +775,10 @@ void type_propogate(AST *ast) {
         handle_call(ast);
     } else if (ast->type == AST_IDENT_USE) {
         xcc_assert(ast->declaration);
-        xcc_assert(ast->declaration->type);
+        if (!ast->declaration->type) {
+            // only a declaration which had an error is left without a type
+            prog_error_cascade();
+        }
         ast->value_type = ast->declaration->type;
     } else if (ast->type == AST_ASSIGN) {
         // lvalue checking is done in check_lvalue.c
@@ -795,7 +852,9 @@ void type_propogate(AST *ast) {
     } else if (ast->type == AST_STATEMENT_EXPRESSION) {
         TYPE_PROPOGATE_RECURSE(ast); // nothing to do here
     } else if (ast->type == AST_BLOCK_STATEMENT) {
-        TYPE_PROPOGATE_RECURSE(ast);
+        for (int i = 0; i < ast->num_nodes; ++i) {
+            type_propogate_statement_or_recover(ast->nodes[i]);
+        }
     } else if (ast->type == AST_IF) {
         xcc_assert(ast->num_nodes == 2 || ast->num_nodes == 3);
         TYPE_PROPOGATE_RECURSE(ast);
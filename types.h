@@ -31,7 +31,11 @@ typedef struct Type {
 } Type;
 
 Type *type_new_int(TypeInteger integer_type, bool is_const, bool is_volatile);
+Type *type_new_void(void);
+Type *type_new_pointer(Type *underlying);
+Type *type_new_function(Type *return_type, Type **param_types, int num_params);
 bool integer_type_is_signed(Type *type);
+int type_get_size(Type *type);
 void type_propogate(AST *ast);
 void type_free_all();
 void type_dump(Type *type);
@@ -5,6 +5,8 @@ typedef struct {
     int temporary_depth;
     int local_var_depth;
     int max_depth;
+
+    int scratch_depth; // scratch registers holding operands
 } AllocationStatus;
 
 static ValuePosition *copy_value_pos(ValuePosition *old) {
@@ -36,48 +38,14 @@ static int max(int a, int b) {
     return (a > b) ? a : b;
 }
 
-static int get_type_size(Type *type) {
-    // TODO: this'll need to be move elsewhere to support sizeof()
-    // This stuff is directly from the ABI
-
-    if (type->type_type == TYPE_INTEGER) {
-        switch (type->integer_type) {
-            case TYPE_BOOL: return 1;
-            case TYPE_CHAR: return 1;
-            case TYPE_SCHAR: return 1;
-            case TYPE_UCHAR: return 1;
-
-            case TYPE_SHORT: return 2;
-            case TYPE_USHORT: return 2;
-
-            case TYPE_INT: return 4;
-            case TYPE_UINT: return 4;
-
-            case TYPE_LONG: return 8;
-            case TYPE_ULONG: return 8;
-
-            case TYPE_LONG_LONG: return 8;
-            case TYPE_ULONG_LONG: return 8;
-
-            case TYPE_INTEGER_LAST: xcc_assert_not_reached();
-        }
-
-        xcc_assert_not_reached();
-    } else if (type->type_type == TYPE_POINTER) {
-        return 8;
-    } else {
-        xcc_assert_not_reached_msg("TODO: size of type");
-    }
-}
-
 static int get_type_alignment(Type *type) {
     if (type->type_type == TYPE_INTEGER) {
         // i don't know if it's a coincidence, but for integers,
         // the alignment is always equal to the size...
-        return get_type_size(type);
+        return type_get_size(type);
     } else if (type->type_type == TYPE_POINTER) {
         // same for pointers
-        return get_type_size(type);
+        return type_get_size(type);
     } else {
         xcc_assert_not_reached_msg("TODO: alignment for type");
     }
@@ -95,7 +63,7 @@ static int get_type_signedness(Type *type) {
 
 static void set_value_pos_to_type(ValuePosition *pos, Type *type) {
     if (type->type_type == TYPE_INTEGER || type->type_type == TYPE_POINTER) {
-        pos->size = get_type_size(type);
+        pos->size = type_get_size(type);
         pos->alignment = get_type_alignment(type);
         pos->is_signed = get_type_signedness(type);
     } else if (type->type_type == TYPE_VOID) {
@@ -135,21 +103,148 @@ static void handle_ident_declaration(AST *ast, AllocationStatus *allocation) {
     ast->declaration->pos = ast->pos;
 }
 
+static ValuePosAllocator allocator = VALUE_POS_SCRATCH_REGISTERS;
+
+static bool is_immediate_literal(AST *ast) {
+    // Literals are used as immediate operands, as long as they fit in the
+    // sign extended 32 bit field. The interpreter wants them in slots.
+    if (ast->type != AST_INTEGER_LITERAL || allocator == VALUE_POS_STACK) return false;
+
+    long long value = ast->integer_literal_val;
+    return type_get_size(ast->value_type) < 8 || value == (int) value;
+}
+
+static ValuePosition *new_literal_pos(AST *ast) {
+    ValuePosition *pos = xcc_malloc(sizeof(ValuePosition));
+    set_value_pos_to_type(pos, ast->value_type);
+    pos->type = POS_LITERAL;
+    pos->literal_value = ast->integer_literal_val;
+    return pos;
+}
+
+// Sethi-Ullman numbering
+//
+// Each expression is labelled with how many scratch registers it needs to
+// be worked out without spilling, and the operand needing more is evaluated
+// first, so that its result only ties up one register while the other is
+// worked out. Expression results then take the scratch registers in order,
+// and only go on the stack once they run out.
+
+// Caller saved, so they never need saving, and RAX and R11 are left for the
+// code generator
+static const RegLoc scratch_registers[] = {
+    REG_R10, REG_RSI, REG_RDI, REG_RDX, REG_RCX, REG_R8, REG_R9
+};
+#define NUM_SCRATCH_REGISTERS ((int) (sizeof(scratch_registers) / sizeof(scratch_registers[0])))
+
+// a call overwrites every scratch register, so it's as if it needs them all
+#define CALL_REGISTERS_NEEDED (NUM_SCRATCH_REGISTERS + 1)
+
+static int label_expression(AST *ast) {
+    // Returns the number of scratch registers needed
+    if (ast->type == AST_IDENT_USE || is_immediate_literal(ast)) {
+        // a variable is read from where it lives, and a literal is part of
+        // the instruction
+        return 0;
+    }
+
+    int needed = 0;
+
+    if (ast->type == AST_CALL) {
+        for (int i = 1; i < ast->num_nodes; ++i) {
+            label_expression(ast->nodes[i]);
+        }
+        needed = CALL_REGISTERS_NEEDED;
+    } else if (ast_is_binary_expression(ast)) {
+        xcc_assert(ast->num_nodes == 2);
+
+        int first_needed = label_expression(ast->nodes[0]);
+        int second_needed = label_expression(ast->nodes[1]);
+
+        // the order of evaluation of operands is unspecified, so either is fine
+        ast->evaluates_second_first = second_needed > first_needed;
+
+        if (first_needed == second_needed) {
+            needed = first_needed + 1;
+        } else {
+            needed = max(first_needed, second_needed);
+        }
+    } else {
+        for (int i = 0; i < ast->num_nodes; ++i) {
+            needed = max(needed, label_expression(ast->nodes[i]));
+        }
+    }
+
+    // the result itself needs somewhere to go
+    return max(needed, 1);
+}
+
+static void label_expressions(AST *ast) {
+    if (is_expression_node(ast)) {
+        label_expression(ast);
+        return;
+    }
+
+    for (int i = 0; i < ast->num_nodes; ++i) {
+        label_expressions(ast->nodes[i]);
+    }
+}
+
+static bool makes_call(AST *ast) {
+    if (ast->type == AST_CALL) return true;
+
+    for (int i = 0; i < ast->num_nodes; ++i) {
+        if (makes_call(ast->nodes[i])) return true;
+    }
+    return false;
+}
+
+static bool later_operand_makes_call(AST *ast, int n) {
+    for (int i = n + 1; i < ast->num_nodes; ++i) {
+        if (makes_call(ast_nth_evaluated(ast, i))) return true;
+    }
+    return false;
+}
+
+static bool can_use_scratch_register(ValuePosition *pos, AllocationStatus *allocation) {
+    // TODO: two-byte registers
+    return allocator == VALUE_POS_SCRATCH_REGISTERS && pos->size != 2
+        && allocation->scratch_depth < NUM_SCRATCH_REGISTERS;
+}
+
+static void place_in_stack_temporary(ValuePosition *pos, AllocationStatus *allocation) {
+    // TODO: this is super terrible and tries to spill as much as possible
+    pos->type = POS_STACK;
+    pos->stack_offset = TOTAL_DEPTH(allocation) + pos->size;
+    allocation->temporary_depth += pos->size;
+    allocation->max_depth = max(TOTAL_DEPTH(allocation), allocation->max_depth);
+}
+
 static void allocate_vals_recursive(AST *ast, AllocationStatus *allocation) {
     int old_temporary_depth = allocation ? allocation->temporary_depth : -1;
     int old_local_var_depth = allocation ? allocation->local_var_depth : -1;
+    int old_scratch_depth = allocation ? allocation->scratch_depth : -1;
 
     for (int i = 0; i < ast->num_nodes; ++i) {
-        allocate_vals_recursive(ast->nodes[i], allocation);
+        AST *child = ast_nth_evaluated(ast, i);
+        allocate_vals_recursive(child, allocation);
+
+        // An operand is held until the whole expression is worked out, but
+        // not over a call, which would overwrite it
+        if (is_expression_node(ast) && child->pos->type == POS_REG) {
+            if (later_operand_makes_call(ast, i)) {
+                place_in_stack_temporary(child->pos, allocation);
+            } else {
+                allocation->scratch_depth++;
+            }
+        }
     }
 
     if (allocation) {
         allocation->temporary_depth = old_temporary_depth;
+        allocation->scratch_depth = old_scratch_depth;
     }
 
-    // TODO: we also need to make sure of alignment for AST_CALL and also
-    // other stuff on the stack.
-
     if (ast_is_block(ast)) {
         xcc_assert(allocation);
 
@@ -159,8 +254,20 @@ static void allocate_vals_recursive(AST *ast, AllocationStatus *allocation) {
         handle_ident_declaration(ast, allocation);
     } else if (ast->type == AST_IDENT_USE) {
         xcc_assert(ast->declaration);
-        xcc_assert(ast->declaration->pos);
-        ast->pos = copy_value_pos(ast->declaration->pos);
+
+        if (ast->declaration->decl_type == DECL_FUNC_PROTOTYPE) {
+            // Built from the name rather than copied from the declaration,
+            // since the defining function may be being allocated on
+            // another thread
+            ast->pos = xcc_malloc(sizeof(ValuePosition));
+            ast->pos->type = POS_FUNC_NAME;
+            ast->pos->func_name = ast->declaration->name;
+        } else {
+            xcc_assert(ast->declaration->pos);
+            ast->pos = copy_value_pos(ast->declaration->pos);
+        }
+    } else if (is_immediate_literal(ast)) {
+        ast->pos = new_literal_pos(ast);
     } else if (is_expression_node(ast)) {
         xcc_assert(allocation);
 
@@ -169,12 +276,13 @@ static void allocate_vals_recursive(AST *ast, AllocationStatus *allocation) {
 
         if (ast->value_type->type_type == TYPE_VOID) {
             ast->pos->type = POS_VOID;
+        } else if (can_use_scratch_register(ast->pos, allocation)) {
+            // the same register as the operand evaluated first, if that's
+            // in one, so the operation can be done in place
+            ast->pos->type = POS_REG;
+            ast->pos->register_num = scratch_registers[allocation->scratch_depth];
         } else {
-            // TODO: this is super terrible and tries to spill as much as possible
-            ast->pos->type = POS_STACK;
-            ast->pos->stack_offset = TOTAL_DEPTH(allocation) + ast->pos->size;
-            int offset_amt = ast->pos->size;
-            allocation->temporary_depth += offset_amt;
+            place_in_stack_temporary(ast->pos, allocation);
         }
     }
 
@@ -183,28 +291,67 @@ static void allocate_vals_recursive(AST *ast, AllocationStatus *allocation) {
     }
 }
 
+void value_pos_set_allocator(ValuePosAllocator new_allocator) {
+    allocator = new_allocator;
+}
+
 static void allocate_vals_for_func(AST *func) {
     xcc_assert(func->type == AST_FUNCTION_DEFINITION);
 
+    // every allocator works in the order chosen here
+    label_expressions(func);
+
     AllocationStatus allocation;
     allocation.temporary_depth = 0;
     allocation.local_var_depth = 0;
     allocation.max_depth = 0;
+    allocation.scratch_depth = 0;
     allocate_vals_recursive(func, &allocation);
 
     xcc_assert(allocation.temporary_depth == 0);
+    xcc_assert(allocation.scratch_depth == 0);
+
+    // Calls need the stack 16 byte aligned, which it is after pushing %rbp
+    // as long as the rest of the frame is a multiple of 16, and temporaries
+    // can leave the depth at any multiple of 4
+    AST *body = func->nodes[2];
+    body->block_max_stack_depth = align_up(body->block_max_stack_depth, 16);
+}
+
+static void allocate_reg_positions(void);
+
+void value_pos_allocate_top_level(AST *ast) {
+    allocate_reg_positions();
+
+    if (ast->type == AST_DECLARATION) {
+        allocate_vals_recursive(ast, NULL);
+    } else {
+        allocate_vals_for_func(ast);
+    }
+}
+
+static void allocate_vals_for_func_task(void *data, int index) {
+    AST *program = data;
+
+    if (program->nodes[index]->type == AST_FUNCTION_DEFINITION) {
+        allocate_vals_for_func(program->nodes[index]);
+    }
 }
 
 void value_pos_allocate(AST *ast) {
     xcc_assert(ast->type == AST_PROGRAM);
 
+    // done up front so that the worker threads only ever read the table
+    allocate_reg_positions();
+
     for(int i = 0; i < ast->num_nodes; ++i) {
         if (ast->nodes[i]->type == AST_DECLARATION) {
-            allocate_vals_recursive(ast->nodes[i], NULL);
-        } else {
-            allocate_vals_for_func(ast->nodes[i]);
+            value_pos_allocate_top_level(ast->nodes[i]);
         }
     }
+
+    // Each function definition only touches its own nodes and declarations
+    parallel_for(ast->num_nodes, allocate_vals_for_func_task, ast);
 }
 
 bool value_pos_is_same(ValuePosition *a, ValuePosition *b) {
@@ -228,6 +375,8 @@ static ValuePosition preallocated_reg_positions[REG_LAST * REG_PREALLOCATED_MAX_
 bool allocated_preallocated_position = false;
 
 static void allocate_reg_positions(void) {
+    if(allocated_preallocated_position) return;
+
     for(int reg_num = 0; reg_num < REG_LAST; ++reg_num) {
         for (int size = 0; size < REG_PREALLOCATED_MAX_SIZE; ++size) {
             for (int is_signed = 0; is_signed <= 1; ++is_signed) {
@@ -284,7 +433,7 @@ void value_pos_dump(ValuePosition *value_pos) {
             fprintf(stderr, "REG (%d)]", value_pos->register_num);
             break;
         case POS_LITERAL:
-            fprintf(stderr, "LITERAL]");
+            fprintf(stderr, "LITERAL %lld]", value_pos->literal_value);
             break;
         case POS_VOID:
             fprintf(stderr, "VOID]");
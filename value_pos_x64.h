@@ -23,6 +23,7 @@ typedef struct ValuePosition {
         int stack_offset;
         RegLoc register_num;
         const char *func_name;
+        long long literal_value; // always fits in a 32 bit immediate
     };
 
     int size;
@@ -30,7 +31,20 @@ typedef struct ValuePosition {
     bool is_signed;
 } ValuePosition;
 
+// Callee saved registers that a function uses are saved at the top of its
+// frame, the first (in RegLoc order) at -8(%rbp), the next at -16(%rbp)...
+#define VALUE_POS_SAVED_REGISTER_SIZE 8
+
+typedef enum {
+    // everything on the stack, which is what the interpreter needs
+    VALUE_POS_STACK,
+    // expression results in scratch registers, by Sethi-Ullman numbering
+    VALUE_POS_SCRATCH_REGISTERS
+} ValuePosAllocator;
+
+void value_pos_set_allocator(ValuePosAllocator allocator);
 void value_pos_allocate(AST *ast);
+void value_pos_allocate_top_level(AST *ast);
 bool value_pos_is_same(ValuePosition *a, ValuePosition *b);
 ValuePosition *value_pos_reg(RegLoc location, int reg_size, bool is_signed);
 void value_pos_dump(ValuePosition *value_pos);
@@ -27,7 +27,8 @@ void *xcc_malloc(size_t size) {
         return NULL;
     }
 
-    ++number_xcc_allocations;
+    // the back end can allocate from several threads at once
+    __atomic_add_fetch(&number_xcc_allocations, 1, __ATOMIC_RELAXED);
 
     void *result = malloc(size);
     xcc_assert_msg(result, "malloc() returned NULL");
@@ -37,18 +38,24 @@ void *xcc_malloc(size_t size) {
 void xcc_free(const void *p) {
     if(!p) return;
 
-    if(number_xcc_allocations < 1) {
+    int old_number_allocations = __atomic_fetch_sub(&number_xcc_allocations, 1, __ATOMIC_RELAXED);
+    if(old_number_allocations < 1) {
         if(!getenv("RUNNING_IN_VALGRIND")) {
             xcc_assert_msg(false, "double free?");
         }
     }
-    --number_xcc_allocations;
 
     free((void *) p);
 }
 
+int align_up(int value, int alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
 static bool has_begun_prog_error = false;
 static const char *current_compiling_stage_error_msg = NULL;
+static int number_prog_errors = 0;
+static ProgErrorRecovery *innermost_recovery = NULL;
 
 const char *xcc_get_prog_error_stage() {
     return current_compiling_stage_error_msg;
@@ -71,10 +78,49 @@ void begin_prog_error_range(const char *msg, Token *start_token, Token *end_toke
     has_begun_prog_error = true;
 }
 
+NORETURN static void recover_from_prog_error() {
+    for(ProgErrorRecovery *recovery = innermost_recovery; recovery; recovery = recovery->outer) {
+        recovery->has_abandoned = true;
+    }
+
+    if(innermost_recovery) {
+        longjmp(innermost_recovery->jump_buffer, 1);
+    }
+
+    driver_abort_link();
+    exit(1);
+}
+
 NORETURN void end_prog_error() {
     xcc_assert_msg(has_begun_prog_error, "end_prog_error error without begin");
     fprintf(stderr, " === end program error ===\n");
-    abort();
+    has_begun_prog_error = false;
+    number_prog_errors++;
+    recover_from_prog_error();
+}
+
+void prog_error_push_recovery(ProgErrorRecovery *recovery) {
+    // The caller then does `if(!setjmp(recovery->jump_buffer))`, and must pop
+    // the recovery point whichever way the if goes
+    recovery->outer = innermost_recovery;
+    recovery->has_abandoned = false;
+    innermost_recovery = recovery;
+}
+
+void prog_error_pop_recovery(ProgErrorRecovery *recovery) {
+    xcc_assert_msg(innermost_recovery == recovery, "recovery points popped out of order");
+    innermost_recovery = recovery->outer;
+}
+
+NORETURN void prog_error_cascade() {
+    // Abandons whatever is being checked, for an error that's already been
+    // reported, so that it doesn't cause a second one
+    xcc_assert(number_prog_errors > 0);
+    recover_from_prog_error();
+}
+
+int xcc_num_prog_errors() {
+    return number_prog_errors;
 }
 
 static bool is_verbose = false;
@@ -82,10 +128,132 @@ bool xcc_verbose() {
     return is_verbose;
 }
 
+static void check_program(Lexer *lexer, PrecompiledHeader *pch,
+                          AST **program_ast_out, ResolutionList **res_list_out) {
+    // All of the stages which can find an error in the program, but none of
+    // the code generation
+    AST *program_ast = parse_program(lexer);
+    if(xcc_verbose()) ast_dump(program_ast, "parsed");
+
+    ResolutionList *res_list = resolve_begin(pch);
+
+    // The declarations skipped by a parse error would just cause more errors
+    if(!xcc_num_prog_errors()) {
+        for(int i = 0; i < program_ast->num_nodes; ++i) {
+            // folding needs the checked types, and doesn't find errors of its own
+            AST *declaration_ast = program_ast->nodes[i];
+            if(check_top_level(res_list, program_ast, declaration_ast, true)) {
+                constant_fold(declaration_ast);
+            }
+        }
+    }
+
+    if(xcc_verbose()) {
+        ast_dump(program_ast, "checked");
+        dump_declaration_list(res_list);
+    }
+
+    *program_ast_out = program_ast;
+    *res_list_out = res_list;
+}
+
+static void report_prog_errors() {
+    int num_errors = xcc_num_prog_errors();
+    fprintf(stderr, "%d program error%s\n", num_errors, num_errors == 1 ? "" : "s");
+}
+
+static void compile_streaming(Lexer *lexer, PrecompiledHeader *pch, const char *filename_in,
+                              InterpProgram *interp_program,
+                              AST **program_ast_out, ResolutionList **res_list_out) {
+    // Takes each top level declaration through every stage before parsing
+    // the next one, then throws away function bodies once they've been
+    // generated. Only the top level declarations (and types) are kept, so
+    // memory use doesn't grow with the size of the function bodies.
+    Parser parser;
+    parser_init(&parser, lexer);
+
+    AST *program_ast = ast_new(AST_PROGRAM, &lexer->tokens[0]);
+    ResolutionList *res_list = resolve_begin(pch);
+
+    if(!interp_program) generate_x64_begin(filename_in);
+
+    // After a parse error the rest of the program is only parsed, and after
+    // any error nothing more is generated
+    bool has_parse_error = false;
+    int num_errors = 0;
+
+    AST *declaration_ast;
+    while((declaration_ast = parse_top_level_declaration(&parser))) {
+        ast_append(program_ast, declaration_ast);
+        Declaration *old_declarations_head = res_list->all_declarations_head;
+
+        // parsing reports errors in the declarations it skips over
+        has_parse_error = has_parse_error || xcc_num_prog_errors() != num_errors;
+        if(!has_parse_error && check_top_level(res_list, program_ast, declaration_ast, true)) {
+            constant_fold(declaration_ast);
+        }
+
+        num_errors = xcc_num_prog_errors();
+        if(num_errors) continue;
+
+        value_pos_allocate_top_level(declaration_ast);
+        if(xcc_verbose()) ast_dump(declaration_ast, "allocated");
+
+        if(interp_program) {
+            interp_add_top_level(interp_program, declaration_ast);
+        } else {
+            generate_x64_top_level(declaration_ast, program_ast->num_nodes - 1);
+        }
+
+        if(declaration_ast->type == AST_FUNCTION_DEFINITION) {
+            xcc_assert(declaration_ast->num_nodes == 3);
+            ast_free_children(declaration_ast->nodes[2]);
+            resolve_free_function_body_declarations(res_list, old_declarations_head);
+        }
+    }
+
+    if(xcc_verbose()) dump_declaration_list(res_list);
+
+    *program_ast_out = program_ast;
+    *res_list_out = res_list;
+}
+
+static FILE *open_output(const char *filename_out, bool links,
+                         const char **link_inputs, int num_link_inputs) {
+    // When linking, the output is the assembler's input
+    if(links) {
+        return driver_start_link(filename_out, link_inputs, num_link_inputs);
+    }
+
+    if(!strcmp(filename_out, "-")) {
+        return stdout;
+    }
+
+    FILE *output_stream = fopen(filename_out, "w");
+    if(!output_stream) {
+        perror("open(output_stream)");
+    }
+    return output_stream;
+}
 
 int main(int argc, char **argv) {
     const char *filename_in = NULL;
     const char *filename_out = NULL;
+    bool is_streaming = false;
+    bool only_check = false;
+    bool is_server = false;
+    bool emit_object = false;
+    bool emit_assembly = false;
+    bool run_program = false;
+    bool interpret = false;
+    bool emit_perf_map = false;
+    bool optimise = false;
+    const char *pch_filename_out = NULL;
+    const char *pch_filename_in = NULL;
+
+    // any inputs after the first are only linked in, not compiled
+    const char **link_inputs = xcc_malloc(sizeof(char *) * argc);
+    int num_link_inputs = 0;
 
     for(int i = 1; i < argc; ++i) {
         if(!strcmp(argv[i], "-o")) {
@@ -101,10 +269,76 @@ int main(int argc, char **argv) {
             }
         } else if(!strcmp(argv[i], "-v")) {
             is_verbose = true;
-        } else if(argv[i][0] != '-') {
-            if(filename_in) {
-                fprintf(stderr, "Two input files specified!");
+        } else if(!strcmp(argv[i], "--stream")) {
+            is_streaming = true;
+        } else if(!strcmp(argv[i], "-c")) {
+            emit_object = true;
+            emit_assembly = false;
+        } else if(!strcmp(argv[i], "-S")) {
+            emit_assembly = true;
+            emit_object = false;
+        } else if(!strcmp(argv[i], "--run")) {
+            run_program = true;
+        } else if(!strcmp(argv[i], "--interp")) {
+            interpret = true;
+        } else if(!strcmp(argv[i], "--perf-map")) {
+            // names the --run functions for perf, in /tmp/perf-PID.map
+            emit_perf_map = true;
+        } else if(!strcmp(argv[i], "--load")) {
+            // a shared library for --run to find functions in
+            if(i + 1 >= argc) {
+                fprintf(stderr, "No library specified after `--load`\n");
+                return 1;
+            }
+            if(!jit_load_library(argv[i + 1])) return 1;
+            ++i;
+        } else if(!strcmp(argv[i], "-O")) {
+            optimise = true;
+        } else if(!strcmp(argv[i], "--check")) {
+            only_check = true;
+        } else if(!strcmp(argv[i], "--server")) {
+            // checks files as an editor sends them, see server.c
+            is_server = true;
+        } else if(!strcmp(argv[i], "--emit-pch") || !strcmp(argv[i], "--include-pch")) {
+            if(i + 1 >= argc) {
+                fprintf(stderr, "No precompiled header specified after `%s`\n", argv[i]);
+                return 1;
+            }
+
+            if(!strcmp(argv[i], "--emit-pch")) {
+                pch_filename_out = argv[i + 1];
+            } else {
+                pch_filename_in = argv[i + 1];
+            }
+            ++i;
+        } else if(!strncmp(argv[i], "-j", 2)) {
+            const char *num_threads_str = argv[i] + 2;
+            if(!*num_threads_str) {
+                if(i + 1 >= argc) {
+                    fprintf(stderr, "No thread count specified after `-j`\n");
+                    return 1;
+                }
+                num_threads_str = argv[i + 1];
+                ++i;
+            }
+
+            int num_threads = atoi(num_threads_str);
+            if(num_threads < 1) {
+                fprintf(stderr, "Invalid thread count `%s`\n", num_threads_str);
+                return 1;
+            }
+            parallel_set_num_threads(num_threads);
+        } else if(!strncmp(argv[i], "--lex-chunk-size=", 17)) {
+            // for testing, since sources are only split up when they're big
+            int chunk_size = atoi(argv[i] + 17);
+            if(chunk_size < 1) {
+                fprintf(stderr, "Invalid chunk size `%s`\n", argv[i] + 17);
                 return 1;
+            }
+            lex_set_parallel_min_chunk_size(chunk_size);
+        } else if(argv[i][0] != '-' || !strcmp(argv[i], "-")) {
+            if(filename_in) {
+                link_inputs[num_link_inputs++] = argv[i];
             } else {
                 filename_in = argv[i];
             }
@@ -114,68 +348,202 @@ int main(int argc, char **argv) {
         }
     }
 
+    if(is_server) {
+        if(filename_in) {
+            fprintf(stderr, "`--server` reads files from its commands, not the arguments\n");
+            return 1;
+        }
+
+        xcc_free(link_inputs);
+        int exit_code = server_run();
+
+        // as in a compile, a parse error leaves the declaration it was
+        // found in half built and not freed
+        if(!xcc_num_prog_errors()) {
+            xcc_assert_msg(number_xcc_allocations == 0, "Memory leak!");
+        }
+        return exit_code;
+    }
+
     if(!filename_in) {
         fprintf(stderr, "No input file specified\n");
         return 1;
     }
 
-    if(!filename_out) {
+    if(run_program && interpret) {
+        fprintf(stderr, "`--run` and `--interp` can't be used together\n");
+        return 1;
+    }
+
+    // both run the program rather than writing it out
+    bool runs_program = run_program || interpret;
+    if(runs_program && (filename_out || only_check || pch_filename_out)) {
+        fprintf(stderr, "`%s` doesn't write any output\n", run_program ? "--run" : "--interp");
+        return 1;
+    }
+
+    // without -S, -c or any of the other modes, the output is an executable
+    bool links = !emit_assembly && !emit_object && !runs_program && !only_check && !pch_filename_out;
+    if(links && !filename_out) {
+        filename_out = "a.out";
+    }
+
+    if(!filename_out && !only_check && !pch_filename_out && !runs_program) {
         fprintf(stderr, "No output file specified\n");
         return 1;
     }
 
-    FILE *input_stream = fopen(filename_in, "r");
+    if(num_link_inputs && !links) {
+        fprintf(stderr, "Two input files specified!");
+        return 1;
+    }
+
+    if(links && !strcmp(filename_out, "-")) {
+        fprintf(stderr, "Can't write an executable to stdout\n");
+        return 1;
+    }
+
+    // `-` reads the source from stdin and `-o -` writes the assembly to stdout
+    bool is_input_stdin = !strcmp(filename_in, "-");
+    if(is_input_stdin) {
+        filename_in = "<stdin>";
+    }
+
+    FILE *input_stream = is_input_stdin ? stdin : fopen(filename_in, "r");
     if(!input_stream) {
         perror("open(input_stream)");
         return 1;
     }
 
-    Lexer *lexer = lex_file(input_stream, filename_in);
+    PrecompiledHeader *pch = NULL;
+    if(pch_filename_in) {
+        pch = pch_load(pch_filename_in);
+        if(!pch) return 1;
+    }
+
+    Lexer *lexer = lex_file(input_stream, filename_in, pch);
     if(xcc_verbose()) lex_dump_lexer_state(lexer);
 
-    if(fclose(input_stream)) {
+    if(!is_input_stdin && fclose(input_stream)) {
         perror("close(input_stream)");
         return 1;
     }
 
-    AST *program_ast = parse_program(lexer);
-    if(xcc_verbose()) ast_dump(program_ast, "parsed");
+    AST *program_ast;
+    ResolutionList *res_list;
+    FILE *output_stream;
 
-    ResolutionList *res_list = resolve_declarations(program_ast);
-    if(xcc_verbose()) {
-        ast_dump(program_ast, "resolved");
-        dump_declaration_list(res_list);
+    // The interpreter's registers are already its frame slots, so it wants
+    // everything on the stack
+    if (interpret) {
+        value_pos_set_allocator(VALUE_POS_STACK);
+    } else {
+        value_pos_set_allocator(VALUE_POS_SCRATCH_REGISTERS);
     }
 
-    check_lvalue(program_ast);
+    // -O generates functions from the IR rather than straight from the AST
+    generate_x64_set_optimise(optimise);
 
-    type_propogate(program_ast);
-    if(xcc_verbose()) ast_dump(program_ast, "typed");
+    // -c encodes the functions into an object file, rather than writing
+    // assembly as they're generated, and --run encodes them to run in memory
+    CodeBuffer *code_buffer = NULL;
+    if((run_program || (emit_object && !interpret)) && !pch_filename_out && !only_check) {
+        code_buffer = encode_x64_new_buffer();
+        generate_set_code_buffer(code_buffer);
+    }
 
-    check_for_return(program_ast);
+    // --interp lowers the functions to bytecode instead of generating them
+    InterpProgram *interp_program = NULL;
+    if(interpret && !pch_filename_out && !only_check) {
+        interp_program = interp_new_program();
+    }
 
-    value_pos_allocate(program_ast);
-    if(xcc_verbose()) ast_dump(program_ast, "allocated");
+    // streaming checks each declaration just before generating it
+    if(!is_streaming || pch_filename_out || only_check) {
+        check_program(lexer, pch, &program_ast, &res_list);
+        if(xcc_num_prog_errors()) {
+            report_prog_errors();
+            return 1;
+        }
+    }
 
-    FILE *output_stream = fopen(filename_out, "w");
-    if(!output_stream) {
-        perror("open(output_stream)");
-        return 1;
+    if(pch_filename_out) {
+        // The input is a header, which is snapshotted rather than generated
+        pch_write(pch_filename_out, lexer, res_list);
+        output_stream = NULL;
+    } else if(only_check) {
+        // Just report any errors, for editors and other quick feedback
+        output_stream = NULL;
+    } else if(is_streaming) {
+        output_stream = runs_program ? NULL : open_output(filename_out, links, link_inputs, num_link_inputs);
+        if(!runs_program && !output_stream) return 1;
+
+        generate_set_output(output_stream);
+        compile_streaming(lexer, pch, filename_in, interp_program, &program_ast, &res_list);
+
+        if(xcc_num_prog_errors()) {
+            // what was written so far isn't worth keeping
+            report_prog_errors();
+            driver_abort_link();
+            if(output_stream && output_stream != stdout && !links) {
+                fclose(output_stream);
+                remove(filename_out);
+            }
+            return 1;
+        }
+    } else {
+        value_pos_allocate(program_ast);
+        if(xcc_verbose()) ast_dump(program_ast, "allocated");
+
+        output_stream = runs_program ? NULL : open_output(filename_out, links, link_inputs, num_link_inputs);
+        if(!runs_program && !output_stream) return 1;
+
+        if(interp_program) {
+            for(int i = 0; i < program_ast->num_nodes; ++i) {
+                interp_add_top_level(interp_program, program_ast->nodes[i]);
+            }
+        } else {
+            generate_set_output(output_stream);
+            generate_x64(program_ast, filename_in);
+        }
     }
 
-    generate_set_output(output_stream);
-    generate_x64(program_ast, filename_in);
+    int exit_code = 0;
+
+    if(interp_program) {
+        bool has_run = interp_run(interp_program, &exit_code);
+        interp_free_program(interp_program);
+        if(!has_run) return 1;
+    } else if(code_buffer && run_program) {
+        bool has_run = jit_run(code_buffer, emit_perf_map, &exit_code);
+        encode_x64_free_buffer(code_buffer);
+        if(!has_run) return 1;
+    } else if(code_buffer) {
+        if(!elf_write_object(output_stream, code_buffer, filename_in)) {
+            perror("write(output_stream)");
+            return 1;
+        }
+        encode_x64_free_buffer(code_buffer);
+    }
 
-    if(fclose(output_stream)) {
+    if(links) {
+        if(!driver_finish_link(output_stream)) return 1;
+    } else if(output_stream == stdout ? fflush(stdout) : output_stream && fclose(output_stream)) {
         perror("close(output_stream)");
         return 1;
     }
 
+    xcc_free(link_inputs);
+
     type_free_all();
     resolve_free(res_list);
     ast_free(program_ast);
     lex_free_lexer(lexer);
+    if(pch) pch_free(pch);
 
     xcc_assert(!has_begun_prog_error);
     xcc_assert_msg(number_xcc_allocations == 0, "Memory leak!");
+
+    // with --run or --interp, the program's exit code
+    return exit_code;
 }
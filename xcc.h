@@ -1,6 +1,7 @@
 #pragma once
 
 #include <errno.h>
+#include <setjmp.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,9 +11,11 @@
 
 void *xcc_malloc(size_t size);
 void xcc_free(const void *p);
+int align_up(int value, int alignment);
 
 #define NORETURN __attribute__((__noreturn__))
 
+#include "symbol_table.h"
 #include "lexer.h"
 
 const char *xcc_get_prog_error_stage();
@@ -21,15 +24,46 @@ void begin_prog_error_range(const char *msg, Token *start_token, Token *end_toke
 NORETURN void end_prog_error();
 #define prog_error(msg, token) do { begin_prog_error_range((msg), (token), (token)); end_prog_error(); } while(false)
 
+// A program error jumps back to the innermost recovery point, so that the
+// rest of the program can still be checked. Without one, xcc exits.
+typedef struct ProgErrorRecovery {
+    jmp_buf jump_buffer;
+    struct ProgErrorRecovery *outer;
+
+    // set when anything inside it was abandoned, even if an inner recovery
+    // point caught it
+    volatile bool has_abandoned;
+} ProgErrorRecovery;
+
+void prog_error_push_recovery(ProgErrorRecovery *recovery);
+void prog_error_pop_recovery(ProgErrorRecovery *recovery);
+NORETURN void prog_error_cascade();
+int xcc_num_prog_errors();
+
 bool xcc_verbose();
 #define debugf(...) (xcc_verbose() ? frpintf(stderr, __VA_ARGS__) : (void) 0)
 
 #include "xcc_assert.h"
 #include "list.h"
 #include "ast.h"
+#include "ir.h"
+#include "ir_build.h"
+#include "ir_licm.h"
 #include "value_pos_x64.h"
 #include "parser.h"
 #include "declaration.h"
 #include "types.h"
 #include "misc_checks.h"
+#include "constant_fold.h"
+#include "encode_x64.h"
+#include "machine_x64.h"
+#include "regalloc_x64.h"
+#include "peephole_x64.h"
+#include "elf.h"
+#include "jit.h"
+#include "interp.h"
+#include "driver.h"
 #include "generate.h"
+#include "parallel.h"
+#include "pch.h"
+#include "server.h"